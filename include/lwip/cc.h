@@ -58,6 +58,7 @@ typedef unsigned   short   u16_t;
 typedef signed     short   s16_t;
 typedef unsigned   int     u32_t;
 typedef signed     int     s32_t;
+typedef unsigned long long u64_t;
 
 typedef unsigned long mem_ptr_t;
 
@@ -121,10 +121,27 @@ u32_t lwip_ntohl(u32_t x);
 
 #endif /* BYTE_ORDER == BIG_ENDIAN */
 
+struct pbuf;
+
+/**
+* One contiguous piece of an outgoing datagram. A piece with p set lies in
+* that pbuf and does not change while a reference on p is held, so an output
+* function may pbuf_ref() it and send it later; a piece without p, like the
+* TCP header that is rewritten for retransmissions, is only valid during the
+* call.
+*/
+struct ip_iovec {
+  void *base;
+  int len;
+  struct pbuf *p;
+};
+
 /**
-* Function prototype for tcp send data.
+* Function prototype for tcp send data. The datagram is the concatenation of
+* the cnt pieces in vec: the TCP header, then the data of the segment's
+* pbufs.
 */
-typedef int (*ip_output_fn)(char *data, int len, u32_t addr, u16_t remote_port);
+typedef int (*ip_output_fn)(const struct ip_iovec *vec, int cnt, u32_t addr, u16_t remote_port);
 
 #ifdef __cplusplus
 }
@@ -33,6 +33,7 @@
 #define LWIP_HDR_INIT_H
 
 #include "lwip/opt.h"
+#include "lwip/err.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -63,7 +64,7 @@ extern "C" {
                         LWIP_VERSION_REVISION << 8 | LWIP_VERSION_RC)
 
 /* Modules initialization */
-void lwip_init(ip_output_fn output_fn);
+err_t lwip_init(ip_output_fn output_fn);
 
 #ifdef __cplusplus
 }
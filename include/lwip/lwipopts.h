@@ -54,11 +54,26 @@
 /* Minimal changes to opt.h required for tcp unit tests: */
 #define MEM_SIZE                        16000
 #define TCP_SND_QUEUELEN                40
-#define MEMP_NUM_TCP_SEG                TCP_SND_QUEUELEN
+/* segments for a few connections with megabyte buffers (tcp_set_bufsize()),
+   the queue limit of a pcb grows with its send buffer */
+#define MEMP_NUM_TCP_SEG                4096
+/* enough pool pbufs to keep a full recvmmsg() batch posted */
+#define PBUF_POOL_SIZE                  128
+/* a pool pbuf holds a whole datagram (20 byte header, 40 bytes of options,
+   one MSS), so every received datagram lands in a single buffer; 32 more
+   bytes leave room for the recvmsg header io_uring puts in front of it */
+#define PBUF_POOL_BUFSIZE               LWIP_MEM_ALIGN_SIZE(TCP_MSS + 20 + 40 + 32)
+/* rudp.c splits UDP_GRO buffers into custom pbufs referencing them,
+   tcp_write_ref() references the data it sends */
+#define LWIP_SUPPORT_CUSTOM_PBUF        1
 #define TCP_SND_BUF                     (12 * TCP_MSS)
 #define TCP_WND                         (10 * TCP_MSS)
+/* windows up to 4 MB, in steps of 64 bytes */
+#define LWIP_WND_SCALE                  1
+#define TCP_RCV_SCALE                   6
 
 #define MEM_LIBC_MALLOC 1
+#define LWIP_PER_THREAD_STACK 1
 
 // johnfu: kill
 #define TCP_CALCULATE_EFF_SEND_MSS 0
@@ -70,10 +85,19 @@
 #define MEMP_NUM_SYS_TIMEOUT 1
 #define LWIP_DEBUG_TIMERNAMES 1
 #define LWIP_TCP_TIMESTAMPS 1
+#define LWIP_TCP_SACK 1
+#define LWIP_TCP_RACK 1
+#define LWIP_TCP_CC_CUBIC 1
+#define LWIP_TCP_CC_BBR 1
+#define LWIP_TCP_TURBO 1
+#define LWIP_TCP_FEC 1
+#define LWIP_TCP_RCV_AUTOTUNE 1
+#define LWIP_TCP_SND_AUTOTUNE 1
+#define LWIP_TCP_WRITE_REF 1
 #define LWIP_TCP_KEEPALIVE 1
 #define TCP_LISTEN_BACKLOG 1
 #define TCP_DEFAULT_LISTEN_BACKLOG 5
-#define MEMP_OVERFLOW_CHECK 2
+#define MEMP_OVERFLOW_CHECK 1
 #define MEMP_SANITY_CHECK 1
 
 #endif /* __LWIPOPTS_H__ */
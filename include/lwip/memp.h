@@ -75,6 +75,9 @@ struct memp_malloc_helper
 };
 #endif /* MEM_USE_POOLS */
 
+/** bytes of pool memory every stack instance needs */
+extern const u32_t memp_memory_size;
+
 void  memp_init(void);
 
 #if MEMP_OVERFLOW_CHECK
@@ -77,6 +77,35 @@
 #define NO_SYS_NO_TIMERS                0
 #endif
 
+/**
+ * LWIP_PER_THREAD_STACK==1: Give every thread its own current stack
+ * instance (see lwip/stack.h), so threads can drive instances in parallel,
+ * e.g. one instance per core, each with its own UDP socket bound with
+ * SO_REUSEPORT. Objects (pcbs, pbufs) belong to their instance and must
+ * not be used while another instance is current.
+ */
+#ifndef LWIP_PER_THREAD_STACK
+#define LWIP_PER_THREAD_STACK           0
+#endif
+
+/**
+ * LWIP_STACK_LOCAL: storage class of the current instance pointer and of
+ * the scratch state of tcp_input(); the instances themselves are on the
+ * heap. Expands to the compiler's thread-local specifier if
+ * LWIP_PER_THREAD_STACK is enabled, to nothing otherwise.
+ */
+#ifndef LWIP_STACK_LOCAL
+#if LWIP_PER_THREAD_STACK
+#ifdef _MSC_VER
+#define LWIP_STACK_LOCAL                __declspec(thread)
+#else
+#define LWIP_STACK_LOCAL                __thread
+#endif
+#else
+#define LWIP_STACK_LOCAL
+#endif
+#endif
+
 /**
  * MEMCPY: override this if you have a faster implementation at hand than the
  * one included in your C library
@@ -269,6 +298,22 @@
 #define TCP_SYNMAXRTX                   6
 #endif
 
+/**
+ * TCP_RTO_MIN: Lower bound of the retransmission time-out in milliseconds.
+ * Without a clock (tcp_set_clock()) it is at least TCP_SLOW_INTERVAL.
+ */
+#ifndef TCP_RTO_MIN
+#define TCP_RTO_MIN                     200
+#endif
+
+/**
+ * TCP_RTO_MAX: Upper bound of the (backed off) retransmission time-out in
+ * milliseconds.
+ */
+#ifndef TCP_RTO_MAX
+#define TCP_RTO_MAX                     60000
+#endif
+
 /**
  * TCP_QUEUE_OOSEQ==1: TCP will queue segments that arrive out of order.
  * Define to 0 if your device is low on memory.
@@ -367,6 +412,16 @@
 #define TCP_DEFAULT_LISTEN_BACKLOG      0xff
 #endif
 
+/**
+ * TCP_PCB_HASH_MIN_SIZE: Initial number of slots in the connection id hash
+ * table used by tcp_input() to find active and TIME-WAIT pcbs. Must be a
+ * power of two. The table doubles (via mem_malloc) whenever it becomes more
+ * than half full, so this only has to cover the common case.
+ */
+#ifndef TCP_PCB_HASH_MIN_SIZE
+#define TCP_PCB_HASH_MIN_SIZE           64
+#endif
+
 /**
  * TCP_OVERSIZE: The maximum number of bytes that tcp_write may
  * allocate ahead of time in an attempt to create shorter pbuf chains
@@ -395,6 +450,172 @@
 #define LWIP_TCP_TIMESTAMPS             0
 #endif
 
+/**
+ * LWIP_TCP_SACK==1: support selective acknowledgments (RFC 2018). SACK is
+ * used on a connection when both SYNs carry the SACK-permitted option; the
+ * receiver then reports its out-of-sequence data in its ACKs and the sender
+ * retransmits only the holes (RFC 6675).
+ */
+#ifndef LWIP_TCP_SACK
+#define LWIP_TCP_SACK                   0
+#endif
+
+/**
+ * LWIP_TCP_RACK==1: time-based loss detection with RACK and tail loss
+ * probes (RFC 8985) on connections that use SACK, once a clock is set
+ * (tcp_set_clock()). A segment counts as lost when one sent sufficiently
+ * later was delivered, and when the last segments of a burst go
+ * unacknowledged a probe is sent after about two RTTs so the peer's SACK
+ * blocks expose the loss, instead of waiting for the RTO. Needs
+ * LWIP_TCP_SACK.
+ */
+#ifndef LWIP_TCP_RACK
+#define LWIP_TCP_RACK                   0
+#endif
+
+/**
+ * TCP_TLP_DELACK: milliseconds added to the probe time-out when only one
+ * segment is in flight, for the peer's delayed ACK. lwIP peers ack it on
+ * their next fast timer tick, which is half a TCP_FAST_INTERVAL away on
+ * average; a probe sent before a later ACK only costs one segment.
+ */
+#ifndef TCP_TLP_DELACK
+#define TCP_TLP_DELACK                  (TCP_FAST_INTERVAL / 2)
+#endif
+
+/**
+ * LWIP_TCP_CC_CUBIC==1: build the CUBIC congestion control (RFC 8312),
+ * tcp_cc_cubic, next to NewReno. See tcp_cc.h.
+ */
+#ifndef LWIP_TCP_CC_CUBIC
+#define LWIP_TCP_CC_CUBIC               0
+#endif
+
+/**
+ * LWIP_TCP_CC_BBR==1: build tcp_cc_bbr, a congestion control that sizes the
+ * window from the measured delivery rate and minimum RTT instead of
+ * reacting to loss. See tcp_cc.h.
+ */
+#ifndef LWIP_TCP_CC_BBR
+#define LWIP_TCP_CC_BBR                 0
+#endif
+
+/**
+ * TCP_CC_DEFAULT: the congestion control new pcbs start with, see
+ * tcp_set_cc() to change it per connection.
+ */
+#ifndef TCP_CC_DEFAULT
+#define TCP_CC_DEFAULT                  tcp_cc_newreno
+#endif
+
+/**
+ * LWIP_TCP_TURBO==1: support a low-latency mode per connection for
+ * interactive traffic, see tcp_set_turbo(). It trades fairness for tail
+ * latency: the RTO does not back off and is capped at TCP_TURBO_RTO_SRTT
+ * times the smoothed RTT, fast retransmit needs TCP_TURBO_DUPTHRESH dupacks,
+ * every segment is acked at once and Nagle is off.
+ */
+#ifndef LWIP_TCP_TURBO
+#define LWIP_TCP_TURBO                  0
+#endif
+
+/**
+ * TCP_TURBO_DUPTHRESH: dupacks that trigger fast retransmit in turbo mode
+ */
+#ifndef TCP_TURBO_DUPTHRESH
+#define TCP_TURBO_DUPTHRESH             2
+#endif
+
+/**
+ * TCP_TURBO_RTO_SRTT: the RTO in turbo mode is at most this many times the
+ * smoothed RTT, and at least TCP_TURBO_RTO_MIN milliseconds
+ */
+#ifndef TCP_TURBO_RTO_SRTT
+#define TCP_TURBO_RTO_SRTT              2
+#endif
+
+#ifndef TCP_TURBO_RTO_MIN
+#define TCP_TURBO_RTO_MIN               30
+#endif
+
+/**
+ * TCP_TURBO_MAXRTX: Maximum number of retransmissions of data segments in
+ * turbo mode. The RTO does not back off there, so it takes more of them to
+ * ride out an outage.
+ */
+#ifndef TCP_TURBO_MAXRTX
+#define TCP_TURBO_MAXRTX                50
+#endif
+
+/**
+ * LWIP_TCP_FEC==1: support forward error correction per connection, see
+ * tcp_set_fec(). After every group of data segments the sender adds XOR
+ * parity datagrams, from which the receiver rebuilds a lost segment without
+ * waiting for its retransmission. Both ends need it: a peer without it takes
+ * a parity datagram for data.
+ */
+#ifndef LWIP_TCP_FEC
+#define LWIP_TCP_FEC                    0
+#endif
+
+/**
+ * TCP_FEC_GROUP_MAX: the most data segments a parity group may have
+ */
+#ifndef TCP_FEC_GROUP_MAX
+#define TCP_FEC_GROUP_MAX               16
+#endif
+
+/**
+ * LWIP_TCP_RCV_AUTOTUNE==1: grow the receive window of a connection with
+ * what the application reads per round trip, so that a bulk transfer gets
+ * the window its path needs and other connections keep TCP_WND. A window
+ * set with tcp_set_bufsize() is left as it is.
+ */
+#ifndef LWIP_TCP_RCV_AUTOTUNE
+#define LWIP_TCP_RCV_AUTOTUNE           0
+#endif
+
+/**
+ * TCP_RCV_AUTOTUNE_MAX: the largest window autotuning gives a connection
+ */
+#ifndef TCP_RCV_AUTOTUNE_MAX
+#define TCP_RCV_AUTOTUNE_MAX            (0xFFFFUL << TCP_RCV_SCALE)
+#endif
+
+/**
+ * LWIP_TCP_SND_AUTOTUNE==1: grow the send buffer of a connection to twice
+ * the window it may have in flight, as the congestion window grows. A send
+ * buffer set with tcp_set_bufsize() is left as it is.
+ */
+#ifndef LWIP_TCP_SND_AUTOTUNE
+#define LWIP_TCP_SND_AUTOTUNE           0
+#endif
+
+/**
+ * TCP_SND_AUTOTUNE_MAX: the largest send buffer autotuning gives a
+ * connection
+ */
+#ifndef TCP_SND_AUTOTUNE_MAX
+#define TCP_SND_AUTOTUNE_MAX            (4 * 1024 * 1024UL)
+#endif
+
+/**
+ * LWIP_TCP_WRITE_REF==1: support tcp_write_ref(), sending the caller's data
+ * without copying it and calling back once it is acked. Needs
+ * LWIP_SUPPORT_CUSTOM_PBUF.
+ */
+#ifndef LWIP_TCP_WRITE_REF
+#define LWIP_TCP_WRITE_REF              0
+#endif
+
+/**
+ * TCP_AUTOTUNE_BUDGET: bytes of window and send buffer autotuning may add
+ * over all connections of a stack instance
+ */
+#ifndef TCP_AUTOTUNE_BUDGET
+#define TCP_AUTOTUNE_BUDGET             (16 * 1024 * 1024UL)
+#endif
+
 /**
  * TCP_WND_UPDATE_THRESHOLD: difference in window to trigger an
  * explicit window update
@@ -0,0 +1,64 @@
+/**
+ * @file
+ * Stack instances
+ *
+ * All mutable state of the stack - pcb lists, timers, memp pools, stats -
+ * lives in a struct lwip_stack, and the stack works on the calling thread's
+ * current instance, lwip_stack_cur. The old global names (tcp_active_pcbs,
+ * lwip_stats, ...) are macros that reach into it.
+ *
+ * lwip_init() creates an instance and makes it current. More of them can be
+ * created with lwip_stack_new() and switched with lwip_stack_set(), so one
+ * thread may drive several instances, and an instance may be driven from
+ * any thread as long as the callers serialize on it. Only the pointer and
+ * the scratch state of tcp_input() are LWIP_STACK_LOCAL.
+ */
+#ifndef LWIP_HDR_STACK_H
+#define LWIP_HDR_STACK_H
+
+#include "lwip/opt.h"
+#include "lwip/def.h"
+#include "lwip/memp.h"
+#include "lwip/stats.h"
+#if LWIP_TCP
+#include "lwip/tcp_impl.h"
+#endif /* LWIP_TCP */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct memp;
+
+struct lwip_stack {
+#if LWIP_STATS
+  struct stats_ stats;
+#endif /* LWIP_STATS */
+#if !MEMP_MEM_MALLOC
+  /** the first free element of each pool */
+  struct memp *memp_tab[MEMP_MAX];
+  /** the pools, allocated together with the instance */
+  u8_t *memp_memory;
+#endif /* !MEMP_MEM_MALLOC */
+#if LWIP_TCP && TCP_QUEUE_OOSEQ && PBUF_POOL_FREE_OOSEQ
+  volatile u8_t free_ooseq_pending;
+#endif /* LWIP_TCP && TCP_QUEUE_OOSEQ && PBUF_POOL_FREE_OOSEQ */
+#if LWIP_TCP
+  struct tcp_instance tcp;
+#endif /* LWIP_TCP */
+};
+
+/** The instance the stack functions work on, per thread if
+ * LWIP_PER_THREAD_STACK is enabled */
+extern LWIP_STACK_LOCAL struct lwip_stack *lwip_stack_cur;
+
+struct lwip_stack *lwip_stack_new(ip_output_fn output_fn);
+void lwip_stack_free(struct lwip_stack *stack);
+void lwip_stack_set(struct lwip_stack *stack);
+struct lwip_stack *lwip_stack_get(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LWIP_HDR_STACK_H */
@@ -125,7 +125,8 @@ struct stats_ {
 #endif
 };
 
-extern struct stats_ lwip_stats;
+/* the current instance's, see lwip/stack.h */
+#define lwip_stats (lwip_stack_cur->stats)
 
 void stats_init(void);
 
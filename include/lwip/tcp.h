@@ -45,6 +45,8 @@ extern "C" {
 #endif
 
 struct tcp_pcb;
+struct tcp_cc_ops;
+struct tcp_fec;
 
 /** Function prototype for tcp accept callback functions. Called when a new
  * connection can be accepted on a listening pcb.
@@ -95,6 +97,15 @@ typedef err_t (*tcp_sent_fn)(void *arg, struct tcp_pcb *tpcb,
  */
 typedef err_t (*tcp_poll_fn)(void *arg, struct tcp_pcb *tpcb);
 
+#if LWIP_TCP_WRITE_REF
+/** Function prototype for tcp_write_ref() completion: the data written
+ * is referenced by the stack no more and may be reused.
+ *
+ * @param arg Additional argument passed to tcp_write_ref()
+ */
+typedef void (*tcp_write_done_fn)(void *arg);
+#endif /* LWIP_TCP_WRITE_REF */
+
 /** Function prototype for tcp error callback functions. Called when the pcb
  * receives a RST or is unexpectedly closed for any other reason.
  *
@@ -125,18 +136,25 @@ typedef err_t (*tcp_connected_fn)(void *arg, struct tcp_pcb *tpcb, err_t err);
 #define RCV_WND_SCALE(pcb, wnd) (((wnd) >> (pcb)->rcv_scale))
 #define SND_WND_SCALE(pcb, wnd) (((wnd) << (pcb)->snd_scale))
 #define TCPWND16(x)             ((u16_t)LWIP_MIN((x), 0xFFFF))
-#define TCP_WND_MAX(pcb)        ((tcpwnd_size_t)(((pcb)->flags & TF_WND_SCALE) ? TCP_WND : TCPWND16(TCP_WND)))
+#define TCP_WND_MAX(pcb)        ((tcpwnd_size_t)(((pcb)->flags & TF_WND_SCALE) ? (pcb)->rcv_wnd_size : TCPWND16((pcb)->rcv_wnd_size)))
 typedef u32_t tcpwnd_size_t;
-typedef u16_t tcpflags_t;
 #else
 #define RCV_WND_SCALE(pcb, wnd) (wnd)
 #define SND_WND_SCALE(pcb, wnd) (wnd)
 #define TCPWND16(x)             (x)
-#define TCP_WND_MAX(pcb)        TCP_WND
+#define TCP_WND_MAX(pcb)        ((pcb)->rcv_wnd_size)
 typedef u16_t tcpwnd_size_t;
+#endif
+
+#if LWIP_WND_SCALE || LWIP_TCP_SACK || LWIP_TCP_TURBO
+typedef u16_t tcpflags_t;
+#else
 typedef u8_t tcpflags_t;
 #endif
 
+/* room for the per-connection state of a congestion control module */
+#define TCP_CC_PRIV_WORDS 12
+
 enum tcp_state {
   CLOSED      = 0,
   LISTEN      = 1,
@@ -192,6 +210,14 @@ struct connect_id_t {
   DEF_ACCEPT_CALLBACK \
   enum tcp_state state; /* TCP state */ \
   u8_t prio; \
+  /* congestion control, passed on from listen pcbs to accepted ones */ \
+  const struct tcp_cc_ops *cc; \
+  /* send buffer and receive window, see tcp_set_bufsize() */ \
+  tcpwnd_size_t snd_buf_size; \
+  tcpwnd_size_t rcv_wnd_size; \
+  /* the send buffer or receive window was set, not autotuned */ \
+  u8_t snd_buf_fixed; \
+  u8_t rcv_wnd_fixed; \
   /* ports are in host byte order */ \
   u16_t local_port
 
@@ -218,6 +244,12 @@ struct tcp_pcb {
 #define TF_NAGLEMEMERR 0x80U   /* nagle enabled, memerr, try to output to prevent delayed ACK to happen */
 #if LWIP_WND_SCALE
 #define TF_WND_SCALE   0x0100U /* Window Scale option enabled */
+#endif
+#if LWIP_TCP_SACK
+#define TF_SACK        0x0200U /* SACK option enabled */
+#endif
+#if LWIP_TCP_TURBO
+#define TF_TURBO       0x0400U /* Low-latency mode, see tcp_set_turbo() */
 #endif
 
   /* the rest of the fields are in host byte order
@@ -225,8 +257,12 @@ struct tcp_pcb {
 
   /* Timers */
   u8_t polltmr, pollinterval;
-  u8_t last_timer;
+  u8_t wheel_state;   /* TCP_WHEEL_OFF, _IDLE or _SLOT, see tcp.c */
   u32_t tmr;
+  /* timer wheel slot and fast timer list links */
+  struct tcp_pcb *wheel_next, **wheel_pprev;
+  struct tcp_pcb *fast_next, **fast_pprev;
+  u32_t wheel_due;
 
   /* receiver variables */
   u32_t rcv_nxt;   /* next seqno expected */
@@ -234,26 +270,77 @@ struct tcp_pcb {
   tcpwnd_size_t rcv_ann_wnd; /* receiver window to announce */
   u32_t rcv_ann_right_edge; /* announced right edge of window */
 
-  /* Retransmission timer. */
-  s16_t rtime;
+  /* Retransmission timer, on the RTO list while running */
+  struct tcp_pcb *rto_next, **rto_pprev;
+  u32_t rto_due;  /* tcp_now_us() at which it fires */
 
   u16_t mss;   /* maximum segment size */
 
   /* RTT (round trip time) estimation variables */
-  u32_t rttest; /* RTT estimate in 500ms ticks */
+  u32_t rttest; /* tcp_now_us() the timed segment was sent at, 0 if none */
   u32_t rtseq;  /* sequence number being timed */
-  s16_t sa, sv; /* @todo document this */
+  s32_t sa, sv; /* smoothed RTT << 3 and RTT variance << 2, in us */
 
-  s16_t rto;    /* retransmission time-out */
+  u32_t rto;    /* retransmission time-out in ms */
   u8_t nrtx;    /* number of retransmissions */
 
   /* fast retransmit/recovery */
   u8_t dupacks;
+#if LWIP_TCP_TURBO
+  u8_t dupthresh; /* dupacks that trigger fast retransmit */
+#endif /* LWIP_TCP_TURBO */
   u32_t lastack; /* Highest acknowledged seqno. */
+#if LWIP_TCP_SACK
+  /* SACK scoreboard: number of segments on unacked the peer holds
+     (TF_SEG_SACKED), and snd_nxt when recovery started */
+  u16_t sacked;
+  u32_t recover;
+  /* seqno of the out-of-sequence segment received last, its block is
+     reported first */
+  u32_t ooseq_recent;
+#endif /* LWIP_TCP_SACK */
+#if LWIP_TCP_RACK
+  /* RACK: the most recently sent segment known delivered, its end and RTT
+     in us (0 if none yet), and the minimum RTT seen */
+  u32_t rack_xmit_us;
+  u32_t rack_end;
+  u32_t rack_rtt;
+  u32_t rack_min_rtt;
+  /* snd_nxt when the tail loss probe was sent, while tlp_out */
+  u32_t tlp_end;
+  u8_t tlp_out;
+  u8_t rto_kind; /* what the retransmission timer does, TCP_RTO_KIND_* */
+#endif /* LWIP_TCP_RACK */
+#if LWIP_TCP_FEC
+  /* tcp_set_fec(): data segments per parity group (0: off) and parity
+     datagrams per group; the coder, allocated on first use */
+  u8_t fec_k;
+  u8_t fec_r;
+  struct tcp_fec *fec;
+#endif /* LWIP_TCP_FEC */
+#if LWIP_TCP_RCV_AUTOTUNE
+  /* receive window autotuning: our RTT estimate in us (0 if none yet),
+     sampled as the time until rcv_nxt passes rcv_rtt_seq from
+     rcv_rtt_start; what the application read since rcv_space_start, the
+     most it read in one RTT, and the window added to the budget */
+  u32_t rcv_rtt;
+  u32_t rcv_rtt_seq;
+  u32_t rcv_rtt_start;
+  u32_t rcv_space_start;
+  u32_t rcv_space_copied;
+  u32_t rcv_space;
+  tcpwnd_size_t rcv_auto_grown;
+#endif /* LWIP_TCP_RCV_AUTOTUNE */
+#if LWIP_TCP_SND_AUTOTUNE
+  /* send buffer added by autotuning, charged to the budget */
+  tcpwnd_size_t snd_auto_grown;
+#endif /* LWIP_TCP_SND_AUTOTUNE */
 
   /* congestion avoidance/control variables */
   tcpwnd_size_t cwnd;
   tcpwnd_size_t ssthresh;
+  /* private state of the congestion control, see TCP_CC_PRIV() */
+  u32_t cc_priv[TCP_CC_PRIV_WORDS];
 
   /* sender variables */
   u32_t snd_nxt;   /* next new seqno to be sent */
@@ -365,12 +452,24 @@ void             tcp_poll    (struct tcp_pcb *pcb, tcp_poll_fn poll, u8_t interv
 void             tcp_err     (struct tcp_pcb *pcb, tcp_err_fn err);
 
 #define          tcp_mss(pcb)             (((pcb)->flags & TF_TIMESTAMP) ? ((pcb)->mss - 12)  : (pcb)->mss)
-#define          tcp_sndbuf(pcb)          (TCPWND16((pcb)->snd_buf))
+#define          tcp_sndbuf(pcb)          ((pcb)->snd_buf)
 #define          tcp_sndqueuelen(pcb)     ((pcb)->snd_queuelen)
 #define          tcp_nagle_disable(pcb)   ((pcb)->flags |= TF_NODELAY)
 #define          tcp_nagle_enable(pcb)    ((pcb)->flags = (tcpflags_t)((pcb)->flags & ~TF_NODELAY))
 #define          tcp_nagle_disabled(pcb)  (((pcb)->flags & TF_NODELAY) != 0)
 
+#if LWIP_TCP_TURBO
+void             tcp_set_turbo(struct tcp_pcb *pcb, u8_t on);
+#define          tcp_turbo_enabled(pcb)   (((pcb)->flags & TF_TURBO) != 0)
+#define          tcp_set_dupthresh(pcb, n) ((pcb)->dupthresh = (u8_t)(n))
+#endif /* LWIP_TCP_TURBO */
+
+err_t            tcp_set_bufsize(struct tcp_pcb *pcb, tcpwnd_size_t snd_size, tcpwnd_size_t rcv_size);
+
+#if LWIP_TCP_FEC
+err_t            tcp_set_fec (struct tcp_pcb *pcb, u8_t k, u8_t r);
+#endif /* LWIP_TCP_FEC */
+
 #if TCP_LISTEN_BACKLOG
 #define          tcp_accepted(pcb) do { \
   LWIP_ASSERT("pcb->state == LISTEN (called for wrong pcb?)", pcb->state == LISTEN); \
@@ -397,8 +496,12 @@ err_t            tcp_shutdown(struct tcp_pcb *pcb, int shut_rx, int shut_tx);
 #define TCP_WRITE_FLAG_COPY 0x01
 #define TCP_WRITE_FLAG_MORE 0x02
 
-err_t            tcp_write   (struct tcp_pcb *pcb, const void *dataptr, u16_t len,
+err_t            tcp_write   (struct tcp_pcb *pcb, const void *dataptr, tcpwnd_size_t len,
                               u8_t apiflags);
+#if LWIP_TCP_WRITE_REF
+err_t            tcp_write_ref(struct tcp_pcb *pcb, const void *dataptr, tcpwnd_size_t len,
+                               u8_t apiflags, tcp_write_done_fn done, void *done_arg);
+#endif /* LWIP_TCP_WRITE_REF */
 
 void             tcp_setprio (struct tcp_pcb *pcb, u8_t prio);
 
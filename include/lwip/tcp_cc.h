@@ -0,0 +1,80 @@
+/**
+ * @file
+ * Congestion control modules
+ *
+ * Every pcb points to a struct tcp_cc_ops which tcp_in.c, tcp_out.c and the
+ * retransmission timer call into instead of running Reno inline. The module
+ * keeps cwnd and ssthresh in the pcb up to date, and whatever else it needs
+ * in pcb->cc_priv. NewReno is always built, CUBIC and BBR with
+ * LWIP_TCP_CC_CUBIC and LWIP_TCP_CC_BBR.
+ */
+#ifndef LWIP_HDR_TCP_CC_H
+#define LWIP_HDR_TCP_CC_H
+
+#include "lwip/opt.h"
+
+#if LWIP_TCP /* don't build if not configured for use in lwipopts.h */
+
+#include "lwip/tcp.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct tcp_cc_ops {
+  /** short name for tcp_cc_find() */
+  const char *name;
+  /** The connection got established, or the pcb switched to this module
+      with cc_priv zeroed. cwnd and ssthresh hold their initial values. */
+  void (*init)(struct tcp_pcb *pcb);
+  /** New data was acked, in fast recovery (TF_INFR) too. */
+  void (*ack)(struct tcp_pcb *pcb, tcpwnd_size_t acked);
+  /** Fast retransmit: set ssthresh, and cwnd for the recovery. cwnd is set
+      back to ssthresh when recovery ends. */
+  void (*loss)(struct tcp_pcb *pcb);
+  /** The retransmission timer fired: set ssthresh and cwnd. */
+  void (*rto)(struct tcp_pcb *pcb);
+  /** A round-trip time sample in microseconds, may be NULL. */
+  void (*rtt)(struct tcp_pcb *pcb, u32_t rtt_us);
+  /** The window tcp_output() may have in flight, NULL to use cwnd. */
+  tcpwnd_size_t (*cwnd)(struct tcp_pcb *pcb);
+};
+
+extern const struct tcp_cc_ops tcp_cc_newreno;
+#if LWIP_TCP_CC_CUBIC
+extern const struct tcp_cc_ops tcp_cc_cubic;
+#endif /* LWIP_TCP_CC_CUBIC */
+#if LWIP_TCP_CC_BBR
+extern const struct tcp_cc_ops tcp_cc_bbr;
+#endif /* LWIP_TCP_CC_BBR */
+
+/** Use cc on pcb from now on. Set on a listen pcb, connections accepted from
+    it use it too. */
+void tcp_set_cc(struct tcp_pcb *pcb, const struct tcp_cc_ops *cc);
+/** The module built under name ("newreno", "cubic", "bbr"), or NULL. */
+const struct tcp_cc_ops *tcp_cc_find(const char *name);
+
+/* For the modules: */
+
+/** The private state of a module, struct type of at most TCP_CC_PRIV_WORDS
+    words. Check the size with TCP_CC_PRIV_CHECK(type). */
+#define TCP_CC_PRIV(pcb, type) ((struct type *)(void *)(pcb)->cc_priv)
+#define TCP_CC_PRIV_CHECK(type) \
+  typedef char tcp_cc_priv_check_##type[(sizeof(struct type) <= TCP_CC_PRIV_WORDS * 4) ? 1 : -1]
+
+/** The largest window tcpwnd_size_t holds */
+#define TCP_CC_WND_MAX ((tcpwnd_size_t)~(tcpwnd_size_t)0)
+
+/** Bytes sent and not acked yet */
+#define TCP_CC_FLIGHT(pcb) ((u32_t)((pcb)->snd_nxt - (pcb)->lastack))
+
+void tcp_cc_set_cwnd(struct tcp_pcb *pcb, u32_t cwnd);
+void tcp_cc_reno_ack(struct tcp_pcb *pcb, tcpwnd_size_t acked);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LWIP_TCP */
+
+#endif /* LWIP_HDR_TCP_CC_H */
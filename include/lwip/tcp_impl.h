@@ -37,6 +37,7 @@
 #if LWIP_TCP /* don't build if not configured for use in lwipopts.h */
 
 #include "lwip/tcp.h"
+#include "lwip/tcp_cc.h"
 #include "lwip/mem.h"
 #include "lwip/pbuf.h"
 #include "lwip/err.h"
@@ -49,6 +50,7 @@ extern "C" {
 
 /* Lower layer interface to TCP: */
 void             tcp_init(ip_output_fn output_fn);  /* Initialize this module. */
+void             tcp_set_shard(u32_t index, u32_t count); /* connid2 % count == index */
 void             tcp_tmr     (void);  /* Must be called every
                                          TCP_TMR_INTERVAL
                                          ms. (Typically 250 ms). */
@@ -57,6 +59,16 @@ void             tcp_tmr     (void);  /* Must be called every
 void             tcp_slowtmr (void);
 void             tcp_fasttmr (void);
 
+/* Clock for RTT samples and retransmission timeouts, in microseconds
+   (wrapping). Without one they are measured in slow timer ticks. */
+typedef u32_t (*tcp_clock_fn)(void);
+void             tcp_set_clock(tcp_clock_fn now_us);
+/* With a clock set, call tcp_rto_tmr() when tcp_rto_next() (microseconds
+   until the earliest retransmission timeout, -1 if none) has passed, so
+   retransmissions are not rounded up to the next slow timer tick. */
+void             tcp_rto_tmr (void);
+s32_t            tcp_rto_next(void);
+
 /* Call this from a netif driver (watch out for threading issues!) that has
    returned a memory error on transmit and now has free buffers to send more.
    This iterates all active pcbs that had an error and tries to call
@@ -72,6 +84,9 @@ err_t            tcp_send_empty_ack(struct tcp_pcb *pcb);
 void             tcp_rexmit  (struct tcp_pcb *pcb);
 void             tcp_rexmit_rto  (struct tcp_pcb *pcb);
 void             tcp_rexmit_fast (struct tcp_pcb *pcb);
+#if LWIP_TCP_SACK
+void             tcp_sack_clear  (struct tcp_pcb *pcb);
+#endif /* LWIP_TCP_SACK */
 u32_t            tcp_update_rcv_ann_wnd(struct tcp_pcb *pcb);
 err_t            tcp_process_refused_data(struct tcp_pcb *pcb);
 
@@ -88,7 +103,7 @@ err_t            tcp_process_refused_data(struct tcp_pcb *pcb);
                             ((tpcb)->flags & (TF_NODELAY | TF_INFR)) || \
                             (((tpcb)->unsent != NULL) && (((tpcb)->unsent->next != NULL) || \
                               ((tpcb)->unsent->len >= (tpcb)->mss))) || \
-                            ((tcp_sndbuf(tpcb) == 0) || (tcp_sndqueuelen(tpcb) >= TCP_SND_QUEUELEN)) \
+                            ((tcp_sndbuf(tpcb) == 0) || (tcp_sndqueuelen(tpcb) >= TCP_SND_QUEUELEN_MAX(tpcb))) \
                             ) ? 1 : 0)
 #define tcp_output_nagle(tpcb) (tcp_do_output_nagle(tpcb) ? tcp_output(tpcb) : ERR_OK)
 
@@ -113,6 +128,12 @@ err_t            tcp_process_refused_data(struct tcp_pcb *pcb);
 
 #define TCP_FLAGS 0x3fU
 
+#if LWIP_TCP_FEC
+/* Reserved header bit marking a parity datagram, see tcp_fec.c */
+#define TCP_FEC 0x100U
+#define TCPH_FEC(phdr) ((ntohs((phdr)->_hdrlen_rsvd_flags) & TCP_FEC) != 0)
+#endif /* LWIP_TCP_FEC */
+
 /* Length of the TCP header, excluding options. */
 #define TCP_HLEN 20
 
@@ -294,6 +315,15 @@ struct tcp_seg {
 #define TF_SEG_DATA_CHECKSUMMED (u8_t)0x04U /* ALL data (not the header) is
                                                checksummed into 'chksum' */
 #define TF_SEG_OPTS_WND_SCALE   (u8_t)0x08U /* Include WND SCALE option */
+#define TF_SEG_OPTS_SACK_PERM   (u8_t)0x10U /* Include SACK permitted option */
+#define TF_SEG_SACKED           (u8_t)0x20U /* on unacked, SACKed by the peer */
+#define TF_SEG_RETX             (u8_t)0x40U /* on unacked, retransmitted in
+                                               this SACK recovery */
+#define TF_SEG_LOST             (u8_t)0x80U /* on unacked, lost by RACK */
+#if LWIP_TCP_RACK
+  u8_t  xmits;             /* times sent */
+  u32_t xmit_us;           /* tcp_now_us() it was last sent at */
+#endif /* LWIP_TCP_RACK */
   struct tcp_hdr *tcphdr;  /* the TCP header */
 };
 
@@ -302,6 +332,8 @@ struct tcp_seg {
 #define LWIP_TCP_OPT_MSS        2
 #define LWIP_TCP_OPT_WS         3
 #define LWIP_TCP_OPT_TS         8
+#define LWIP_TCP_OPT_SACK_PERM  4
+#define LWIP_TCP_OPT_SACK       5
 
 #define LWIP_TCP_OPT_LEN_MSS    4
 #if LWIP_TCP_TIMESTAMPS
@@ -316,11 +348,22 @@ struct tcp_seg {
 #else
 #define LWIP_TCP_OPT_LEN_WS_OUT 0
 #endif
+#if LWIP_TCP_SACK
+#define LWIP_TCP_OPT_LEN_SACK_PERM     2
+#define LWIP_TCP_OPT_LEN_SACK_PERM_OUT 4 /* aligned for output (includes NOP padding) */
+/* a SACK option of n blocks, aligned for output (includes NOP padding) */
+#define LWIP_TCP_OPT_LEN_SACK_OUT(n)   (4 + 8 * (n))
+/* blocks that fit next to a timestamp option (RFC 2018, 3) */
+#define LWIP_TCP_SACK_MAX_BLOCKS       3
+#else
+#define LWIP_TCP_OPT_LEN_SACK_PERM_OUT 0
+#endif
 
 #define LWIP_TCP_OPT_LENGTH(flags) \
   (flags & TF_SEG_OPTS_MSS       ? LWIP_TCP_OPT_LEN_MSS    : 0) + \
   (flags & TF_SEG_OPTS_TS        ? LWIP_TCP_OPT_LEN_TS_OUT : 0) + \
-  (flags & TF_SEG_OPTS_WND_SCALE ? LWIP_TCP_OPT_LEN_WS_OUT : 0)
+  (flags & TF_SEG_OPTS_WND_SCALE ? LWIP_TCP_OPT_LEN_WS_OUT : 0) + \
+  (flags & TF_SEG_OPTS_SACK_PERM ? LWIP_TCP_OPT_LEN_SACK_PERM_OUT : 0)
 
 /** This returns a TCP header option for MSS in an u32_t */
 #define TCP_BUILD_MSS_OPTION(mss) htonl(0x02040000 | ((mss) & 0xFFFF))
@@ -330,31 +373,85 @@ struct tcp_seg {
 #define TCPWND_MAX         0xFFFFFFFFU
 #define TCPWND_CHECK16(x)  LWIP_ASSERT("window size > 0xFFFF", (x) <= 0xFFFF)
 #define TCPWND_MIN16(x)    ((u16_t)LWIP_MIN((x), 0xFFFF))
+/* the largest receive window a 16 bit header field announces */
+#define TCP_RCV_WND_LIMIT  (0xFFFFUL << TCP_RCV_SCALE)
 #else /* LWIP_WND_SCALE */
 #define TCPWNDSIZE_F       U16_F
 #define TCPWND_MAX         0xFFFFU
 #define TCPWND_CHECK16(x)
 #define TCPWND_MIN16(x)    x
+#define TCP_RCV_WND_LIMIT  0xFFFFUL
 #endif /* LWIP_WND_SCALE */
 
+/** The most pbufs pcb may queue for sending: TCP_SND_QUEUELEN for
+    TCP_SND_BUF bytes, as many more as its send buffer is larger */
+#define TCP_SND_QUEUELEN_MAX(pcb) \
+  ((u16_t)LWIP_MIN(TCP_SNDQUEUELEN_OVERFLOW, \
+     LWIP_MAX(TCP_SND_QUEUELEN, (u32_t)TCP_SND_QUEUELEN * ((pcb)->snd_buf_size / TCP_MSS) / (TCP_SND_BUF / TCP_MSS))))
+
 /* Global variables: */
-extern struct tcp_pcb *tcp_input_pcb;
-extern u32_t tcp_ticks;
-extern u8_t tcp_active_pcbs_changed;
+extern LWIP_STACK_LOCAL struct tcp_pcb *tcp_input_pcb;
 
 /* The TCP PCB lists. */
 union tcp_listen_pcbs_t { /* List of all TCP PCBs in LISTEN state. */
   struct tcp_pcb_listen *listen_pcbs; 
   struct tcp_pcb *pcbs;
 };
-extern struct tcp_pcb *tcp_bound_pcbs;
-extern union tcp_listen_pcbs_t tcp_listen_pcbs;
-extern struct tcp_pcb *tcp_active_pcbs;  /* List of all TCP PCBs that are in a
-              state in which they accept or send
-              data. */
-extern struct tcp_pcb *tcp_tw_pcbs;      /* List of all TCP PCBs in TIME-WAIT. */
 
-extern struct tcp_pcb *tcp_tmp_pcb;      /* Only used for temporary storage. */
+#define NUM_TCP_PCB_LISTS               4
+#define NUM_TCP_PCB_LISTS_NO_TIME_WAIT  3
+
+/** Slots per timer wheel, see tcp.c */
+#define TCP_WHEEL_BITS  8
+#define TCP_WHEEL_SIZE  (1UL << TCP_WHEEL_BITS)
+
+/** The TCP state of a stack instance (struct lwip_stack), reached through
+ * the macros below and the ones private to tcp.c */
+struct tcp_instance {
+  u16_t port;             /* last local TCP port */
+  u32_t server_id;
+  u32_t shard_index;      /* encoded into every connid2 handed out */
+  u32_t shard_count;
+  u32_t iss;
+  u32_t ticks;            /* incremented every slow timer shot */
+  u8_t timer;             /* to handle calling slow-timer from tcp_tmr() */
+  u8_t active_pcbs_changed;
+  ip_output_fn ip_output;
+
+  struct tcp_pcb *bound_pcbs;
+  union tcp_listen_pcbs_t listen_pcbs;
+  struct tcp_pcb *active_pcbs;
+  struct tcp_pcb *tw_pcbs;
+  struct tcp_pcb **pcb_lists[NUM_TCP_PCB_LISTS];
+
+  struct tcp_pcb *wheel[2][TCP_WHEEL_SIZE];
+  u32_t wheel_now;
+  struct tcp_pcb *fast_pcbs;
+  struct tcp_pcb *timer_pcb;
+  struct tcp_pcb *rto_pcbs;
+  u32_t rto_earliest;
+  tcp_clock_fn clock;
+
+  struct tcp_pcb **hash_tab;
+  u32_t hash_size;
+  u32_t hash_count;
+
+  u32_t autotune_used;
+};
+
+#define tcp_ticks               (lwip_stack_cur->tcp.ticks)
+#define tcp_active_pcbs_changed (lwip_stack_cur->tcp.active_pcbs_changed)
+/** List of all TCP PCBs bound but not yet (connected || listening) */
+#define tcp_bound_pcbs          (lwip_stack_cur->tcp.bound_pcbs)
+/** List of all TCP PCBs in LISTEN state */
+#define tcp_listen_pcbs         (lwip_stack_cur->tcp.listen_pcbs)
+/** List of all TCP PCBs that are in a state in which
+ * they accept or send data. */
+#define tcp_active_pcbs         (lwip_stack_cur->tcp.active_pcbs)
+/** List of all TCP PCBs in TIME-WAIT state */
+#define tcp_tw_pcbs             (lwip_stack_cur->tcp.tw_pcbs)
+
+extern LWIP_STACK_LOCAL struct tcp_pcb *tcp_tmp_pcb;      /* Only used for temporary storage. */
 
 /* Axioms about the above lists:   
    1) Every TCP PCB that is not CLOSED is in one of the lists.
@@ -427,18 +524,34 @@ extern struct tcp_pcb *tcp_tmp_pcb;      /* Only used for temporary storage. */
 
 #endif /* LWIP_DEBUG */
 
+/* Active and TIME-WAIT pcbs are additionally indexed by conn_id in a hash
+   table (see tcp_pcb_hash_lookup()) and sit on the timer wheel (see
+   tcp_timer_update()). The macros below and tcp_pcb_remove() keep both in
+   sync with the lists. A pcb new to both lists needs tcp_pcb_hash_reserve()
+   first, so that indexing it cannot fail. */
 #define TCP_REG_ACTIVE(npcb)                       \
   do {                                             \
     TCP_REG(&tcp_active_pcbs, npcb);               \
+    tcp_pcb_hash_insert(npcb);                     \
+    tcp_timer_add(npcb);                           \
     tcp_active_pcbs_changed = 1;                   \
   } while (0)
 
 #define TCP_RMV_ACTIVE(npcb)                       \
   do {                                             \
+    tcp_pcb_hash_remove(npcb);                     \
+    tcp_timer_remove(npcb);                        \
     TCP_RMV(&tcp_active_pcbs, npcb);               \
     tcp_active_pcbs_changed = 1;                   \
   } while (0)
 
+#define TCP_REG_TW(npcb)                           \
+  do {                                             \
+    TCP_REG(&tcp_tw_pcbs, npcb);                   \
+    tcp_pcb_hash_insert(npcb);                     \
+    tcp_timer_add(npcb);                           \
+  } while (0)
+
 #define TCP_PCB_REMOVE_ACTIVE(pcb)                 \
   do {                                             \
     tcp_pcb_remove(&tcp_active_pcbs, pcb);         \
@@ -451,13 +564,85 @@ struct tcp_pcb *tcp_pcb_copy(struct tcp_pcb *pcb);
 void tcp_pcb_purge(struct tcp_pcb *pcb);
 void tcp_pcb_remove(struct tcp_pcb **pcblist, struct tcp_pcb *pcb);
 
+err_t tcp_pcb_hash_reserve(void);
+err_t tcp_pcb_hash_insert(struct tcp_pcb *pcb);
+void tcp_pcb_hash_remove(struct tcp_pcb *pcb);
+struct tcp_pcb *tcp_pcb_hash_lookup(u32_t connid1, u32_t connid2);
+
+void tcp_timer_add(struct tcp_pcb *pcb);
+void tcp_timer_remove(struct tcp_pcb *pcb);
+void tcp_timer_update(struct tcp_pcb *pcb);
+
+u32_t tcp_now_us(void);
+u8_t tcp_has_clock(void);
+void tcp_rto_start(struct tcp_pcb *pcb);
+void tcp_rto_stop(struct tcp_pcb *pcb);
+u32_t tcp_rto_calc(struct tcp_pcb *pcb);
+/** The retransmission timer runs while the pcb is on the RTO list */
+#define TCP_RTO_RUNNING(pcb) ((pcb)->rto_pprev != NULL)
+
+#if LWIP_TCP_RACK
+/* What the retransmission timer does when it fires */
+#define TCP_RTO_KIND_RTO 0 /* retransmission time-out */
+#define TCP_RTO_KIND_TLP 1 /* tail loss probe */
+#define TCP_RTO_KIND_REO 2 /* RACK reordering window passed */
+void tcp_rto_arm(struct tcp_pcb *pcb, u32_t timeout_us, u8_t kind);
+
+/** RACK-TLP runs on pcbs that use SACK, with a clock */
+#define TCP_RACK(pcb) (((pcb)->flags & TF_SACK) && tcp_has_clock())
+void tcp_rack_delivered(struct tcp_pcb *pcb, struct tcp_seg *seg);
+void tcp_rack_ack(struct tcp_pcb *pcb);
+void tcp_rack_timeout(struct tcp_pcb *pcb);
+u32_t tcp_tlp_timeout(struct tcp_pcb *pcb);
+err_t tcp_rexmit_tlp(struct tcp_pcb *pcb);
+#endif /* LWIP_TCP_RACK */
+
+#if LWIP_TCP_FEC
+void tcp_fec_sent(struct tcp_pcb *pcb, struct tcp_seg *seg);
+void tcp_fec_flush(struct tcp_pcb *pcb);
+void tcp_fec_recv(struct tcp_pcb *pcb, u32_t seqno, u8_t flags, struct pbuf *p);
+struct pbuf *tcp_fec_input(struct tcp_pcb *pcb, struct tcp_hdr *tcphdr, struct pbuf *p);
+void tcp_fec_free(struct tcp_pcb *pcb);
+err_t tcp_output_fec(struct tcp_pcb *pcb, struct pbuf *p);
+#endif /* LWIP_TCP_FEC */
+
+#if LWIP_TCP_RCV_AUTOTUNE
+void tcp_rcv_rtt_measure(struct tcp_pcb *pcb);
+void tcp_rcv_autotune(struct tcp_pcb *pcb, u16_t len);
+void tcp_rcv_autotune_free(struct tcp_pcb *pcb);
+#endif /* LWIP_TCP_RCV_AUTOTUNE */
+#if LWIP_TCP_SND_AUTOTUNE
+void tcp_snd_autotune(struct tcp_pcb *pcb);
+void tcp_snd_autotune_free(struct tcp_pcb *pcb);
+#endif /* LWIP_TCP_SND_AUTOTUNE */
+
+/** Dupacks, or SACKed segments above an unacked one, that make it count
+    as lost */
+#if LWIP_TCP_TURBO
+#define TCP_DUPTHRESH(pcb) ((pcb)->dupthresh)
+#define TCP_TURBO(pcb)     ((pcb)->flags & TF_TURBO)
+#else /* LWIP_TCP_TURBO */
+#define TCP_DUPTHRESH(pcb) 3
+#define TCP_TURBO(pcb)     0
+#endif /* LWIP_TCP_TURBO */
+
+/** The congestion window tcp_output() fills */
+#define TCP_CC_CWND(pcb) ((pcb)->cc->cwnd != NULL ? (pcb)->cc->cwnd(pcb) : (pcb)->cwnd)
+
 void tcp_segs_free(struct tcp_seg *seg);
 void tcp_seg_free(struct tcp_seg *seg);
 struct tcp_seg *tcp_seg_copy(struct tcp_seg *seg);
 
+#if LWIP_TCP_TURBO
+#define TCP_ACK_DELAY_MASK (TF_ACK_DELAY | TF_TURBO)
+#else /* LWIP_TCP_TURBO */
+#define TCP_ACK_DELAY_MASK TF_ACK_DELAY
+#endif /* LWIP_TCP_TURBO */
+
+/* ACK every other segment at once, every one in turbo mode */
 #define tcp_ack(pcb)                               \
   do {                                             \
-    if((pcb)->flags & TF_ACK_DELAY) {              \
+    if((pcb)->flags & TCP_ACK_DELAY_MASK) {        \
       (pcb)->flags &= ~TF_ACK_DELAY;               \
       (pcb)->flags |= TF_ACK_NOW;                  \
     }                                              \
@@ -481,6 +666,7 @@ void tcp_rst(u32_t seqno, u32_t ackno,
        const struct connect_id_t *conn_id, u16_t remote_udp_port);
 
 u32_t tcp_next_iss(void);
+u32_t tcp_new_server_id(void);
 
 err_t tcp_keepalive(struct tcp_pcb *pcb);
 err_t tcp_zero_window_probe(struct tcp_pcb *pcb);
@@ -534,6 +720,9 @@ void tcp_netif_ipv4_addr_changed(const ip4_addr_t* old_addr, const ip4_addr_t* n
 }
 #endif
 
+/* struct lwip_stack, which the state macros above dereference */
+#include "lwip/stack.h"
+
 #endif /* LWIP_TCP */
 
 #endif /* LWIP_HDR_TCP_H */
@@ -44,6 +44,9 @@
 #include "lwip/memp.h"
 #include "lwip/pbuf.h"
 #include "lwip/tcp_impl.h"
+#include "lwip/stack.h"
+
+#include <string.h>
 
 /* Compile-time sanity checks for configuration errors.
  * These can be done independently of LWIP_DEBUG, without penalty.
@@ -83,6 +86,21 @@
 #if (LWIP_TCP && (TCP_SND_QUEUELEN < 2))
   #error "TCP_SND_QUEUELEN must be at least 2 for no-copy TCP writes to work"
 #endif
+#if (LWIP_TCP && LWIP_TCP_RACK && !LWIP_TCP_SACK)
+  #error "LWIP_TCP_RACK needs LWIP_TCP_SACK"
+#endif
+#if (LWIP_TCP && LWIP_TCP_FEC && ((TCP_FEC_GROUP_MAX < 1) || (TCP_FEC_GROUP_MAX > 127)))
+  #error "TCP_FEC_GROUP_MAX must be 1 to 127"
+#endif
+#if (LWIP_TCP && LWIP_TCP_RCV_AUTOTUNE && ((TCP_RCV_AUTOTUNE_MAX < TCP_WND) || (TCP_RCV_AUTOTUNE_MAX > (0xFFFFUL << TCP_RCV_SCALE))))
+  #error "TCP_RCV_AUTOTUNE_MAX must be at least TCP_WND and fit the window scale"
+#endif
+#if (LWIP_TCP && LWIP_TCP_SND_AUTOTUNE && ((TCP_SND_AUTOTUNE_MAX < TCP_SND_BUF) || (!LWIP_WND_SCALE && (TCP_SND_AUTOTUNE_MAX > 0xFFFF))))
+  #error "TCP_SND_AUTOTUNE_MAX must be at least TCP_SND_BUF and, without LWIP_WND_SCALE, fit 16 bits"
+#endif
+#if (LWIP_TCP && LWIP_TCP_WRITE_REF && !LWIP_SUPPORT_CUSTOM_PBUF)
+  #error "LWIP_TCP_WRITE_REF needs LWIP_SUPPORT_CUSTOM_PBUF"
+#endif
 #if (LWIP_TCP && ((TCP_MAXRTX > 12) || (TCP_SYNMAXRTX > 12)))
   #error "If you want to use TCP, TCP_MAXRTX and TCP_SYNMAXRTX must less or equal to 12 (due to tcp_backoff table), so, you have to reduce them in your lwipopts.h"
 #endif
@@ -149,13 +167,48 @@
 
 #endif
 
+LWIP_STACK_LOCAL struct lwip_stack *lwip_stack_cur;
+
+#if MEMP_SEPARATE_POOLS
+/* the static pools can only belong to one instance */
+static u8_t lwip_stack_pools_taken;
+#endif /* MEMP_SEPARATE_POOLS */
+
 /**
- * Initialize all modules.
+ * Create a stack instance: its state and its pools in one allocation,
+ * with all modules initialized. The current instance is not changed.
+ *
+ * @param output_fn sends the segments of the instance
+ * @return the new instance, NULL if out of memory
  */
-void
-lwip_init(ip_output_fn output_fn)
+struct lwip_stack *
+lwip_stack_new(ip_output_fn output_fn)
 {
-  /* Modules initialization */
+  struct lwip_stack *stack, *prev;
+  mem_size_t size = LWIP_MEM_ALIGN_SIZE(sizeof(struct lwip_stack));
+
+#if MEMP_SEPARATE_POOLS
+  if (lwip_stack_pools_taken) {
+    return NULL;
+  }
+#endif /* MEMP_SEPARATE_POOLS */
+#if !MEMP_MEM_MALLOC
+  size += memp_memory_size;
+#endif /* !MEMP_MEM_MALLOC */
+  stack = (struct lwip_stack *)mem_malloc(size);
+  if (stack == NULL) {
+    return NULL;
+  }
+  memset(stack, 0, sizeof(struct lwip_stack));
+#if MEMP_SEPARATE_POOLS
+  lwip_stack_pools_taken = 1;
+#elif !MEMP_MEM_MALLOC
+  stack->memp_memory = (u8_t *)stack + LWIP_MEM_ALIGN_SIZE(sizeof(struct lwip_stack));
+#endif /* MEMP_SEPARATE_POOLS */
+
+  /* Modules initialization, they work on the current instance */
+  prev = lwip_stack_cur;
+  lwip_stack_cur = stack;
   stats_init();
   mem_init();
   memp_init();
@@ -163,4 +216,61 @@ lwip_init(ip_output_fn output_fn)
 #if LWIP_TCP
   tcp_init(output_fn);
 #endif /* LWIP_TCP */
+  lwip_stack_cur = prev;
+  return stack;
+}
+
+/**
+ * Free an instance created by lwip_stack_new(). Its pcbs must have been
+ * freed, and it must not be current in any thread.
+ */
+void
+lwip_stack_free(struct lwip_stack *stack)
+{
+  if (stack == NULL) {
+    return;
+  }
+#if LWIP_TCP
+  if (stack->tcp.hash_tab != NULL) {
+    mem_free(stack->tcp.hash_tab);
+  }
+#endif /* LWIP_TCP */
+#if MEMP_SEPARATE_POOLS
+  lwip_stack_pools_taken = 0;
+#endif /* MEMP_SEPARATE_POOLS */
+  mem_free(stack);
+}
+
+/**
+ * Make stack the instance the calling thread works on.
+ */
+void
+lwip_stack_set(struct lwip_stack *stack)
+{
+  lwip_stack_cur = stack;
+}
+
+/**
+ * The instance the calling thread works on.
+ */
+struct lwip_stack *
+lwip_stack_get(void)
+{
+  return lwip_stack_cur;
+}
+
+/**
+ * Initialize all modules: create an instance and make it the current one.
+ *
+ * @return ERR_MEM if the instance cannot be allocated
+ */
+err_t
+lwip_init(ip_output_fn output_fn)
+{
+  struct lwip_stack *stack = lwip_stack_new(output_fn);
+  if (stack == NULL) {
+    return ERR_MEM;
+  }
+  lwip_stack_cur = stack;
+  return ERR_OK;
 }
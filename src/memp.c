@@ -44,6 +44,7 @@
 #include "lwip/pbuf.h"
 #include "lwip/tcp_impl.h"
 #include "lwip/stats.h"
+#include "lwip/stack.h"
 
 #include <string.h>
 
@@ -100,7 +101,7 @@ struct memp {
 
 /** This array holds the first free element of each pool.
  *  Elements form a linked list. */
-static struct memp *memp_tab[MEMP_MAX];
+#define memp_tab (lwip_stack_cur->memp_tab)
 
 #else /* MEMP_MEM_MALLOC */
 
@@ -139,6 +140,7 @@ static const char *memp_desc[MEMP_MAX] = {
  * XXX is the name of the pool defined in memp_std.h).
  * To relocate a pool, declare it as extern in cc.h. Example for GCC:
  *   extern u8_t __attribute__((section(".onchip_mem"))) memp_memory_UDP_PCB_base[];
+ * The pools are static, so only one stack instance can exist.
  */
 #define LWIP_MEMPOOL(name,num,size,desc) u8_t memp_memory_ ## name ## _base \
   [((num) * (MEMP_SIZE + MEMP_ALIGN_SIZE(size)))];   
@@ -150,13 +152,17 @@ static u8_t *const memp_bases[] = {
 #include "lwip/memp_std.h"
 };
 
+const u32_t memp_memory_size = 0;
+
 #else /* MEMP_SEPARATE_POOLS */
 
-/** This is the actual memory used by the pools (all pools in one big block). */
-static u8_t memp_memory[MEM_ALIGNMENT - 1 
+/** The size of the memory used by the pools (all pools in one big block),
+ *  lwip_stack_new() allocates it with the instance. */
+const u32_t memp_memory_size = MEM_ALIGNMENT - 1 
 #define LWIP_MEMPOOL(name,num,size,desc) + ( (num) * (MEMP_SIZE + MEMP_ALIGN_SIZE(size) ) )
 #include "lwip/memp_std.h"
-];
+;
+#define memp_memory (lwip_stack_cur->memp_memory)
 
 #endif /* MEMP_SEPARATE_POOLS */
 
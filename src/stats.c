@@ -44,11 +44,10 @@
 #include "lwip/stats.h"
 #include "lwip/mem.h"
 #include "lwip/debug.h"
+#include "lwip/stack.h"
 
 #include <string.h>
 
-struct stats_ lwip_stats;
-
 void stats_init(void)
 {
 #ifdef LWIP_DEBUG
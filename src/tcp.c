@@ -84,48 +84,34 @@ const char * const tcp_state_str[] = {
   "TIME_WAIT"   
 };
 
+/* The state of the current instance, see struct tcp_instance */
+
 /* last local TCP port */
-static u16_t tcp_port = TCP_LOCAL_PORT_RANGE_START;
+#define tcp_port        (lwip_stack_cur->tcp.port)
 
-static u32_t tcp_server_id = 9528;
+#define tcp_server_id   (lwip_stack_cur->tcp.server_id)
+/* this instance's shard, encoded into every connid2 it hands out */
+#define tcp_shard_index (lwip_stack_cur->tcp.shard_index)
+#define tcp_shard_count (lwip_stack_cur->tcp.shard_count)
 
-/* Incremented every coarse grained timer shot (typically every 500 ms). */
-u32_t tcp_ticks;
 const u8_t tcp_backoff[13] =
     { 1, 2, 3, 4, 5, 6, 7, 7, 7, 7, 7, 7, 7};
  /* Times per slowtmr hits */
 const u8_t tcp_persist_backoff[7] = { 3, 6, 12, 24, 48, 96, 120 };
 
-/* The TCP PCB lists. */
-
-/** List of all TCP PCBs bound but not yet (connected || listening) */
-struct tcp_pcb *tcp_bound_pcbs;
-/** List of all TCP PCBs in LISTEN state */
-union tcp_listen_pcbs_t tcp_listen_pcbs;
-/** List of all TCP PCBs that are in a state in which
- * they accept or send data. */
-struct tcp_pcb *tcp_active_pcbs;
-/** List of all TCP PCBs in TIME-WAIT state */
-struct tcp_pcb *tcp_tw_pcbs;
-
-#define NUM_TCP_PCB_LISTS               4
-#define NUM_TCP_PCB_LISTS_NO_TIME_WAIT  3
-/** An array with all (non-temporary) PCB lists, mainly used for smaller code size */
-struct tcp_pcb ** const tcp_pcb_lists[] = {&tcp_listen_pcbs.pcbs, &tcp_bound_pcbs,
-  &tcp_active_pcbs, &tcp_tw_pcbs};
+/** An array with all (non-temporary) PCB lists, mainly used for smaller code size,
+ * filled in by tcp_init() */
+#define tcp_pcb_lists   (lwip_stack_cur->tcp.pcb_lists)
 
 /** Only used for temporary storage. */
-struct tcp_pcb *tcp_tmp_pcb;
-
-u8_t tcp_active_pcbs_changed;
+LWIP_STACK_LOCAL struct tcp_pcb *tcp_tmp_pcb;
 
 /** Timer counter to handle calling slow-timer from tcp_tmr() */ 
-static u8_t tcp_timer;
-static u8_t tcp_timer_ctr;
+#define tcp_timer       (lwip_stack_cur->tcp.timer)
 static u16_t tcp_new_port(void);
 
 /*output callback function*/
-ip_output_fn ip_output;
+#define ip_output       (lwip_stack_cur->tcp.ip_output)
 
 /**
  * Initialize this module.
@@ -133,9 +119,19 @@ ip_output_fn ip_output;
 void
 tcp_init(ip_output_fn output_fn)
 {
+  /* the rest of the instance starts out zeroed */
+  tcp_port = TCP_LOCAL_PORT_RANGE_START;
 #if LWIP_RANDOMIZE_INITIAL_LOCAL_PORTS && defined(LWIP_RAND)
   tcp_port = TCP_ENSURE_LOCAL_PORT_RANGE(LWIP_RAND());
 #endif /* LWIP_RANDOMIZE_INITIAL_LOCAL_PORTS && defined(LWIP_RAND) */
+  tcp_server_id = 9528;
+  tcp_shard_count = 1;
+  lwip_stack_cur->tcp.iss = 6510;
+
+  tcp_pcb_lists[0] = &tcp_listen_pcbs.pcbs;
+  tcp_pcb_lists[1] = &tcp_bound_pcbs;
+  tcp_pcb_lists[2] = &tcp_active_pcbs;
+  tcp_pcb_lists[3] = &tcp_tw_pcbs;
 
   ip_output = output_fn;
 }
@@ -192,7 +188,7 @@ tcp_close_shutdown(struct tcp_pcb *pcb, u8_t rst_on_unacked_data)
       if (pcb->state == ESTABLISHED) {
         /* move to TIME_WAIT since we close actively */
         pcb->state = TIME_WAIT;
-        TCP_REG(&tcp_tw_pcbs, pcb);
+        TCP_REG_TW(pcb);
       } else {
         /* CLOSE_WAIT: deallocate the pcb since we already sent a RST for it */
         if (tcp_input_pcb == pcb) {
@@ -570,6 +566,11 @@ tcp_listen_with_backlog(struct tcp_pcb *pcb, u8_t backlog)
   lpcb->local_port = pcb->local_port;
   lpcb->state = LISTEN;
   lpcb->prio = pcb->prio;
+  lpcb->cc = pcb->cc;
+  lpcb->snd_buf_size = pcb->snd_buf_size;
+  lpcb->rcv_wnd_size = pcb->rcv_wnd_size;
+  lpcb->snd_buf_fixed = pcb->snd_buf_fixed;
+  lpcb->rcv_wnd_fixed = pcb->rcv_wnd_fixed;
 //  ip_addr_copy(lpcb->local_ip, pcb->local_ip);
   if (pcb->local_port != 0) {
     TCP_RMV(&tcp_bound_pcbs, pcb);
@@ -630,7 +631,7 @@ u32_t tcp_update_rcv_ann_wnd(struct tcp_pcb *pcb)
 {
   u32_t new_right_edge = pcb->rcv_nxt + pcb->rcv_wnd;
 
-  if (TCP_SEQ_GEQ(new_right_edge, pcb->rcv_ann_right_edge + LWIP_MIN((TCP_WND / 2), pcb->mss))) {
+  if (TCP_SEQ_GEQ(new_right_edge, pcb->rcv_ann_right_edge + LWIP_MIN((TCP_WND_MAX(pcb) / 2), pcb->mss))) {
     /* we can advertise more window */
     pcb->rcv_ann_wnd = pcb->rcv_wnd;
     return new_right_edge - pcb->rcv_ann_right_edge;
@@ -662,7 +663,7 @@ u32_t tcp_update_rcv_ann_wnd(struct tcp_pcb *pcb)
 void
 tcp_recved(struct tcp_pcb *pcb, u16_t len)
 {
-  int wnd_inflation;
+  u32_t wnd_inflation;
 
   /* pcb->state LISTEN not allowed here */
   LWIP_ASSERT("don't call tcp_recved for listen-pcbs",
@@ -682,6 +683,9 @@ tcp_recved(struct tcp_pcb *pcb, u16_t len)
       LWIP_ASSERT("tcp_recved: len wrapped rcv_wnd\n", 0);
     }
   }
+#if LWIP_TCP_RCV_AUTOTUNE
+  tcp_rcv_autotune(pcb, len);
+#endif /* LWIP_TCP_RCV_AUTOTUNE */
 
   wnd_inflation = tcp_update_rcv_ann_wnd(pcb);
 
@@ -694,7 +698,7 @@ tcp_recved(struct tcp_pcb *pcb, u16_t len)
     tcp_output(pcb);
   }
 
-  LWIP_DEBUGF(TCP_DEBUG, ("tcp_recved: received %"U16_F" bytes, wnd %"U16_F" (%"U16_F").\n",
+  LWIP_DEBUGF(TCP_DEBUG, ("tcp_recved: received %"U16_F" bytes, wnd %"TCPWNDSIZE_F" (%"TCPWNDSIZE_F").\n",
          len, pcb->rcv_wnd, TCP_WND_MAX(pcb) - pcb->rcv_wnd));
 }
 
@@ -728,23 +732,51 @@ again:
   return tcp_port;
 }
 
-u32_t tcp_new_server_id(void) {
-    u8_t i;
-    struct tcp_pcb *pcb;
+/**
+ * Set the shard this stack instance serves when several instances share one
+ * UDP port. Every connid2 handed out by tcp_new_server_id() afterwards
+ * satisfies (connid2 % count) == index, so a packet can be steered to its
+ * owning instance by looking at connid2 alone.
+ *
+ * @param index shard number of this instance, 0 <= index < count
+ * @param count total number of shards
+ */
+void
+tcp_set_shard(u32_t index, u32_t count)
+{
+  LWIP_ASSERT("tcp_set_shard: index < count", index < count);
+  tcp_shard_index = index;
+  tcp_shard_count = count;
+}
+
+/**
+ * Allocate a connid2 for a connection accepted by this instance.
+ * The id is unique among all pcbs and carries the shard index
+ * (see tcp_set_shard()).
+ *
+ * @return a new, non-zero connid2
+ */
+u32_t
+tcp_new_server_id(void)
+{
+  u8_t i;
+  u32_t id;
+  struct tcp_pcb *pcb;
 
 again:
-    if (++tcp_server_id == 0) {
-        ++tcp_server_id;
-    }
-    /* Check all PCB lists. */
-    for (i = 0; i < NUM_TCP_PCB_LISTS; i++) {
-      for(pcb = *tcp_pcb_lists[i]; pcb != NULL; pcb = pcb->next) {
-        if (pcb->conn_id.connid2 == tcp_server_id) {
-          goto again;
-        }
+  if (++tcp_server_id > (0xffffffffUL - tcp_shard_index) / tcp_shard_count) {
+    tcp_server_id = 1;
+  }
+  id = tcp_server_id * tcp_shard_count + tcp_shard_index;
+  /* Check all PCB lists. */
+  for (i = 0; i < NUM_TCP_PCB_LISTS; i++) {
+    for(pcb = *tcp_pcb_lists[i]; pcb != NULL; pcb = pcb->next) {
+      if (pcb->conn_id.connid2 == id) {
+        goto again;
       }
     }
-    return ++tcp_server_id;
+  }
+  return id;
 }
 
 /**
@@ -840,7 +872,7 @@ tcp_connect(struct tcp_pcb *pcb, const struct ip_addr_t* ipaddr, u16_t port,
   pcb->snd_lbb = iss - 1;
   /* Start with a window that does not need scaling. When window scaling is
      enabled and used, the window is enlarged when both sides agree on scaling. */
-  pcb->rcv_wnd = pcb->rcv_ann_wnd = TCPWND_MIN16(TCP_WND);
+  pcb->rcv_wnd = pcb->rcv_ann_wnd = TCPWND_MIN16(pcb->rcv_wnd_size);
   pcb->rcv_ann_right_edge = pcb->rcv_nxt;
   pcb->snd_wnd = TCP_WND;
   /* As initial send MSS, we use TCP_MSS but limit it to 536.
@@ -857,6 +889,11 @@ tcp_connect(struct tcp_pcb *pcb, const struct ip_addr_t* ipaddr, u16_t port,
   LWIP_UNUSED_ARG(connected);
 #endif /* LWIP_CALLBACK_API */
 
+  /* TCP_REG_ACTIVE() below must be able to index the pcb */
+  if (tcp_pcb_hash_reserve() != ERR_OK) {
+    return ERR_MEM;
+  }
+
   /* Send a SYN together with the MSS option. */
   ret = tcp_enqueue_flags(pcb, TCP_SYN);
   if (ret == ERR_OK) {
@@ -872,317 +909,664 @@ tcp_connect(struct tcp_pcb *pcb, const struct ip_addr_t* ipaddr, u16_t port,
   return ret;
 }
 
+/*
+ * Timer wheel.
+ *
+ * tcp_slowtmr() does not walk every pcb. Each active and TIME-WAIT pcb sits
+ * in the slot of the next slow tick at which one of its timers can fire
+ * (see tcp_timer_due()), or nowhere (TCP_WHEEL_IDLE) while none can. Level
+ * 0 has a slot per tick for the next TCP_WHEEL_SIZE ticks, level 1 a slot
+ * per TCP_WHEEL_SIZE ticks after that; its slots are cascaded into level 0
+ * as their time comes. Deadlines further out are clamped to the last level
+ * 1 slot. A pcb that is looked at before its timers are due is simply
+ * rescheduled, so tcp_timer_update() only has to move a pcb when its
+ * deadline comes closer.
+ *
+ * Pcbs with a delayed ACK or refused data are also on tcp_fast_pcbs, which
+ * is all tcp_fasttmr() walks.
+ */
+#define TCP_WHEEL_MASK  (TCP_WHEEL_SIZE - 1)
+
+#define TCP_WHEEL_OFF   0   /* not on tcp_active_pcbs or tcp_tw_pcbs */
+#define TCP_WHEEL_IDLE  1   /* no timer running */
+#define TCP_WHEEL_SLOT  2   /* in the slot for pcb->wheel_due */
+
+#define tcp_wheel         (lwip_stack_cur->tcp.wheel)
+/* the wheel's own tick count, tcp_ticks may be set from outside */
+#define tcp_wheel_now     (lwip_stack_cur->tcp.wheel_now)
+#define tcp_fast_pcbs     (lwip_stack_cur->tcp.fast_pcbs)
+/* the pcb a timer runs for, reset to NULL if it is removed meanwhile */
+#define tcp_timer_pcb     (lwip_stack_cur->tcp.timer_pcb)
+/* pcbs with a running retransmission timer, see tcp_rto_tmr() */
+#define tcp_rto_pcbs      (lwip_stack_cur->tcp.rto_pcbs)
+/* no pcb on tcp_rto_pcbs is due before this */
+#define tcp_rto_earliest  (lwip_stack_cur->tcp.rto_earliest)
+#define tcp_clock         (lwip_stack_cur->tcp.clock)
+
+#define TCP_TMR_LINK(head, pcb, next, pprev) do { \
+    (pcb)->next = *(head);                        \
+    if ((pcb)->next != NULL) {                    \
+      (pcb)->next->pprev = &(pcb)->next;          \
+    }                                             \
+    *(head) = (pcb);                              \
+    (pcb)->pprev = (head);                        \
+  } while (0)
+
+#define TCP_TMR_UNLINK(pcb, next, pprev) do {    \
+    if ((pcb)->pprev != NULL) {                   \
+      *(pcb)->pprev = (pcb)->next;                \
+      if ((pcb)->next != NULL) {                  \
+        (pcb)->next->pprev = (pcb)->pprev;        \
+      }                                           \
+      (pcb)->next = NULL;                         \
+      (pcb)->pprev = NULL;                        \
+    }                                             \
+  } while (0)
+
+/** Move a whole list to *to, so that it can be walked while pcbs are
+    unlinked from it and new ones are scheduled. */
+#define TCP_TMR_TAKE(to, from, pprev) do {        \
+    *(to) = *(from);                              \
+    *(from) = NULL;                               \
+    if (*(to) != NULL) {                          \
+      (*(to))->pprev = (to);                      \
+    }                                             \
+  } while (0)
+
+static void
+tcp_wheel_insert(struct tcp_pcb *pcb, u32_t due)
+{
+  struct tcp_pcb **slot;
+
+  if (due - tcp_wheel_now < TCP_WHEEL_SIZE) {
+    slot = &tcp_wheel[0][due & TCP_WHEEL_MASK];
+  } else {
+    if ((due >> TCP_WHEEL_BITS) - (tcp_wheel_now >> TCP_WHEEL_BITS) >= TCP_WHEEL_SIZE) {
+      due = ((tcp_wheel_now >> TCP_WHEEL_BITS) + TCP_WHEEL_SIZE - 1) << TCP_WHEEL_BITS;
+    }
+    slot = &tcp_wheel[1][(due >> TCP_WHEEL_BITS) & TCP_WHEEL_MASK];
+  }
+  pcb->wheel_due = due;
+  pcb->wheel_state = TCP_WHEEL_SLOT;
+  TCP_TMR_LINK(slot, pcb, wheel_next, wheel_pprev);
+}
+
 /**
- * Called every 500 ms and implements the retransmission timer and the timer that
- * removes PCBs that have been in TIME-WAIT for enough time. It also increments
- * various timers such as the inactivity timer in each PCB.
+ * Compute the wheel tick at which tcp_slowtmr() next has to look at a pcb:
+ * the next tick while a timer that counts ticks (persist, poll) runs or data waits to be sent, otherwise the first tick at which
+ * one of the conditions tcp_slowtmr_pcb() tests on pcb->tmr becomes true.
  *
- * Automatically called from tcp_tmr().
+ * @return 0 if no timer runs
+ */
+static u8_t
+tcp_timer_due(struct tcp_pcb *pcb, u32_t *due)
+{
+  u32_t when = 0;
+  u8_t running = 0;
+  s32_t delta;
+
+#define TCP_TIMER_AT(t) do {                            \
+    u32_t at_ = (t);                                    \
+    if (!running || (s32_t)(at_ - when) < 0) {          \
+      when = at_;                                       \
+      running = 1;                                      \
+    }                                                   \
+  } while (0)
+
+  if (pcb->state == TIME_WAIT || pcb->state == LAST_ACK) {
+    TCP_TIMER_AT(pcb->tmr + 2 * TCP_MSL / TCP_SLOW_INTERVAL + 1);
+  }
+  if (pcb->state != TIME_WAIT) {
+    if (pcb->persist_backoff > 0 || pcb->unsent != NULL
+#if LWIP_CALLBACK_API
+        || pcb->poll != NULL
+#else /* LWIP_CALLBACK_API */
+        || 1
+#endif /* LWIP_CALLBACK_API */
+       ) {
+      TCP_TIMER_AT(tcp_ticks + 1);
+    }
+    if (pcb->state == FIN_WAIT_2 && (pcb->flags & TF_RXCLOSED)) {
+      TCP_TIMER_AT(pcb->tmr + TCP_FIN_WAIT_TIMEOUT / TCP_SLOW_INTERVAL + 1);
+    }
+    if (pcb->state == ESTABLISHED || pcb->state == CLOSE_WAIT) {
+      TCP_TIMER_AT(pcb->tmr + (pcb->keep_idle + pcb->keep_cnt_sent * TCP_KEEP_INTVL(pcb))
+                   / TCP_SLOW_INTERVAL + 1);
+    }
+#if TCP_QUEUE_OOSEQ
+    if (pcb->ooseq != NULL) {
+      TCP_TIMER_AT(pcb->tmr + pcb->rto * TCP_OOSEQ_TIMEOUT / TCP_SLOW_INTERVAL);
+    }
+#endif /* TCP_QUEUE_OOSEQ */
+    if (pcb->state == SYN_RCVD) {
+      TCP_TIMER_AT(pcb->tmr + TCP_SYN_RCVD_TIMEOUT / TCP_SLOW_INTERVAL + 1);
+    }
+  }
+#undef TCP_TIMER_AT
+
+  if (!running) {
+    return 0;
+  }
+  delta = (s32_t)(when - tcp_ticks);
+  *due = tcp_wheel_now + (delta > 1 ? (u32_t)delta : 1);
+  return 1;
+}
+
+/**
+ * Put a pcb that has just been put on tcp_active_pcbs or tcp_tw_pcbs on
+ * the timer wheel. Called from TCP_REG_ACTIVE/TCP_REG_TW.
  */
 void
-tcp_slowtmr(void)
+tcp_timer_add(struct tcp_pcb *pcb)
 {
-  struct tcp_pcb *pcb, *prev;
-  tcpwnd_size_t eff_wnd;
-  u8_t pcb_remove;      /* flag if a PCB should be removed */
-  u8_t pcb_reset;       /* flag if a RST should be sent when removing */
-  err_t err;
+  pcb->wheel_next = pcb->fast_next = pcb->rto_next = NULL;
+  pcb->wheel_pprev = pcb->fast_pprev = pcb->rto_pprev = NULL;
+  pcb->wheel_state = TCP_WHEEL_IDLE;
+  tcp_timer_update(pcb);
+}
 
-  err = ERR_OK;
+/**
+ * Take a pcb off the timer wheel. Must be called before it leaves
+ * tcp_active_pcbs/tcp_tw_pcbs, does nothing if it is not on the wheel.
+ */
+void
+tcp_timer_remove(struct tcp_pcb *pcb)
+{
+  TCP_TMR_UNLINK(pcb, wheel_next, wheel_pprev);
+  TCP_TMR_UNLINK(pcb, fast_next, fast_pprev);
+  TCP_TMR_UNLINK(pcb, rto_next, rto_pprev);
+  pcb->wheel_state = TCP_WHEEL_OFF;
+  if (tcp_timer_pcb == pcb) {
+    tcp_timer_pcb = NULL;
+  }
+}
 
-  ++tcp_ticks;
-  ++tcp_timer_ctr;
+/**
+ * Reschedule a pcb after something may have started one of its timers
+ * sooner than it is scheduled for: data queued or sent, a delayed ACK or
+ * refused data, a state change, a poll callback. Called from tcp_input(),
+ * tcp_output() and the API functions that do so.
+ */
+void
+tcp_timer_update(struct tcp_pcb *pcb)
+{
+  u32_t due;
 
-tcp_slowtmr_start:
-  /* Steps through all of the active PCBs. */
-  prev = NULL;
-  pcb = tcp_active_pcbs;
-  if (pcb == NULL) {
-    LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: no active pcbs\n"));
+  if (pcb->wheel_state == TCP_WHEEL_OFF) {
+    return;
   }
-  while (pcb != NULL) {
-    LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: processing active pcb\n"));
-    LWIP_ASSERT("tcp_slowtmr: active pcb->state != CLOSED\n", pcb->state != CLOSED);
-    LWIP_ASSERT("tcp_slowtmr: active pcb->state != LISTEN\n", pcb->state != LISTEN);
-    LWIP_ASSERT("tcp_slowtmr: active pcb->state != TIME-WAIT\n", pcb->state != TIME_WAIT);
-    if (pcb->last_timer == tcp_timer_ctr) {
-      /* skip this pcb, we have already processed it */
-      pcb = pcb->next;
-      continue;
+  if (pcb->fast_pprev == NULL && pcb->state != TIME_WAIT &&
+      ((pcb->flags & TF_ACK_DELAY) || pcb->refused_data != NULL)) {
+    TCP_TMR_LINK(&tcp_fast_pcbs, pcb, fast_next, fast_pprev);
+  }
+  if (!tcp_timer_due(pcb, &due)) {
+    return;
+  }
+  if (pcb->wheel_state == TCP_WHEEL_SLOT) {
+    if ((s32_t)(due - pcb->wheel_due) >= 0) {
+      return;
     }
-    pcb->last_timer = tcp_timer_ctr;
+    TCP_TMR_UNLINK(pcb, wheel_next, wheel_pprev);
+  }
+  tcp_wheel_insert(pcb, due);
+}
+
+/**
+ * Set the clock RTT samples and retransmission timeouts are measured with.
+ *
+ * @param now_us returns a monotonic time in microseconds, may wrap
+ */
+void
+tcp_set_clock(tcp_clock_fn now_us)
+{
+  tcp_clock = now_us;
+}
+
+/** The current time in microseconds, slow timer ticks if no clock is set */
+u32_t
+tcp_now_us(void)
+{
+  if (tcp_clock != NULL) {
+    return tcp_clock();
+  }
+  return tcp_ticks * (TCP_SLOW_INTERVAL * 1000UL);
+}
 
-    pcb_remove = 0;
-    pcb_reset = 0;
+/** Whether tcp_now_us() is a clock rather than slow timer ticks */
+u8_t
+tcp_has_clock(void)
+{
+  return tcp_clock != NULL;
+}
 
-    if (pcb->state == SYN_SENT && pcb->nrtx == TCP_SYNMAXRTX) {
-      ++pcb_remove;
-      LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: max SYN retries reached\n"));
+/**
+ * The retransmission time-out in milliseconds from the RTT estimate,
+ * SRTT + max(G, 4 * RTTVAR) (RFC 6298), G being the clock granularity,
+ * bounded by TCP_RTO_MIN and TCP_RTO_MAX. In turbo mode it is bounded by
+ * TCP_TURBO_RTO_MIN and TCP_TURBO_RTO_SRTT * SRTT instead.
+ */
+u32_t
+tcp_rto_calc(struct tcp_pcb *pcb)
+{
+  u32_t g = tcp_clock != NULL ? 1000 : TCP_SLOW_INTERVAL * 1000UL;
+  u32_t rto = ((u32_t)(pcb->sa >> 3) + LWIP_MAX((u32_t)pcb->sv, g) + 999) / 1000;
+
+  if (TCP_TURBO(pcb) && pcb->sa != 0) {
+    /* a few smoothed RTTs at most, and no TCP_RTO_MIN */
+    u32_t cap = ((u32_t)(pcb->sa >> 3) + 999) / 1000 * TCP_TURBO_RTO_SRTT;
+    return LWIP_MAX(LWIP_MIN(rto, cap), TCP_TURBO_RTO_MIN);
+  }
+  return LWIP_MIN(LWIP_MAX(rto, TCP_RTO_MIN), TCP_RTO_MAX);
+}
+
+/** Put pcb on the RTO list to fire at due */
+static void
+tcp_rto_link(struct tcp_pcb *pcb, u32_t due)
+{
+  if (pcb->wheel_state == TCP_WHEEL_OFF) {
+    return;
+  }
+  pcb->rto_due = due;
+  if (pcb->rto_pprev == NULL) {
+    if (tcp_rto_pcbs == NULL || (s32_t)(pcb->rto_due - tcp_rto_earliest) < 0) {
+      tcp_rto_earliest = pcb->rto_due;
     }
-    else if (pcb->nrtx == TCP_MAXRTX) {
-      ++pcb_remove;
-      LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: max DATA retries reached\n"));
-    } else {
-      if (pcb->persist_backoff > 0) {
-        /* If snd_wnd is zero, use persist timer to send 1 byte probes
-         * instead of using the standard retransmission mechanism. */
-        u8_t backoff_cnt = tcp_persist_backoff[pcb->persist_backoff-1];
-        if (pcb->persist_cnt < backoff_cnt) {
-          pcb->persist_cnt++;
-        }
-        if (pcb->persist_cnt >= backoff_cnt) {
-          if (tcp_zero_window_probe(pcb) == ERR_OK) {
-            pcb->persist_cnt = 0;
-            if (pcb->persist_backoff < sizeof(tcp_persist_backoff)) {
-              pcb->persist_backoff++;
-            }
-          }
-        }
-      } else {
-        /* Increase the retransmission timer if it is running */
-        if(pcb->rtime >= 0) {
-          ++pcb->rtime;
-        }
+    TCP_TMR_LINK(&tcp_rto_pcbs, pcb, rto_next, rto_pprev);
+  } else if ((s32_t)(pcb->rto_due - tcp_rto_earliest) < 0) {
+    tcp_rto_earliest = pcb->rto_due;
+  }
+}
 
-        if (pcb->unacked != NULL && pcb->rtime >= pcb->rto) {
-          /* Time for a retransmission. */
-          LWIP_DEBUGF(TCP_RTO_DEBUG, ("tcp_slowtmr: rtime %"S16_F
-                                      " pcb->rto %"S16_F"\n",
-                                      pcb->rtime, pcb->rto));
+/**
+ * (Re)start the retransmission timer, it fires pcb->rto ms from now, or
+ * for a tail loss probe (LWIP_TCP_RACK) after the probe time-out but at
+ * the latest then (RFC 8985, 7.2)
+ */
+void
+tcp_rto_start(struct tcp_pcb *pcb)
+{
+#if LWIP_TCP_RACK
+  u32_t pto = tcp_tlp_timeout(pcb);
 
-          /* Double retransmission time-out unless we are trying to
-           * connect to somebody (i.e., we are in SYN_SENT). */
-          if (pcb->state != SYN_SENT) {
-            pcb->rto = ((pcb->sa >> 3) + pcb->sv) << tcp_backoff[pcb->nrtx];
-          }
+  if (pto != 0) {
+    /* the probe is due no later than the time-out it stands in for */
+    tcp_rto_arm(pcb, LWIP_MIN(pto, pcb->rto * 1000UL), TCP_RTO_KIND_TLP);
+    return;
+  }
+  pcb->rto_kind = TCP_RTO_KIND_RTO;
+#endif /* LWIP_TCP_RACK */
+  tcp_rto_link(pcb, tcp_now_us() + pcb->rto * 1000);
+}
 
-          /* Reset the retransmission timer. */
-          pcb->rtime = 0;
+#if LWIP_TCP_RACK
+/** Start the retransmission timer to fire timeout_us from now for kind */
+void
+tcp_rto_arm(struct tcp_pcb *pcb, u32_t timeout_us, u8_t kind)
+{
+  pcb->rto_kind = kind;
+  tcp_rto_link(pcb, tcp_now_us() + timeout_us);
+}
+#endif /* LWIP_TCP_RACK */
 
-          /* Reduce congestion window and ssthresh. */
-          eff_wnd = LWIP_MIN(pcb->cwnd, pcb->snd_wnd);
-          pcb->ssthresh = eff_wnd >> 1;
-          if (pcb->ssthresh < (tcpwnd_size_t)(pcb->mss << 1)) {
-            pcb->ssthresh = (pcb->mss << 1);
-          }
-          pcb->cwnd = pcb->mss;
-          LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_slowtmr: cwnd %"TCPWNDSIZE_F
-                                       " ssthresh %"TCPWNDSIZE_F"\n",
-                                       pcb->cwnd, pcb->ssthresh));
-
-          /* The following needs to be called AFTER cwnd is set to one
-             mss - STJ */
-          tcp_rexmit_rto(pcb);
-        }
+void
+tcp_rto_stop(struct tcp_pcb *pcb)
+{
+  TCP_TMR_UNLINK(pcb, rto_next, rto_pprev);
+}
+
+/**
+ * Microseconds until tcp_rto_tmr() has to run, 0 if it is due, -1 if no
+ * retransmission timer runs. May be early, never late.
+ */
+s32_t
+tcp_rto_next(void)
+{
+  s32_t left;
+
+  if (tcp_rto_pcbs == NULL) {
+    return -1;
+  }
+  left = (s32_t)(tcp_rto_earliest - tcp_now_us());
+  return left > 0 ? left : 0;
+}
+
+/**
+ * Retransmission timer expiry of one pcb: give up after TCP_MAXRTX
+ * (TCP_SYNMAXRTX, TCP_TURBO_MAXRTX) retransmissions, otherwise back off the
+ * time-out and retransmit. With LWIP_TCP_RACK the timer may instead be
+ * due for a tail loss probe or RACK's reordering window. The pcb may be
+ * freed on return.
+ */
+static void
+tcp_rto_expired(struct tcp_pcb *pcb)
+{
+  tcp_err_fn err_fn;
+  void *err_arg;
+
+  if (pcb->persist_backoff > 0) {
+    /* zero window probes are sent instead, see tcp_slowtmr_pcb() */
+    tcp_rto_start(pcb);
+    return;
+  }
+  if (pcb->unacked == NULL) {
+    return;
+  }
+#if LWIP_TCP_RACK
+  if (pcb->rto_kind == TCP_RTO_KIND_TLP) {
+    tcp_rexmit_tlp(pcb);
+    return;
+  }
+  if (pcb->rto_kind == TCP_RTO_KIND_REO) {
+    tcp_rack_timeout(pcb);
+    return;
+  }
+  /* the probe did not help */
+  pcb->tlp_out = 0;
+#endif /* LWIP_TCP_RACK */
+  if ((pcb->state == SYN_SENT && pcb->nrtx >= TCP_SYNMAXRTX) ||
+      pcb->nrtx >= (TCP_TURBO(pcb) ? TCP_TURBO_MAXRTX : TCP_MAXRTX)) {
+    LWIP_DEBUGF(TCP_DEBUG, ("tcp_rto_tmr: max %s retries reached\n",
+                            pcb->state == SYN_SENT ? "SYN" : "DATA"));
+    tcp_pcb_purge(pcb);
+    TCP_RMV_ACTIVE(pcb);
+    err_fn = pcb->errf;
+    err_arg = pcb->callback_arg;
+    memp_free(MEMP_TCP_PCB, pcb);
+    TCP_EVENT_ERR(err_fn, err_arg, ERR_ABRT);
+    return;
+  }
+
+  /* Time for a retransmission. */
+  LWIP_DEBUGF(TCP_RTO_DEBUG, ("tcp_rto_tmr: pcb->rto %"U32_F" nrtx %"U16_F"\n",
+                              pcb->rto, (u16_t)pcb->nrtx));
+
+  /* Double retransmission time-out unless we are trying to
+   * connect to somebody (i.e., we are in SYN_SENT), or in turbo mode. */
+  if (pcb->state != SYN_SENT && !TCP_TURBO(pcb)) {
+    pcb->rto = LWIP_MIN(tcp_rto_calc(pcb) << tcp_backoff[pcb->nrtx], TCP_RTO_MAX);
+  }
+
+  /* Reset the retransmission timer. */
+  tcp_rto_start(pcb);
+
+  /* Reduce congestion window and ssthresh. */
+  pcb->cc->rto(pcb);
+  LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_rto_tmr: cwnd %"TCPWNDSIZE_F
+                               " ssthresh %"TCPWNDSIZE_F"\n",
+                               pcb->cwnd, pcb->ssthresh));
+
+  /* The following needs to be called AFTER cwnd is reduced - STJ */
+  tcp_rexmit_rto(pcb);
+}
+
+/**
+ * Fire the retransmission timers that are due. Only does work once the
+ * earliest of them may be due, and then walks the pcbs whose
+ * retransmission timer runs, not all of them.
+ *
+ * Called from tcp_slowtmr(), and by the event loop at tcp_rto_next() when
+ * a clock is set.
+ */
+void
+tcp_rto_tmr(void)
+{
+  struct tcp_pcb *due, *pcb;
+  u32_t now;
+
+  if (tcp_rto_pcbs == NULL) {
+    return;
+  }
+  now = tcp_now_us();
+  if ((s32_t)(now - tcp_rto_earliest) < 0) {
+    return;
+  }
+
+  TCP_TMR_TAKE(&due, &tcp_rto_pcbs, rto_pprev);
+  while ((pcb = due) != NULL) {
+    TCP_TMR_UNLINK(pcb, rto_next, rto_pprev);
+    if ((s32_t)(now - pcb->rto_due) < 0) {
+      /* not yet, back on the list */
+      if (tcp_rto_pcbs == NULL || (s32_t)(pcb->rto_due - tcp_rto_earliest) < 0) {
+        tcp_rto_earliest = pcb->rto_due;
       }
+      TCP_TMR_LINK(&tcp_rto_pcbs, pcb, rto_next, rto_pprev);
+      continue;
+    }
+    tcp_rto_expired(pcb);
+  }
+}
+
+/**
+ * The per-pcb part of tcp_slowtmr() for an active pcb: persist, keepalive and the state timeouts, then the poll callback.
+ * The pcb may be freed on return.
+ */
+static void
+tcp_slowtmr_pcb(struct tcp_pcb *pcb)
+{
+  u8_t pcb_remove = 0;  /* flag if a PCB should be removed */
+  u8_t pcb_reset = 0;   /* flag if a RST should be sent when removing */
+  err_t err = ERR_OK;
+
+  LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: processing active pcb\n"));
+  LWIP_ASSERT("tcp_slowtmr: active pcb->state != CLOSED\n", pcb->state != CLOSED);
+  LWIP_ASSERT("tcp_slowtmr: active pcb->state != LISTEN\n", pcb->state != LISTEN);
+  LWIP_ASSERT("tcp_slowtmr: active pcb->state != TIME-WAIT\n", pcb->state != TIME_WAIT);
+
+  if (pcb->persist_backoff > 0) {
+    /* If snd_wnd is zero, use persist timer to send 1 byte probes
+     * instead of using the standard retransmission mechanism. */
+    u8_t backoff_cnt = tcp_persist_backoff[pcb->persist_backoff-1];
+    if (pcb->persist_cnt < backoff_cnt) {
+      pcb->persist_cnt++;
     }
-    /* Check if this PCB has stayed too long in FIN-WAIT-2 */
-    if (pcb->state == FIN_WAIT_2) {
-      /* If this PCB is in FIN_WAIT_2 because of SHUT_WR don't let it time out. */
-      if (pcb->flags & TF_RXCLOSED) {
-        /* PCB was fully closed (either through close() or SHUT_RDWR):
-           normal FIN-WAIT timeout handling. */
-        if ((u32_t)(tcp_ticks - pcb->tmr) >
-            TCP_FIN_WAIT_TIMEOUT / TCP_SLOW_INTERVAL) {
-          ++pcb_remove;
-          LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: removing pcb stuck in FIN-WAIT-2\n"));
+    if (pcb->persist_cnt >= backoff_cnt) {
+      if (tcp_zero_window_probe(pcb) == ERR_OK) {
+        pcb->persist_cnt = 0;
+        if (pcb->persist_backoff < sizeof(tcp_persist_backoff)) {
+          pcb->persist_backoff++;
         }
       }
     }
-
-    /* Check if KEEPALIVE should be sent */
-    /*
-     * checked by so_options of ip layer, del it. so it always keeplive.
-     * modified by ryan. 2015-9-15
-     */
-    if ((pcb->state == ESTABLISHED) ||
-        (pcb->state == CLOSE_WAIT)) {
-      if((u32_t)(tcp_ticks - pcb->tmr) >
-         (pcb->keep_idle + TCP_KEEP_DUR(pcb)) / TCP_SLOW_INTERVAL)
-      {
-        LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: KEEPALIVE timeout. Aborting connection to "));
-//        ip_addr_debug_print(TCP_DEBUG, &pcb->remote_ip);
-        LWIP_DEBUGF(TCP_DEBUG, ("\n"));
-        
+  }
+  /* Check if this PCB has stayed too long in FIN-WAIT-2 */
+  if (pcb->state == FIN_WAIT_2) {
+    /* If this PCB is in FIN_WAIT_2 because of SHUT_WR don't let it time out. */
+    if (pcb->flags & TF_RXCLOSED) {
+      /* PCB was fully closed (either through close() or SHUT_RDWR):
+         normal FIN-WAIT timeout handling. */
+      if ((u32_t)(tcp_ticks - pcb->tmr) >
+          TCP_FIN_WAIT_TIMEOUT / TCP_SLOW_INTERVAL) {
         ++pcb_remove;
-        ++pcb_reset;
+        LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: removing pcb stuck in FIN-WAIT-2\n"));
       }
-      else if((u32_t)(tcp_ticks - pcb->tmr) > 
-              (pcb->keep_idle + pcb->keep_cnt_sent * TCP_KEEP_INTVL(pcb))
-              / TCP_SLOW_INTERVAL)
-      {
-        err = tcp_keepalive(pcb);
-        if (err == ERR_OK) {
-          pcb->keep_cnt_sent++;
-        }
+    }
+  }
+
+  /* Check if KEEPALIVE should be sent */
+  /*
+   * checked by so_options of ip layer, del it. so it always keeplive.
+   * modified by ryan. 2015-9-15
+   */
+  if ((pcb->state == ESTABLISHED) ||
+      (pcb->state == CLOSE_WAIT)) {
+    if((u32_t)(tcp_ticks - pcb->tmr) >
+       (pcb->keep_idle + TCP_KEEP_DUR(pcb)) / TCP_SLOW_INTERVAL)
+    {
+      LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: KEEPALIVE timeout. Aborting connection to "));
+//        ip_addr_debug_print(TCP_DEBUG, &pcb->remote_ip);
+      LWIP_DEBUGF(TCP_DEBUG, ("\n"));
+
+      ++pcb_remove;
+      ++pcb_reset;
+    }
+    else if((u32_t)(tcp_ticks - pcb->tmr) >
+            (pcb->keep_idle + pcb->keep_cnt_sent * TCP_KEEP_INTVL(pcb))
+            / TCP_SLOW_INTERVAL)
+    {
+      err = tcp_keepalive(pcb);
+      if (err == ERR_OK) {
+        pcb->keep_cnt_sent++;
       }
     }
+  }
 
-    /* If this PCB has queued out of sequence data, but has been
-       inactive for too long, will drop the data (it will eventually
-       be retransmitted). */
+  /* If this PCB has queued out of sequence data, but has been
+     inactive for too long, will drop the data (it will eventually
+     be retransmitted). */
 #if TCP_QUEUE_OOSEQ
-    if (pcb->ooseq != NULL &&
-        (u32_t)tcp_ticks - pcb->tmr >= pcb->rto * TCP_OOSEQ_TIMEOUT) {
-      tcp_segs_free(pcb->ooseq);
-      pcb->ooseq = NULL;
-      LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_slowtmr: dropping OOSEQ queued data\n"));
-    }
+  if (pcb->ooseq != NULL &&
+      (u32_t)tcp_ticks - pcb->tmr >= pcb->rto * TCP_OOSEQ_TIMEOUT / TCP_SLOW_INTERVAL) {
+    tcp_segs_free(pcb->ooseq);
+    pcb->ooseq = NULL;
+    LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_slowtmr: dropping OOSEQ queued data\n"));
+  }
 #endif /* TCP_QUEUE_OOSEQ */
 
-    /* Check if this PCB has stayed too long in SYN-RCVD */
-    if (pcb->state == SYN_RCVD) {
-      if ((u32_t)(tcp_ticks - pcb->tmr) >
-          TCP_SYN_RCVD_TIMEOUT / TCP_SLOW_INTERVAL) {
-        ++pcb_remove;
-        LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: removing pcb stuck in SYN-RCVD\n"));
-      }
+  /* Check if this PCB has stayed too long in SYN-RCVD */
+  if (pcb->state == SYN_RCVD) {
+    if ((u32_t)(tcp_ticks - pcb->tmr) >
+        TCP_SYN_RCVD_TIMEOUT / TCP_SLOW_INTERVAL) {
+      ++pcb_remove;
+      LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: removing pcb stuck in SYN-RCVD\n"));
     }
+  }
 
-    /* Check if this PCB has stayed too long in LAST-ACK */
-    if (pcb->state == LAST_ACK) {
-      if ((u32_t)(tcp_ticks - pcb->tmr) > 2 * TCP_MSL / TCP_SLOW_INTERVAL) {
-        ++pcb_remove;
-        LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: removing pcb stuck in LAST-ACK\n"));
-      }
+  /* Check if this PCB has stayed too long in LAST-ACK */
+  if (pcb->state == LAST_ACK) {
+    if ((u32_t)(tcp_ticks - pcb->tmr) > 2 * TCP_MSL / TCP_SLOW_INTERVAL) {
+      ++pcb_remove;
+      LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: removing pcb stuck in LAST-ACK\n"));
     }
+  }
 
-    /* If the PCB should be removed, do it. */
-    if (pcb_remove) {
-      struct tcp_pcb *pcb2;
-      tcp_err_fn err_fn;
-      void *err_arg;
-      tcp_pcb_purge(pcb);
-      /* Remove PCB from tcp_active_pcbs list. */
-      if (prev != NULL) {
-        LWIP_ASSERT("tcp_slowtmr: middle tcp != tcp_active_pcbs", pcb != tcp_active_pcbs);
-        prev->next = pcb->next;
-      } else {
-        /* This PCB was the first. */
-        LWIP_ASSERT("tcp_slowtmr: first pcb == tcp_active_pcbs", tcp_active_pcbs == pcb);
-        tcp_active_pcbs = pcb->next;
-      }
-
-      if (pcb_reset) {
-        tcp_rst(pcb->snd_nxt, pcb->rcv_nxt, &pcb->remote_ip, &pcb->conn_id, pcb->remote_udp_port);
-      }
+  /* If the PCB should be removed, do it. */
+  if (pcb_remove) {
+    tcp_err_fn err_fn;
+    void *err_arg;
+    tcp_pcb_purge(pcb);
+    TCP_RMV_ACTIVE(pcb);
 
-      err_fn = pcb->errf;
-      err_arg = pcb->callback_arg;
-      pcb2 = pcb;
-      pcb = pcb->next;
-      memp_free(MEMP_TCP_PCB, pcb2);
+    if (pcb_reset) {
+      tcp_rst(pcb->snd_nxt, pcb->rcv_nxt, &pcb->remote_ip, &pcb->conn_id, pcb->remote_udp_port);
+    }
 
-      tcp_active_pcbs_changed = 0;
-      TCP_EVENT_ERR(err_fn, err_arg, ERR_ABRT);
-      if (tcp_active_pcbs_changed) {
-        goto tcp_slowtmr_start;
-      }
-    } else {
-      /* get the 'next' element now and work with 'prev' below (in case of abort) */
-      prev = pcb;
-      pcb = pcb->next;
+    err_fn = pcb->errf;
+    err_arg = pcb->callback_arg;
+    memp_free(MEMP_TCP_PCB, pcb);
 
-      /* We check if we should poll the connection. */
-      ++prev->polltmr;
-      if (prev->polltmr >= prev->pollinterval) {
-        prev->polltmr = 0;
-        LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: polling application\n"));
-        tcp_active_pcbs_changed = 0;
-        TCP_EVENT_POLL(prev, err);
-        if (tcp_active_pcbs_changed) {
-          goto tcp_slowtmr_start;
-        }
-        /* if err == ERR_ABRT, 'prev' is already deallocated */
-        if (err == ERR_OK) {
-          tcp_output(prev);
-        }
+    TCP_EVENT_ERR(err_fn, err_arg, ERR_ABRT);
+  } else {
+    /* We check if we should poll the connection. */
+    ++pcb->polltmr;
+    if (pcb->polltmr >= pcb->pollinterval) {
+      pcb->polltmr = 0;
+      LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: polling application\n"));
+      TCP_EVENT_POLL(pcb, err);
+      /* if the callback removed the pcb (err == ERR_ABRT means it is also
+         deallocated), leave it alone */
+      if (tcp_timer_pcb != NULL && err == ERR_OK) {
+        tcp_output(pcb);
       }
     }
   }
+}
 
-  
-  /* Steps through all of the TIME-WAIT PCBs. */
-  prev = NULL;
-  pcb = tcp_tw_pcbs;
-  while (pcb != NULL) {
-    LWIP_ASSERT("tcp_slowtmr: TIME-WAIT pcb->state == TIME-WAIT", pcb->state == TIME_WAIT);
-    pcb_remove = 0;
+/**
+ * Called every 500 ms and implements the timer that removes PCBs that have
+ * been in TIME-WAIT for enough time. It also increments various timers such
+ * as the inactivity timer in each PCB.
+ *
+ * Only the pcbs on the wheel slot of this tick are looked at. Due
+ * retransmission timers are fired at the end, see tcp_rto_tmr().
+ *
+ * Automatically called from tcp_tmr().
+ */
+void
+tcp_slowtmr(void)
+{
+  struct tcp_pcb *due, *pcb;
+  struct tcp_pcb **slot;
 
-    /* Check if this PCB has stayed long enough in TIME-WAIT */
-    if ((u32_t)(tcp_ticks - pcb->tmr) > 2 * TCP_MSL / TCP_SLOW_INTERVAL) {
-      ++pcb_remove;
+  ++tcp_ticks;
+  ++tcp_wheel_now;
+
+  if ((tcp_wheel_now & TCP_WHEEL_MASK) == 0) {
+    /* a new round of level 0: spread the next level 1 slot over it */
+    slot = &tcp_wheel[1][(tcp_wheel_now >> TCP_WHEEL_BITS) & TCP_WHEEL_MASK];
+    while ((pcb = *slot) != NULL) {
+      TCP_TMR_UNLINK(pcb, wheel_next, wheel_pprev);
+      tcp_wheel_insert(pcb, pcb->wheel_due);
     }
-    
+  }
 
+  TCP_TMR_TAKE(&due, &tcp_wheel[0][tcp_wheel_now & TCP_WHEEL_MASK], wheel_pprev);
+  if (due == NULL) {
+    LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: no pcbs due\n"));
+  }
+  while ((pcb = due) != NULL) {
+    TCP_TMR_UNLINK(pcb, wheel_next, wheel_pprev);
+    pcb->wheel_state = TCP_WHEEL_IDLE;
+    tcp_timer_pcb = pcb;
 
-    /* If the PCB should be removed, do it. */
-    if (pcb_remove) {
-      struct tcp_pcb *pcb2;
-      tcp_pcb_purge(pcb);
-      /* Remove PCB from tcp_tw_pcbs list. */
-      if (prev != NULL) {
-        LWIP_ASSERT("tcp_slowtmr: middle tcp != tcp_tw_pcbs", pcb != tcp_tw_pcbs);
-        prev->next = pcb->next;
-      } else {
-        /* This PCB was the first. */
-        LWIP_ASSERT("tcp_slowtmr: first pcb == tcp_tw_pcbs", tcp_tw_pcbs == pcb);
-        tcp_tw_pcbs = pcb->next;
+    if (pcb->state == TIME_WAIT) {
+      /* Check if this PCB has stayed long enough in TIME-WAIT */
+      if ((u32_t)(tcp_ticks - pcb->tmr) > 2 * TCP_MSL / TCP_SLOW_INTERVAL) {
+        tcp_pcb_purge(pcb);
+        tcp_pcb_hash_remove(pcb);
+        tcp_timer_remove(pcb);
+        TCP_RMV(&tcp_tw_pcbs, pcb);
+        memp_free(MEMP_TCP_PCB, pcb);
       }
-      pcb2 = pcb;
-      pcb = pcb->next;
-      memp_free(MEMP_TCP_PCB, pcb2);
     } else {
-      prev = pcb;
-      pcb = pcb->next;
+      tcp_slowtmr_pcb(pcb);
+    }
+
+    if (tcp_timer_pcb != NULL) {
+      tcp_timer_update(pcb);
     }
   }
+  tcp_timer_pcb = NULL;
+
+  tcp_rto_tmr();
 }
 
 /**
  * Is called every TCP_FAST_INTERVAL (250 ms) and process data previously
  * "refused" by upper layer (application) and sends delayed ACKs.
  *
+ * Only the pcbs on tcp_fast_pcbs are looked at.
+ *
  * Automatically called from tcp_tmr().
  */
 void
 tcp_fasttmr(void)
 {
-  struct tcp_pcb *pcb;
-
-  ++tcp_timer_ctr;
+  struct tcp_pcb *due, *pcb;
 
-tcp_fasttmr_start:
-  pcb = tcp_active_pcbs;
+  TCP_TMR_TAKE(&due, &tcp_fast_pcbs, fast_pprev);
+  while ((pcb = due) != NULL) {
+    TCP_TMR_UNLINK(pcb, fast_next, fast_pprev);
+    tcp_timer_pcb = pcb;
 
-  while(pcb != NULL) {
-    if (pcb->last_timer != tcp_timer_ctr) {
-      struct tcp_pcb *next;
-      pcb->last_timer = tcp_timer_ctr;
-      /* send delayed ACKs */
-      if (pcb->flags & TF_ACK_DELAY) {
-        LWIP_DEBUGF(TCP_DEBUG, ("tcp_fasttmr: delayed ACK\n"));
-        tcp_ack_now(pcb);
-        tcp_output(pcb);
-        pcb->flags &= ~(TF_ACK_DELAY | TF_ACK_NOW);
-      }
+    /* send delayed ACKs */
+    if (pcb->flags & TF_ACK_DELAY) {
+      LWIP_DEBUGF(TCP_DEBUG, ("tcp_fasttmr: delayed ACK\n"));
+      tcp_ack_now(pcb);
+      tcp_output(pcb);
+      pcb->flags &= ~(TF_ACK_DELAY | TF_ACK_NOW);
+    }
 
-      next = pcb->next;
+    /* If there is data which was previously "refused" by upper layer */
+    if (pcb->refused_data != NULL) {
+      tcp_process_refused_data(pcb);
+    }
 
-      /* If there is data which was previously "refused" by upper layer */
-      if (pcb->refused_data != NULL) {
-        tcp_active_pcbs_changed = 0;
-        tcp_process_refused_data(pcb);
-        if (tcp_active_pcbs_changed) {
-          /* application callback has changed the pcb list: restart the loop */
-          goto tcp_fasttmr_start;
-        }
-      }
-      pcb = next;
-    } else {
-      pcb = pcb->next;
+    /* back on the list if the ACK failed or data is still refused */
+    if (tcp_timer_pcb != NULL) {
+      tcp_timer_update(pcb);
     }
   }
+  tcp_timer_pcb = NULL;
 }
 
 /** Call tcp_output for all active pcbs that have TF_NAGLEMEMERR set */
@@ -1304,6 +1688,114 @@ tcp_setprio(struct tcp_pcb *pcb, u8_t prio)
   pcb->prio = prio;
 }
 
+/**
+ * Sets the send buffer and the receive window of a connection, in place of
+ * TCP_SND_BUF and TCP_WND. Set on a listen pcb, connections accepted from
+ * it use them too. A receive window above 64 KB needs LWIP_WND_SCALE and
+ * is only used if the peer agrees to window scaling in the handshake.
+ *
+ * On a connection the free space grows or shrinks by the difference, and
+ * a larger window is announced right away. Neither may shrink below what
+ * is in use: data not acked yet, or not passed to tcp_recved() yet.
+ *
+ * @param pcb the tcp_pcb to manipulate
+ * @param snd_size send buffer in bytes, 0 to keep it
+ * @param rcv_size receive window in bytes, 0 to keep it
+ * @return ERR_OK, ERR_VAL for a size out of range or below what is in
+ *         use, ERR_INPROGRESS while a SYN is outstanding
+ */
+err_t
+tcp_set_bufsize(struct tcp_pcb *pcb, tcpwnd_size_t snd_size, tcpwnd_size_t rcv_size)
+{
+  tcpwnd_size_t snd_used, rcv_used, old_rcv_size;
+  u8_t snd_fixed = snd_size != 0;
+  u8_t rcv_fixed = rcv_size != 0;
+
+  if (snd_size == 0) {
+    snd_size = pcb->snd_buf_size;
+  }
+  if (rcv_size == 0) {
+    rcv_size = pcb->rcv_wnd_size;
+  }
+  if (snd_size < 2 * TCP_MSS || rcv_size < TCP_MSS || rcv_size > TCP_RCV_WND_LIMIT ||
+      (rcv_size >> TCP_RCV_SCALE) == 0) {
+    return ERR_VAL;
+  }
+  if (pcb->state == LISTEN) {
+    pcb->snd_buf_size = snd_size;
+    pcb->rcv_wnd_size = rcv_size;
+    pcb->snd_buf_fixed |= snd_fixed;
+    pcb->rcv_wnd_fixed |= rcv_fixed;
+    return ERR_OK;
+  }
+  if (pcb->state == SYN_SENT || pcb->state == SYN_RCVD) {
+    /* the window scaling decision is pending */
+    return ERR_INPROGRESS;
+  }
+
+  snd_used = pcb->snd_buf_size - pcb->snd_buf;
+  rcv_used = TCP_WND_MAX(pcb) - pcb->rcv_wnd;
+  old_rcv_size = pcb->rcv_wnd_size;
+  pcb->rcv_wnd_size = rcv_size;
+  if (snd_size < snd_used || TCP_WND_MAX(pcb) < rcv_used) {
+    pcb->rcv_wnd_size = old_rcv_size;
+    return ERR_VAL;
+  }
+  pcb->snd_buf_size = snd_size;
+  pcb->snd_buf = snd_size - snd_used;
+  pcb->rcv_wnd = TCP_WND_MAX(pcb) - rcv_used;
+  /* sizes set are the application's now, autotuning stops */
+  if (snd_fixed) {
+    pcb->snd_buf_fixed = 1;
+#if LWIP_TCP_SND_AUTOTUNE
+    tcp_snd_autotune_free(pcb);
+#endif /* LWIP_TCP_SND_AUTOTUNE */
+  }
+  if (rcv_fixed) {
+    pcb->rcv_wnd_fixed = 1;
+#if LWIP_TCP_RCV_AUTOTUNE
+    tcp_rcv_autotune_free(pcb);
+#endif /* LWIP_TCP_RCV_AUTOTUNE */
+  }
+  LWIP_DEBUGF(TCP_WND_DEBUG, ("tcp_set_bufsize: snd_buf %"TCPWNDSIZE_F" rcv_wnd %"TCPWNDSIZE_F"\n",
+                              pcb->snd_buf, pcb->rcv_wnd));
+
+  if (pcb->state == CLOSED) {
+    pcb->rcv_ann_wnd = pcb->rcv_wnd;
+  } else if (tcp_update_rcv_ann_wnd(pcb) >= TCP_WND_UPDATE_THRESHOLD) {
+    tcp_ack_now(pcb);
+    tcp_output(pcb);
+  }
+  return ERR_OK;
+}
+
+#if LWIP_TCP_TURBO
+/**
+ * Switches the low-latency mode of a connection on or off (see
+ * LWIP_TCP_TURBO). Turning it on also disables Nagle and sets the fast
+ * retransmit threshold to TCP_TURBO_DUPTHRESH, tcp_set_dupthresh() can
+ * change that afterwards.
+ *
+ * @param pcb the tcp_pcb to manipulate
+ * @param on 1 for turbo mode, 0 for the defaults
+ */
+void
+tcp_set_turbo(struct tcp_pcb *pcb, u8_t on)
+{
+  LWIP_ASSERT("invalid socket state for turbo", pcb->state != LISTEN);
+  if (on) {
+    pcb->flags |= TF_TURBO | TF_NODELAY;
+    pcb->dupthresh = TCP_TURBO_DUPTHRESH;
+  } else {
+    pcb->flags = (tcpflags_t)(pcb->flags & ~(TF_TURBO | TF_NODELAY));
+    pcb->dupthresh = 3;
+  }
+  if (pcb->sa != 0) {
+    pcb->rto = tcp_rto_calc(pcb);
+  }
+}
+#endif /* LWIP_TCP_TURBO */
+
 #if TCP_QUEUE_OOSEQ
 /**
  * Returns a copy of the given TCP segment.
@@ -1498,8 +1990,9 @@ tcp_alloc(u8_t prio)
   if (pcb != NULL) {
     memset(pcb, 0, sizeof(struct tcp_pcb));
     pcb->prio = prio;
-    pcb->snd_buf = TCP_SND_BUF;
+    pcb->snd_buf = pcb->snd_buf_size = TCP_SND_BUF;
     pcb->snd_queuelen = 0;
+    pcb->rcv_wnd_size = TCP_WND;
     /* Start with a window that does not need scaling. When window scaling is
        enabled and used, the window is enlarged when both sides agree on scaling. */
     pcb->rcv_wnd = pcb->rcv_ann_wnd = TCPWND_MIN16(TCP_WND);
@@ -1511,18 +2004,20 @@ tcp_alloc(u8_t prio)
     /* As initial send MSS, we use TCP_MSS but limit it to 536.
        The send MSS is updated when an MSS option is received. */
     pcb->mss = (TCP_MSS > 536) ? 536 : TCP_MSS;
-    pcb->rto = 3000 / TCP_SLOW_INTERVAL;
+    pcb->rto = 3000;
     pcb->sa = 0;
-    pcb->sv = 3000 / TCP_SLOW_INTERVAL;
-    pcb->rtime = -1;
+    pcb->sv = 3000 * 1000;
     pcb->cwnd = 1;
+    pcb->cc = &TCP_CC_DEFAULT;
+#if LWIP_TCP_TURBO
+    pcb->dupthresh = 3;
+#endif /* LWIP_TCP_TURBO */
     iss = tcp_next_iss();
     pcb->snd_wl2 = iss;
     pcb->snd_nxt = iss;
     pcb->lastack = iss;
     pcb->snd_lbb = iss;   
     pcb->tmr = tcp_ticks;
-    pcb->last_timer = tcp_timer_ctr;
 
     pcb->polltmr = 0;
 
@@ -1654,6 +2149,7 @@ tcp_poll(struct tcp_pcb *pcb, tcp_poll_fn poll, u8_t interval)
   LWIP_UNUSED_ARG(poll);
 #endif /* LWIP_CALLBACK_API */  
   pcb->pollinterval = interval;
+  tcp_timer_update(pcb);
 }
 
 /**
@@ -1713,7 +2209,7 @@ tcp_pcb_purge(struct tcp_pcb *pcb)
 
     /* Stop the retransmission timer as it will expect data on unacked
        queue if it fires */
-    pcb->rtime = -1;
+    tcp_rto_stop(pcb);
 
     tcp_segs_free(pcb->unsent);
     tcp_segs_free(pcb->unacked);
@@ -1721,6 +2217,18 @@ tcp_pcb_purge(struct tcp_pcb *pcb)
 #if TCP_OVERSIZE
     pcb->unsent_oversize = 0;
 #endif /* TCP_OVERSIZE */
+#if LWIP_TCP_SACK
+    pcb->sacked = 0;
+#endif /* LWIP_TCP_SACK */
+#if LWIP_TCP_FEC
+    tcp_fec_free(pcb);
+#endif /* LWIP_TCP_FEC */
+#if LWIP_TCP_RCV_AUTOTUNE
+    tcp_rcv_autotune_free(pcb);
+#endif /* LWIP_TCP_RCV_AUTOTUNE */
+#if LWIP_TCP_SND_AUTOTUNE
+    tcp_snd_autotune_free(pcb);
+#endif /* LWIP_TCP_SND_AUTOTUNE */
   }
 }
 
@@ -1733,6 +2241,10 @@ tcp_pcb_purge(struct tcp_pcb *pcb)
 void
 tcp_pcb_remove(struct tcp_pcb **pcblist, struct tcp_pcb *pcb)
 {
+  if (pcblist == &tcp_active_pcbs || pcblist == &tcp_tw_pcbs) {
+    tcp_pcb_hash_remove(pcb);
+    tcp_timer_remove(pcb);
+  }
   TCP_RMV(pcblist, pcb);
 
   tcp_pcb_purge(pcb);
@@ -1760,6 +2272,175 @@ tcp_pcb_remove(struct tcp_pcb **pcblist, struct tcp_pcb *pcb)
   LWIP_ASSERT("tcp_pcb_remove: tcp_pcbs_sane()", tcp_pcbs_sane());
 }
 
+/*
+ * Connection id hash table.
+ *
+ * Open addressing with linear probing over a power-of-two array of pcb
+ * pointers, keyed on pcb->conn_id. Deletion shifts the following entries of
+ * the probe run back, so no tombstones are needed and lookups never degrade.
+ * A SYN_SENT pcb is stored under (connid1, 0) and re-keyed by tcp_process()
+ * once the SYN-ACK tells us connid2.
+ */
+#define tcp_pcb_hash_tab    (lwip_stack_cur->tcp.hash_tab)
+#define tcp_pcb_hash_size   (lwip_stack_cur->tcp.hash_size)   /* number of slots, power of two */
+#define tcp_pcb_hash_count  (lwip_stack_cur->tcp.hash_count)  /* number of used slots */
+
+static u32_t
+tcp_pcb_hash_fn(u32_t connid1, u32_t connid2)
+{
+  u32_t h = connid1 * 0x9e3779b1UL;
+  h ^= connid2 * 0x85ebca6bUL;
+  /* murmur3 finalizer: the ids are correlated (client ports repeat, server
+     ids count up), the low bits that pick the slot need all of them */
+  h ^= h >> 16;
+  h *= 0x85ebca6bUL;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35UL;
+  h ^= h >> 16;
+  return h;
+}
+
+/** Grow (or initially allocate) the hash table to new_size slots. */
+static err_t
+tcp_pcb_hash_resize(u32_t new_size)
+{
+  struct tcp_pcb **old_tab = tcp_pcb_hash_tab;
+  u32_t old_size = tcp_pcb_hash_size;
+  u32_t i, j;
+
+  tcp_pcb_hash_tab = (struct tcp_pcb **)mem_malloc((mem_size_t)(new_size * sizeof(struct tcp_pcb *)));
+  if (tcp_pcb_hash_tab == NULL) {
+    tcp_pcb_hash_tab = old_tab;
+    return ERR_MEM;
+  }
+  memset(tcp_pcb_hash_tab, 0, new_size * sizeof(struct tcp_pcb *));
+  tcp_pcb_hash_size = new_size;
+
+  for (i = 0; i < old_size; i++) {
+    if (old_tab[i] != NULL) {
+      j = tcp_pcb_hash_fn(old_tab[i]->conn_id.connid1, old_tab[i]->conn_id.connid2);
+      while (tcp_pcb_hash_tab[j & (new_size - 1)] != NULL) {
+        j++;
+      }
+      tcp_pcb_hash_tab[j & (new_size - 1)] = old_tab[i];
+    }
+  }
+  if (old_tab != NULL) {
+    mem_free(old_tab);
+  }
+  return ERR_OK;
+}
+
+/**
+ * Make room in the hash table for one more pcb, growing it at half load.
+ * If it cannot grow, it goes on at a higher load factor, but the last free
+ * slot is never filled: lookups stop at an empty slot.
+ *
+ * @return ERR_OK if a pcb can be inserted, ERR_MEM if not
+ */
+err_t
+tcp_pcb_hash_reserve(void)
+{
+  if (2 * (tcp_pcb_hash_count + 1) > tcp_pcb_hash_size) {
+    if (tcp_pcb_hash_resize(tcp_pcb_hash_size ? 2 * tcp_pcb_hash_size : TCP_PCB_HASH_MIN_SIZE) != ERR_OK) {
+      if (tcp_pcb_hash_count + 1 >= tcp_pcb_hash_size) {
+        LWIP_DEBUGF(TCP_DEBUG, ("tcp_pcb_hash_reserve: table full\n"));
+        return ERR_MEM;
+      }
+      LWIP_DEBUGF(TCP_DEBUG, ("tcp_pcb_hash_reserve: could not grow table\n"));
+    }
+  }
+  return ERR_OK;
+}
+
+/**
+ * Index a pcb that has just been put on tcp_active_pcbs or tcp_tw_pcbs.
+ * Called from TCP_REG_ACTIVE/TCP_REG_TW. Cannot fail for a pcb that took
+ * the place of a removed one, or after tcp_pcb_hash_reserve().
+ *
+ * @return ERR_OK, or ERR_MEM if the table has no room
+ */
+err_t
+tcp_pcb_hash_insert(struct tcp_pcb *pcb)
+{
+  u32_t i;
+
+  if (tcp_pcb_hash_reserve() != ERR_OK) {
+    return ERR_MEM;
+  }
+
+  i = tcp_pcb_hash_fn(pcb->conn_id.connid1, pcb->conn_id.connid2);
+  while (tcp_pcb_hash_tab[i & (tcp_pcb_hash_size - 1)] != NULL) {
+    LWIP_ASSERT("tcp_pcb_hash_insert: already indexed",
+                tcp_pcb_hash_tab[i & (tcp_pcb_hash_size - 1)] != pcb);
+    i++;
+  }
+  tcp_pcb_hash_tab[i & (tcp_pcb_hash_size - 1)] = pcb;
+  tcp_pcb_hash_count++;
+  return ERR_OK;
+}
+
+/**
+ * Drop a pcb from the conn_id index. Must be called before pcb->conn_id
+ * changes or the pcb leaves tcp_active_pcbs/tcp_tw_pcbs. Does nothing if the
+ * pcb is not indexed.
+ */
+void
+tcp_pcb_hash_remove(struct tcp_pcb *pcb)
+{
+  u32_t mask = tcp_pcb_hash_size - 1;
+  u32_t i, j, home;
+
+  if (tcp_pcb_hash_count == 0) {
+    return;
+  }
+  i = tcp_pcb_hash_fn(pcb->conn_id.connid1, pcb->conn_id.connid2) & mask;
+  while (tcp_pcb_hash_tab[i] != pcb) {
+    if (tcp_pcb_hash_tab[i] == NULL) {
+      return;
+    }
+    i = (i + 1) & mask;
+  }
+  tcp_pcb_hash_tab[i] = NULL;
+  tcp_pcb_hash_count--;
+
+  /* close the gap: move back every entry of the run whose home slot does
+     not lie cyclically in (i, j] */
+  for (j = (i + 1) & mask; tcp_pcb_hash_tab[j] != NULL; j = (j + 1) & mask) {
+    home = tcp_pcb_hash_fn(tcp_pcb_hash_tab[j]->conn_id.connid1,
+                           tcp_pcb_hash_tab[j]->conn_id.connid2) & mask;
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      tcp_pcb_hash_tab[i] = tcp_pcb_hash_tab[j];
+      tcp_pcb_hash_tab[j] = NULL;
+      i = j;
+    }
+  }
+}
+
+/**
+ * Find the active or TIME-WAIT pcb for a connection id.
+ *
+ * @return the matching pcb or NULL
+ */
+struct tcp_pcb *
+tcp_pcb_hash_lookup(u32_t connid1, u32_t connid2)
+{
+  u32_t mask = tcp_pcb_hash_size - 1;
+  u32_t i;
+  struct tcp_pcb *pcb;
+
+  if (tcp_pcb_hash_count == 0) {
+    return NULL;
+  }
+  for (i = tcp_pcb_hash_fn(connid1, connid2) & mask;
+       (pcb = tcp_pcb_hash_tab[i]) != NULL; i = (i + 1) & mask) {
+    if (pcb->conn_id.connid1 == connid1 && pcb->conn_id.connid2 == connid2) {
+      return pcb;
+    }
+  }
+  return NULL;
+}
+
 /**
  * Calculates a new initial sequence number for new connections.
  *
@@ -1768,10 +2449,8 @@ tcp_pcb_remove(struct tcp_pcb **pcblist, struct tcp_pcb *pcb)
 u32_t
 tcp_next_iss(void)
 {
-  static u32_t iss = 6510;
-  
-  iss += tcp_ticks;       /* XXX */
-  return iss;
+  lwip_stack_cur->tcp.iss += tcp_ticks;       /* XXX */
+  return lwip_stack_cur->tcp.iss;
 }
 
 #if TCP_CALCULATE_EFF_SEND_MSS
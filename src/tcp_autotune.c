@@ -0,0 +1,172 @@
+/**
+ * @file
+ * Receive window and send buffer autotuning
+ *
+ * Like the receive buffer autotuning of Linux (dynamic right-sizing): once
+ * per round trip the window is set to twice what the application read in
+ * the last one, plus some segments, if that is more than it has. The
+ * sender then is never held back by the window, while it may still double
+ * its rate in slow start, and a connection that reads little keeps
+ * TCP_WND.
+ *
+ * Our RTT comes from the receive side, as a pure receiver sends no data to
+ * time: data beyond the window we have open now cannot arrive before the
+ * sender got a later window update, so the time until it does is at least
+ * one RTT. The lowest such sample is kept, the handshake RTT stands in
+ * until there is one.
+ *
+ * The send buffer follows the congestion window instead: at twice what
+ * may be in flight, the application can refill one window while the last
+ * one is acked.
+ *
+ * What autotuning adds to windows and send buffers is charged to a budget
+ * per stack instance (TCP_AUTOTUNE_BUDGET) and given back with the pcb, so
+ * many connections together cannot grow without bound.
+ */
+
+#include "lwip/opt.h"
+
+#if LWIP_TCP && (LWIP_TCP_RCV_AUTOTUNE || LWIP_TCP_SND_AUTOTUNE) /* don't build if not configured for use in lwipopts.h */
+
+#include "lwip/tcp_impl.h"
+#include "lwip/debug.h"
+
+/** window and send buffer bytes added by autotuning over all pcbs */
+#define tcp_autotune_used (lwip_stack_cur->tcp.autotune_used)
+
+/** The part of grow the budget has room for, charged to it */
+static u32_t
+tcp_autotune_charge(u32_t grow)
+{
+  grow = LWIP_MIN(grow, TCP_AUTOTUNE_BUDGET - tcp_autotune_used);
+  tcp_autotune_used += grow;
+  return grow;
+}
+
+#if LWIP_TCP_RCV_AUTOTUNE
+/**
+ * In-order data advanced rcv_nxt: end the RTT sample if it went beyond the
+ * window that was open when the sample began, and begin the next one.
+ */
+void
+tcp_rcv_rtt_measure(struct tcp_pcb *pcb)
+{
+  u32_t now = tcp_now_us();
+  s32_t rtt;
+
+  if (pcb->rcv_rtt_start != 0) {
+    if (TCP_SEQ_LEQ(pcb->rcv_nxt, pcb->rcv_rtt_seq)) {
+      return;
+    }
+    /* start may be a us ahead, from the | 1 */
+    rtt = LWIP_MAX((s32_t)(now - pcb->rcv_rtt_start), 1);
+    if (pcb->rcv_rtt == 0 || (u32_t)rtt < pcb->rcv_rtt) {
+      pcb->rcv_rtt = (u32_t)rtt;
+    }
+  }
+  pcb->rcv_rtt_seq = pcb->rcv_nxt + pcb->rcv_wnd;
+  pcb->rcv_rtt_start = now | 1;
+}
+
+/** Add up to wnd - rcv_wnd_size to the window, as the budget allows */
+static void
+tcp_rcv_autotune_grow(struct tcp_pcb *pcb, u32_t wnd)
+{
+  u32_t grow;
+
+  if (!(pcb->flags & TF_WND_SCALE)) {
+    wnd = LWIP_MIN(wnd, 0xFFFF);
+  }
+  wnd = LWIP_MIN(wnd, TCP_RCV_AUTOTUNE_MAX);
+  if (wnd <= pcb->rcv_wnd_size) {
+    return;
+  }
+  grow = tcp_autotune_charge(wnd - pcb->rcv_wnd_size);
+  if (grow == 0) {
+    return;
+  }
+  pcb->rcv_auto_grown += grow;
+  pcb->rcv_wnd_size += grow;
+  pcb->rcv_wnd += grow;
+  LWIP_DEBUGF(TCP_WND_DEBUG, ("tcp_rcv_autotune: window %"TCPWNDSIZE_F", rtt %"U32_F" us\n",
+                              pcb->rcv_wnd_size, pcb->rcv_rtt));
+}
+
+/**
+ * The application read len bytes (tcp_recved()). Once per RTT, make the
+ * window twice the most it read in one RTT, plus 16 segments. The first
+ * read begins the first round, which has to beat the initial window.
+ */
+void
+tcp_rcv_autotune(struct tcp_pcb *pcb, u16_t len)
+{
+  u32_t now, rtt, copied;
+
+  if (pcb->rcv_wnd_fixed) {
+    return;
+  }
+  now = tcp_now_us();
+  if (pcb->rcv_space_start == 0) {
+    pcb->rcv_space = LWIP_MIN(pcb->rcv_wnd_size, 10 * TCP_MSS);
+    pcb->rcv_space_copied = len;
+    pcb->rcv_space_start = now | 1;
+    return;
+  }
+  pcb->rcv_space_copied += len;
+  rtt = pcb->rcv_rtt != 0 ? pcb->rcv_rtt : (u32_t)pcb->sa >> 3;
+  if (rtt == 0 || (s32_t)(now - pcb->rcv_space_start) < (s32_t)rtt) {
+    return;
+  }
+  copied = pcb->rcv_space_copied;
+  if (copied > pcb->rcv_space) {
+    pcb->rcv_space = copied;
+    tcp_rcv_autotune_grow(pcb, 2 * copied + 16 * TCP_MSS);
+  }
+  pcb->rcv_space_copied = 0;
+  pcb->rcv_space_start = now | 1;
+}
+
+/** Give the window pcb got from autotuning back to the budget */
+void
+tcp_rcv_autotune_free(struct tcp_pcb *pcb)
+{
+  tcp_autotune_used -= pcb->rcv_auto_grown;
+  pcb->rcv_auto_grown = 0;
+}
+#endif /* LWIP_TCP_RCV_AUTOTUNE */
+
+#if LWIP_TCP_SND_AUTOTUNE
+/**
+ * An ACK updated cwnd: grow the send buffer to twice the window that may be
+ * in flight, the smaller of cwnd and the peer's window. It is not shrunk
+ * when cwnd falls, the data in it may well be needed after recovery.
+ */
+void
+tcp_snd_autotune(struct tcp_pcb *pcb)
+{
+  u32_t size, grow;
+
+  if (pcb->snd_buf_fixed) {
+    return;
+  }
+  size = 2 * (u32_t)LWIP_MIN(pcb->cwnd, pcb->snd_wnd);
+  size = LWIP_MIN(size, TCP_SND_AUTOTUNE_MAX);
+  if (size <= pcb->snd_buf_size) {
+    return;
+  }
+  grow = tcp_autotune_charge(size - pcb->snd_buf_size);
+  pcb->snd_auto_grown += grow;
+  pcb->snd_buf_size += grow;
+  pcb->snd_buf += grow;
+}
+
+/** Give the send buffer pcb got from autotuning back to the budget */
+void
+tcp_snd_autotune_free(struct tcp_pcb *pcb)
+{
+  tcp_autotune_used -= pcb->snd_auto_grown;
+  pcb->snd_auto_grown = 0;
+}
+#endif /* LWIP_TCP_SND_AUTOTUNE */
+
+#endif /* LWIP_TCP && (LWIP_TCP_RCV_AUTOTUNE || LWIP_TCP_SND_AUTOTUNE) */
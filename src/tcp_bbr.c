@@ -0,0 +1,259 @@
+/**
+ * @file
+ * BBR-style model-based congestion control
+ *
+ * Instead of backing off on loss, the window is sized from a model of the
+ * path: the bottleneck bandwidth, the highest delivery rate seen over the
+ * last rounds, times the minimum RTT seen over the last 10 seconds. Like
+ * BBR it starts up doubling the rate per round until the bandwidth stops
+ * growing, drains the queue that built up, then cycles around the
+ * bandwidth-delay product, and drops to 4 segments for a moment every 10
+ * seconds to measure the minimum RTT again.
+ *
+ * lwIP has no pacing, so the gains BBR applies to the pacing rate are
+ * applied to the window here. The delivery rate is sampled once per round
+ * from the bytes acked during it. Needs a clock (tcp_set_clock()) for
+ * useful samples.
+ */
+
+#include "lwip/opt.h"
+
+#if LWIP_TCP && LWIP_TCP_CC_BBR /* don't build if not configured for use in lwipopts.h */
+
+#include "lwip/tcp_impl.h"
+#include "lwip/tcp_cc.h"
+#include "lwip/debug.h"
+
+/* gains in 1/256 */
+#define BBR_UNIT             256
+/* 2/ln(2): doubles the delivery rate per round */
+#define BBR_STARTUP_GAIN     739
+/* window gain in PROBE_BW, headroom for delayed and stretched ACKs */
+#define BBR_CWND_GAIN        512
+#define BBR_CYCLE_LEN        8
+/* rounds the bandwidth estimate is the maximum of, two halves of it */
+#define BBR_BW_ROUNDS        10
+/* startup ends after this many rounds without 25% more bandwidth */
+#define BBR_FULL_BW_ROUNDS   3
+#define BBR_MIN_RTT_WIN_US   (10 * 1000000UL)
+#define BBR_PROBE_RTT_US     (200 * 1000UL)
+#define BBR_MIN_CWND(pcb)    (4U * (pcb)->mss)
+
+enum bbr_mode {
+  BBR_STARTUP,
+  BBR_DRAIN,
+  BBR_PROBE_BW,
+  BBR_PROBE_RTT
+};
+
+/* PROBE_BW: probe for more bandwidth for a min RTT, drain what that queued,
+   then cruise */
+static const u16_t bbr_cycle_gain[BBR_CYCLE_LEN] = {
+  BBR_UNIT * 5 / 4, BBR_UNIT * 3 / 4,
+  BBR_UNIT, BBR_UNIT, BBR_UNIT, BBR_UNIT, BBR_UNIT, BBR_UNIT
+};
+
+struct bbr {
+  u32_t bw[2];           /* max delivery rate in bytes/s, this and the last half window */
+  u32_t full_bw;         /* bandwidth startup last grew to */
+  u32_t min_rtt;         /* us, 0 if none yet */
+  u32_t min_rtt_stamp;   /* tcp_now_us() min_rtt was measured at */
+  u32_t round_end;       /* the round ends when this seqno is acked */
+  u32_t round_start;     /* tcp_now_us() the round started at */
+  u32_t round_acked;     /* bytes acked in this round */
+  u32_t mode_stamp;      /* tcp_now_us() the cycle phase or PROBE_RTT started */
+  u16_t rounds;
+  u8_t mode;
+  u8_t cycle;
+  u8_t full_bw_cnt;
+  u8_t rtt_expired;      /* next RTT sample replaces min_rtt */
+  u8_t probe_rtt_round;  /* a round ended in PROBE_RTT */
+};
+TCP_CC_PRIV_CHECK(bbr);
+
+static u32_t
+bbr_bw(struct bbr *b)
+{
+  return LWIP_MAX(b->bw[0], b->bw[1]);
+}
+
+/** The window for gain times the estimated bandwidth-delay product, 0 while
+    there is no estimate */
+static u32_t
+bbr_target(struct tcp_pcb *pcb, struct bbr *b, u32_t gain)
+{
+  u64_t bdp = (u64_t)bbr_bw(b) * b->min_rtt / 1000000;
+
+  if (bdp == 0) {
+    return 0;
+  }
+  bdp = bdp * gain / BBR_UNIT;
+  return (u32_t)LWIP_MAX(LWIP_MIN(bdp, TCP_CC_WND_MAX), BBR_MIN_CWND(pcb));
+}
+
+static u32_t
+bbr_gain(struct bbr *b)
+{
+  switch (b->mode) {
+    case BBR_STARTUP:
+      return BBR_STARTUP_GAIN;
+    case BBR_PROBE_BW:
+      return (u32_t)BBR_CWND_GAIN * bbr_cycle_gain[b->cycle] / BBR_UNIT;
+    default:
+      return BBR_UNIT;
+  }
+}
+
+/** A round ended: take a delivery rate sample, advance the state machine */
+static void
+bbr_round(struct tcp_pcb *pcb, struct bbr *b, u32_t now)
+{
+  u32_t elapsed = now - b->round_start;
+  u32_t bw;
+
+  if (elapsed > 0 && b->round_acked > 0) {
+    u64_t rate = (u64_t)b->round_acked * 1000000 / elapsed;
+    bw = (u32_t)LWIP_MIN(rate, 0xffffffffUL);
+    if (bw > b->bw[0]) {
+      b->bw[0] = bw;
+    }
+  }
+  if (++b->rounds % (BBR_BW_ROUNDS / 2) == 0) {
+    b->bw[1] = b->bw[0];
+    b->bw[0] = 0;
+  }
+  b->round_end = pcb->snd_nxt;
+  b->round_start = now;
+  b->round_acked = 0;
+  b->probe_rtt_round = 1;
+
+  bw = bbr_bw(b);
+  if (b->mode == BBR_STARTUP) {
+    if (bw >= b->full_bw + b->full_bw / 4) {
+      b->full_bw = bw;
+      b->full_bw_cnt = 0;
+    } else if (++b->full_bw_cnt >= BBR_FULL_BW_ROUNDS) {
+      LWIP_DEBUGF(TCP_CWND_DEBUG, ("bbr: bandwidth %"U32_F" B/s, drain\n", bw));
+      b->mode = BBR_DRAIN;
+    }
+  }
+}
+
+static void
+bbr_init(struct tcp_pcb *pcb)
+{
+  struct bbr *b = TCP_CC_PRIV(pcb, bbr);
+  u32_t now = tcp_now_us();
+
+  b->mode = BBR_STARTUP;
+  b->round_end = pcb->snd_nxt;
+  b->round_start = now;
+  b->min_rtt_stamp = now;
+}
+
+static void
+bbr_ack(struct tcp_pcb *pcb, tcpwnd_size_t acked)
+{
+  struct bbr *b = TCP_CC_PRIV(pcb, bbr);
+  u32_t now = tcp_now_us();
+  u32_t target, cwnd;
+
+  b->round_acked += acked;
+  if (TCP_SEQ_GEQ(pcb->lastack, b->round_end)) {
+    bbr_round(pcb, b, now);
+  }
+
+  switch (b->mode) {
+    case BBR_DRAIN:
+      if (TCP_CC_FLIGHT(pcb) <= bbr_target(pcb, b, BBR_UNIT)) {
+        b->mode = BBR_PROBE_BW;
+        b->cycle = 0;
+        b->mode_stamp = now;
+      }
+      break;
+    case BBR_PROBE_BW:
+      if (now - b->mode_stamp >= b->min_rtt) {
+        b->cycle = (u8_t)((b->cycle + 1) % BBR_CYCLE_LEN);
+        b->mode_stamp = now;
+      }
+      break;
+    case BBR_PROBE_RTT:
+      if (now - b->mode_stamp >= BBR_PROBE_RTT_US && b->probe_rtt_round) {
+        b->min_rtt_stamp = now;
+        b->mode = (u8_t)(b->full_bw_cnt >= BBR_FULL_BW_ROUNDS ? BBR_PROBE_BW : BBR_STARTUP);
+        b->mode_stamp = now;
+      }
+      break;
+    default:
+      break;
+  }
+  if (b->mode != BBR_PROBE_RTT && now - b->min_rtt_stamp > BBR_MIN_RTT_WIN_US) {
+    /* min_rtt went stale: drain the queue to measure it again */
+    b->mode = BBR_PROBE_RTT;
+    b->mode_stamp = now;
+    b->rtt_expired = 1;
+    b->probe_rtt_round = 0;
+  }
+
+  /* grow by what was acked up to the target, straight down to it once the
+     bandwidth is known */
+  cwnd = pcb->cwnd + acked;
+  target = bbr_target(pcb, b, bbr_gain(b));
+  if (target != 0 && (b->mode != BBR_STARTUP || cwnd > target)) {
+    cwnd = target;
+  }
+  tcp_cc_set_cwnd(pcb, LWIP_MAX(cwnd, BBR_MIN_CWND(pcb)));
+}
+
+static void
+bbr_loss(struct tcp_pcb *pcb)
+{
+  /* the model, not loss, sizes the window; SACK recovery may fill it */
+  pcb->ssthresh = pcb->cwnd;
+}
+
+static void
+bbr_rto(struct tcp_pcb *pcb)
+{
+  /* start over from one segment, bbr_ack() grows it back to the target */
+  pcb->ssthresh = pcb->cwnd;
+  pcb->cwnd = pcb->mss;
+}
+
+static void
+bbr_rtt(struct tcp_pcb *pcb, u32_t rtt_us)
+{
+  struct bbr *b = TCP_CC_PRIV(pcb, bbr);
+
+  if (rtt_us == 0) {
+    rtt_us = 1;
+  }
+  if (b->rtt_expired || b->min_rtt == 0 || rtt_us <= b->min_rtt) {
+    b->min_rtt = rtt_us;
+    b->min_rtt_stamp = tcp_now_us();
+    b->rtt_expired = 0;
+  }
+}
+
+static tcpwnd_size_t
+bbr_cwnd(struct tcp_pcb *pcb)
+{
+  struct bbr *b = TCP_CC_PRIV(pcb, bbr);
+
+  if (b->mode == BBR_PROBE_RTT) {
+    return (tcpwnd_size_t)LWIP_MIN(pcb->cwnd, BBR_MIN_CWND(pcb));
+  }
+  return pcb->cwnd;
+}
+
+const struct tcp_cc_ops tcp_cc_bbr = {
+  "bbr",
+  bbr_init,
+  bbr_ack,
+  bbr_loss,
+  bbr_rto,
+  bbr_rtt,
+  bbr_cwnd
+};
+
+#endif /* LWIP_TCP && LWIP_TCP_CC_BBR */
@@ -0,0 +1,145 @@
+/**
+ * @file
+ * Congestion control modules: selection, helpers and NewReno
+ *
+ * NewReno is the Reno lwIP always ran inline: slow start and congestion
+ * avoidance on new ACKs, halving on fast retransmit, one segment after an
+ * RTO. Fast recovery itself (cwnd inflation on dupacks, partial ACKs) stays
+ * in tcp_in.c for all modules.
+ */
+
+#include "lwip/opt.h"
+
+#if LWIP_TCP /* don't build if not configured for use in lwipopts.h */
+
+#include "lwip/tcp_impl.h"
+#include "lwip/tcp_cc.h"
+#include "lwip/debug.h"
+
+#include <string.h>
+
+static const struct tcp_cc_ops * const tcp_cc_modules[] = {
+  &tcp_cc_newreno,
+#if LWIP_TCP_CC_CUBIC
+  &tcp_cc_cubic,
+#endif /* LWIP_TCP_CC_CUBIC */
+#if LWIP_TCP_CC_BBR
+  &tcp_cc_bbr,
+#endif /* LWIP_TCP_CC_BBR */
+};
+
+void
+tcp_set_cc(struct tcp_pcb *pcb, const struct tcp_cc_ops *cc)
+{
+  LWIP_ASSERT("tcp_set_cc: invalid cc", cc != NULL && cc->init != NULL);
+  pcb->cc = cc;
+  /* listen pcbs only pass it on, they have no cc_priv */
+  if (pcb->state != LISTEN) {
+    memset(pcb->cc_priv, 0, sizeof(pcb->cc_priv));
+    if (pcb->state >= ESTABLISHED) {
+      cc->init(pcb);
+    }
+  }
+}
+
+const struct tcp_cc_ops *
+tcp_cc_find(const char *name)
+{
+  size_t i;
+
+  for (i = 0; i < sizeof(tcp_cc_modules) / sizeof(tcp_cc_modules[0]); i++) {
+    if (strcmp(tcp_cc_modules[i]->name, name) == 0) {
+      return tcp_cc_modules[i];
+    }
+  }
+  return NULL;
+}
+
+/** Set cwnd, saturating at what tcpwnd_size_t holds */
+void
+tcp_cc_set_cwnd(struct tcp_pcb *pcb, u32_t cwnd)
+{
+  pcb->cwnd = (tcpwnd_size_t)LWIP_MIN(cwnd, TCP_CC_WND_MAX);
+}
+
+/**
+ * Reno window growth for an ACK of new data: one segment per ACK below
+ * ssthresh (slow start), one segment per window above it (congestion
+ * avoidance).
+ */
+void
+tcp_cc_reno_ack(struct tcp_pcb *pcb, tcpwnd_size_t acked)
+{
+  LWIP_UNUSED_ARG(acked);
+  if (pcb->cwnd < pcb->ssthresh) {
+    if ((tcpwnd_size_t)(pcb->cwnd + pcb->mss) > pcb->cwnd) {
+      pcb->cwnd += pcb->mss;
+    }
+    LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_receive: slow start cwnd %"TCPWNDSIZE_F"\n", pcb->cwnd));
+  } else {
+    tcpwnd_size_t new_cwnd = (pcb->cwnd + pcb->mss * pcb->mss / pcb->cwnd);
+    if (new_cwnd > pcb->cwnd) {
+      pcb->cwnd = new_cwnd;
+    }
+    LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_receive: congestion avoidance cwnd %"TCPWNDSIZE_F"\n", pcb->cwnd));
+  }
+}
+
+/** ssthresh to half the effective window, at least 2 MSS */
+static void
+newreno_halve(struct tcp_pcb *pcb)
+{
+  tcpwnd_size_t eff_wnd = LWIP_MIN(pcb->cwnd, pcb->snd_wnd);
+
+  pcb->ssthresh = eff_wnd >> 1;
+  if (pcb->ssthresh < (tcpwnd_size_t)(2 * pcb->mss)) {
+    LWIP_DEBUGF(TCP_FR_DEBUG,
+                ("newreno_halve: The minimum value for ssthresh %"TCPWNDSIZE_F
+                 " should be min 2 mss %"U16_F"...\n",
+                 pcb->ssthresh, (u16_t)(2*pcb->mss)));
+    pcb->ssthresh = (tcpwnd_size_t)(2 * pcb->mss);
+  }
+}
+
+static void
+newreno_init(struct tcp_pcb *pcb)
+{
+  LWIP_UNUSED_ARG(pcb);
+}
+
+static void
+newreno_ack(struct tcp_pcb *pcb, tcpwnd_size_t acked)
+{
+  if (!(pcb->flags & TF_INFR)) {
+    tcp_cc_reno_ack(pcb, acked);
+  }
+}
+
+static void
+newreno_loss(struct tcp_pcb *pcb)
+{
+  newreno_halve(pcb);
+  /* Set cwnd to ssthresh plus 3*SMSS. This artificially "inflates" the
+     congestion window by the number of segments (three) that have left the
+     network and which the receiver has buffered. -RFC2581 */
+  tcp_cc_set_cwnd(pcb, pcb->ssthresh + 3 * pcb->mss);
+}
+
+static void
+newreno_rto(struct tcp_pcb *pcb)
+{
+  newreno_halve(pcb);
+  pcb->cwnd = pcb->mss;
+}
+
+const struct tcp_cc_ops tcp_cc_newreno = {
+  "newreno",
+  newreno_init,
+  newreno_ack,
+  newreno_loss,
+  newreno_rto,
+  NULL,
+  NULL
+};
+
+#endif /* LWIP_TCP */
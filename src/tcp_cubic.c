@@ -0,0 +1,169 @@
+/**
+ * @file
+ * CUBIC congestion control (RFC 8312)
+ *
+ * Above ssthresh the window follows W(t) = C * (t - K)^3 + W_max, t being
+ * the time since the last reduction and K the time it takes to get back to
+ * W_max, so it grows with time rather than with ACKs and regains a large
+ * window on a long RTT path as fast as on a short one. It never grows
+ * slower than Reno would (the TCP-friendly region). Slow start and fast
+ * recovery are NewReno's, with a multiplicative decrease of 0.7.
+ */
+
+#include "lwip/opt.h"
+
+#if LWIP_TCP && LWIP_TCP_CC_CUBIC /* don't build if not configured for use in lwipopts.h */
+
+#include "lwip/tcp_impl.h"
+#include "lwip/tcp_cc.h"
+#include "lwip/debug.h"
+
+/* beta = 7/10; fast convergence remembers (1 + beta) / 2 of the window */
+#define CUBIC_BETA_NUM       7
+#define CUBIC_BETA_DEN       10
+/* C = 0.4 segments/s^3: 1/C = 5/2 */
+#define CUBIC_C_INV_NUM      5
+#define CUBIC_C_INV_DEN      2
+/* 3 * (1 - beta) / (1 + beta), the Reno-friendly growth per RTT */
+#define CUBIC_ALPHA_NUM      9
+#define CUBIC_ALPHA_DEN      17
+/* |t - K| is clamped to this many ms, W(t) is far off the window there */
+#define CUBIC_T_MAX          100000
+
+struct cubic {
+  u32_t epoch_start;  /* tcp_now_us() the epoch began, 0 if none */
+  u32_t w_max;        /* window before the last reduction, bytes */
+  u32_t k;            /* ms from epoch_start until W(t) reaches w_max */
+  u32_t origin;       /* W(K), bytes */
+  u32_t w_est;        /* window Reno would have, bytes */
+  u32_t acc;          /* growth carried to the next ACK, bytes * cwnd */
+};
+TCP_CC_PRIV_CHECK(cubic);
+
+/** Integer cube root */
+static u32_t
+cubic_cbrt(u64_t a)
+{
+  u32_t x = 0;
+  int s;
+
+  for (s = 63; s >= 0; s -= 3) {
+    u64_t b;
+    x <<= 1;
+    b = 3 * (u64_t)x * (x + 1) + 1;
+    if ((a >> s) >= b) {
+      a -= b << s;
+      x++;
+    }
+  }
+  return x;
+}
+
+static void
+cubic_reduce(struct tcp_pcb *pcb)
+{
+  struct cubic *c = TCP_CC_PRIV(pcb, cubic);
+  u32_t eff_wnd = LWIP_MIN(pcb->cwnd, pcb->snd_wnd);
+
+  if (eff_wnd < c->w_max) {
+    /* lost again below the last maximum: leave bandwidth to new flows */
+    c->w_max = eff_wnd * (CUBIC_BETA_DEN + CUBIC_BETA_NUM) / (2 * CUBIC_BETA_DEN);
+  } else {
+    c->w_max = eff_wnd;
+  }
+  c->epoch_start = 0;
+  pcb->ssthresh = (tcpwnd_size_t)LWIP_MAX(eff_wnd * CUBIC_BETA_NUM / CUBIC_BETA_DEN,
+                                          2U * pcb->mss);
+  LWIP_DEBUGF(TCP_CWND_DEBUG, ("cubic_reduce: w_max %"U32_F" ssthresh %"TCPWNDSIZE_F"\n",
+                               c->w_max, pcb->ssthresh));
+}
+
+static void
+cubic_init(struct tcp_pcb *pcb)
+{
+  LWIP_UNUSED_ARG(pcb);
+}
+
+static void
+cubic_ack(struct tcp_pcb *pcb, tcpwnd_size_t acked)
+{
+  struct cubic *c = TCP_CC_PRIV(pcb, cubic);
+  u32_t now, target, cwnd = pcb->cwnd;
+  u64_t off;
+  s32_t t;
+
+  if (pcb->flags & TF_INFR) {
+    return;
+  }
+  if (cwnd < pcb->ssthresh) {
+    tcp_cc_reno_ack(pcb, acked);
+    return;
+  }
+
+  now = tcp_now_us();
+  if (c->epoch_start == 0) {
+    c->epoch_start = now | 1;
+    c->acc = 0;
+    c->w_est = cwnd;
+    if (cwnd < c->w_max) {
+      /* K = cbrt((W_max - cwnd) / C), in ms */
+      c->k = cubic_cbrt((u64_t)(c->w_max - cwnd) * 1000000000 / pcb->mss *
+                        CUBIC_C_INV_NUM / CUBIC_C_INV_DEN);
+      c->origin = c->w_max;
+    } else {
+      c->k = 0;
+      c->origin = cwnd;
+    }
+  }
+
+  /* W(t + RTT), the window one round-trip ahead */
+  t = (s32_t)((now - c->epoch_start) / 1000 + ((u32_t)pcb->sa >> 3) / 1000 - c->k);
+  t = LWIP_MIN(LWIP_MAX(t, -CUBIC_T_MAX), CUBIC_T_MAX);
+  off = (u64_t)(t < 0 ? -t : t);
+  off = off * off * off / 1000 * pcb->mss / CUBIC_C_INV_NUM * CUBIC_C_INV_DEN / 1000000;
+  if (t >= 0) {
+    target = (u32_t)LWIP_MIN(c->origin + off, 0xffffffffUL);
+  } else {
+    target = off < c->origin ? c->origin - (u32_t)off : 0;
+  }
+
+  /* never slower than Reno */
+  c->w_est += (u32_t)((u64_t)acked * pcb->mss * CUBIC_ALPHA_NUM / CUBIC_ALPHA_DEN / cwnd);
+  target = LWIP_MAX(target, c->w_est);
+
+  if (target > cwnd) {
+    /* (target - cwnd) / cwnd per segment acked, at most half a window per
+       window */
+    u64_t acc = (u64_t)LWIP_MIN(target - cwnd, cwnd / 2) * acked + c->acc;
+    tcp_cc_set_cwnd(pcb, cwnd + (u32_t)(acc / cwnd));
+    c->acc = (u32_t)(acc % cwnd);
+  }
+  LWIP_DEBUGF(TCP_CWND_DEBUG, ("cubic_ack: target %"U32_F" cwnd %"TCPWNDSIZE_F"\n",
+                               target, pcb->cwnd));
+}
+
+static void
+cubic_loss(struct tcp_pcb *pcb)
+{
+  cubic_reduce(pcb);
+  tcp_cc_set_cwnd(pcb, pcb->ssthresh + 3 * pcb->mss);
+}
+
+static void
+cubic_rto(struct tcp_pcb *pcb)
+{
+  cubic_reduce(pcb);
+  pcb->cwnd = pcb->mss;
+}
+
+const struct tcp_cc_ops tcp_cc_cubic = {
+  "cubic",
+  cubic_init,
+  cubic_ack,
+  cubic_loss,
+  cubic_rto,
+  NULL,
+  NULL
+};
+
+#endif /* LWIP_TCP && LWIP_TCP_CC_CUBIC */
@@ -0,0 +1,373 @@
+/**
+ * @file
+ * Forward error correction with XOR parity
+ *
+ * With tcp_set_fec(pcb, k, r) the sender splits the data segments it sends
+ * into groups of k and follows every group with r parity datagrams, parity
+ * j covering the members i with i % r == j. A parity datagram is a TCP
+ * header with the reserved TCP_FEC bit set, the list of its members (seqno,
+ * length, PSH/FIN) and the XOR of their payloads. A burst shorter than k
+ * closes the group early (tcp_fec_flush() from tcp_output()), so the tail
+ * of a burst is covered too.
+ *
+ * The receiver keeps a copy of the last 2k data segments. When a parity
+ * datagram arrives and exactly one of its members is missing, XORing the
+ * others out of it gives the missing payload, and tcp_input() takes the
+ * rebuilt segment as if it had arrived. So r losses per group are repaired
+ * without a round trip if they hit different parities, at a cost of r/k
+ * more datagrams and a copy of every received segment. Losses it cannot
+ * repair are left to SACK, RACK and the RTO as usual.
+ *
+ * Both ends need LWIP_TCP_FEC, a peer without it takes a parity datagram
+ * for data. Call tcp_set_fec() on both.
+ */
+
+#include "lwip/opt.h"
+
+#if LWIP_TCP && LWIP_TCP_FEC /* don't build if not configured for use in lwipopts.h */
+
+#include <string.h>
+
+#include "lwip/tcp_impl.h"
+#include "lwip/def.h"
+#include "lwip/mem.h"
+#include "lwip/debug.h"
+
+/* bytes a parity payload starts with: member count, pad, XOR length */
+#define FEC_HLEN        4
+/* bytes per member: seqno, length, flags, pad */
+#define FEC_MEMBER_LEN  8
+/* payload bytes a coder buffer holds */
+#define FEC_SLOT        TCP_MSS
+
+struct tcp_fec_member {
+  u32_t seqno;
+  u16_t len;    /* 0 for an empty receive slot */
+  u8_t flags;   /* TCP_PSH and TCP_FIN of the segment */
+};
+
+struct tcp_fec {
+  /* encoder: the members of the group being built, and per parity the
+     XOR of its members' payloads and the longest of them */
+  u8_t cnt;
+  struct tcp_fec_member tx[TCP_FEC_GROUP_MAX];
+  u16_t tx_len[TCP_FEC_GROUP_MAX];
+  u8_t *tx_buf;
+  /* decoder: ring of the last rx_n data segments received */
+  u8_t rx_n;
+  u8_t rx_next;
+  struct tcp_fec_member *rx;
+  u8_t *rx_buf;
+};
+
+/**
+ * dst ^= src over len bytes. A word at a time, which compilers turn into
+ * vector instructions where the target has them.
+ */
+static void
+tcp_fec_xor(u8_t *dst, const u8_t *src, u16_t len)
+{
+  unsigned long a, b;
+
+  for (; len >= sizeof(a); len -= sizeof(a), dst += sizeof(a), src += sizeof(a)) {
+    MEMCPY(&a, dst, sizeof(a));
+    MEMCPY(&b, src, sizeof(b));
+    a ^= b;
+    MEMCPY(dst, &a, sizeof(a));
+  }
+  for (; len > 0; len--) {
+    *dst++ ^= *src++;
+  }
+}
+
+/** dst ^= len bytes of p from offset on */
+static void
+tcp_fec_xor_pbuf(u8_t *dst, struct pbuf *p, u16_t offset, u16_t len)
+{
+  struct pbuf *q;
+  u16_t n;
+
+  for (q = p; q != NULL && len > 0; q = q->next) {
+    if (offset >= q->len) {
+      offset = (u16_t)(offset - q->len);
+      continue;
+    }
+    n = (u16_t)LWIP_MIN(len, q->len - offset);
+    tcp_fec_xor(dst, (const u8_t *)q->payload + offset, n);
+    dst += n;
+    len = (u16_t)(len - n);
+    offset = 0;
+  }
+}
+
+/** The coder of pcb, allocated for its k and r on first use. NULL if FEC
+    is off or there is no memory. */
+static struct tcp_fec *
+tcp_fec_get(struct tcp_pcb *pcb)
+{
+  struct tcp_fec *fec;
+  u8_t rx_n;
+
+  if (pcb->fec != NULL || pcb->fec_k == 0) {
+    return pcb->fec;
+  }
+  rx_n = (u8_t)(2 * pcb->fec_k);
+  fec = (struct tcp_fec *)mem_malloc((mem_size_t)(sizeof(struct tcp_fec) +
+    rx_n * sizeof(struct tcp_fec_member) + (pcb->fec_r + rx_n) * FEC_SLOT));
+  if (fec == NULL) {
+    LWIP_DEBUGF(TCP_DEBUG, ("tcp_fec_get: out of memory\n"));
+    return NULL;
+  }
+  memset(fec, 0, sizeof(struct tcp_fec));
+  fec->rx_n = rx_n;
+  fec->rx = (struct tcp_fec_member *)(void *)(fec + 1);
+  memset(fec->rx, 0, rx_n * sizeof(struct tcp_fec_member));
+  fec->tx_buf = (u8_t *)(fec->rx + rx_n);
+  memset(fec->tx_buf, 0, pcb->fec_r * FEC_SLOT);
+  fec->rx_buf = fec->tx_buf + pcb->fec_r * FEC_SLOT;
+  pcb->fec = fec;
+  return fec;
+}
+
+/**
+ * Protects the data pcb sends with XOR parity: after every k data
+ * segments r parity datagrams follow. Both ends must set it.
+ *
+ * @param pcb the tcp_pcb to manipulate
+ * @param k data segments per group, 1 to TCP_FEC_GROUP_MAX; 0 turns FEC off
+ * @param r parity datagrams per group, 1 to k
+ * @return ERR_OK, or ERR_VAL for k or r out of range
+ */
+err_t
+tcp_set_fec(struct tcp_pcb *pcb, u8_t k, u8_t r)
+{
+  LWIP_ASSERT("invalid socket state for fec", pcb->state != LISTEN);
+  if (k > TCP_FEC_GROUP_MAX || (k != 0 && (r == 0 || r > k))) {
+    return ERR_VAL;
+  }
+  if (k == 0) {
+    r = 0;
+  }
+  if (k != pcb->fec_k || r != pcb->fec_r) {
+    tcp_fec_flush(pcb);
+    tcp_fec_free(pcb);
+    pcb->fec_k = k;
+    pcb->fec_r = r;
+  }
+  return ERR_OK;
+}
+
+/** Frees the coder of pcb, called when the pcb is purged */
+void
+tcp_fec_free(struct tcp_pcb *pcb)
+{
+  if (pcb->fec != NULL) {
+    mem_free(pcb->fec);
+    pcb->fec = NULL;
+  }
+}
+
+/**
+ * tcp_output_segment() sent seg: add it to the group, and send the parity
+ * once the group is full.
+ */
+void
+tcp_fec_sent(struct tcp_pcb *pcb, struct tcp_seg *seg)
+{
+  struct tcp_fec *fec;
+  struct tcp_fec_member *m;
+  u8_t j, flags = TCPH_FLAGS(seg->tcphdr);
+
+  if (pcb->fec_k == 0 || seg->len == 0 || seg->len > FEC_SLOT ||
+      (flags & TCP_SYN) || (fec = tcp_fec_get(pcb)) == NULL) {
+    return;
+  }
+  j = (u8_t)(fec->cnt % pcb->fec_r);
+  tcp_fec_xor_pbuf(fec->tx_buf + j * FEC_SLOT, seg->p,
+                   (u16_t)(seg->p->tot_len - seg->len), seg->len);
+  fec->tx_len[j] = LWIP_MAX(fec->tx_len[j], seg->len);
+  m = &fec->tx[fec->cnt++];
+  m->seqno = ntohl(seg->tcphdr->seqno);
+  m->len = seg->len;
+  m->flags = (u8_t)(flags & (TCP_PSH | TCP_FIN));
+  if (fec->cnt >= pcb->fec_k) {
+    tcp_fec_flush(pcb);
+  }
+}
+
+/**
+ * Sends the parity of the group being built, if it has members, and starts
+ * the next one. Called when the group is full and when tcp_output() has
+ * sent all it had.
+ */
+void
+tcp_fec_flush(struct tcp_pcb *pcb)
+{
+  struct tcp_fec *fec = pcb->fec;
+  struct tcp_hdr *tcphdr;
+  struct pbuf *p;
+  u8_t *d;
+  u8_t i, j, n;
+
+  if (fec == NULL || fec->cnt == 0) {
+    return;
+  }
+  for (j = 0; j < pcb->fec_r && j < fec->cnt; j++) {
+    n = (u8_t)((fec->cnt - j + pcb->fec_r - 1) / pcb->fec_r);
+    p = pbuf_alloc(PBUF_IP, (u16_t)(TCP_HLEN + FEC_HLEN + n * FEC_MEMBER_LEN +
+                                     fec->tx_len[j]), PBUF_RAM);
+    if (p != NULL) {
+      tcphdr = (struct tcp_hdr *)p->payload;
+      tcphdr->connid1 = htonl(pcb->conn_id.connid1);
+      tcphdr->connid2 = htonl(pcb->conn_id.connid2);
+      tcphdr->seqno = htonl(fec->tx[j].seqno);
+      tcphdr->ackno = htonl(pcb->rcv_nxt);
+      TCPH_HDRLEN_FLAGS_SET(tcphdr, 5, TCP_ACK | TCP_FEC);
+      tcphdr->wnd = htons(TCPWND_MIN16(RCV_WND_SCALE(pcb, pcb->rcv_ann_wnd)));
+
+      d = (u8_t *)(tcphdr + 1);
+      d[0] = n;
+      d[1] = 0;
+      d[2] = (u8_t)(fec->tx_len[j] >> 8);
+      d[3] = (u8_t)fec->tx_len[j];
+      d += FEC_HLEN;
+      for (i = j; i < fec->cnt; i = (u8_t)(i + pcb->fec_r), d += FEC_MEMBER_LEN) {
+        u32_t seqno_be = htonl(fec->tx[i].seqno);
+        u16_t len_be = htons(fec->tx[i].len);
+        MEMCPY(d, &seqno_be, 4);
+        MEMCPY(d + 4, &len_be, 2);
+        d[6] = fec->tx[i].flags;
+        d[7] = 0;
+      }
+      MEMCPY(d, fec->tx_buf + j * FEC_SLOT, fec->tx_len[j]);
+      LWIP_DEBUGF(TCP_OUTPUT_DEBUG, ("tcp_fec_flush: parity of %"U16_F" from %"U32_F"\n",
+                                     (u16_t)n, fec->tx[j].seqno));
+      tcp_output_fec(pcb, p);
+      pbuf_free(p);
+    }
+    memset(fec->tx_buf + j * FEC_SLOT, 0, fec->tx_len[j]);
+    fec->tx_len[j] = 0;
+  }
+  fec->cnt = 0;
+}
+
+/**
+ * tcp_input() got a data segment for pcb: keep a copy for the parity
+ * covering it. p->payload points to the data.
+ */
+void
+tcp_fec_recv(struct tcp_pcb *pcb, u32_t seqno, u8_t flags, struct pbuf *p)
+{
+  struct tcp_fec *fec;
+  struct tcp_fec_member *m;
+
+  if (pcb->fec_k == 0 || p->tot_len == 0 || p->tot_len > FEC_SLOT ||
+      (flags & TCP_SYN) || (fec = tcp_fec_get(pcb)) == NULL) {
+    return;
+  }
+  m = &fec->rx[fec->rx_next];
+  m->seqno = seqno;
+  m->len = p->tot_len;
+  pbuf_copy_partial(p, fec->rx_buf + fec->rx_next * FEC_SLOT, p->tot_len, 0);
+  fec->rx_next = (u8_t)((fec->rx_next + 1) % fec->rx_n);
+}
+
+/** The receive slot holding the segment at seqno of len bytes, -1 if none */
+static int
+tcp_fec_find(struct tcp_fec *fec, u32_t seqno, u16_t len)
+{
+  int i;
+
+  for (i = 0; i < fec->rx_n; i++) {
+    if (fec->rx[i].len == len && fec->rx[i].seqno == seqno) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/**
+ * tcp_input() got a parity datagram for pcb, with tcphdr in host byte order
+ * and p->payload pointing past it. If exactly one member is missing, it is
+ * rebuilt.
+ *
+ * @return the missing segment as a datagram for tcp_input(), or NULL
+ */
+struct pbuf *
+tcp_fec_input(struct tcp_pcb *pcb, struct tcp_hdr *tcphdr, struct pbuf *p)
+{
+  struct tcp_fec *fec;
+  struct tcp_fec_member members[TCP_FEC_GROUP_MAX];
+  int slots[TCP_FEC_GROUP_MAX];
+  u8_t hdr[FEC_HLEN + TCP_FEC_GROUP_MAX * FEC_MEMBER_LEN];
+  struct tcp_hdr *rhdr;
+  struct pbuf *q;
+  u8_t *d;
+  u16_t xor_len, off;
+  u8_t i, n, lost;
+
+  if (pcb->fec_k == 0 || (fec = tcp_fec_get(pcb)) == NULL ||
+      pbuf_copy_partial(p, hdr, FEC_HLEN, 0) != FEC_HLEN) {
+    return NULL;
+  }
+  n = hdr[0];
+  xor_len = (u16_t)((hdr[2] << 8) | hdr[3]);
+  off = (u16_t)(FEC_HLEN + n * FEC_MEMBER_LEN);
+  if (n == 0 || n > TCP_FEC_GROUP_MAX || xor_len > FEC_SLOT ||
+      p->tot_len < off + xor_len ||
+      pbuf_copy_partial(p, hdr + FEC_HLEN, (u16_t)(off - FEC_HLEN), FEC_HLEN) != off - FEC_HLEN) {
+    LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_fec_input: bad parity datagram\n"));
+    return NULL;
+  }
+
+  lost = n;
+  for (i = 0; i < n; i++) {
+    u32_t seqno_be;
+    u16_t len_be;
+    d = hdr + FEC_HLEN + i * FEC_MEMBER_LEN;
+    MEMCPY(&seqno_be, d, 4);
+    MEMCPY(&len_be, d + 4, 2);
+    members[i].seqno = ntohl(seqno_be);
+    members[i].len = ntohs(len_be);
+    members[i].flags = d[6];
+    slots[i] = tcp_fec_find(fec, members[i].seqno, members[i].len);
+    if (slots[i] < 0) {
+      if (lost != n) {
+        /* two missing, XOR cannot tell them apart */
+        return NULL;
+      }
+      lost = i;
+    }
+  }
+  i = lost;
+  if (i == n || members[i].len > xor_len ||
+      TCP_SEQ_LEQ(members[i].seqno + members[i].len, pcb->rcv_nxt)) {
+    /* nothing lost, or the lost one got through before and was delivered */
+    return NULL;
+  }
+
+  q = pbuf_alloc(PBUF_RAW, (u16_t)(TCP_HLEN + members[i].len), PBUF_RAM);
+  if (q == NULL) {
+    return NULL;
+  }
+  rhdr = (struct tcp_hdr *)q->payload;
+  rhdr->connid1 = htonl(tcphdr->connid1);
+  rhdr->connid2 = htonl(tcphdr->connid2);
+  rhdr->seqno = htonl(members[i].seqno);
+  rhdr->ackno = htonl(tcphdr->ackno);
+  TCPH_HDRLEN_FLAGS_SET(rhdr, 5, TCP_ACK | members[i].flags);
+  rhdr->wnd = htons(tcphdr->wnd);
+  d = (u8_t *)(rhdr + 1);
+  pbuf_copy_partial(p, d, members[i].len, off);
+  for (n = 0; n < hdr[0]; n++) {
+    if (n != i) {
+      tcp_fec_xor(d, fec->rx_buf + slots[n] * FEC_SLOT,
+                  LWIP_MIN(members[n].len, members[i].len));
+    }
+  }
+  LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_fec_input: rebuilt %"U32_F":%"U32_F"\n",
+                                members[i].seqno, members[i].seqno + members[i].len));
+  return q;
+}
+
+#endif /* LWIP_TCP && LWIP_TCP_FEC */
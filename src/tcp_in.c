@@ -61,35 +61,49 @@
 
 /** Initial CWND calculation as defined RFC 2581 */
 #define LWIP_TCP_CALC_INITIAL_CWND(mss) LWIP_MIN((4U * (mss)), LWIP_MAX((2U * (mss)), 4380U));
-/** Initial slow start threshold value: we use the full window */
+/** Initial slow start threshold value: we use the full window. A peer that
+    scales its window may open it far beyond the first one (receive window
+    autotuning), so then the largest it can announce (RFC 5681, 3.1) */
+#if LWIP_WND_SCALE
+#define LWIP_TCP_INITIAL_SSTHRESH(pcb)  (((pcb)->flags & TF_WND_SCALE) ? \
+  (tcpwnd_size_t)(0xFFFFUL << (pcb)->snd_scale) : (pcb)->snd_wnd)
+#else /* LWIP_WND_SCALE */
 #define LWIP_TCP_INITIAL_SSTHRESH(pcb)  ((pcb)->snd_wnd)
+#endif /* LWIP_WND_SCALE */
 
 /* These variables are global to all functions involved in the input
    processing of TCP segments. They are set by the tcp_input()
    function. */
-static struct tcp_seg inseg;
-static struct tcp_hdr *tcphdr;
-static u16_t tcphdr_opt1len;
-static u8_t* tcphdr_opt2;
-static u16_t tcp_optidx;
-static u32_t seqno, ackno;
-static u8_t flags;
-static u16_t tcplen;
-
-static u8_t recv_flags;
-static struct pbuf *recv_data;
-
-struct tcp_pcb *tcp_input_pcb;
+static LWIP_STACK_LOCAL struct tcp_seg inseg;
+static LWIP_STACK_LOCAL struct tcp_hdr *tcphdr;
+static LWIP_STACK_LOCAL u16_t tcphdr_opt1len;
+static LWIP_STACK_LOCAL u8_t* tcphdr_opt2;
+static LWIP_STACK_LOCAL u16_t tcp_optidx;
+static LWIP_STACK_LOCAL u32_t seqno, ackno;
+static LWIP_STACK_LOCAL u8_t flags;
+static LWIP_STACK_LOCAL u16_t tcplen;
+
+static LWIP_STACK_LOCAL u8_t recv_flags;
+static LWIP_STACK_LOCAL struct pbuf *recv_data;
+#if LWIP_TCP_SACK
+/* SACK blocks of the incoming segment, left and right edge each */
+static LWIP_STACK_LOCAL u32_t tcp_sack_blocks[2 * LWIP_TCP_SACK_MAX_BLOCKS];
+static LWIP_STACK_LOCAL u8_t tcp_sack_cnt;
+#endif /* LWIP_TCP_SACK */
+
+LWIP_STACK_LOCAL struct tcp_pcb *tcp_input_pcb;
 
 /* Forward declarations. */
 static err_t tcp_process(struct tcp_pcb *pcb);
 static void tcp_receive(struct tcp_pcb *pcb);
 static void tcp_parseopt(struct tcp_pcb *pcb);
+#if LWIP_TCP_SACK
+static void tcp_sack_update(struct tcp_pcb *pcb);
+#endif /* LWIP_TCP_SACK */
 
 static err_t tcp_listen_input(struct tcp_pcb_listen *pcb, const struct ip_addr_t *remote_ip, u16_t remote_udp_port, const struct connect_id_t *conn_id);
 static err_t tcp_timewait_input(struct tcp_pcb *pcb);
 
-extern u32_t tcp_new_server_id(void);
 
 /**
  * The initial input processing of TCP. It verifies the TCP header, demultiplexes
@@ -103,7 +117,7 @@ extern u32_t tcp_new_server_id(void);
 void
 tcp_input(struct ip_addr_t remote_udp_ip, u16_t remote_udp_port, struct pbuf *p)
 {
-  struct tcp_pcb *pcb, *prev;
+  struct tcp_pcb *pcb;
   struct tcp_pcb_listen *lpcb;
 #if SO_REUSE
   struct tcp_pcb *lpcb_prev = NULL;
@@ -179,54 +193,49 @@ tcp_input(struct ip_addr_t remote_udp_ip, u16_t remote_udp_port, struct pbuf *p)
   flags = TCPH_FLAGS(tcphdr);
   tcplen = p->tot_len + ((flags & (TCP_FIN | TCP_SYN)) ? 1 : 0);
 
-  /* Demultiplex an incoming segment. First, we check if it is destined
-     for an active connection. */
-  prev = NULL;
-
-  for(pcb = tcp_active_pcbs; pcb != NULL; pcb = pcb->next) {
+  /* Demultiplex an incoming segment. Active and TIME-WAIT connections are
+     found through the conn_id hash table. A connection in SYN-SENT does not
+     know its connid2 yet and is indexed under (connid1, 0). */
+  pcb = tcp_pcb_hash_lookup(tcphdr->connid1, tcphdr->connid2);
+  if (pcb == NULL && tcphdr->connid2 != 0) {
+    pcb = tcp_pcb_hash_lookup(tcphdr->connid1, 0);
+    if (pcb != NULL && pcb->state != SYN_SENT) {
+      pcb = NULL;
+    }
+  }
+  if (pcb != NULL) {
     LWIP_ASSERT("tcp_input: active pcb->state != CLOSED", pcb->state != CLOSED);
-    LWIP_ASSERT("tcp_input: active pcb->state != TIME-WAIT", pcb->state != TIME_WAIT);
     LWIP_ASSERT("tcp_input: active pcb->state != LISTEN", pcb->state != LISTEN);
-    if (pcb->conn_id.connid1 == tcphdr->connid1 &&
-        (pcb->state == SYN_SENT ? 1 : pcb->conn_id.connid2 == tcphdr->connid2)) {
-      /* Move this PCB to the front of the list so that subsequent
-         lookups will be faster (we exploit locality in TCP segment
-         arrivals). */
-      LWIP_ASSERT("tcp_input: pcb->next != pcb (before cache)", pcb->next != pcb);
-      if (prev != NULL) {
-        prev->next = pcb->next;
-        pcb->next = tcp_active_pcbs;
-        tcp_active_pcbs = pcb;
-      }
-      LWIP_ASSERT("tcp_input: pcb->next != pcb (after cache)", pcb->next != pcb);
-      break;
+    if (pcb->state == TIME_WAIT) {
+      LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_input: packed for TIME_WAITing connection.\n"));
+      tcp_timewait_input(pcb);
+      pbuf_free(p);
+      return;
     }
-    prev = pcb;
   }
 
-  if (pcb == NULL) {
-    /* If it did not go to an active connection, we check the connections
-       in the TIME-WAIT state. */
-    for(pcb = tcp_tw_pcbs; pcb != NULL; pcb = pcb->next) {
-      LWIP_ASSERT("tcp_input: TIME-WAIT pcb->state == TIME-WAIT", pcb->state == TIME_WAIT);
-      if (pcb->conn_id.connid1 == tcphdr->connid1 &&
-              pcb->conn_id.connid2 == tcphdr-> connid2) {
-        /* We don't really care enough to move this PCB to the front
-           of the list since we are not very likely to receive that
-           many segments for connections in TIME-WAIT. */
-        LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_input: packed for TIME_WAITing connection.\n"));
-        tcp_timewait_input(pcb);
-        pbuf_free(p);
-        return;
-      }
+#if LWIP_TCP_FEC
+  if (TCPH_FEC(tcphdr)) {
+    /* a parity datagram: rebuild the segment it covers that got lost, if
+       there is one, and take that instead */
+    struct pbuf *q = NULL;
+    if (pcb != NULL) {
+      q = tcp_fec_input(pcb, tcphdr, p);
+    }
+    pbuf_free(p);
+    if (q != NULL) {
+      tcp_input(remote_udp_ip, remote_udp_port, q);
     }
+    return;
+  }
+#endif /* LWIP_TCP_FEC */
 
+  if (pcb == NULL) {
     /* Finally, if we still did not get a match, we check all PCBs that
        are LISTENing for incoming connections. */
     /*
      * tcp_listen_pcbs这个列表无需支持多个。 add by ryanbai.
      */
-    prev = NULL;
     lpcb = tcp_listen_pcbs.listen_pcbs;
     if (lpcb != NULL) {
       LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_input: packed for LISTENing connection.\n"));
@@ -259,6 +268,9 @@ tcp_input(struct ip_addr_t remote_udp_ip, u16_t remote_udp_port, struct pbuf *p)
     inseg.len = p->tot_len;
     inseg.p = p;
     inseg.tcphdr = tcphdr;
+#if LWIP_TCP_FEC
+    tcp_fec_recv(pcb, seqno, flags, p);
+#endif /* LWIP_TCP_FEC */
 
     recv_data = NULL;
     recv_flags = 0;
@@ -400,6 +412,8 @@ tcp_input(struct ip_addr_t remote_udp_ip, u16_t remote_udp_port, struct pbuf *p)
         tcp_input_pcb = NULL;
         /* Try to send something out. */
         tcp_output(pcb);
+        /* this segment may have started or brought forward a timer */
+        tcp_timer_update(pcb);
 #if TCP_INPUT_DEBUG
 #if TCP_DEBUG
         tcp_debug_print_state(pcb->state);
@@ -478,10 +492,15 @@ tcp_listen_input(struct tcp_pcb_listen *pcb, const struct ip_addr_t *remote_udp_
       return ERR_ABRT;
     }
 #endif /* TCP_LISTEN_BACKLOG */
+    /* If a new PCB could not be created or indexed (probably due to lack
+       of memory), we don't do anything, but rely on the sender will
+       retransmit the SYN at a time when we have more memory available. */
+    if (tcp_pcb_hash_reserve() != ERR_OK) {
+      LWIP_DEBUGF(TCP_DEBUG, ("tcp_listen_input: could not index PCB\n"));
+      TCP_STATS_INC(tcp.memerr);
+      return ERR_MEM;
+    }
     npcb = tcp_alloc(pcb->prio);
-    /* If a new PCB could not be created (probably due to lack of memory),
-       we don't do anything, but rely on the sender will retransmit the
-       SYN at a time when we have more memory available. */
     if (npcb == NULL) {
       LWIP_DEBUGF(TCP_DEBUG, ("tcp_listen_input: could not allocate PCB\n"));
       TCP_STATS_INC(tcp.memerr);
@@ -506,6 +525,12 @@ tcp_listen_input(struct tcp_pcb_listen *pcb, const struct ip_addr_t *remote_udp_
     npcb->rcv_ann_right_edge = npcb->rcv_nxt;
     npcb->snd_wl1 = seqno - 1;/* initialise to seqno-1 to force window update */
     npcb->callback_arg = pcb->callback_arg;
+    npcb->cc = pcb->cc;
+    npcb->snd_buf = npcb->snd_buf_size = pcb->snd_buf_size;
+    npcb->rcv_wnd_size = pcb->rcv_wnd_size;
+    npcb->snd_buf_fixed = pcb->snd_buf_fixed;
+    npcb->rcv_wnd_fixed = pcb->rcv_wnd_fixed;
+    npcb->rcv_wnd = npcb->rcv_ann_wnd = TCPWND_MIN16(npcb->rcv_wnd_size);
 #if LWIP_CALLBACK_API
     npcb->accept = pcb->accept;
 #endif /* LWIP_CALLBACK_API */
@@ -515,7 +540,8 @@ tcp_listen_input(struct tcp_pcb_listen *pcb, const struct ip_addr_t *remote_udp_
 
     /* Parse any options in the SYN. */
     tcp_parseopt(npcb);
-    npcb->snd_wnd = SND_WND_SCALE(npcb, tcphdr->wnd);
+    /* the window in a SYN is never scaled (RFC 7323, 2.2) */
+    npcb->snd_wnd = tcphdr->wnd;
     npcb->snd_wnd_max = npcb->snd_wnd;
     npcb->ssthresh = LWIP_TCP_INITIAL_SSTHRESH(npcb);
 
@@ -654,11 +680,15 @@ tcp_process(struct tcp_pcb *pcb)
       pcb->rcv_nxt = seqno + 1;
       pcb->rcv_ann_right_edge = pcb->rcv_nxt;
       pcb->lastack = ackno;
-      pcb->snd_wnd = SND_WND_SCALE(pcb, tcphdr->wnd);
+      /* the window in a SYN is never scaled (RFC 7323, 2.2) */
+      pcb->snd_wnd = tcphdr->wnd;
       pcb->snd_wnd_max = pcb->snd_wnd;
       pcb->snd_wl1 = seqno - 1; /* initialise to seqno - 1 to force window update */
       pcb->state = ESTABLISHED;
+      /* re-key the conn_id index now that the server assigned connid2 */
+      tcp_pcb_hash_remove(pcb);
       pcb->conn_id.connid2 = tcphdr->connid2;
+      tcp_pcb_hash_insert(pcb);
 
 #if TCP_CALCULATE_EFF_SEND_MSS
       pcb->mss = tcp_eff_send_mss(pcb->mss, &pcb->local_ip, &pcb->remote_ip,
@@ -669,6 +699,7 @@ tcp_process(struct tcp_pcb *pcb)
       pcb->ssthresh = LWIP_TCP_INITIAL_SSTHRESH(pcb);
 
       pcb->cwnd = LWIP_TCP_CALC_INITIAL_CWND(pcb->mss);
+      pcb->cc->init(pcb);
       LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_process (SENT): cwnd %"TCPWNDSIZE_F
                                    " ssthresh %"TCPWNDSIZE_F", connid2:%u\n",
                                    pcb->cwnd, pcb->ssthresh, pcb->conn_id.connid2));
@@ -682,10 +713,10 @@ tcp_process(struct tcp_pcb *pcb)
       /* If there's nothing left to acknowledge, stop the retransmit
          timer, otherwise reset it to start again */
       if(pcb->unacked == NULL)
-        pcb->rtime = -1;
+        tcp_rto_stop(pcb);
       else {
-        pcb->rtime = 0;
         pcb->nrtx = 0;
+        tcp_rto_start(pcb);
       }
 
       /* Call the user specified function to call when successfully
@@ -737,6 +768,7 @@ tcp_process(struct tcp_pcb *pcb)
         }
 
         pcb->cwnd = LWIP_TCP_CALC_INITIAL_CWND(pcb->mss);
+        pcb->cc->init(pcb);
         LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_process (SYN_RCVD): cwnd %"TCPWNDSIZE_F
                                      " ssthresh %"TCPWNDSIZE_F"\n",
                                      pcb->cwnd, pcb->ssthresh));
@@ -774,7 +806,7 @@ tcp_process(struct tcp_pcb *pcb)
         tcp_pcb_purge(pcb);
         TCP_RMV_ACTIVE(pcb);
         pcb->state = TIME_WAIT;
-        TCP_REG(&tcp_tw_pcbs, pcb);
+        TCP_REG_TW(pcb);
       } else {
         tcp_ack_now(pcb);
         pcb->state = CLOSING;
@@ -791,7 +823,7 @@ tcp_process(struct tcp_pcb *pcb)
       tcp_pcb_purge(pcb);
       TCP_RMV_ACTIVE(pcb);
       pcb->state = TIME_WAIT;
-      TCP_REG(&tcp_tw_pcbs, pcb);
+      TCP_REG_TW(pcb);
     }
     break;
   case CLOSING:
@@ -801,7 +833,7 @@ tcp_process(struct tcp_pcb *pcb)
       tcp_pcb_purge(pcb);
       TCP_RMV_ACTIVE(pcb);
       pcb->state = TIME_WAIT;
-      TCP_REG(&tcp_tw_pcbs, pcb);
+      TCP_REG_TW(pcb);
     }
     break;
   case LAST_ACK:
@@ -880,7 +912,7 @@ tcp_receive(struct tcp_pcb *pcb)
 #endif /* TCP_QUEUE_OOSEQ */
   struct pbuf *p;
   s32_t off;
-  s16_t m;
+  s32_t m;
   u32_t right_wnd_edge;
   u16_t new_tot_len;
   int found_dupack = 0;
@@ -916,10 +948,10 @@ tcp_receive(struct tcp_pcb *pcb)
         /* stop persist timer */
           pcb->persist_backoff = 0;
       }
-      LWIP_DEBUGF(TCP_WND_DEBUG, ("tcp_receive: window update %"U16_F"\n", pcb->snd_wnd));
+      LWIP_DEBUGF(TCP_WND_DEBUG, ("tcp_receive: window update %"TCPWNDSIZE_F"\n", pcb->snd_wnd));
 #if TCP_WND_DEBUG
     } else {
-      if (pcb->snd_wnd != SND_WND_SCALE(pcb, tcphdr->wnd)) {
+      if (pcb->snd_wnd != (u32_t)SND_WND_SCALE(pcb, tcphdr->wnd)) {
         LWIP_DEBUGF(TCP_WND_DEBUG, 
                     ("tcp_receive: no window update lastack %"U32_F" ackno %"
                      U32_F" wl1 %"U32_F" seqno %"U32_F" wl2 %"U32_F"\n",
@@ -938,7 +970,7 @@ tcp_receive(struct tcp_pcb *pcb)
      * 
      * If it passes all five, should process as a dupack: 
      * a) dupacks < 3: do nothing 
-     * b) dupacks == 3: fast retransmit 
+     * b) dupacks == 3 (TCP_DUPTHRESH): fast retransmit 
      * c) dupacks > 3: increase cwnd 
      * 
      * If it only passes 1-3, should reset dupack counter (and add to
@@ -956,20 +988,20 @@ tcp_receive(struct tcp_pcb *pcb)
         /* Clause 3 */
         if (pcb->snd_wl2 + pcb->snd_wnd == right_wnd_edge){
           /* Clause 4 */
-          if (pcb->rtime >= 0) {
+          if (TCP_RTO_RUNNING(pcb)) {
             /* Clause 5 */
             if (pcb->lastack == ackno) {
               found_dupack = 1;
               if ((u8_t)(pcb->dupacks + 1) > pcb->dupacks) {
                 ++pcb->dupacks;
               }
-              if (pcb->dupacks > 3) {
+              if (pcb->dupacks > TCP_DUPTHRESH(pcb)) {
                 /* Inflate the congestion window, but not if it means that
                    the value overflows. */
                 if ((tcpwnd_size_t)(pcb->cwnd + pcb->mss) > pcb->cwnd) {
                   pcb->cwnd += pcb->mss;
                 }
-              } else if (pcb->dupacks == 3) {
+              } else if (pcb->dupacks == TCP_DUPTHRESH(pcb)) {
                 /* Do fast retransmit */
                 tcp_rexmit_fast(pcb);
               }
@@ -989,15 +1021,22 @@ tcp_receive(struct tcp_pcb *pcb)
          in fast retransmit. Also reset the congestion window to the
          slow start threshold. */
       if (pcb->flags & TF_INFR) {
-        pcb->flags &= ~TF_INFR;
-        pcb->cwnd = pcb->ssthresh;
+#if LWIP_TCP_SACK
+        if ((pcb->flags & TF_SACK) && TCP_SEQ_LT(ackno, pcb->recover)) {
+          /* partial ACK: stay in recovery, tcp_output() sends the next hole */
+        } else
+#endif /* LWIP_TCP_SACK */
+        {
+          pcb->flags &= ~TF_INFR;
+          pcb->cwnd = pcb->ssthresh;
+        }
       }
 
       /* Reset the number of retransmissions. */
       pcb->nrtx = 0;
 
       /* Reset the retransmission time-out. */
-      pcb->rto = (pcb->sa >> 3) + pcb->sv;
+      pcb->rto = tcp_rto_calc(pcb);
 
       /* Update the send buffer space. Diff between the two can never exceed 64K
          unless window scaling is used. */
@@ -1012,18 +1051,10 @@ tcp_receive(struct tcp_pcb *pcb)
       /* Update the congestion control variables (cwnd and
          ssthresh). */
       if (pcb->state >= ESTABLISHED) {
-        if (pcb->cwnd < pcb->ssthresh) {
-          if ((tcpwnd_size_t)(pcb->cwnd + pcb->mss) > pcb->cwnd) {
-            pcb->cwnd += pcb->mss;
-          }
-          LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_receive: slow start cwnd %"TCPWNDSIZE_F"\n", pcb->cwnd));
-        } else {
-          tcpwnd_size_t new_cwnd = (pcb->cwnd + pcb->mss * pcb->mss / pcb->cwnd);
-          if (new_cwnd > pcb->cwnd) {
-            pcb->cwnd = new_cwnd;
-          }
-          LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_receive: congestion avoidance cwnd %"TCPWNDSIZE_F"\n", pcb->cwnd));
-        }
+        pcb->cc->ack(pcb, pcb->acked);
+#if LWIP_TCP_SND_AUTOTUNE
+        tcp_snd_autotune(pcb);
+#endif /* LWIP_TCP_SND_AUTOTUNE */
       }
       LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_receive: ACK for %"U32_F", unacked->seqno %"U32_F":%"U32_F"\n",
                                     ackno,
@@ -1053,6 +1084,14 @@ tcp_receive(struct tcp_pcb *pcb)
         }
 
         pcb->snd_queuelen -= pbuf_clen(next->p);
+#if LWIP_TCP_SACK
+        if (next->flags & TF_SEG_SACKED) {
+          pcb->sacked--;
+        }
+#endif /* LWIP_TCP_SACK */
+#if LWIP_TCP_RACK
+        tcp_rack_delivered(pcb, next);
+#endif /* LWIP_TCP_RACK */
         tcp_seg_free(next);
 
         LWIP_DEBUGF(TCP_QLEN_DEBUG, ("%"TCPWNDSIZE_F" (after freeing unacked)\n", (tcpwnd_size_t)pcb->snd_queuelen));
@@ -1065,9 +1104,9 @@ tcp_receive(struct tcp_pcb *pcb)
       /* If there's nothing left to acknowledge, stop the retransmit
          timer, otherwise reset it to start again */
       if (pcb->unacked == NULL) {
-        pcb->rtime = -1;
+        tcp_rto_stop(pcb);
       } else {
-        pcb->rtime = 0;
+        tcp_rto_start(pcb);
       }
 
       pcb->polltmr = 0;
@@ -1114,6 +1153,16 @@ tcp_receive(struct tcp_pcb *pcb)
     }
     /* End of ACK for new data processing. */
 
+#if LWIP_TCP_SACK
+    if (pcb->flags & TF_SACK) {
+      tcp_sack_update(pcb);
+      /* the SACK blocks may show a loss before three dupacks came in */
+      if (pcb->sacked >= TCP_DUPTHRESH(pcb)) {
+        tcp_rexmit_fast(pcb);
+      }
+    }
+#endif /* LWIP_TCP_SACK */
+
     LWIP_DEBUGF(TCP_RTO_DEBUG, ("tcp_receive: pcb->rttest %"U32_F" rtseq %"U32_F" ackno %"U32_F"\n",
                                 pcb->rttest, pcb->rtseq, ackno));
 
@@ -1121,28 +1170,48 @@ tcp_receive(struct tcp_pcb *pcb)
        incoming segment acknowledges the segment we use to take a
        round-trip time measurement. */
     if (pcb->rttest && TCP_SEQ_LT(pcb->rtseq, ackno)) {
-      /* diff between this shouldn't exceed 32K since this are tcp timer ticks
-         and a round-trip shouldn't be that long... */
-      m = (s16_t)(tcp_ticks - pcb->rttest);
+      /* in microseconds, a round-trip shouldn't come close to 35 minutes */
+      m = (s32_t)(tcp_now_us() - pcb->rttest);
+      if (m < 0) {
+        m = 0;
+      }
 
-      LWIP_DEBUGF(TCP_RTO_DEBUG, ("tcp_receive: experienced rtt %"U16_F" ticks (%"U16_F" msec).\n",
-                                  m, m * TCP_SLOW_INTERVAL));
+      LWIP_DEBUGF(TCP_RTO_DEBUG, ("tcp_receive: experienced rtt %"S32_F" usec.\n", m));
+      if (pcb->cc->rtt != NULL) {
+        pcb->cc->rtt(pcb, (u32_t)m);
+      }
 
-      /* This is taken directly from VJs original code in his paper */
-      m = m - (pcb->sa >> 3);
-      pcb->sa += m;
-      if (m < 0) {
-        m = -m;
+      if (pcb->sa == 0) {
+        /* first measurement: SRTT = R, RTTVAR = R/2 (RFC 6298, 2.2) */
+        pcb->sa = m << 3;
+        pcb->sv = m << 1;
+      } else {
+        /* This is taken directly from VJs original code in his paper */
+        m = m - (pcb->sa >> 3);
+        pcb->sa += m;
+        if (m < 0) {
+          m = -m;
+        }
+        m = m - (pcb->sv >> 2);
+        pcb->sv += m;
       }
-      m = m - (pcb->sv >> 2);
-      pcb->sv += m;
-      pcb->rto = (pcb->sa >> 3) + pcb->sv;
+      pcb->rto = tcp_rto_calc(pcb);
+
+      LWIP_DEBUGF(TCP_RTO_DEBUG, ("tcp_receive: RTO %"U32_F" milliseconds\n", pcb->rto));
 
-      LWIP_DEBUGF(TCP_RTO_DEBUG, ("tcp_receive: RTO %"U16_F" (%"U16_F" milliseconds)\n",
-                                  pcb->rto, pcb->rto * TCP_SLOW_INTERVAL));
+      /* the timer was restarted for the new data acked above, with the
+         previous estimate */
+      if (TCP_RTO_RUNNING(pcb)) {
+        tcp_rto_start(pcb);
+      }
 
       pcb->rttest = 0;
     }
+
+#if LWIP_TCP_RACK
+    /* may start recovery, or arm the timer for reordering */
+    tcp_rack_ack(pcb);
+#endif /* LWIP_TCP_RACK */
   }
 
   /* If the incoming segment contains data, we must process it
@@ -1330,6 +1399,9 @@ tcp_receive(struct tcp_pcb *pcb)
         /* Update the receiver's (our) window. */
         LWIP_ASSERT("tcp_receive: tcplen > rcv_wnd\n", pcb->rcv_wnd >= tcplen);
         pcb->rcv_wnd -= tcplen;
+#if LWIP_TCP_RCV_AUTOTUNE
+        tcp_rcv_rtt_measure(pcb);
+#endif /* LWIP_TCP_RCV_AUTOTUNE */
 
         tcp_update_rcv_ann_wnd(pcb);
 
@@ -1402,8 +1474,10 @@ tcp_receive(struct tcp_pcb *pcb)
 
       } else {
         /* We get here if the incoming segment is out-of-sequence. */
-        tcp_send_empty_ack(pcb);
 #if TCP_QUEUE_OOSEQ
+#if LWIP_TCP_SACK
+        pcb->ooseq_recent = seqno;
+#endif /* LWIP_TCP_SACK */
         /* We queue the segment on the ->ooseq queue. */
         if (pcb->ooseq == NULL) {
           pcb->ooseq = tcp_seg_copy(&inseg);
@@ -1550,6 +1624,8 @@ tcp_receive(struct tcp_pcb *pcb)
         }
 #endif /* TCP_OOSEQ_MAX_BYTES || TCP_OOSEQ_MAX_PBUFS */
 #endif /* TCP_QUEUE_OOSEQ */
+        /* ACK it once it is on ooseq, so that SACK reports it */
+        tcp_send_empty_ack(pcb);
       }
     } else {
       /* The incoming segment is not within the window. */
@@ -1575,6 +1651,17 @@ static u8_t tcp_getoptbyte(void)
   }
 }
 
+#if LWIP_TCP_SACK
+/* Reads a 32-bit option field in host order */
+static u32_t tcp_getoptu32(void)
+{
+  u32_t val = (u32_t)tcp_getoptbyte() << 24;
+  val |= (u32_t)tcp_getoptbyte() << 16;
+  val |= (u32_t)tcp_getoptbyte() << 8;
+  return val | tcp_getoptbyte();
+}
+#endif /* LWIP_TCP_SACK */
+
 /**
  * Parses the options contained in the incoming segment.
  *
@@ -1592,6 +1679,10 @@ tcp_parseopt(struct tcp_pcb *pcb)
   u32_t tsval;
 #endif
 
+#if LWIP_TCP_SACK
+  tcp_sack_cnt = 0;
+#endif /* LWIP_TCP_SACK */
+
   /* Parse the TCP MSS option, if present. */
   if (TCPH_HDRLEN(tcphdr) > 0x5) {
     u16_t max_c = (TCPH_HDRLEN(tcphdr) - 5) << 2;
@@ -1639,9 +1730,9 @@ tcp_parseopt(struct tcp_pcb *pcb)
           pcb->rcv_scale = TCP_RCV_SCALE;
           pcb->flags |= TF_WND_SCALE;
           /* window scaling is enabled, we can use the full receive window */
-          LWIP_ASSERT("window not at default value", pcb->rcv_wnd == TCPWND_MIN16(TCP_WND));
-          LWIP_ASSERT("window not at default value", pcb->rcv_ann_wnd == TCPWND_MIN16(TCP_WND));
-          pcb->rcv_wnd = pcb->rcv_ann_wnd = TCP_WND;
+          LWIP_ASSERT("window not at default value", pcb->rcv_wnd == TCPWND_MIN16(pcb->rcv_wnd_size));
+          LWIP_ASSERT("window not at default value", pcb->rcv_ann_wnd == TCPWND_MIN16(pcb->rcv_wnd_size));
+          pcb->rcv_wnd = pcb->rcv_ann_wnd = pcb->rcv_wnd_size;
         }
         break;
 #endif
@@ -1669,6 +1760,38 @@ tcp_parseopt(struct tcp_pcb *pcb)
         /* Advance to next option (6 bytes already read) */
         tcp_optidx += LWIP_TCP_OPT_LEN_TS - 6;
         break;
+#endif
+#if LWIP_TCP_SACK
+      case LWIP_TCP_OPT_SACK_PERM:
+        LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_parseopt: SACK_PERM\n"));
+        if (tcp_getoptbyte() != LWIP_TCP_OPT_LEN_SACK_PERM || (tcp_optidx - 2 + LWIP_TCP_OPT_LEN_SACK_PERM) > max_c) {
+          /* Bad length */
+          LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_parseopt: bad length\n"));
+          return;
+        }
+        if (flags & TCP_SYN) {
+          /* the peer accepts SACK blocks: send them, and use its own */
+          pcb->flags |= TF_SACK;
+        }
+        break;
+      case LWIP_TCP_OPT_SACK:
+        LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_parseopt: SACK\n"));
+        data = tcp_getoptbyte();
+        if (data < 10 || ((data - 2) & 7) != 0 || (tcp_optidx - 2 + data) > max_c) {
+          /* Bad length */
+          LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_parseopt: bad length\n"));
+          return;
+        }
+        for (data = (data - 2) / 8; data > 0; data--) {
+          u32_t left = tcp_getoptu32();
+          u32_t right = tcp_getoptu32();
+          if (tcp_sack_cnt < LWIP_TCP_SACK_MAX_BLOCKS) {
+            tcp_sack_blocks[2 * tcp_sack_cnt] = left;
+            tcp_sack_blocks[2 * tcp_sack_cnt + 1] = right;
+            tcp_sack_cnt++;
+          }
+        }
+        break;
 #endif
       default:
         LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_parseopt: other\n"));
@@ -1687,6 +1810,60 @@ tcp_parseopt(struct tcp_pcb *pcb)
   }
 }
 
+#if LWIP_TCP_SACK
+/**
+ * Mark the segments on unacked that the SACK blocks of the incoming segment
+ * cover as a whole. If the ACK stops right at a marked segment, the peer
+ * would have acked it cumulatively had it kept it: it dropped
+ * out-of-sequence data (reneging), so all marks are forgotten. After an RTO
+ * the holes wait on unsent while the marked segments stay on unacked, so a
+ * marked head with data below it on unsent is no reneging.
+ *
+ * Called from tcp_receive() after the cumulative ACK has been processed.
+ */
+static void
+tcp_sack_update(struct tcp_pcb *pcb)
+{
+  struct tcp_seg *seg;
+  u32_t left, right, seg_seqno;
+  u8_t i;
+
+  for (i = 0; i < tcp_sack_cnt; i++) {
+    left = tcp_sack_blocks[2 * i];
+    right = tcp_sack_blocks[2 * i + 1];
+    /* ignore D-SACK (RFC 2883) and blocks beyond what was sent */
+    if (!TCP_SEQ_LT(left, right) || TCP_SEQ_LEQ(right, pcb->lastack) ||
+        TCP_SEQ_GT(right, pcb->snd_nxt)) {
+      continue;
+    }
+    for (seg = pcb->unacked; seg != NULL; seg = seg->next) {
+      seg_seqno = ntohl(seg->tcphdr->seqno);
+      if (TCP_SEQ_GEQ(seg_seqno, right)) {
+        break;
+      }
+      if (!(seg->flags & TF_SEG_SACKED) && TCP_SEQ_GEQ(seg_seqno, left) &&
+          TCP_SEQ_LEQ(seg_seqno + TCP_TCPLEN(seg), right)) {
+        seg->flags |= TF_SEG_SACKED;
+        pcb->sacked++;
+#if LWIP_TCP_RACK
+        tcp_rack_delivered(pcb, seg);
+#endif /* LWIP_TCP_RACK */
+      }
+    }
+  }
+
+  seg = pcb->unacked;
+  if (seg != NULL && (seg->flags & TF_SEG_SACKED)) {
+    seg_seqno = ntohl(seg->tcphdr->seqno);
+    if (seg_seqno == pcb->lastack && (pcb->unsent == NULL ||
+        TCP_SEQ_GT(ntohl(pcb->unsent->tcphdr->seqno), seg_seqno))) {
+      LWIP_DEBUGF(TCP_FR_DEBUG, ("tcp_sack_update: peer reneged\n"));
+      tcp_sack_clear(pcb);
+    }
+  }
+}
+#endif /* LWIP_TCP_SACK */
+
 void
 tcp_trigger_input_pcb_close(void)
 {
@@ -86,8 +86,15 @@
 /* Forward declarations.*/
 static err_t tcp_output_segment(struct tcp_seg *seg, struct tcp_pcb *pcb);
 static err_t ip_output_if(struct pbuf *data, struct ip_addr_t remote_ip, u16_t remote_port);
+struct tcp_write_ref;
+static err_t tcp_write_data(struct tcp_pcb *pcb, const void *arg, tcpwnd_size_t len, u8_t apiflags,
+                            struct tcp_write_ref *ref);
 
-extern ip_output_fn ip_output;
+/* output callback of the current instance */
+#define ip_output (lwip_stack_cur->tcp.ip_output)
+
+/* pieces per segment that ip_output_if() describes without allocating */
+#define TCP_OUTPUT_IOV_MAX 8
 
 /** Allocate a pbuf and create a tcphdr at p->payload, used for output
  * functions other than the default tcp_output -> tcp_output_segment
@@ -181,6 +188,10 @@ tcp_create_segment(struct tcp_pcb *pcb, struct pbuf *p, u8_t flags, u32_t seqno,
 #if TCP_OVERSIZE_DBGCHECK
   seg->oversize_left = 0;
 #endif /* TCP_OVERSIZE_DBGCHECK */
+#if LWIP_TCP_RACK
+  seg->xmits = 0;
+  seg->xmit_us = 0;
+#endif /* LWIP_TCP_RACK */
 #if TCP_CHECKSUM_ON_COPY
   seg->chksum = 0;
   seg->chksum_swapped = 0;
@@ -298,7 +309,7 @@ tcp_seg_add_chksum(u16_t chksum, u16_t len, u16_t *seg_chksum,
  * @return ERR_OK if tcp_write is allowed to proceed, another err_t otherwise
  */
 static err_t
-tcp_write_checks(struct tcp_pcb *pcb, u16_t len)
+tcp_write_checks(struct tcp_pcb *pcb, tcpwnd_size_t len)
 {
   /* connection is in invalid state for data transmission? */
   if ((pcb->state != ESTABLISHED) &&
@@ -313,7 +324,7 @@ tcp_write_checks(struct tcp_pcb *pcb, u16_t len)
 
   /* fail on too much data */
   if (len > pcb->snd_buf) {
-    LWIP_DEBUGF(TCP_OUTPUT_DEBUG | 3, ("tcp_write: too much data (len=%"U16_F" > snd_buf=%"U16_F")\n",
+    LWIP_DEBUGF(TCP_OUTPUT_DEBUG | 3, ("tcp_write: too much data (len=%"TCPWNDSIZE_F" > snd_buf=%"TCPWNDSIZE_F")\n",
       len, pcb->snd_buf));
     pcb->flags |= TF_NAGLEMEMERR;
     return ERR_MEM;
@@ -324,9 +335,9 @@ tcp_write_checks(struct tcp_pcb *pcb, u16_t len)
   /* If total number of pbufs on the unsent/unacked queues exceeds the
    * configured maximum, return an error */
   /* check for configured max queuelen and possible overflow */
-  if ((pcb->snd_queuelen >= TCP_SND_QUEUELEN) || (pcb->snd_queuelen > TCP_SNDQUEUELEN_OVERFLOW)) {
+  if ((pcb->snd_queuelen >= TCP_SND_QUEUELEN_MAX(pcb)) || (pcb->snd_queuelen > TCP_SNDQUEUELEN_OVERFLOW)) {
     LWIP_DEBUGF(TCP_OUTPUT_DEBUG | 3, ("tcp_write: too long queue %"TCPWNDSIZE_F" (max %"TCPWNDSIZE_F")\n",
-      pcb->snd_queuelen, TCP_SND_QUEUELEN));
+      (tcpwnd_size_t)pcb->snd_queuelen, (tcpwnd_size_t)TCP_SND_QUEUELEN_MAX(pcb)));
     TCP_STATS_INC(tcp.memerr);
     pcb->flags |= TF_NAGLEMEMERR;
     return ERR_MEM;
@@ -341,6 +352,75 @@ tcp_write_checks(struct tcp_pcb *pcb, u16_t len)
   return ERR_OK;
 }
 
+#if LWIP_TCP_WRITE_REF
+/** A buffer passed to tcp_write_ref(), referenced by pbufs */
+struct tcp_write_ref {
+  /** pbufs referencing the buffer, plus one while tcp_write_ref() runs */
+  u32_t refs;
+  tcp_write_done_fn done;
+  void *arg;
+};
+
+/** A pbuf referencing part of a tcp_write_ref() buffer */
+struct tcp_ref_pbuf {
+  struct pbuf_custom pc;
+  struct tcp_write_ref *ref;
+};
+
+/** Drop a reference to ref: the last one calls done and frees ref */
+static void
+tcp_write_ref_release(struct tcp_write_ref *ref)
+{
+  if (--ref->refs == 0) {
+    if (ref->done != NULL) {
+      ref->done(ref->arg);
+    }
+    mem_free(ref);
+  }
+}
+
+/** pbuf_free() of a tcp_ref_pbuf */
+static void
+tcp_ref_pbuf_free(struct pbuf *p)
+{
+  struct tcp_write_ref *ref = ((struct tcp_ref_pbuf *)p)->ref;
+
+  mem_free(p);
+  tcp_write_ref_release(ref);
+}
+#endif /* LWIP_TCP_WRITE_REF */
+
+/**
+ * Allocate a pbuf referencing len bytes at data instead of copying them:
+ * a PBUF_REF pbuf counted in ref for tcp_write_ref(), else PBUF_ROM, as
+ * tcp_write() callers keep their data until it is acked anyway.
+ */
+static struct pbuf *
+tcp_pbuf_nocopy(pbuf_layer layer, const u8_t *data, u16_t len, struct tcp_write_ref *ref)
+{
+  struct pbuf *p;
+
+#if LWIP_TCP_WRITE_REF
+  if (ref != NULL) {
+    struct tcp_ref_pbuf *rp = (struct tcp_ref_pbuf *)mem_malloc(sizeof(struct tcp_ref_pbuf));
+    if (rp == NULL) {
+      return NULL;
+    }
+    rp->pc.custom_free_function = tcp_ref_pbuf_free;
+    rp->ref = ref;
+    ref->refs++;
+    return pbuf_alloced_custom(PBUF_RAW, len, PBUF_REF, &rp->pc, (void *)data, len);
+  }
+#else /* LWIP_TCP_WRITE_REF */
+  LWIP_UNUSED_ARG(ref);
+#endif /* LWIP_TCP_WRITE_REF */
+  if ((p = pbuf_alloc(layer, len, PBUF_ROM)) != NULL) {
+    /* reference the non-volatile payload data */
+    ((struct pbuf_rom*)p)->payload = data;
+  }
+  return p;
+}
+
 /**
  * Write data for sending (but does not send it immediately).
  *
@@ -349,6 +429,10 @@ tcp_write_checks(struct tcp_pcb *pcb, u16_t len)
  * To prompt the system to send data now, call tcp_output() after
  * calling tcp_write().
  *
+ * Any length up to tcp_sndbuf() is taken in one call, which is segmented
+ * in one pass: the checks and finding the unsent tail are paid once, not
+ * per 64 KB.
+ *
  * @param pcb Protocol control block for the TCP connection to enqueue data for.
  * @param arg Pointer to the data to be enqueued for sending.
  * @param len Data length in bytes
@@ -358,11 +442,68 @@ tcp_write_checks(struct tcp_pcb *pcb, u16_t len)
  * @return ERR_OK if enqueued, another err_t on error
  */
 err_t
-tcp_write(struct tcp_pcb *pcb, const void *arg, u16_t len, u8_t apiflags)
+tcp_write(struct tcp_pcb *pcb, const void *arg, tcpwnd_size_t len, u8_t apiflags)
+{
+  return tcp_write_data(pcb, arg, len, apiflags, NULL);
+}
+
+#if LWIP_TCP_WRITE_REF
+/**
+ * Write data for sending without copying it, like tcp_write() without
+ * TCP_WRITE_FLAG_COPY, but the data need not stay put until the
+ * connection ends: done(done_arg) is called once the stack let go of the
+ * last byte, when it is acked or the pcb is freed, and the output function
+ * released the pbufs it kept (see struct ip_iovec). Until then the data
+ * must not change. Segments reference it through PBUF_REF pbufs, so it
+ * is never copied before it reaches the transport.
+ *
+ * done is not called if this fails, the data is the caller's again. It
+ * runs from pbuf_free(), mostly while an ACK is processed, so it must not
+ * call into the stack.
+ *
+ * @param pcb Protocol control block for the TCP connection to enqueue data for.
+ * @param arg Pointer to the data to be enqueued for sending.
+ * @param len Data length in bytes
+ * @param apiflags TCP_WRITE_FLAG_MORE as for tcp_write()
+ * @param done called when the data may be reused
+ * @param done_arg argument passed to done
+ * @return ERR_OK if enqueued, another err_t on error
+ */
+err_t
+tcp_write_ref(struct tcp_pcb *pcb, const void *arg, tcpwnd_size_t len, u8_t apiflags,
+              tcp_write_done_fn done, void *done_arg)
+{
+  struct tcp_write_ref *ref;
+  err_t err;
+
+  ref = (struct tcp_write_ref *)mem_malloc(sizeof(struct tcp_write_ref));
+  if (ref == NULL) {
+    return ERR_MEM;
+  }
+  ref->refs = 1;
+  ref->done = done;
+  ref->arg = done_arg;
+  err = tcp_write_data(pcb, arg, len, (u8_t)(apiflags & ~TCP_WRITE_FLAG_COPY), ref);
+  if (err != ERR_OK) {
+    /* pbufs allocated before the error are freed already */
+    ref->done = NULL;
+  }
+  tcp_write_ref_release(ref);
+  return err;
+}
+#endif /* LWIP_TCP_WRITE_REF */
+
+/**
+ * tcp_write() and tcp_write_ref(): data not copied is referenced by pbufs
+ * counted in ref if it is not NULL.
+ */
+static err_t
+tcp_write_data(struct tcp_pcb *pcb, const void *arg, tcpwnd_size_t len, u8_t apiflags,
+               struct tcp_write_ref *ref)
 {
   struct pbuf *concat_p = NULL;
   struct tcp_seg *last_unsent = NULL, *seg = NULL, *prev_seg = NULL, *queue = NULL;
-  u16_t pos = 0; /* position in 'arg' data */
+  tcpwnd_size_t pos = 0; /* position in 'arg' data */
   u16_t queuelen;
   u8_t optlen = 0;
   u8_t optflags = 0;
@@ -385,7 +526,7 @@ tcp_write(struct tcp_pcb *pcb, const void *arg, u16_t len, u8_t apiflags)
   apiflags |= TCP_WRITE_FLAG_COPY;
 #endif /* LWIP_NETIF_TX_SINGLE_PBUF */
 
-  LWIP_DEBUGF(TCP_OUTPUT_DEBUG, ("tcp_write(pcb=%p, data=%p, len=%"U16_F", apiflags=%"U16_F")\n",
+  LWIP_DEBUGF(TCP_OUTPUT_DEBUG, ("tcp_write(pcb=%p, data=%p, len=%"TCPWNDSIZE_F", apiflags=%"U16_F")\n",
     (void *)pcb, arg, len, (u16_t)apiflags));
   LWIP_ERROR("tcp_write: arg == NULL (programmer violates API)", 
              arg != NULL, return ERR_ARG;);
@@ -461,7 +602,7 @@ tcp_write(struct tcp_pcb *pcb, const void *arg, u16_t len, u8_t apiflags)
     if (oversize > 0) {
       LWIP_ASSERT("inconsistent oversize vs. space", oversize_used <= space);
       seg = last_unsent;
-      oversize_used = oversize < len ? oversize : len;
+      oversize_used = oversize < len ? oversize : (u16_t)len;
       pos += oversize_used;
       oversize -= oversize_used;
       space -= oversize_used;
@@ -478,7 +619,7 @@ tcp_write(struct tcp_pcb *pcb, const void *arg, u16_t len, u8_t apiflags)
      * the end.
      */
     if ((pos < len) && (space > 0) && (last_unsent->len > 0)) {
-      u16_t seglen = space < len - pos ? space : len - pos;
+      u16_t seglen = space < len - pos ? space : (u16_t)(len - pos);
       seg = last_unsent;
 
       /* Create a pbuf with a copy or reference to seglen bytes. We
@@ -501,7 +642,7 @@ tcp_write(struct tcp_pcb *pcb, const void *arg, u16_t len, u8_t apiflags)
 #endif /* TCP_CHECKSUM_ON_COPY */
       } else {
         /* Data is not copied */
-        if ((concat_p = pbuf_alloc(PBUF_RAW, seglen, PBUF_ROM)) == NULL) {
+        if ((concat_p = tcp_pbuf_nocopy(PBUF_RAW, (const u8_t*)arg + pos, seglen, ref)) == NULL) {
           LWIP_DEBUGF(TCP_OUTPUT_DEBUG | 2,
                       ("tcp_write: could not allocate memory for zero-copy pbuf\n"));
           goto memerr;
@@ -512,8 +653,6 @@ tcp_write(struct tcp_pcb *pcb, const void *arg, u16_t len, u8_t apiflags)
           &concat_chksum, &concat_chksum_swapped);
         concat_chksummed += seglen;
 #endif /* TCP_CHECKSUM_ON_COPY */
-        /* reference the non-volatile payload data */
-        ((struct pbuf_rom*)concat_p)->payload = (const u8_t*)arg + pos;
       }
 
       pos += seglen;
@@ -531,12 +670,25 @@ tcp_write(struct tcp_pcb *pcb, const void *arg, u16_t len, u8_t apiflags)
    *
    * The new segments are chained together in the local 'queue'
    * variable, ready to be appended to pcb->unsent.
+   *
+   * A large write would hit the queue limit after allocating many
+   * segments, all to be freed again: see if they fit first.
    */
+  if (pos < len) {
+    u16_t max_len = mss_local - optlen;
+    u32_t nsegs = (len - pos + max_len - 1) / max_len;
+    /* pbufs per segment: the data, and a header for referenced data */
+    u32_t need = queuelen + nsegs * ((apiflags & TCP_WRITE_FLAG_COPY) ? 1 : 2);
+    if ((need > TCP_SND_QUEUELEN_MAX(pcb)) || (need > TCP_SNDQUEUELEN_OVERFLOW)) {
+      LWIP_DEBUGF(TCP_OUTPUT_DEBUG | 2, ("tcp_write: queue too long for %"U32_F" segments\n", nsegs));
+      goto memerr;
+    }
+  }
   while (pos < len) {
     struct pbuf *p;
-    u16_t left = len - pos;
+    tcpwnd_size_t left = len - pos;
     u16_t max_len = mss_local - optlen;
-    u16_t seglen = left > max_len ? max_len : left;
+    u16_t seglen = left > max_len ? max_len : (u16_t)left;
 #if TCP_CHECKSUM_ON_COPY
     u16_t chksum = 0;
     u8_t chksum_swapped = 0;
@@ -556,13 +708,14 @@ tcp_write(struct tcp_pcb *pcb, const void *arg, u16_t len, u8_t apiflags)
       /* Copy is not set: First allocate a pbuf for holding the data.
        * Since the referenced data is available at least until it is
        * sent out on the link (as it has to be ACKed by the remote
-       * party) we can safely use PBUF_ROM instead of PBUF_REF here.
+       * party) we can safely use PBUF_ROM instead of PBUF_REF here,
+       * unless tcp_write_ref() counts the references.
        */
       struct pbuf *p2;
 #if TCP_OVERSIZE
       LWIP_ASSERT("oversize == 0", oversize == 0);
 #endif /* TCP_OVERSIZE */
-      if ((p2 = pbuf_alloc(PBUF_TRANSPORT, seglen, PBUF_ROM)) == NULL) {
+      if ((p2 = tcp_pbuf_nocopy(PBUF_TRANSPORT, (const u8_t*)arg + pos, seglen, ref)) == NULL) {
         LWIP_DEBUGF(TCP_OUTPUT_DEBUG | 2, ("tcp_write: could not allocate memory for zero-copy pbuf\n"));
         goto memerr;
       }
@@ -574,8 +727,6 @@ tcp_write(struct tcp_pcb *pcb, const void *arg, u16_t len, u8_t apiflags)
         chksum = SWAP_BYTES_IN_WORD(chksum);
       }
 #endif /* TCP_CHECKSUM_ON_COPY */
-      /* reference the non-volatile payload data */
-      ((struct pbuf_rom*)p2)->payload = (const u8_t*)arg + pos;
 
       /* Second, allocate a pbuf for the headers. */
       if ((p = pbuf_alloc(PBUF_TRANSPORT, optlen, PBUF_RAM)) == NULL) {
@@ -594,8 +745,9 @@ tcp_write(struct tcp_pcb *pcb, const void *arg, u16_t len, u8_t apiflags)
     /* Now that there are more segments queued, we check again if the
      * length of the queue exceeds the configured maximum or
      * overflows. */
-    if ((queuelen > TCP_SND_QUEUELEN) || (queuelen > TCP_SNDQUEUELEN_OVERFLOW)) {
-      LWIP_DEBUGF(TCP_OUTPUT_DEBUG | 2, ("tcp_write: queue too long %"TCPWNDSIZE_F" (%"TCPWNDSIZE_F")\n", queuelen, TCP_SND_QUEUELEN));
+    if ((queuelen > TCP_SND_QUEUELEN_MAX(pcb)) || (queuelen > TCP_SNDQUEUELEN_OVERFLOW)) {
+      LWIP_DEBUGF(TCP_OUTPUT_DEBUG | 2, ("tcp_write: queue too long %"TCPWNDSIZE_F" (%"TCPWNDSIZE_F")\n",
+        (tcpwnd_size_t)queuelen, (tcpwnd_size_t)TCP_SND_QUEUELEN_MAX(pcb)));
       pbuf_free(p);
       goto memerr;
     }
@@ -710,6 +862,8 @@ tcp_write(struct tcp_pcb *pcb, const void *arg, u16_t len, u8_t apiflags)
     TCPH_SET_FLAG(seg->tcphdr, TCP_PSH);
   }
 
+  /* unsent data is retried from tcp_slowtmr() */
+  tcp_timer_update(pcb);
   return ERR_OK;
 memerr:
   pcb->flags |= TF_NAGLEMEMERR;
@@ -753,10 +907,10 @@ tcp_enqueue_flags(struct tcp_pcb *pcb, u8_t flags)
               (flags & (TCP_SYN | TCP_FIN)) != 0);
 
   /* check for configured max queuelen and possible overflow (FIN flag should always come through!) */
-  if (((pcb->snd_queuelen >= TCP_SND_QUEUELEN) || (pcb->snd_queuelen > TCP_SNDQUEUELEN_OVERFLOW)) &&
+  if (((pcb->snd_queuelen >= TCP_SND_QUEUELEN_MAX(pcb)) || (pcb->snd_queuelen > TCP_SNDQUEUELEN_OVERFLOW)) &&
       ((flags & TCP_FIN) == 0)) {
     LWIP_DEBUGF(TCP_OUTPUT_DEBUG | 3, ("tcp_enqueue_flags: too long queue %"U16_F" (max %"U16_F")\n",
-                                       pcb->snd_queuelen, TCP_SND_QUEUELEN));
+                                       pcb->snd_queuelen, TCP_SND_QUEUELEN_MAX(pcb)));
     TCP_STATS_INC(tcp.memerr);
     pcb->flags |= TF_NAGLEMEMERR;
     return ERR_MEM;
@@ -771,6 +925,12 @@ tcp_enqueue_flags(struct tcp_pcb *pcb, u8_t flags)
       optflags |= TF_SEG_OPTS_WND_SCALE;
     }
 #endif /* LWIP_WND_SCALE */
+#if LWIP_TCP_SACK
+    if ((pcb->state != SYN_RCVD) || (pcb->flags & TF_SACK)) {
+      /* same for SACK permitted */
+      optflags |= TF_SEG_OPTS_SACK_PERM;
+    }
+#endif /* LWIP_TCP_SACK */
   }
 #if LWIP_TCP_TIMESTAMPS
   if ((pcb->flags & TF_TIMESTAMP)) {
@@ -846,6 +1006,7 @@ tcp_enqueue_flags(struct tcp_pcb *pcb, u8_t flags)
       pcb->unacked != NULL || pcb->unsent != NULL);
   }
 
+  tcp_timer_update(pcb);
   return ERR_OK;
 }
 
@@ -878,6 +1039,75 @@ tcp_build_wnd_scale_option(u32_t *opts)
 }
 #endif
 
+#if LWIP_TCP_SACK
+/** Build a SACK permitted option (2 bytes long) at the specified options pointer
+ *
+ * @param opts option pointer where to store the SACK permitted option
+ */
+static void
+tcp_build_sack_perm_option(u32_t *opts)
+{
+  /* Pad with two NOP options to make everything nicely aligned */
+  opts[0] = PP_HTONL(0x01010402);
+}
+
+#if TCP_QUEUE_OOSEQ
+/**
+ * Describe the ooseq queue as SACK blocks, contiguous segments merged into
+ * one block. The block with the segment received last goes first, the
+ * others follow in sequence order as long as there is room (RFC 2018, 4).
+ *
+ * @param blocks left and right edge of each block
+ * @return number of blocks
+ */
+static u8_t
+tcp_sack_blocks(struct tcp_pcb *pcb, u32_t *blocks)
+{
+  struct tcp_seg *seg = pcb->ooseq;
+  u32_t left, right;
+  u8_t n = 0, i;
+
+  while (seg != NULL) {
+    /* ooseq segments keep their header in host byte order */
+    left = seg->tcphdr->seqno;
+    right = left + TCP_TCPLEN(seg);
+    for (seg = seg->next; seg != NULL && TCP_SEQ_LEQ(seg->tcphdr->seqno, right); seg = seg->next) {
+      if (TCP_SEQ_GT(seg->tcphdr->seqno + TCP_TCPLEN(seg), right)) {
+        right = seg->tcphdr->seqno + TCP_TCPLEN(seg);
+      }
+    }
+    if (TCP_SEQ_BETWEEN(pcb->ooseq_recent, left, right - 1)) {
+      i = (n < LWIP_TCP_SACK_MAX_BLOCKS) ? n++ : n - 1;
+      for (; i > 0; i--) {
+        blocks[2 * i] = blocks[2 * i - 2];
+        blocks[2 * i + 1] = blocks[2 * i - 1];
+      }
+      blocks[0] = left;
+      blocks[1] = right;
+    } else if (n < LWIP_TCP_SACK_MAX_BLOCKS) {
+      blocks[2 * n] = left;
+      blocks[2 * n + 1] = right;
+      n++;
+    }
+  }
+  return n;
+}
+
+/** Build a SACK option of n blocks at the specified options pointer */
+static void
+tcp_build_sack_option(u32_t *opts, const u32_t *blocks, u8_t n)
+{
+  u8_t i;
+
+  /* Pad with two NOP options to make everything nicely aligned */
+  opts[0] = htonl(0x01010500 | (LWIP_TCP_OPT_LEN_SACK_OUT(n) - 2));
+  for (i = 0; i < 2 * n; i++) {
+    opts[1 + i] = htonl(blocks[i]);
+  }
+}
+#endif /* TCP_QUEUE_OOSEQ */
+#endif /* LWIP_TCP_SACK */
+
 /** Send an ACK without data.
  *
  * @param pcb Protocol control block for the TCP connection to send the ACK
@@ -888,26 +1118,43 @@ tcp_send_empty_ack(struct tcp_pcb *pcb)
   err_t err;
   struct pbuf *p;
   u8_t optlen = 0;
-#if LWIP_TCP_TIMESTAMPS || CHECKSUM_GEN_TCP
+#if LWIP_TCP_TIMESTAMPS || CHECKSUM_GEN_TCP || LWIP_TCP_SACK
   struct tcp_hdr *tcphdr;
-#endif /* LWIP_TCP_TIMESTAMPS || CHECKSUM_GEN_TCP */
+#endif /* LWIP_TCP_TIMESTAMPS || CHECKSUM_GEN_TCP || LWIP_TCP_SACK */
+#if LWIP_TCP_TIMESTAMPS || LWIP_TCP_SACK
+  u32_t *opts;
+#endif /* LWIP_TCP_TIMESTAMPS || LWIP_TCP_SACK */
+#if LWIP_TCP_SACK && TCP_QUEUE_OOSEQ
+  u32_t sack_blocks[2 * LWIP_TCP_SACK_MAX_BLOCKS];
+  u8_t sack_cnt = 0;
+#endif /* LWIP_TCP_SACK && TCP_QUEUE_OOSEQ */
 
 #if LWIP_TCP_TIMESTAMPS
   if (pcb->flags & TF_TIMESTAMP) {
     optlen = LWIP_TCP_OPT_LENGTH(TF_SEG_OPTS_TS);
   }
 #endif
+#if LWIP_TCP_SACK && TCP_QUEUE_OOSEQ
+  if ((pcb->flags & TF_SACK) && pcb->ooseq != NULL) {
+    sack_cnt = tcp_sack_blocks(pcb, sack_blocks);
+    optlen += LWIP_TCP_OPT_LEN_SACK_OUT(sack_cnt);
+  }
+#endif /* LWIP_TCP_SACK && TCP_QUEUE_OOSEQ */
 
   p = tcp_output_alloc_header(pcb, optlen, 0, htonl(pcb->snd_nxt));
   if (p == NULL) {
     /* let tcp_fasttmr retry sending this ACK */
     pcb->flags |= (TF_ACK_DELAY | TF_ACK_NOW);
+    tcp_timer_update(pcb);
     LWIP_DEBUGF(TCP_OUTPUT_DEBUG, ("tcp_output: (ACK) could not allocate pbuf\n"));
     return ERR_BUF;
   }
-#if LWIP_TCP_TIMESTAMPS || CHECKSUM_GEN_TCP
+#if LWIP_TCP_TIMESTAMPS || CHECKSUM_GEN_TCP || LWIP_TCP_SACK
   tcphdr = (struct tcp_hdr *)p->payload;
-#endif /* LWIP_TCP_TIMESTAMPS || CHECKSUM_GEN_TCP */
+#endif /* LWIP_TCP_TIMESTAMPS || CHECKSUM_GEN_TCP || LWIP_TCP_SACK */
+#if LWIP_TCP_TIMESTAMPS || LWIP_TCP_SACK
+  opts = (u32_t *)(tcphdr + 1);
+#endif /* LWIP_TCP_TIMESTAMPS || LWIP_TCP_SACK */
   LWIP_DEBUGF(TCP_OUTPUT_DEBUG, 
               ("tcp_output: sending ACK for %"U32_F"\n", pcb->rcv_nxt));
 
@@ -916,9 +1163,15 @@ tcp_send_empty_ack(struct tcp_pcb *pcb)
   pcb->ts_lastacksent = pcb->rcv_nxt;
 
   if (pcb->flags & TF_TIMESTAMP) {
-    tcp_build_timestamp_option(pcb, (u32_t *)(tcphdr + 1));
+    tcp_build_timestamp_option(pcb, opts);
+    opts += 3;
   }
 #endif
+#if LWIP_TCP_SACK && TCP_QUEUE_OOSEQ
+  if (sack_cnt > 0) {
+    tcp_build_sack_option(opts, sack_blocks, sack_cnt);
+  }
+#endif /* LWIP_TCP_SACK && TCP_QUEUE_OOSEQ */
 
   err = ip_output_if(p, pcb->remote_ip, pcb->remote_udp_port);
   pbuf_free(p);
@@ -926,6 +1179,7 @@ tcp_send_empty_ack(struct tcp_pcb *pcb)
   if (err != ERR_OK) {
     /* let tcp_fasttmr retry sending this ACK */
     pcb->flags |= (TF_ACK_DELAY | TF_ACK_NOW);
+    tcp_timer_update(pcb);
   } else {
     /* remove ACK flags from the PCB, as we sent an empty ACK now */
     pcb->flags &= ~(TF_ACK_DELAY | TF_ACK_NOW);
@@ -934,6 +1188,85 @@ tcp_send_empty_ack(struct tcp_pcb *pcb)
   return err;
 }
 
+#if LWIP_TCP_SACK
+/** A segment not SACKed itself is taken as lost once TCP_DUPTHRESH
+    segments above it are, the first one always (RFC 6675, 4 and 5), or
+    when RACK says so */
+#define TCP_SACK_LOST(pcb, seg, sacked_above) \
+  ((seg) == (pcb)->unacked || (sacked_above) >= TCP_DUPTHRESH(pcb) || \
+   ((seg)->flags & TF_SEG_LOST))
+
+/**
+ * Loss recovery with SACK: retransmit the segments on unacked that are
+ * lost and have not been retransmitted in this recovery yet, in place,
+ * while the data in flight (RFC 6675 "pipe": not SACKed and not lost, plus
+ * retransmitted) stays within ssthresh. The first one goes out regardless.
+ *
+ * Called by tcp_output() while in fast recovery.
+ */
+static err_t
+tcp_rexmit_sack(struct tcp_pcb *pcb)
+{
+  struct tcp_seg *seg;
+  u16_t sacked_above = pcb->sacked;
+  u32_t pipe = 0;
+  err_t err;
+
+  for (seg = pcb->unacked; seg != NULL; seg = seg->next) {
+    if (seg->flags & TF_SEG_SACKED) {
+      sacked_above--;
+      continue;
+    }
+    if (!TCP_SACK_LOST(pcb, seg, sacked_above)) {
+      pipe += TCP_TCPLEN(seg);
+    }
+    if (seg->flags & TF_SEG_RETX) {
+      pipe += TCP_TCPLEN(seg);
+    }
+  }
+
+  sacked_above = pcb->sacked;
+  for (seg = pcb->unacked; seg != NULL; seg = seg->next) {
+    if (seg->flags & TF_SEG_SACKED) {
+      sacked_above--;
+      continue;
+    }
+    if (!TCP_SACK_LOST(pcb, seg, sacked_above) || (seg->flags & TF_SEG_RETX)) {
+      continue;
+    }
+    if (seg != pcb->unacked && pipe + TCP_TCPLEN(seg) > pcb->ssthresh) {
+      break;
+    }
+    LWIP_DEBUGF(TCP_FR_DEBUG, ("tcp_rexmit_sack: %"U32_F"\n", ntohl(seg->tcphdr->seqno)));
+    err = tcp_output_segment(seg, pcb);
+    if (err != ERR_OK) {
+      pcb->flags |= TF_NAGLEMEMERR;
+      return err;
+    }
+    seg->flags |= TF_SEG_RETX;
+    pipe += TCP_TCPLEN(seg);
+    pcb->flags &= ~(TF_ACK_DELAY | TF_ACK_NOW);
+    /* Don't take any rtt measurements after retransmitting. */
+    pcb->rttest = 0;
+  }
+  return ERR_OK;
+}
+
+/**
+ * Forget what the peer SACKed, it may drop out-of-sequence data (reneging).
+ */
+void
+tcp_sack_clear(struct tcp_pcb *pcb)
+{
+  struct tcp_seg *seg;
+
+  for (seg = pcb->unacked; seg != NULL; seg = seg->next) {
+    seg->flags &= ~(TF_SEG_SACKED | TF_SEG_RETX | TF_SEG_LOST);
+  }
+  pcb->sacked = 0;
+}
+#endif /* LWIP_TCP_SACK */
+
 /**
  * Find out what we can send and send it
  *
@@ -947,6 +1280,10 @@ tcp_output(struct tcp_pcb *pcb)
   struct tcp_seg *seg, *useg;
   u32_t wnd, snd_nxt;
   err_t err;
+#if LWIP_TCP_RACK
+  u32_t snd_nxt_old = pcb->snd_nxt;
+  u32_t pto, rto_left;
+#endif /* LWIP_TCP_RACK */
 #if TCP_CWND_DEBUG
   s16_t i = 0;
 #endif /* TCP_CWND_DEBUG */
@@ -963,7 +1300,17 @@ tcp_output(struct tcp_pcb *pcb)
     return ERR_OK;
   }
 
-  wnd = LWIP_MIN(pcb->snd_wnd, pcb->cwnd);
+#if LWIP_TCP_SACK
+  /* holes first */
+  if ((pcb->flags & (TF_SACK | TF_INFR)) == (TF_SACK | TF_INFR)) {
+    err = tcp_rexmit_sack(pcb);
+    if (err != ERR_OK) {
+      return err;
+    }
+  }
+#endif /* LWIP_TCP_SACK */
+
+  wnd = LWIP_MIN(pcb->snd_wnd, TCP_CC_CWND(pcb));
 
   seg = pcb->unsent;
 
@@ -1091,6 +1438,30 @@ tcp_output(struct tcp_pcb *pcb)
     pcb->unsent_oversize = 0;
   }
 #endif /* TCP_OVERSIZE */
+#if LWIP_TCP_RACK
+  /* a tail loss probe is due a while after the last segment sent, now that
+     it is on unacked */
+  if (pcb->snd_nxt != snd_nxt_old && pcb->rto_kind != TCP_RTO_KIND_REO) {
+    pto = tcp_tlp_timeout(pcb);
+    if (pto != 0) {
+      /* but not after a retransmission time-out that already runs */
+      rto_left = pcb->rto * 1000UL;
+      if (pcb->rto_pprev != NULL && pcb->rto_kind == TCP_RTO_KIND_RTO) {
+        rto_left = pcb->rto_due - tcp_now_us();
+        if ((s32_t)rto_left < 0) {
+          rto_left = 0;
+        }
+      }
+      tcp_rto_arm(pcb, LWIP_MIN(pto, rto_left), TCP_RTO_KIND_TLP);
+    }
+  }
+#endif /* LWIP_TCP_RACK */
+#if LWIP_TCP_FEC
+  if (pcb->unsent == NULL) {
+    /* the burst is over, its last group gets its parity now */
+    tcp_fec_flush(pcb);
+  }
+#endif /* LWIP_TCP_FEC */
 
   pcb->flags &= ~TF_NAGLEMEMERR;
   return ERR_OK;
@@ -1154,15 +1525,28 @@ tcp_output_segment(struct tcp_seg *seg, struct tcp_pcb *pcb)
     opts += 1;
   }
 #endif
+#if LWIP_TCP_SACK
+  if (seg->flags & TF_SEG_OPTS_SACK_PERM) {
+    tcp_build_sack_perm_option(opts);
+    opts += 1;
+  }
+#endif
   
   /* Set retransmission timer running if it is not currently enabled 
      This must be set before checking the route. */
-  if (pcb->rtime == -1) {
-    pcb->rtime = 0;
+  if (!TCP_RTO_RUNNING(pcb)) {
+    tcp_rto_start(pcb);
+  }
+#if LWIP_TCP_RACK
+  seg->xmit_us = tcp_now_us();
+  if (seg->xmits < 0xff) {
+    seg->xmits++;
   }
+#endif /* LWIP_TCP_RACK */
 
   if (pcb->rttest == 0) {
-    pcb->rttest = tcp_ticks;
+    /* 0 stands for no measurement running */
+    pcb->rttest = tcp_now_us() | 1;
     pcb->rtseq = ntohl(seg->tcphdr->seqno);
 
     LWIP_DEBUGF(TCP_RTO_DEBUG, ("tcp_output_segment: rtseq %"U32_F"\n", pcb->rtseq));
@@ -1186,10 +1570,29 @@ tcp_output_segment(struct tcp_seg *seg, struct tcp_pcb *pcb)
 #endif
 
   err = ip_output_if(seg->p, pcb->remote_ip, pcb->remote_udp_port);
+#if LWIP_TCP_FEC
+  if (err == ERR_OK && TCP_SEQ_GEQ(ntohl(seg->tcphdr->seqno), pcb->snd_nxt)) {
+    /* new data joins a parity group, retransmissions do not */
+    tcp_fec_sent(pcb, seg);
+  }
+#endif /* LWIP_TCP_FEC */
 
   return err;
 }
 
+#if LWIP_TCP_FEC
+/**
+ * Send a parity datagram built by tcp_fec_flush(), p->payload pointing to
+ * its TCP header. p is not freed.
+ */
+err_t
+tcp_output_fec(struct tcp_pcb *pcb, struct pbuf *p)
+{
+  TCP_STATS_INC(tcp.xmit);
+  return ip_output_if(p, pcb->remote_ip, pcb->remote_udp_port);
+}
+#endif /* LWIP_TCP_FEC */
+
 /**
  * Send a TCP RESET packet (empty segment with RST flag set) either to
  * abort a connection or to show that there is no matching local connection
@@ -1245,6 +1648,40 @@ tcp_rst(u32_t seqno, u32_t ackno,
   LWIP_DEBUGF(TCP_RST_DEBUG, ("tcp_rst: seqno %"U32_F" ackno %"U32_F".\n", seqno, ackno));
 }
 
+#if LWIP_TCP_SACK
+/**
+ * tcp_rexmit_rto() with SACK: only the segments the peer does not hold are
+ * requeued, the SACKed ones stay on unacked. Ends fast recovery.
+ */
+static void
+tcp_rexmit_rto_sack(struct tcp_pcb *pcb)
+{
+  struct tcp_seg *seg, *next, *rexmit = NULL;
+  struct tcp_seg **keep = &pcb->unacked, **tail = &rexmit;
+
+  for (seg = pcb->unacked; seg != NULL; seg = next) {
+    next = seg->next;
+    seg->flags &= ~(TF_SEG_RETX | TF_SEG_LOST);
+    if (seg->flags & TF_SEG_SACKED) {
+      *keep = seg;
+      keep = &seg->next;
+    } else {
+      *tail = seg;
+      tail = &seg->next;
+    }
+  }
+  *keep = NULL;
+  /* everything on unsent comes after it */
+  *tail = pcb->unsent;
+  pcb->unsent = rexmit;
+  pcb->flags &= ~TF_INFR;
+
+  ++pcb->nrtx;
+  pcb->rttest = 0;
+  tcp_output(pcb);
+}
+#endif /* LWIP_TCP_SACK */
+
 /**
  * Requeue all unacked segments for retransmission
  *
@@ -1261,6 +1698,13 @@ tcp_rexmit_rto(struct tcp_pcb *pcb)
     return;
   }
 
+#if LWIP_TCP_SACK
+  if (pcb->flags & TF_SACK) {
+    tcp_rexmit_rto_sack(pcb);
+    return;
+  }
+#endif /* LWIP_TCP_SACK */
+
   /* Move all unacked segments to the head of the unsent queue */
   for (seg = pcb->unacked; seg->next != NULL; seg = seg->next);
   /* concatenate unsent queue after unacked queue */
@@ -1347,37 +1791,59 @@ tcp_rexmit_fast(struct tcp_pcb *pcb)
                  "), fast retransmit %"U32_F"\n",
                  (u16_t)pcb->dupacks, pcb->lastack,
                  ntohl(pcb->unacked->tcphdr->seqno)));
-    tcp_rexmit(pcb);
-
-    /* Set ssthresh to half of the minimum of the current
-     * cwnd and the advertised window */
-    if (pcb->cwnd > pcb->snd_wnd) {
-      pcb->ssthresh = pcb->snd_wnd / 2;
-    } else {
-      pcb->ssthresh = pcb->cwnd / 2;
-    }
-    
-    /* The minimum value for ssthresh should be 2 MSS */
-    if (pcb->ssthresh < (2U * pcb->mss)) {
-      LWIP_DEBUGF(TCP_FR_DEBUG, 
-                  ("tcp_receive: The minimum value for ssthresh %"U16_F
-                   " should be min 2 mss %"U16_F"...\n",
-                   pcb->ssthresh, 2*pcb->mss));
-      pcb->ssthresh = 2*pcb->mss;
+#if LWIP_TCP_SACK
+    if (pcb->flags & TF_SACK) {
+      /* tcp_output() retransmits the holes from unacked until everything
+         sent so far is acked */
+      pcb->recover = pcb->snd_nxt;
+      ++pcb->nrtx;
+    } else
+#endif /* LWIP_TCP_SACK */
+    {
+      tcp_rexmit(pcb);
     }
-    
-    /**
-     * Retransmit the lost segment and set cwnd to ssthresh plus 3*SMSS.
-       This artificially "inflates" the congestion window by the number
-       of segments (three) that have left the network and which the
-       receiver has buffered. -RFC2581 TCP Congestion Control
-     */
-    pcb->cwnd = pcb->ssthresh + 3 * pcb->mss;
+
+    /* Reduce ssthresh, set cwnd for the recovery */
+    pcb->cc->loss(pcb);
     pcb->flags |= TF_INFR;
+#if LWIP_TCP_RACK
+    /* the recovery takes over from a tail loss probe */
+    pcb->tlp_out = 0;
+#endif /* LWIP_TCP_RACK */
   } 
 }
 
 
+#if LWIP_TCP_RACK
+/**
+ * Tail loss probe (RFC 8985, 7.3): nothing was acked for a probe time-out,
+ * so the last segments sent may be lost with nothing behind them to show
+ * it. Retransmit the last one; the ACK for it carries the SACK blocks that
+ * let RACK find the holes. The RTO runs again, there is one probe per
+ * episode.
+ *
+ * Called when the retransmission timer fires for a probe.
+ *
+ * @param pcb the tcp_pcb with data in flight
+ */
+err_t
+tcp_rexmit_tlp(struct tcp_pcb *pcb)
+{
+  struct tcp_seg *seg;
+  err_t err;
+
+  for (seg = pcb->unacked; seg->next != NULL; seg = seg->next);
+  LWIP_DEBUGF(TCP_FR_DEBUG, ("tcp_rexmit_tlp: %"U32_F"\n", ntohl(seg->tcphdr->seqno)));
+  pcb->tlp_out = 1;
+  pcb->tlp_end = pcb->snd_nxt;
+  /* restarts the retransmission timer, for the RTO now */
+  err = tcp_output_segment(seg, pcb);
+  /* Don't take any rtt measurements after retransmitting. */
+  pcb->rttest = 0;
+  return err;
+}
+#endif /* LWIP_TCP_RACK */
+
 /**
  * Send keepalive packets to keep a connection active although
  * no data is sent over it.
@@ -1490,20 +1956,69 @@ tcp_zero_window_probe(struct tcp_pcb *pcb)
   return err;
 }
 
-err_t ip_output_if(struct pbuf *data, struct ip_addr_t remote_ip, u16_t remote_port)
+/**
+ * Hand one segment to the output function as a single datagram. The pbuf
+ * chain is described by an ip_iovec per pbuf, so the payload is not copied.
+ * The TCP header at p->payload is a piece of its own, without a pbuf: it is
+ * rewritten in place when the segment is sent again.
+ */
+static err_t
+ip_output_if(struct pbuf *p, struct ip_addr_t remote_ip, u16_t remote_port)
 {
-    struct pbuf * p = data;
-    for (; p != NULL; p = p->next)
-    {
-        err_t err = ip_output(p->payload, p->len, remote_ip.addr, remote_port);
-        if (ERR_OK != err)
-        {
-            LWIP_DEBUGF(TCP_DEBUG, ("ip_output failed. err %d.\n", (int)err));
-            return err;
-        }
+  struct ip_iovec vec_buf[TCP_OUTPUT_IOV_MAX];
+  struct ip_iovec *vec = vec_buf;
+  struct pbuf *q;
+  u16_t hlen = (u16_t)(TCPH_HDRLEN((struct tcp_hdr *)p->payload) * 4);
+  size_t size;
+  int cnt, i;
+  err_t err;
+
+  /* small writes by reference chain a pbuf each up to the MSS, so there
+     may be hundreds */
+  cnt = 1;
+  for (q = p; q != NULL; q = q->next) {
+    cnt++;
+  }
+  if (cnt > TCP_OUTPUT_IOV_MAX) {
+    /* long chain of small writes */
+    size = (size_t)cnt * sizeof(struct ip_iovec);
+    if ((mem_size_t)size != size) {
+      return ERR_MEM;
     }
+    vec = (struct ip_iovec *)mem_malloc((mem_size_t)size);
+    if (vec == NULL) {
+      return ERR_MEM;
+    }
+  }
+  vec[0].base = p->payload;
+  vec[0].len = hlen;
+  vec[0].p = NULL;
+  for (q = p, i = 1; q != NULL; q = q->next) {
+    if (q == p) {
+      if (q->len == hlen) {
+        continue;
+      }
+      vec[i].base = (u8_t *)q->payload + hlen;
+      vec[i].len = q->len - hlen;
+    } else {
+      vec[i].base = q->payload;
+      vec[i].len = q->len;
+    }
+    vec[i].p = q;
+    i++;
+  }
+  LWIP_ASSERT("ip_output_if: pieces fit", i <= cnt);
+  cnt = i;
 
-    return ERR_OK;
+  err = ip_output(vec, cnt, remote_ip.addr, remote_port);
+  if (err != ERR_OK) {
+    LWIP_DEBUGF(TCP_DEBUG, ("ip_output failed. err %d.\n", (int)err));
+  }
+
+  if (vec != vec_buf) {
+    mem_free(vec);
+  }
+  return err;
 }
 
 #endif /* LWIP_TCP */
@@ -0,0 +1,200 @@
+/**
+ * @file
+ * RACK-TLP loss detection (RFC 8985)
+ *
+ * RACK takes a segment as lost by time rather than by counting dupacks:
+ * once a segment sent after it has been delivered (acked or SACKed) and
+ * more than that segment's RTT plus a reordering window has passed since
+ * it was sent. That also finds lost retransmissions, and losses with too
+ * few segments behind them for three dupacks. Segments that are not
+ * overdue yet get a timer (TCP_RTO_KIND_REO) for when they will be.
+ *
+ * When the last segments of a burst are lost nothing behind them can be
+ * delivered, so instead of waiting for the RTO a tail loss probe goes out
+ * about two SRTTs after the last transmission (TCP_RTO_KIND_TLP): the last
+ * segment again, and the peer's ACK for it shows the holes to RACK and
+ * SACK recovery.
+ *
+ * Both run on connections that use SACK, with a clock (tcp_set_clock()).
+ * The minimum RTT is the lowest unambiguous sample over the connection.
+ */
+
+#include "lwip/opt.h"
+
+#if LWIP_TCP && LWIP_TCP_RACK /* don't build if not configured for use in lwipopts.h */
+
+#include "lwip/tcp_impl.h"
+#include "lwip/tcp_cc.h"
+#include "lwip/debug.h"
+
+/** Whether the segment sent at t1 and ending at end1 was sent after the one
+    sent at t2 and ending at end2 */
+#define RACK_SENT_AFTER(t1, end1, t2, end2) \
+  ((s32_t)((t1) - (t2)) > 0 || ((t1) == (t2) && TCP_SEQ_GT(end1, end2)))
+
+#define RACK_SEG_END(seg) (ntohl((seg)->tcphdr->seqno) + TCP_TCPLEN(seg))
+
+/**
+ * seg was acked or SACKed: if it was sent after the segment RACK goes by so
+ * far, it is the one now.
+ */
+void
+tcp_rack_delivered(struct tcp_pcb *pcb, struct tcp_seg *seg)
+{
+  u32_t rtt, end;
+
+  if (!TCP_RACK(pcb) || seg->xmits == 0) {
+    return;
+  }
+  rtt = tcp_now_us() - seg->xmit_us;
+  if (seg->xmits > 1 && rtt < pcb->rack_min_rtt) {
+    /* too fast for the last transmission, an earlier one got through */
+    return;
+  }
+  rtt = LWIP_MAX(rtt, 1);
+  if (seg->xmits == 1 && (pcb->rack_min_rtt == 0 || rtt < pcb->rack_min_rtt)) {
+    pcb->rack_min_rtt = rtt;
+  }
+  end = RACK_SEG_END(seg);
+  if (pcb->rack_rtt == 0 ||
+      RACK_SENT_AFTER(seg->xmit_us, end, pcb->rack_xmit_us, pcb->rack_end)) {
+    pcb->rack_xmit_us = seg->xmit_us;
+    pcb->rack_end = end;
+    pcb->rack_rtt = rtt;
+  }
+}
+
+/**
+ * Mark the segments on unacked that RACK finds lost (TF_SEG_LOST). A lost
+ * retransmission loses TF_SEG_RETX so it goes out again.
+ *
+ * @return the number of segments marked; *timeout is set to the
+ *         microseconds until the next one would be, 0 if none
+ */
+static u16_t
+tcp_rack_detect(struct tcp_pcb *pcb, u32_t *timeout)
+{
+  struct tcp_seg *seg;
+  u32_t now, reo_wnd;
+  s32_t left;
+  u16_t lost = 0;
+
+  *timeout = 0;
+  if (pcb->rack_rtt == 0) {
+    return 0;
+  }
+  now = tcp_now_us();
+  /* a quarter of the minimum RTT, at most SRTT (RFC 8985, 6.2) */
+  reo_wnd = LWIP_MIN(pcb->rack_min_rtt / 4, (u32_t)pcb->sa >> 3);
+
+  for (seg = pcb->unacked; seg != NULL; seg = seg->next) {
+    if ((seg->flags & TF_SEG_SACKED) ||
+        (seg->flags & (TF_SEG_LOST | TF_SEG_RETX)) == TF_SEG_LOST) {
+      /* delivered, or waiting for its retransmission */
+      continue;
+    }
+    if (!RACK_SENT_AFTER(pcb->rack_xmit_us, pcb->rack_end,
+                         seg->xmit_us, RACK_SEG_END(seg))) {
+      continue;
+    }
+    left = (s32_t)(seg->xmit_us + pcb->rack_rtt + reo_wnd - now);
+    if (left <= 0) {
+      LWIP_DEBUGF(TCP_FR_DEBUG, ("tcp_rack_detect: %"U32_F" lost\n",
+                                 ntohl(seg->tcphdr->seqno)));
+      seg->flags = (u8_t)((seg->flags | TF_SEG_LOST) & ~TF_SEG_RETX);
+      lost++;
+    } else if ((u32_t)left > *timeout) {
+      *timeout = (u32_t)left;
+    }
+  }
+  return lost;
+}
+
+/** Recover what tcp_rack_detect() found, and wait for what it may find */
+static void
+tcp_rack_recover(struct tcp_pcb *pcb, u16_t lost, u32_t timeout)
+{
+  if (lost > 0) {
+    /* enter fast recovery unless in it, tcp_output() retransmits */
+    tcp_rexmit_fast(pcb);
+  }
+  if (timeout > 0) {
+    tcp_rto_arm(pcb, timeout, TCP_RTO_KIND_REO);
+  }
+}
+
+/**
+ * Loss detection for an incoming ACK, once tcp_receive() processed its
+ * cumulative ACK and SACK blocks. Ends the tail loss probe episode if the
+ * probe is acked.
+ */
+void
+tcp_rack_ack(struct tcp_pcb *pcb)
+{
+  u32_t timeout;
+  u16_t lost;
+
+  if (!TCP_RACK(pcb)) {
+    return;
+  }
+  if (pcb->tlp_out && TCP_SEQ_GEQ(pcb->lastack, pcb->tlp_end)) {
+    pcb->tlp_out = 0;
+    if (!(pcb->flags & TF_INFR)) {
+      /* The probe repaired a loss, with no D-SACK to tell it was not
+         needed: respond as to a fast recovery that is over (RFC 8985,
+         7.4.2). */
+      LWIP_DEBUGF(TCP_FR_DEBUG, ("tcp_rack_ack: loss probe acked\n"));
+      pcb->cc->loss(pcb);
+      pcb->cwnd = pcb->ssthresh;
+    }
+  }
+  if (pcb->unacked == NULL) {
+    return;
+  }
+  lost = tcp_rack_detect(pcb, &timeout);
+  tcp_rack_recover(pcb, lost, timeout);
+}
+
+/**
+ * The reordering window of a segment passed without an ACK for it.
+ *
+ * Called when the retransmission timer fires for TCP_RTO_KIND_REO.
+ */
+void
+tcp_rack_timeout(struct tcp_pcb *pcb)
+{
+  u32_t timeout;
+  u16_t lost;
+
+  tcp_rto_start(pcb);
+  lost = tcp_rack_detect(pcb, &timeout);
+  tcp_rack_recover(pcb, lost, timeout);
+  if (pcb->flags & TF_INFR) {
+    tcp_output(pcb);
+  }
+}
+
+/**
+ * The probe time-out (RFC 8985, 7.2) in microseconds if a tail loss probe
+ * is to be scheduled now, 0 if not: with data in flight outside of loss
+ * recovery, once per episode. Two SRTTs, plus the peer's delayed ACK when
+ * a single segment is in flight; not in turbo mode, which rudp sets on
+ * both ends and which acks at once.
+ */
+u32_t
+tcp_tlp_timeout(struct tcp_pcb *pcb)
+{
+  u32_t pto;
+
+  if (!TCP_RACK(pcb) || pcb->state < ESTABLISHED || pcb->unacked == NULL ||
+      (pcb->flags & TF_INFR) || pcb->nrtx != 0 || pcb->tlp_out || pcb->sa == 0) {
+    return 0;
+  }
+  pto = 2 * ((u32_t)pcb->sa >> 3);
+  if (pcb->unacked->next == NULL && !TCP_TURBO(pcb)) {
+    pto += TCP_TLP_DELACK * 1000UL;
+  }
+  return pto;
+}
+
+#endif /* LWIP_TCP && LWIP_TCP_RACK */
@@ -0,0 +1,195 @@
+/*
+ * bench.cpp
+ *
+ *  Echo throughput versus number of stack instances.
+ *
+ *  Every server thread runs its own stack (LWIP_PER_THREAD_STACK) with its
+ *  own UDP socket bound to the same port via SO_REUSEPORT, and datagrams
+ *  are steered to the owning shard by connection id. Every client
+ *  thread runs its own stack too, driven from its own poll() loop, and
+ *  keeps a fixed number of bytes in flight per connection, sending again
+ *  whatever was echoed back.
+ *
+ *  usage: test_bench [server_threads] [client_threads] [seconds] [port]
+ *                    [bytes_in_flight] [congestion_control]
+ *
+ *  Up to TCP_SND_BUF bytes in flight per connection, 512 by default; a few
+ *  MSS worth lets segments leave back to back (UDP_SEGMENT batching).
+ *  congestion_control is one of rudp_set_cc()'s names, newreno by default.
+ *
+ *  test_bench_uring is the same program over the io_uring transport
+ *  (RUDP_IO_URING).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "bench_util.h"
+
+#if !LWIP_PER_THREAD_STACK
+#error "test_bench needs LWIP_PER_THREAD_STACK enabled in lwipopts.h"
+#endif
+
+static const int CONNS_PER_CLIENT = 2;
+static const size_t MSG_LEN = 64;
+static size_t bytes_in_flight = MSG_LEN * 8;
+
+static volatile int run_flag = 1;
+static u16_t bench_port = 10001;
+static int servers = 1;
+static const char* bench_cc = "newreno";
+
+struct client_stat
+{
+    unsigned long long echoed_bytes;
+    int connected;
+};
+
+static LWIP_STACK_LOCAL struct client_stat* my_stat;
+static struct rudp_stats* server_stats;
+
+static void* server_main(void* arg)
+{
+    int index = (int)(long)arg;
+
+    if (rudp_init() != 0 || rudp_set_shard(index, servers) != 0)
+        exit(1);
+
+    rudp_fd_ptr fd = rudp_socket();
+    if (fd == NULL
+        || rudp_set_cc(fd, bench_cc) != 0
+        || rudp_bind(fd, "127.0.0.1", bench_port) != 0
+        || rudp_listen(fd, bench_accept, NULL) != 0)
+    {
+        fprintf(stderr, "server setup failed\n");
+        exit(1);
+    }
+    rudp_set_recv_iov(fd, bench_echo);
+    bench_serve(&run_flag);
+
+    server_stats[index] = *rudp_get_stats();
+    return NULL;
+}
+
+static err_t client_connected(rudp_fd_ptr fd, err_t err)
+{
+    static const char zeros[TCP_SND_BUF] = {0};
+
+    if (err != ERR_OK)
+        return err;
+    my_stat->connected++;
+    return rudp_send(fd, zeros, bytes_in_flight);
+}
+
+static void client_recv(rudp_fd_ptr fd, const void* buf, size_t len, err_t err)
+{
+    if (buf != NULL && len != 0)
+    {
+        my_stat->echoed_bytes += len;
+        rudp_send(fd, buf, len);
+    }
+}
+
+static void* client_main(void* arg)
+{
+    my_stat = (struct client_stat*)arg;
+
+    if (rudp_init() != 0)
+        exit(1);
+
+    for (int i = 0; i < CONNS_PER_CLIENT; i++)
+    {
+        rudp_fd_ptr fd = rudp_socket();
+        if (fd == NULL
+            || rudp_set_cc(fd, bench_cc) != 0
+            || rudp_connect(fd, "127.0.0.1", bench_port, client_connected, client_recv) != 0)
+        {
+            fprintf(stderr, "client setup failed\n");
+            exit(1);
+        }
+    }
+
+    /* clients run the stack from their own poll() loop */
+    bench_client_loop(&run_flag, NULL, NULL);
+    return NULL;
+}
+
+int main(int argc, const char* argv[])
+{
+    servers = argc > 1 ? atoi(argv[1]) : 1;
+    int clients = argc > 2 ? atoi(argv[2]) : 2 * servers;
+    int seconds = argc > 3 ? atoi(argv[3]) : 5;
+    if (argc > 4)
+        bench_port = (u16_t)atoi(argv[4]);
+    if (argc > 5)
+        bytes_in_flight = (size_t)atoi(argv[5]);
+    if (bytes_in_flight == 0 || bytes_in_flight > TCP_SND_BUF)
+        bytes_in_flight = TCP_SND_BUF;
+    if (argc > 6)
+        bench_cc = argv[6];
+
+    FILE* report = bench_report_open();
+    if (report == NULL)
+        return 1;
+
+    pthread_t* threads = new pthread_t[servers + clients];
+    struct client_stat* stats = new client_stat[clients];
+    memset(stats, 0, sizeof(client_stat) * clients);
+    server_stats = new rudp_stats[servers];
+
+    /* shards have to bind in index order */
+    for (int i = 0; i < servers; i++)
+        threads[i] = bench_server_start(server_main, (void*)(long)i);
+    for (int i = 0; i < clients; i++)
+        pthread_create(&threads[servers + i], NULL, client_main, &stats[i]);
+
+    /* warm up, then sample over the measurement window */
+    sleep(1);
+    unsigned long long start_bytes = 0;
+    for (int i = 0; i < clients; i++)
+        start_bytes += stats[i].echoed_bytes;
+    double start = bench_now_sec();
+    sleep(seconds);
+    unsigned long long end_bytes = 0;
+    int connected = 0;
+    for (int i = 0; i < clients; i++)
+    {
+        end_bytes += stats[i].echoed_bytes;
+        connected += stats[i].connected;
+    }
+    double elapsed = bench_now_sec() - start;
+
+    run_flag = 0;
+    for (int i = 0; i < servers + clients; i++)
+        pthread_join(threads[i], NULL);
+
+    double mbps = (end_bytes - start_bytes) / elapsed / (1024 * 1024);
+    fprintf(report, "servers %d clients %d connections %d/%d (%s): %.2f MB/s, %.0f msgs/s\n",
+            servers, clients, connected, clients * CONNS_PER_CLIENT, bench_cc,
+            mbps, (end_bytes - start_bytes) / elapsed / MSG_LEN);
+    unsigned long long rx_syscalls = 0, rx_packets = 0;
+    for (int i = 0; i < servers; i++)
+    {
+        rx_syscalls += server_stats[i].rx_syscalls;
+        rx_packets += server_stats[i].rx_packets;
+    }
+    unsigned long long tx_syscalls = 0, tx_packets = 0;
+    for (int i = 0; i < servers; i++)
+    {
+        tx_syscalls += server_stats[i].tx_syscalls;
+        tx_packets += server_stats[i].tx_packets;
+    }
+    fprintf(report, "server rx: %llu packets, %.3f syscalls/packet\n",
+            rx_packets, rx_packets ? (double)rx_syscalls / rx_packets : 0.0);
+    fprintf(report, "server tx: %llu packets, %.3f syscalls/packet\n",
+            tx_packets, tx_packets ? (double)tx_syscalls / tx_packets : 0.0);
+    fclose(report);
+
+    delete[] threads;
+    delete[] stats;
+    delete[] server_stats;
+    return 0;
+}
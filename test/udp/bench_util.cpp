@@ -0,0 +1,86 @@
+/*
+ * bench_util.cpp
+ *
+ *  See bench_util.h.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/time.h>
+
+#include "bench_util.h"
+
+/* servers that reached bench_serve() */
+static volatile int servers_ready;
+
+FILE* bench_report_open()
+{
+    fflush(stdout);
+    int out = dup(1);
+    if (out < 0 || freopen("/dev/null", "w", stdout) == NULL)
+        return NULL;
+    return fdopen(out, "w");
+}
+
+pthread_t bench_server_start(void* (*fn)(void*), void* arg)
+{
+    pthread_t thread;
+    int ready = servers_ready;
+
+    if (pthread_create(&thread, NULL, fn, arg) != 0)
+    {
+        fprintf(stderr, "pthread_create failed\n");
+        exit(1);
+    }
+    while (servers_ready == ready)
+        usleep(1000);
+    return thread;
+}
+
+void bench_serve(volatile int* run)
+{
+    __sync_fetch_and_add(&servers_ready, 1);
+    while (*run)
+        rudp_update();
+}
+
+void bench_client_loop(volatile int* run, void (*refill)(void*), void* arg)
+{
+    struct pollfd pfd;
+    pfd.fd = rudp_get_fd();
+    pfd.events = POLLIN;
+    while (*run)
+    {
+        int n = poll(&pfd, 1, rudp_next_timeout());
+        if (n > 0)
+            rudp_process_ready();
+        if (refill != NULL)
+            refill(arg);
+        rudp_process_timers();
+    }
+}
+
+err_t bench_accept(rudp_fd_ptr fd, err_t err)
+{
+    return ERR_OK;
+}
+
+void bench_echo(rudp_fd_ptr fd, const struct rudp_iovec* iov, int iovcnt, rudp_rx_ptr rx, err_t err)
+{
+    if (rx == NULL)
+    {
+        rudp_close(fd);
+        return;
+    }
+    for (int i = 0; i < iovcnt; i++)
+        rudp_send(fd, iov[i].base, iov[i].len);
+    rudp_release(rx);
+}
+
+double bench_now_sec()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
@@ -0,0 +1,48 @@
+/*
+ * bench_util.h
+ *
+ *  What the benchmark programs share: a report stream next to the traces,
+ *  starting server threads in order and driving their stack instances,
+ *  and an echo server.
+ */
+
+#ifndef BENCH_UTIL_H
+#define BENCH_UTIL_H
+
+#include <stdio.h>
+#include <pthread.h>
+
+#include "rudp.h"
+
+/*
+ * The stack and rudp.c trace every packet to stdout: send stdout to
+ * /dev/null and return a stream on the real one for the results, NULL on
+ * failure.
+ */
+FILE* bench_report_open();
+
+/*
+ * Start a server thread running fn(arg) and wait until it calls
+ * bench_serve(), so that servers started one after another bind in that
+ * order (shards have to).
+ */
+pthread_t bench_server_start(void* (*fn)(void*), void* arg);
+
+/* from a server thread, once it listens: rudp_update() while *run is set */
+void bench_serve(volatile int* run);
+
+/*
+ * From a client thread: drive its instance from a poll() loop while *run
+ * is set. refill, if not NULL, is called with arg after input was
+ * processed and before output is flushed.
+ */
+void bench_client_loop(volatile int* run, void (*refill)(void*), void* arg);
+
+/* a listener that takes every connection, and echoes what it receives
+   straight out of the receive buffers */
+err_t bench_accept(rudp_fd_ptr fd, err_t err);
+void bench_echo(rudp_fd_ptr fd, const struct rudp_iovec* iov, int iovcnt, rudp_rx_ptr rx, err_t err);
+
+double bench_now_sec();
+
+#endif /* BENCH_UTIL_H */
@@ -0,0 +1,219 @@
+/*
+ * latency.cpp
+ *
+ *  Request/response latency under emulated loss, default versus turbo
+ *  mode (rudp_set_turbo()), and turbo mode with forward error correction
+ *  (rudp_set_fec()) where it is built.
+ *
+ *  One server thread echoes, one client thread sends a small request and
+ *  waits for the whole echo before sending the next one. With a single
+ *  segment in flight a lost datagram is only recovered by the
+ *  retransmission timer, so the tail of the distribution is the RTO. Both
+ *  runs drop the same share of datagrams (rudp_set_loss()), from the
+ *  moment the connection is up.
+ *
+ *  usage: test_latency [requests] [loss_per_mille] [port] [message_bytes]
+ *                      [fec_group]
+ *
+ *  5000 requests of 64 bytes and 10 per mille by default; run i uses
+ *  port + i. Messages of a few MSS show tail losses, which the tail loss
+ *  probes of LWIP_TCP_RACK repair without waiting for the RTO. The FEC run
+ *  sends one parity datagram per fec_group (4) segments, or per request if
+ *  that is shorter.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <algorithm>
+
+#include "bench_util.h"
+
+#if !LWIP_PER_THREAD_STACK || !LWIP_TCP_TURBO
+#error "test_latency needs LWIP_PER_THREAD_STACK and LWIP_TCP_TURBO enabled in lwipopts.h"
+#endif
+
+static size_t msg_len = 64;
+static int requests = 5000;
+static int loss = 10;
+
+struct run
+{
+    u16_t port;
+    int turbo;
+    int fec;
+    volatile int server_run;
+    volatile int client_run;
+    int sent;
+    size_t echoed;
+    unsigned long long start_us;
+    unsigned long long* samples;
+    int count;
+};
+
+static LWIP_STACK_LOCAL struct run* my_run;
+
+static unsigned long long now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void* server_main(void* arg)
+{
+    struct run* r = (struct run*)arg;
+
+    if (rudp_init() != 0)
+        exit(1);
+
+    rudp_fd_ptr fd = rudp_socket();
+    if (fd == NULL)
+        exit(1);
+    rudp_set_turbo(fd, r->turbo);
+#if LWIP_TCP_FEC
+    rudp_set_fec(fd, r->fec, r->fec > 0);
+#endif
+    if (rudp_bind(fd, "127.0.0.1", r->port) != 0
+        || rudp_listen(fd, bench_accept, NULL) != 0)
+    {
+        fprintf(stderr, "server setup failed\n");
+        exit(1);
+    }
+    rudp_set_recv_iov(fd, bench_echo);
+    bench_serve(&r->server_run);
+    return NULL;
+}
+
+static err_t send_request(rudp_fd_ptr fd)
+{
+    static const char zeros[TCP_SND_BUF] = {0};
+
+    my_run->echoed = 0;
+    my_run->start_us = now_us();
+    my_run->sent++;
+    return rudp_send(fd, zeros, msg_len);
+}
+
+static err_t client_connected(rudp_fd_ptr fd, err_t err)
+{
+    if (err != ERR_OK)
+        return err;
+    rudp_set_loss(loss);
+    return send_request(fd);
+}
+
+static void client_recv(rudp_fd_ptr fd, const void* buf, size_t len, err_t err)
+{
+    struct run* r = my_run;
+
+    if (buf == NULL || len == 0)
+        return;
+    r->echoed += len;
+    if (r->echoed < msg_len)
+        return;
+
+    r->samples[r->count++] = now_us() - r->start_us;
+    if (r->sent < requests)
+        send_request(fd);
+    else
+        r->client_run = 0;
+}
+
+static void* client_main(void* arg)
+{
+    my_run = (struct run*)arg;
+
+    if (rudp_init() != 0)
+        exit(1);
+
+    rudp_fd_ptr fd = rudp_socket();
+    if (fd == NULL)
+        exit(1);
+    rudp_set_turbo(fd, my_run->turbo);
+#if LWIP_TCP_FEC
+    rudp_set_fec(fd, my_run->fec, my_run->fec > 0);
+#endif
+    if (rudp_connect(fd, "127.0.0.1", my_run->port, client_connected, client_recv) != 0)
+    {
+        fprintf(stderr, "client setup failed\n");
+        exit(1);
+    }
+
+    bench_client_loop(&my_run->client_run, NULL, NULL);
+    return NULL;
+}
+
+static double percentile(unsigned long long* samples, int count, double p)
+{
+    int i = (int)(count * p);
+    if (i >= count)
+        i = count - 1;
+    return samples[i] / 1000.0;
+}
+
+static void run(FILE* report, struct run* r)
+{
+    pthread_t server, client;
+
+    r->samples = new unsigned long long[requests];
+    r->server_run = 1;
+    r->client_run = 1;
+    server = bench_server_start(server_main, r);
+    pthread_create(&client, NULL, client_main, r);
+    pthread_join(client, NULL);
+    r->server_run = 0;
+    pthread_join(server, NULL);
+    rudp_set_loss(0);
+
+    std::sort(r->samples, r->samples + r->count);
+    fprintf(report, "%-7s %d requests of %zu bytes, %d/1000 lost: p50 %.3f ms, p99 %.3f ms, p99.9 %.3f ms, max %.3f ms\n",
+            r->fec ? "fec" : r->turbo ? "turbo" : "default", r->count, msg_len, loss,
+            percentile(r->samples, r->count, 0.5),
+            percentile(r->samples, r->count, 0.99),
+            percentile(r->samples, r->count, 0.999),
+            r->samples[r->count - 1] / 1000.0);
+    delete[] r->samples;
+}
+
+int main(int argc, const char* argv[])
+{
+    if (argc > 1)
+        requests = atoi(argv[1]);
+    if (argc > 2)
+        loss = atoi(argv[2]);
+    u16_t port = argc > 3 ? (u16_t)atoi(argv[3]) : 10101;
+    if (argc > 4)
+        msg_len = (size_t)atoi(argv[4]);
+    int fec = argc > 5 ? atoi(argv[5]) : 4;
+    if (requests <= 0)
+        requests = 1;
+    if (msg_len == 0 || msg_len > TCP_SND_BUF)
+        msg_len = TCP_SND_BUF;
+#if LWIP_TCP_FEC
+    if (fec < 1 || fec > TCP_FEC_GROUP_MAX)
+        fec = 4;
+    const int nruns = 3;
+#else
+    const int nruns = 2;
+#endif
+
+    FILE* report = bench_report_open();
+    if (report == NULL)
+        return 1;
+
+    struct run runs[3];
+    memset(runs, 0, sizeof(runs));
+    for (int i = 0; i < nruns; i++)
+    {
+        runs[i].port = (u16_t)(port + i);
+        runs[i].turbo = i > 0;
+        runs[i].fec = i == 2 ? fec : 0;
+        run(report, &runs[i]);
+        fflush(report);
+    }
+    fclose(report);
+    return 0;
+}
@@ -7,6 +7,7 @@
 
 //#include <cygwin/in.h>
 //#include <cygwin/socket.h>
+#define _GNU_SOURCE /* recvmmsg */
 #include "rudp.h"
 
 #include <arpa/inet.h>
@@ -16,21 +17,212 @@
 #include <string.h>
 #include <sys/errno.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
 #include <assert.h>
+#include <linux/filter.h>
+#include <netinet/udp.h>
 
 
 #include "lwip/tcp_impl.h"
 #include "lwip/pbuf.h"
 #include "lwip/memp.h"
+#include "lwip/init.h"
+#include "lwip/stack.h"
+
+#if RUDP_IO_URING
+#include "rudp_uring.h"
+#endif
 
-int udp_fd = -1;
 int uid = 1;
 
-struct timeval last_ts;
-static const unsigned int TIME_INTERVAL = 250000;
-struct timeval timeout;
+/* largest datagram we accept: header, options and one MSS of data */
+#define RUDP_MAX_DGRAM  (TCP_HLEN + 40 + TCP_MSS)
+#define RUDP_MAX_IOV    ((RUDP_MAX_DGRAM + PBUF_POOL_BUFSIZE - 1) / PBUF_POOL_BUFSIZE)
+/* iovecs and pbuf references of the egress queue, a header and a data piece
+   for most datagrams */
+#define RUDP_SEND_IOV   (4 * RUDP_SEND_BATCH)
+
+#define RUDP_RX_GRO (RUDP_UDP_GRO && !RUDP_IO_URING)
+
+#if RUDP_RX_GRO
+#if !LWIP_SUPPORT_CUSTOM_PBUF
+#error "RUDP_UDP_GRO needs LWIP_SUPPORT_CUSTOM_PBUF"
+#endif
+#if RUDP_GRO_BATCH > RUDP_RECV_BATCH
+#error "RUDP_GRO_BATCH shares the RUDP_RECV_BATCH receive slots"
+#endif
+
+/* segments of one UDP_GRO buffer handed out without copying, the rest
+   are copied into pool pbufs */
+#define RUDP_GRO_MAX_SEGS 64
+/* a buffer of fewer segments is copied into pool pbufs, each segment would
+   keep all 64 KB of it alive */
+#define RUDP_GRO_MIN_REF_SEGS 8
+/* buffers that segments keep alive, on ooseq or until rudp_release(), at
+   most; past that the segments are copied, so a peer can pin no more than
+   this times 64 KB per instance */
+#define RUDP_GRO_MAX_HELD 16
+
+/*
+ * A UDP_GRO receive buffer. Its datagrams go to tcp_input() as custom pbufs
+ * pointing into data, each holding a reference; the buffer is recycled
+ * once the slot and all of them have let go.
+ */
+struct rx_gro_buf
+{
+    int refs;
+    struct rx_gro_seg
+    {
+        struct pbuf_custom pc;
+        struct rx_gro_buf *owner;
+    } segs[RUDP_GRO_MAX_SEGS];
+    char data[65536];
+};
+#endif
+
+/* rudp_set_loss() */
+static int loss_per_mille;
+
+/* rudp_set_delay(): datagrams held back, in the order they are due */
+struct delayed_dgram
+{
+    struct delayed_dgram *next;
+    unsigned long long due;
+    u32_t remote_ip;
+    u16_t remote_port;
+    int len;
+    char data[];
+};
+static int delay_ms;
+
+/*
+ * One instance: its lwip stack, socket, event loop and batches. rudp_init()
+ * allocates it and makes it current, every other function works on the
+ * current one (rudp_set_instance()). The names below reach into it.
+ */
+struct rudp_instance
+{
+    struct lwip_stack *stack;
+    int udp_fd;
+
+    /* monotonic ms of the next tcp_tmr() tick, 0 while no pcb needs timers */
+    unsigned long long next_tick;
+    /* monotonic ms by which tcp_rto_tmr() has to run, 0 if no RTO is pending */
+    unsigned long long next_rto;
+#if RUDP_IO_URING
+    struct rudp_uring *uring;
+#else
+    /* rudp_update() waits on the socket and a timerfd that ticks tcp_tmr() */
+    int epoll_fd;
+    int timer_fd;
+    /* deadline the timerfd is armed for */
+    unsigned long long timer_armed;
+#endif
+    /* number of instances sharing the port, see rudp_set_shard() */
+    int shard_count;
+
+#if !RUDP_IO_URING
+    /* receive slots for recvmmsg(), each backed by a pool pbuf chain that the
+       kernel fills directly; with PBUF_POOL_BUFSIZE covering RUDP_MAX_DGRAM
+       that is a single pbuf */
+    struct pbuf *rx_pbufs[RUDP_RECV_BATCH];
+    struct mmsghdr rx_msgs[RUDP_RECV_BATCH];
+    struct iovec rx_iovs[RUDP_RECV_BATCH][RUDP_MAX_IOV];
+    struct sockaddr_in rx_addrs[RUDP_RECV_BATCH];
+#endif
+
+#if RUDP_RX_GRO
+    struct rx_gro_buf *rx_gro[RUDP_GRO_BATCH];
+    char rx_cmsgs[RUDP_GRO_BATCH][CMSG_SPACE(sizeof(int))];
+    /* one spare buffer, so a split does not cost a malloc() */
+    struct rx_gro_buf *gro_spare;
+    /* buffers taken over by their segments, see RUDP_GRO_MAX_HELD */
+    int gro_held;
+    /* kernel takes UDP_GRO, probed by rudp_init() */
+    int gro_enabled;
+#endif
+
+    /* egress queue, flushed with one sendmmsg(); slots take consecutive
+       iovecs, so a slot can grow into a UDP_SEGMENT super-buffer. Pieces
+       without a pbuf (TCP headers) are copied to tx_buf, the data stays in
+       its pbufs, referenced in tx_refs until the kernel is done with it */
+    char tx_buf[RUDP_SEND_BATCH * RUDP_MAX_DGRAM];
+    int tx_buf_used;
+    struct mmsghdr tx_msgs[RUDP_SEND_BATCH];
+    struct iovec tx_iovs[RUDP_SEND_IOV];
+    int tx_iov_used;
+    struct pbuf *tx_refs[RUDP_SEND_IOV];
+    int tx_ref_count;
+    struct sockaddr_in tx_addrs[RUDP_SEND_BATCH];
+    /* bytes in each slot, its datagrams and their size, the last one may be
+       shorter */
+    int tx_len[RUDP_SEND_BATCH];
+    u16_t tx_segs[RUDP_SEND_BATCH];
+    u16_t tx_seg_size[RUDP_SEND_BATCH];
+    char tx_cmsgs[RUDP_SEND_BATCH][CMSG_SPACE(sizeof(uint16_t))];
+    int tx_count;
+    /* kernel takes UDP_SEGMENT, probed by rudp_init() */
+    int gso_enabled;
+#if RUDP_IO_URING
+    /* slots handed to the kernel, reused once all sends completed */
+    int tx_submitted;
+#endif
+
+    struct rudp_stats stats;
+
+    unsigned int loss_seed;
+    struct delayed_dgram *delay_head;
+    struct delayed_dgram *delay_tail;
+};
+
+/* the calling thread's current instance, see LWIP_PER_THREAD_STACK */
+static LWIP_STACK_LOCAL struct rudp_instance *rudp_cur;
+
+#define udp_fd          (rudp_cur->udp_fd)
+#define next_tick       (rudp_cur->next_tick)
+#define next_rto        (rudp_cur->next_rto)
+#define uring           (rudp_cur->uring)
+#define epoll_fd        (rudp_cur->epoll_fd)
+#define timer_fd        (rudp_cur->timer_fd)
+#define timer_armed     (rudp_cur->timer_armed)
+#define shard_count     (rudp_cur->shard_count)
+#define rx_pbufs        (rudp_cur->rx_pbufs)
+#define rx_msgs         (rudp_cur->rx_msgs)
+#define rx_iovs         (rudp_cur->rx_iovs)
+#define rx_addrs        (rudp_cur->rx_addrs)
+#define rx_gro          (rudp_cur->rx_gro)
+#define rx_cmsgs        (rudp_cur->rx_cmsgs)
+#define gro_spare       (rudp_cur->gro_spare)
+#define gro_held        (rudp_cur->gro_held)
+#define gro_enabled     (rudp_cur->gro_enabled)
+#define tx_buf          (rudp_cur->tx_buf)
+#define tx_buf_used     (rudp_cur->tx_buf_used)
+#define tx_msgs         (rudp_cur->tx_msgs)
+#define tx_iovs         (rudp_cur->tx_iovs)
+#define tx_iov_used     (rudp_cur->tx_iov_used)
+#define tx_refs         (rudp_cur->tx_refs)
+#define tx_ref_count    (rudp_cur->tx_ref_count)
+#define tx_addrs        (rudp_cur->tx_addrs)
+#define tx_len          (rudp_cur->tx_len)
+#define tx_segs         (rudp_cur->tx_segs)
+#define tx_seg_size     (rudp_cur->tx_seg_size)
+#define tx_cmsgs        (rudp_cur->tx_cmsgs)
+#define tx_count        (rudp_cur->tx_count)
+#define gso_enabled     (rudp_cur->gso_enabled)
+#define tx_submitted    (rudp_cur->tx_submitted)
+#define loss_seed       (rudp_cur->loss_seed)
+#define delay_head      (rudp_cur->delay_head)
+#define delay_tail      (rudp_cur->delay_tail)
+
+#if !RUDP_IO_URING
 static const int max_loop = 1000;
+/* descriptors in the event set: the socket and the timer */
+#define RUDP_MAX_EVENTS 2
+#endif
 
 void
 rudp_error(void *arg, err_t err);
@@ -42,21 +234,18 @@ err_t on_recv(void *arg, rudp_pcb tpcb, struct pbuf *p, err_t err);
 err_t on_connect(void *arg, rudp_pcb tpcb, err_t err);
 err_t on_accept(void *arg, rudp_pcb newpcb, err_t err);
 void rudp_free(rudp_fd_ptr fd);
-int ip_output_if(char *p, int len, u32_t remote_ip, u16_t remote_port);
-
-void init_timer()
-{
-    gettimeofday(&last_ts, NULL);
-}
+int ip_output_if(const struct ip_iovec *vec, int cnt, u32_t remote_ip, u16_t remote_port);
+static u32_t clock_us();
+static void delay_release(unsigned long long now);
 
 void tcp_timer()
 {
-    printf("recvfrom timeout\n");
-
     //		usleep(250*1000);
     /* timer still needed? */
     if (tcp_active_pcbs || tcp_tw_pcbs)
         tcp_tmr();
+    /* retransmits and delayed ACKs of this tick */
+    rudp_flush();
 }
 
 int bind_udp(in_addr_t s_addr, u16_t port)
@@ -76,102 +265,635 @@ int bind_udp(in_addr_t s_addr, u16_t port)
     return 0;
 }
 
+/*
+ * Classic BPF program for SO_ATTACH_REUSEPORT_CBPF. It runs on the UDP
+ * payload, i.e. the struct tcp_hdr, and returns the index of the socket in
+ * the reuseport group that owns the connection: connid2 % shards. Packets of
+ * connections that have no connid2 yet (SYN) go to connid1 % shards, which is
+ * stable across retransmits and NAT rebinding as well.
+ */
+static int attach_shard_filter(int shards)
+{
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+    struct sock_filter code[] = {
+        /* A = connid2 */
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct tcp_hdr, connid2)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 1),
+        /* A = connid1 */
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct tcp_hdr, connid1)),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (u32_t)shards),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+    };
+    struct sock_fprog prog;
+    prog.len = sizeof(code) / sizeof(code[0]);
+    prog.filter = code;
+
+    if (setsockopt(udp_fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) != 0)
+    {
+        perror("setsockopt SO_ATTACH_REUSEPORT_CBPF failed\n");
+        return -1;
+    }
+    return 0;
+#else
+    printf("SO_ATTACH_REUSEPORT_CBPF not supported, using kernel hash\n");
+    return 0;
+#endif
+}
+
 int rudp_init()
 {
-    tcp_init(ip_output_if);
-    pbuf_init();
-    memp_init();
+    struct rudp_instance *inst = (struct rudp_instance *)calloc(1, sizeof(struct rudp_instance));
+    if (inst == NULL)
+        return -1;
+    rudp_cur = inst;
+    udp_fd = -1;
+#if !RUDP_IO_URING
+    epoll_fd = -1;
+    timer_fd = -1;
+#endif
+    shard_count = 1;
+    loss_seed = 1;
+
+    /* a stack instance of its own, current from now on */
+    if (lwip_init(ip_output_if) != ERR_OK)
+        return -1;
+    inst->stack = lwip_stack_get();
+    /* RTT and RTO in real time rather than timer ticks */
+    tcp_set_clock(clock_us);
 
-    udp_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    udp_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (udp_fd < 0)
     {
         perror("cannot create socket\n");
         return -1;
     }
 
-    timeout.tv_sec = 0;
-    timeout.tv_usec = TIME_INTERVAL;
-    int ret = setsockopt(udp_fd, SOL_SOCKET, SO_RCVTIMEO,(char*)&timeout,sizeof(timeout));
-    if (ret != 0)
+#ifdef SO_REUSEPORT
+    /* let the instances on other threads bind the same port, the kernel
+       then spreads incoming datagrams over their sockets */
+    int on = 1;
+    if (setsockopt(udp_fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0)
     {
-        perror("setsockopt failed\n");
+        perror("setsockopt SO_REUSEPORT failed\n");
         return -1;
     }
-
-    init_timer();
+#endif
+
+    int rcvbuf = RUDP_SOCK_RCVBUF;
+    if (setsockopt(udp_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) != 0)
+        perror("setsockopt SO_RCVBUF failed\n");
+
+    tx_count = 0;
+    tx_buf_used = 0;
+    tx_iov_used = 0;
+    tx_ref_count = 0;
+    gso_enabled = 0;
+#if RUDP_UDP_GSO
+    int gso_size = 0;
+    socklen_t optlen = sizeof(gso_size);
+    if (getsockopt(udp_fd, SOL_UDP, UDP_SEGMENT, &gso_size, &optlen) == 0)
+        gso_enabled = 1;
+#endif
+
+#if RUDP_RX_GRO
+    int gro_on = 1;
+    gro_enabled = setsockopt(udp_fd, SOL_UDP, UDP_GRO, &gro_on, sizeof(gro_on)) == 0;
+#endif
+
+#if RUDP_IO_URING
+    uring = rudp_uring_init(udp_fd);
+    if (uring == NULL)
+        return -1;
+    tx_submitted = 0;
+#else
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (timer_fd < 0 || epoll_fd < 0)
+    {
+        perror("cannot create event loop\n");
+        return -1;
+    }
+    next_tick = 0;
+    timer_armed = 0;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = udp_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, udp_fd, &ev) != 0)
+    {
+        perror("epoll_ctl failed\n");
+        return -1;
+    }
+    ev.data.fd = timer_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev) != 0)
+    {
+        perror("epoll_ctl failed\n");
+        return -1;
+    }
+#endif
 
     return 0;
 }
 
-int rudp_update()
+#if !RUDP_IO_URING
+#if RUDP_RX_GRO
+static struct rx_gro_buf *gro_buf_get()
 {
-    int udp_process_count = 0;
-    const int BUFSIZE = 64*1024;
-    char buf[BUFSIZE];
+    struct rx_gro_buf *b = gro_spare;
+    if (b != NULL)
+        gro_spare = NULL;
+    else if ((b = (struct rx_gro_buf *)malloc(sizeof(*b))) == NULL)
+        return NULL;
+    b->refs = 1;
+    return b;
+}
 
-    struct sockaddr_in remaddr;     /* remote address */
-    static socklen_t addrlen = sizeof(remaddr);
+static void gro_buf_put(struct rx_gro_buf *b)
+{
+    if (--b->refs > 0)
+        return;
+    /* only buffers the slot gave up get here */
+    gro_held--;
+    if (gro_spare == NULL)
+        gro_spare = b;
+    else
+        free(b);
+}
+
+static void gro_seg_free(struct pbuf *p)
+{
+    gro_buf_put(((struct rx_gro_seg *)p)->owner);
+}
+
+/* Point the receive slots at UDP_GRO buffers. Returns the number of leading
+   slots ready for recvmmsg(). */
+static int rx_prepare_gro()
+{
+    int i;
+    for (i = 0; i < RUDP_GRO_BATCH; i++)
+    {
+        if (rx_gro[i] == NULL && (rx_gro[i] = gro_buf_get()) == NULL)
+            break;
+
+        rx_iovs[i][0].iov_base = rx_gro[i]->data;
+        rx_iovs[i][0].iov_len = sizeof(rx_gro[i]->data);
+
+        struct msghdr *hdr = &rx_msgs[i].msg_hdr;
+        memset(hdr, 0, sizeof(*hdr));
+        hdr->msg_name = &rx_addrs[i];
+        hdr->msg_namelen = sizeof(rx_addrs[i]);
+        hdr->msg_iov = rx_iovs[i];
+        hdr->msg_iovlen = 1;
+        hdr->msg_control = rx_cmsgs[i];
+        hdr->msg_controllen = sizeof(rx_cmsgs[i]);
+    }
+    return i;
+}
+
+/*
+ * Feed what landed in GRO slot i to tcp_input(), cut at the gso_size the
+ * kernel reports. The segments of a full enough buffer take it over, up to
+ * RUDP_GRO_MAX_HELD buffers; others are copied out and the slot keeps its
+ * buffer. Returns the number of datagrams.
+ */
+static int rx_input_gro(int i, int len)
+{
+    struct msghdr *hdr = &rx_msgs[i].msg_hdr;
+    struct rx_gro_buf *b = rx_gro[i];
+    struct ip_addr_t ipaddr;
+    ipaddr.addr = rx_addrs[i].sin_addr.s_addr;
+    u16_t port = ntohs(rx_addrs[i].sin_port);
+
+    int seg_size = len;
+    struct cmsghdr *cm;
+    for (cm = CMSG_FIRSTHDR(hdr); cm != NULL; cm = CMSG_NXTHDR(hdr, cm))
+    {
+        if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO)
+            memcpy(&seg_size, CMSG_DATA(cm), sizeof(seg_size));
+    }
+    if (seg_size <= 0 || seg_size > len)
+        seg_size = len;
+
+    int by_ref = (len + seg_size - 1) / seg_size >= RUDP_GRO_MIN_REF_SEGS
+        && gro_held < RUDP_GRO_MAX_HELD;
+    if (by_ref)
+    {
+        /* the slot's reference is dropped once all segments are out */
+        rx_gro[i] = NULL;
+        gro_held++;
+    }
+
+    struct pbuf *p;
+    int n = 0, off;
+    for (off = 0; off < len; off += seg_size, n++)
+    {
+        int seg_len = len - off < seg_size ? len - off : seg_size;
+        if (by_ref && n < RUDP_GRO_MAX_SEGS)
+        {
+            struct rx_gro_seg *seg = &b->segs[n];
+            seg->owner = b;
+            seg->pc.custom_free_function = gro_seg_free;
+            p = pbuf_alloced_custom(PBUF_RAW, seg_len, PBUF_REF, &seg->pc,
+                                    b->data + off, seg_len);
+            b->refs++;
+        }
+        else
+        {
+            p = pbuf_alloc(PBUF_RAW, seg_len, PBUF_POOL);
+            if (p == NULL)
+            {
+                printf("no pbufs for receive, drop\n");
+                continue;
+            }
+            pbuf_take(p, b->data + off, seg_len);
+        }
+        tcp_input(ipaddr, port, p);
+    }
+    if (by_ref)
+        gro_buf_put(b);
+
+    return n;
+}
+#endif
+
+/* Refill the receive slots with pool pbufs and point their iovecs at the
+   chains. Returns the number of leading slots ready for recvmmsg(). */
+static int rx_prepare()
+{
+    int i;
+#if RUDP_RX_GRO
+    if (gro_enabled)
+        return rx_prepare_gro();
+#endif
+    for (i = 0; i < RUDP_RECV_BATCH; i++)
+    {
+        if (rx_pbufs[i] == NULL)
+        {
+            rx_pbufs[i] = pbuf_alloc(PBUF_RAW, RUDP_MAX_DGRAM, PBUF_POOL);
+            if (rx_pbufs[i] == NULL)
+                break;
+        }
+
+        size_t iovlen = 0;
+        struct pbuf *q;
+        for (q = rx_pbufs[i]; q != NULL && iovlen < RUDP_MAX_IOV; q = q->next)
+        {
+            rx_iovs[i][iovlen].iov_base = q->payload;
+            rx_iovs[i][iovlen].iov_len = q->len;
+            iovlen++;
+        }
+
+        struct msghdr *hdr = &rx_msgs[i].msg_hdr;
+        memset(hdr, 0, sizeof(*hdr));
+        hdr->msg_name = &rx_addrs[i];
+        hdr->msg_namelen = sizeof(rx_addrs[i]);
+        hdr->msg_iov = rx_iovs[i];
+        hdr->msg_iovlen = iovlen;
+    }
+    return i;
+}
+
+#endif
+
+static unsigned long long now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static u32_t clock_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u32_t)((unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+/*
+ * Tick every TCP_TMR_INTERVAL while some pcb has timers to run. Deadlines
+ * advance by the interval, so ticks do not drift with processing time, and
+ * an instance without connections has no deadline at all. Retransmission
+ * timeouts get a deadline of their own, to the ms.
+ */
+static void timer_schedule(unsigned long long now)
+{
+    if (tcp_active_pcbs == NULL && tcp_tw_pcbs == NULL)
+        next_tick = 0;
+    else if (next_tick == 0)
+        next_tick = now + TCP_TMR_INTERVAL;
+
+    s32_t rto = tcp_rto_next();
+    next_rto = rto < 0 ? 0 : now + (rto + 999) / 1000;
+}
+
+/* the earliest of next_tick, next_rto and the next delayed datagram, 0 if
+   none is set */
+static unsigned long long timer_deadline()
+{
+    unsigned long long deadline = next_tick;
+    if (next_rto != 0 && (deadline == 0 || next_rto < deadline))
+        deadline = next_rto;
+    if (delay_head != NULL && (deadline == 0 || delay_head->due < deadline))
+        deadline = delay_head->due;
+    return deadline;
+}
+
+#if !RUDP_IO_URING
+/* arm the timerfd for rudp_update() when the deadline moved */
+static void timer_arm()
+{
+    unsigned long long deadline = timer_deadline();
+    if (deadline == timer_armed)
+        return;
+
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (deadline != 0)
+    {
+        its.it_value.tv_sec = deadline / 1000;
+        its.it_value.tv_nsec = (deadline % 1000) * 1000000L;
+    }
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) != 0)
+    {
+        perror("timerfd_settime failed\n");
+        return;
+    }
+    timer_armed = deadline;
+}
+
+#endif
+
+int rudp_next_timeout()
+{
+    unsigned long long now = now_ms();
+    timer_schedule(now);
+    unsigned long long deadline = timer_deadline();
+    if (deadline == 0)
+        return -1;
+    return deadline > now ? (int)(deadline - now) : 0;
+}
+
+/* one tcp_tmr() per elapsed interval, then the due retransmissions and
+   delayed datagrams */
+static int timer_run()
+{
+    int ticks = 0;
+    unsigned long long now = now_ms();
+
+    while (next_tick != 0 && now >= next_tick)
+    {
+        tcp_timer();
+        next_tick += TCP_TMR_INTERVAL;
+        ticks++;
+    }
+    tcp_rto_tmr();
+    delay_release(now);
+    timer_schedule(now);
+
+    return ticks;
+}
+
+int rudp_process_timers()
+{
+    int ticks = timer_run();
+    rudp_flush();
+    return ticks;
+}
+
+#if !RUDP_IO_URING
+/* take what is queued on a readable socket, at most max_loop datagrams */
+static int rx_drain(int fd)
+{
+    int udp_process_count = 0;
 
     do
     {
-        int recvlen = recvfrom(udp_fd, buf, BUFSIZE, 0, (struct sockaddr *)&remaddr, &addrlen);
-        if (recvlen < 0)
+        int slots = rx_prepare();
+        if (slots == 0)
         {
-            // timeout
-            if (errno == EAGAIN || errno == EWOULDBLOCK)
-                tcp_timer();
-            else
-                perror("recvfrom failed\n");
-            return -1;
+            printf("no pbufs for receive\n");
+            break;
         }
 
-        struct pbuf *mybuf = pbuf_alloc(PBUF_TRANSPORT, recvlen, PBUF_POOL);
-        assert (mybuf != NULL);
+        int n = recvmmsg(fd, rx_msgs, slots, MSG_DONTWAIT, NULL);
+        rudp_cur->stats.rx_syscalls++;
+        if (n < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                perror("recvmmsg failed\n");
+            break;
+        }
 
-        int copy_len = 0;
-        struct pbuf *tmp_buf = mybuf;
-        while (tmp_buf != NULL)
+        int i, count = 0;
+        for (i = 0; i < n; i++)
         {
-            memcpy(tmp_buf->payload, buf+copy_len, mybuf->len);
-            copy_len += tmp_buf->len;
-            tmp_buf = tmp_buf->next;
+#if RUDP_RX_GRO
+            if (gro_enabled)
+            {
+                count += rx_input_gro(i, rx_msgs[i].msg_len);
+                continue;
+            }
+#endif
+            count++;
+            struct pbuf *mybuf = rx_pbufs[i];
+            rx_pbufs[i] = NULL;
+
+            if (rx_msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+            {
+                printf("datagram truncated, drop\n");
+                pbuf_free(mybuf);
+                continue;
+            }
+            pbuf_realloc(mybuf, rx_msgs[i].msg_len);
+
+            struct ip_addr_t ipaddr;
+            ipaddr.addr = rx_addrs[i].sin_addr.s_addr;
+
+            tcp_input(ipaddr, ntohs(rx_addrs[i].sin_port), mybuf);
         }
 
+        rudp_cur->stats.rx_packets += count;
+        udp_process_count += count;
+        /* a short batch means the socket is drained */
+        if (n < slots)
+            break;
+    } while (udp_process_count < max_loop);
+
+    return udp_process_count;
+}
+
+#endif
+
+/* empty the egress queue once the kernel is done with it, dropping the
+   references on the data it sent */
+static void tx_release()
+{
+    int k;
+    for (k = 0; k < tx_ref_count; k++)
+        pbuf_free(tx_refs[k]);
+    tx_ref_count = 0;
+    tx_iov_used = 0;
+    tx_buf_used = 0;
+    tx_count = 0;
+}
+
+#if RUDP_IO_URING
+/* feed what the ring received to the stack, then give it new buffers */
+static int rx_input_ring()
+{
+    int n = 0;
+    struct sockaddr_in from;
+    struct pbuf *p;
+    while ((p = rudp_uring_rx_next(uring, &from)) != NULL)
+    {
         struct ip_addr_t ipaddr;
-        ipaddr.addr = remaddr.sin_addr.s_addr;
+        ipaddr.addr = from.sin_addr.s_addr;
 
-        tcp_input(ipaddr, ntohs(remaddr.sin_port), mybuf);
+        tcp_input(ipaddr, ntohs(from.sin_port), p);
+        n++;
+    }
+    rudp_cur->stats.rx_packets += n;
+    rudp_uring_rx_refill(uring);
 
-        udp_process_count++;
-    } while (udp_process_count < max_loop);
+    return n;
+}
 
-    struct timeval now;
-    gettimeofday(&now, NULL);
-    unsigned long long pass_usec = now.tv_sec*1000000 + now.tv_usec - (last_ts.tv_sec*1000000+last_ts.tv_usec);
-    if (pass_usec > TIME_INTERVAL)
+/* queue a sendmsg for every slot not submitted yet */
+static int tx_submit()
+{
+    int queued = 0;
+    while (tx_submitted < tx_count
+           && rudp_uring_send(uring, &tx_msgs[tx_submitted].msg_hdr) == 0)
     {
-        last_ts = now;
-        tcp_timer();
+        rudp_cur->stats.tx_packets += tx_segs[tx_submitted];
+        tx_submitted++;
+        queued++;
     }
-    else
+
+    return queued;
+}
+
+/* the slots are free again once the kernel completed all of them */
+static void tx_reclaim()
+{
+    if (tx_submitted == tx_count && rudp_uring_tx_inflight(uring) == 0)
     {
-        // modify block timeout
-        timeout.tv_sec = 0;
-        timeout.tv_usec = TIME_INTERVAL - pass_usec;
-        setsockopt(udp_fd, SOL_SOCKET, SO_RCVTIMEO,(char*)&timeout,sizeof(timeout));
+        tx_release();
+        tx_submitted = 0;
     }
+}
+#endif
+
+int rudp_get_fd()
+{
+#if RUDP_IO_URING
+    /* readable while completions are pending */
+    return rudp_uring_fd(uring);
+#else
+    return udp_fd;
+#endif
+}
+
+int rudp_process_ready()
+{
+#if RUDP_IO_URING
+    if (rudp_uring_enter(uring, 0) > 0)
+        rudp_cur->stats.rx_syscalls++;
+    tx_reclaim();
+    int n = rx_input_ring();
+#else
+    int n = rx_drain(udp_fd);
+#endif
+    rudp_flush();
+    return n;
+}
+
+int rudp_update()
+{
+#if RUDP_IO_URING
+    /* one io_uring_enter() submits the sends and waits for input or the
+       next timer tick */
+    tx_submit();
+    if (rudp_uring_enter(uring, rudp_next_timeout()) > 0)
+        rudp_cur->stats.rx_syscalls++;
+    tx_reclaim();
+    rx_input_ring();
+    /* output goes out with the next enter */
+    timer_run();
+
+    return 0;
+#else
+    struct epoll_event events[RUDP_MAX_EVENTS];
+
+    /* whatever the last pass (or the app) produced goes out before we block */
+    rudp_flush();
+    timer_schedule(now_ms());
+    timer_arm();
+
+    int n = epoll_wait(epoll_fd, events, RUDP_MAX_EVENTS, -1);
+    if (n < 0)
+    {
+        if (errno == EINTR)
+            return 0;
+        perror("epoll_wait failed\n");
+        return -1;
+    }
+
+    int i;
+    for (i = 0; i < n; i++)
+    {
+        if (events[i].data.fd == timer_fd)
+        {
+            uint64_t expirations;
+            if (read(timer_fd, &expirations, sizeof(expirations)) < 0)
+                perror("timerfd read failed\n");
+        }
+        else
+            rx_drain(events[i].data.fd);
+    }
+    /* output is flushed before the next wait */
+    timer_run();
+
+    return 0;
+#endif
+}
+
+const struct rudp_stats* rudp_get_stats()
+{
+    return &rudp_cur->stats;
+}
+
+struct rudp_instance* rudp_get_instance()
+{
+    return rudp_cur;
+}
+
+void rudp_set_instance(struct rudp_instance* inst)
+{
+    rudp_cur = inst;
+    lwip_stack_set(inst != NULL ? inst->stack : NULL);
+}
+
+int rudp_set_shard(int index, int count)
+{
+    if (index < 0 || index >= count)
+        return -1;
+
+    tcp_set_shard(index, count);
+    shard_count = count;
 
     return 0;
 }
 
 void setup_pcb(rudp_fd_ptr fd, rudp_pcb pcb)
 {
+    memset(fd, 0, sizeof(*fd));
     tcp_arg(pcb, fd);
     fd->pcb = pcb;
 
     tcp_recv(fd->pcb, on_recv);
     tcp_err(fd->pcb, rudp_error);
-    tcp_poll(fd->pcb, rudp_poll, 0);
     tcp_sent(fd->pcb, rudp_sent);
 }
 
@@ -202,6 +924,13 @@ int rudp_bind(rudp_fd_ptr fd, const char *ipaddr, u16_t port)
         return ret;
     }
 
+    if (shard_count > 1)
+    {
+        ret = attach_shard_filter(shard_count);
+        if (ret < 0)
+            return ret;
+    }
+
     err_t err = tcp_bind(fd->pcb, port);
     if (err != ERR_OK)
     {
@@ -252,12 +981,134 @@ err_t on_accept(void *arg, rudp_pcb newpcb, err_t err)
     //    new_fd->retries = 0;
     //    fd->p = NULL;
     new_fd->recv_cb = listen_fd->recv_cb;
+    new_fd->recv_iov_cb = listen_fd->recv_iov_cb;
+    new_fd->sendq_cb = listen_fd->sendq_cb;
+#if LWIP_TCP_TURBO
+    if (listen_fd->turbo)
+        rudp_set_turbo(new_fd, 1);
+#endif
+#if LWIP_TCP_FEC
+    if (listen_fd->fec_k)
+        rudp_set_fec(new_fd, listen_fd->fec_k, listen_fd->fec_r);
+#endif
     /* pass newly allocated fd to our callbacks */
     //    ret_err = ERR_OK;
 
     return listen_fd->accept_cb(new_fd, err);
 }
 
+struct rudp_rx
+{
+    rudp_fd_ptr fd;
+    struct pbuf *p;
+    struct rudp_iovec iov[1];
+};
+
+void rudp_set_recv_iov(rudp_fd_ptr fd, rudp_recv_iov_fn cb)
+{
+    fd->recv_iov_cb = cb;
+}
+
+int rudp_set_cc(rudp_fd_ptr fd, const char* name)
+{
+    const struct tcp_cc_ops* cc = tcp_cc_find(name);
+    if (cc == NULL)
+        return -1;
+
+    tcp_set_cc(fd->pcb, cc);
+    return 0;
+}
+
+#if LWIP_TCP_TURBO
+void rudp_set_turbo(rudp_fd_ptr fd, int on)
+{
+    fd->turbo = (u8_t)(on != 0);
+    // a listen pcb only remembers it for on_accept()
+    if (fd->pcb->state != LISTEN)
+        tcp_set_turbo(fd->pcb, fd->turbo);
+}
+#endif
+
+#if LWIP_TCP_FEC
+int rudp_set_fec(rudp_fd_ptr fd, int k, int r)
+{
+    if (k < 0 || k > TCP_FEC_GROUP_MAX || (k > 0 && (r < 1 || r > k)))
+        return -1;
+    fd->fec_k = (u8_t)k;
+    fd->fec_r = (u8_t)(k > 0 ? r : 0);
+    // a listen pcb only remembers it for on_accept()
+    if (fd->pcb->state != LISTEN)
+        tcp_set_fec(fd->pcb, fd->fec_k, fd->fec_r);
+    return 0;
+}
+#endif
+
+void rudp_set_loss(int per_mille)
+{
+    loss_per_mille = per_mille;
+}
+
+void rudp_set_delay(int ms)
+{
+    delay_ms = ms;
+}
+
+int rudp_set_bufsize(rudp_fd_ptr fd, size_t snd_size, size_t rcv_size)
+{
+    if (snd_size > TCPWND_MAX || rcv_size > TCPWND_MAX
+        || tcp_set_bufsize(fd->pcb, (tcpwnd_size_t)snd_size, (tcpwnd_size_t)rcv_size) != ERR_OK)
+        return -1;
+    return 0;
+}
+
+void rudp_release(rudp_rx_ptr rx)
+{
+    rudp_fd_ptr fd = rx->fd;
+
+    if (!fd->is_freed)
+        tcp_recved(fd->pcb, rx->p->tot_len);
+    pbuf_free(rx->p);
+    mem_free(rx);
+
+    if (--fd->rx_held == 0 && fd->is_freed)
+        mem_free(fd);
+}
+
+static void deliver_close(rudp_fd_ptr fd, err_t err)
+{
+    if (fd->recv_iov_cb != NULL)
+        fd->recv_iov_cb(fd, NULL, 0, NULL, err);
+    else
+        fd->recv_cb(fd, NULL, 0, err);
+}
+
+/* hand the chain to the app as is, it is freed by rudp_release() */
+static err_t deliver_iov(rudp_fd_ptr fd, struct pbuf *p)
+{
+    // counted here, not with pbuf_clen(): drained out-of-order segments
+    // make a chain of a pbuf per datagram, as long as the peer likes
+    int cnt = 0;
+    struct pbuf *q;
+    for (q = p; q != NULL; q = q->next)
+        cnt++;
+    rudp_rx_ptr rx = (rudp_rx_ptr)mem_malloc(sizeof(struct rudp_rx) + (cnt - 1) * sizeof(struct rudp_iovec));
+    if (rx == NULL)
+        return ERR_MEM;
+
+    rx->fd = fd;
+    rx->p = p;
+    int i = 0;
+    for (q = p; q != NULL; q = q->next, i++)
+    {
+        rx->iov[i].base = q->payload;
+        rx->iov[i].len = q->len;
+    }
+    fd->rx_held++;
+
+    fd->recv_iov_cb(fd, rx->iov, cnt, rx, ERR_OK);
+    return ERR_OK;
+}
+
 /**
   The callback function will be passed a NULL pbuf to
   indicate that the remote host has closed the connection. If
@@ -267,8 +1118,6 @@ err_t on_accept(void *arg, rudp_pcb newpcb, err_t err)
  */
 err_t on_recv(void *arg, rudp_pcb tpcb, struct pbuf *p, err_t err)
 {
-    printf("on_recv\n");
-
     rudp_fd_ptr fd = (rudp_fd_ptr)arg;
     if (fd == NULL)
     {
@@ -287,7 +1136,7 @@ err_t on_recv(void *arg, rudp_pcb tpcb, struct pbuf *p, err_t err)
     {
         printf("remote close\n");
 
-        fd->recv_cb(fd, NULL, 0, err);
+        deliver_close(fd, err);
 
         return ERR_OK;
     }
@@ -297,27 +1146,35 @@ err_t on_recv(void *arg, rudp_pcb tpcb, struct pbuf *p, err_t err)
     if (err != ERR_OK)
     {
         printf("on_recv err=%d\n", err);
-        fd->recv_cb(fd, NULL, 0, err);
+        deliver_close(fd, err);
 
         // return ERR_OK means cb execute ok
         // err return is not needed, for up-layer already know
         return ERR_OK;
     }
 
-    const int BUFSIZE = 64*1024;
-    char buf[BUFSIZE];
-    int copy_len = 0;
-    while (p != NULL)
+    if (fd->recv_iov_cb != NULL)
     {
-        memcpy(buf+copy_len, p->payload, p->len);
-        copy_len += p->len;
-        p = p->next;
+        // not taken, lwip keeps it as refused data and retries
+        return deliver_iov(fd, p);
     }
-    printf("recv: %s\n", buf);
 
-    tcp_recved(tpcb, copy_len);
+    // a single pbuf needs no flattening
+    u16_t len = p->tot_len;
+    if (p->next == NULL)
+    {
+        fd->recv_cb(fd, p->payload, len, err);
+    }
+    else
+    {
+        const int BUFSIZE = 64*1024;
+        char buf[BUFSIZE];
+        pbuf_copy_partial(p, buf, len, 0);
+        fd->recv_cb(fd, buf, len, err);
+    }
+    pbuf_free(p);
 
-    fd->recv_cb(fd, buf, copy_len, err);
+    tcp_recved(tpcb, len);
 
     return ERR_OK;
 }
@@ -376,18 +1233,311 @@ callback function.
   the application should wait until some of the currently enqueued
   data has been successfully received by the other host and try again.
  */
+struct rudp_tx_chunk
+{
+    struct rudp_tx_chunk *next;
+    const char *data; // copied behind the chunk, or the rudp_send_ref() buffer
+    size_t len;
+    size_t off; // bytes of it already in the send buffer
+    struct rudp_send_ref *ref; // NULL for a copy
+};
+
+/* a rudp_send_ref() buffer */
+struct rudp_send_ref
+{
+    const void *buf;
+    rudp_send_done_fn done;
+    void *arg;
+    // tcp_write_ref() calls not done yet, plus one while queued
+    unsigned parts;
+};
+
+/* tcp_write_done_fn, and dropping the hold of the queue */
+static void send_ref_release(void *arg)
+{
+    struct rudp_send_ref *ref = (struct rudp_send_ref *)arg;
+
+    if (--ref->parts == 0)
+    {
+        ref->done(ref->buf, ref->arg);
+        free(ref);
+    }
+}
+
+static err_t tx_write_part(rudp_fd_ptr fd, const char *buf, size_t n, struct rudp_send_ref *ref)
+{
+    err_t e;
+
+    if (ref == NULL)
+        return tcp_write(fd->pcb, buf, (tcpwnd_size_t)n, TCP_WRITE_FLAG_COPY);
+    // the queue's hold keeps parts above 0, a failed write never calls back
+    ref->parts++;
+    e = tcp_write_ref(fd->pcb, buf, (tcpwnd_size_t)n, 0, send_ref_release, ref);
+    if (e != ERR_OK)
+        ref->parts--;
+    return e;
+}
+
+/* Put as much of buf in the send buffer as it has room for, in one
+   tcp_write(), returns how much; copied, or referenced on behalf of ref if
+   it is not NULL. *err is set unless the send buffer merely ran full */
+static size_t tx_write(rudp_fd_ptr fd, const char *buf, size_t len, struct rudp_send_ref *ref, err_t *err)
+{
+    size_t n = LWIP_MIN(len, tcp_sndbuf(fd->pcb));
+
+    while (n > 0)
+    {
+        err_t e = tx_write_part(fd, buf, n, ref);
+        if (e == ERR_OK)
+            return n;
+        if (e != ERR_MEM)
+        {
+            *err = e;
+            break;
+        }
+        // out of segments or queue entries: a part may still fit
+        n = n > TCP_MSS ? n / 2 : 0;
+    }
+    return 0;
+}
+
+static size_t sendq_hiwat(rudp_fd_ptr fd)
+{
+    size_t wnd = LWIP_MIN(fd->pcb->cwnd, fd->pcb->snd_wnd);
+    return LWIP_MAX((size_t)RUDP_SENDQ_HIWAT_MIN, 2 * wnd);
+}
+
+/* Report crossing the watermarks; cb may close fd, so call last */
+static void sendq_notify(rudp_fd_ptr fd)
+{
+    size_t hiwat = sendq_hiwat(fd);
+
+    if (!fd->sendq_full && fd->sendq_len >= hiwat)
+        fd->sendq_full = 1;
+    else if (fd->sendq_full && fd->sendq_len <= hiwat / 2)
+        fd->sendq_full = 0;
+    else
+        return;
+    if (fd->sendq_cb != NULL)
+        fd->sendq_cb(fd, fd->sendq_full);
+}
+
+/* Move queued data to the send buffer while it has room */
+static err_t sendq_push(rudp_fd_ptr fd)
+{
+    struct rudp_tx_chunk *c;
+    err_t err = ERR_OK;
+
+    while ((c = fd->sendq_head) != NULL)
+    {
+        size_t n = tx_write(fd, c->data + c->off, c->len - c->off, c->ref, &err);
+        c->off += n;
+        fd->sendq_len -= n;
+        if (c->off < c->len)
+            break;
+        fd->sendq_head = c->next;
+        if (c->ref != NULL)
+            send_ref_release(c->ref);
+        free(c);
+    }
+    if (fd->sendq_head == NULL)
+        fd->sendq_tail = NULL;
+    return err;
+}
+
+static void sendq_free(rudp_fd_ptr fd)
+{
+    while (fd->sendq_head != NULL)
+    {
+        struct rudp_tx_chunk *c = fd->sendq_head;
+        fd->sendq_head = c->next;
+        // never sent, but no longer referenced either
+        if (c->ref != NULL)
+            send_ref_release(c->ref);
+        free(c);
+    }
+    fd->sendq_tail = NULL;
+    fd->sendq_len = 0;
+}
+
+/* A queue chunk for len bytes at data, copied unless ref holds them */
+static struct rudp_tx_chunk *sendq_chunk(const char *data, size_t len, struct rudp_send_ref *ref)
+{
+    struct rudp_tx_chunk *c = (struct rudp_tx_chunk *)malloc(sizeof(*c) + (ref != NULL ? 0 : len));
+    if (c == NULL)
+        return NULL;
+    if (ref == NULL)
+    {
+        memcpy(c + 1, data, len);
+        data = (const char *)(c + 1);
+    }
+    c->next = NULL;
+    c->data = data;
+    c->len = len;
+    c->off = 0;
+    c->ref = ref;
+    return c;
+}
+
+static void sendq_append(rudp_fd_ptr fd, struct rudp_tx_chunk *c)
+{
+    if (fd->sendq_tail != NULL)
+        fd->sendq_tail->next = c;
+    else
+        fd->sendq_head = c;
+    fd->sendq_tail = c;
+    fd->sendq_len += c->len - c->off;
+    sendq_notify(fd);
+}
+
 int rudp_send(rudp_fd_ptr fd, const void* buf, size_t len)
 {
+    err_t err = ERR_OK;
+    size_t done = 0;
+
     // already call close
     if (fd->is_closing)
         return -1;
 
-    // 不处理TCP_WRITE_FLAG_MORE的情况，意味着不能一次性发送大于最大缓冲区的包
-    return tcp_write(fd->pcb, buf, len, 1);
+    // data goes behind what is queued already
+    if (fd->sendq_head == NULL)
+    {
+        done = tx_write(fd, (const char *)buf, len, NULL, &err);
+        if (err != ERR_OK)
+            return err;
+    }
+    if (done == len)
+        return ERR_OK;
+
+    struct rudp_tx_chunk *c = sendq_chunk((const char *)buf + done, len - done, NULL);
+    if (c == NULL)
+        return ERR_MEM;
+    sendq_append(fd, c);
+    return ERR_OK;
+}
+
+int rudp_send_ref(rudp_fd_ptr fd, const void* buf, size_t len, rudp_send_done_fn done_cb, void* arg)
+{
+    err_t err = ERR_OK;
+    size_t done = 0;
+
+    if (fd->is_closing)
+        return -1;
+
+    // allocated up front, so that nothing is taken if we fail
+    struct rudp_send_ref *ref = (struct rudp_send_ref *)malloc(sizeof(*ref));
+    if (ref == NULL)
+        return ERR_MEM;
+    struct rudp_tx_chunk *c = sendq_chunk((const char *)buf, len, ref);
+    if (c == NULL)
+    {
+        free(ref);
+        return ERR_MEM;
+    }
+    ref->buf = buf;
+    ref->done = done_cb;
+    ref->arg = arg;
+    ref->parts = 1; // the queue's, until all of buf is written
+
+    if (fd->sendq_head == NULL)
+    {
+        done = tx_write(fd, (const char *)buf, len, ref, &err);
+        if (err != ERR_OK)
+        {
+            free(c);
+            free(ref);
+            return err;
+        }
+    }
+    if (done == len)
+    {
+        free(c);
+        send_ref_release(ref);
+        return ERR_OK;
+    }
+    c->off = done;
+    sendq_append(fd, c);
+    return ERR_OK;
+}
+
+void rudp_set_sendq_cb(rudp_fd_ptr fd, rudp_sendq_fn cb)
+{
+    fd->sendq_cb = cb;
+}
+
+size_t rudp_sendq_len(rudp_fd_ptr fd)
+{
+    return fd->sendq_len;
+}
+
+int rudp_flush()
+{
+#if RUDP_IO_URING
+    /* also submits a receive re-armed meanwhile; completions are left for
+       rudp_update() or rudp_process_ready(), which feed input to the stack */
+    int sent = tx_submit();
+    if (rudp_uring_submit(uring) > 0)
+        rudp_cur->stats.tx_syscalls++;
+
+    return sent;
+#else
+    int sent = 0;
+    while (sent < tx_count)
+    {
+        int n = sendmmsg(udp_fd, tx_msgs + sent, tx_count - sent, 0);
+        rudp_cur->stats.tx_syscalls++;
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            // the datagrams are lost, retransmission recovers them
+            perror("udp sendmmsg failed");
+            break;
+        }
+        for (; n > 0; n--)
+            rudp_cur->stats.tx_packets += tx_segs[sent++];
+    }
+    tx_release();
+
+    return sent;
+#endif
+}
+
+/* room for a datagram of cnt pieces, copy bytes of which go to tx_buf */
+static int tx_room(int cnt, int copy)
+{
+    return tx_count < RUDP_SEND_BATCH && tx_buf_used + copy <= (int)sizeof(tx_buf)
+        && tx_iov_used + cnt <= RUDP_SEND_IOV && tx_ref_count + cnt <= RUDP_SEND_IOV;
 }
 
-int ip_output_if(char *p, int len, u32_t remote_ip, u16_t remote_port)
+/*
+ * A datagram to the same peer as the last slot, and no larger than the
+ * datagrams in it, joins that slot while all of them are full-sized: the
+ * kernel cuts the buffer every tx_seg_size bytes (UDP_SEGMENT), so only the
+ * last one may be short. Runs of full-MSS segments and of pure ACKs from
+ * tcp_output() thus leave as one buffer.
+ */
+static int tx_can_append(const struct sockaddr_in *to, int len)
 {
+    int i = tx_count - 1;
+    if (!gso_enabled || i < 0)
+        return 0;
+#if RUDP_IO_URING
+    if (i < tx_submitted)
+        return 0;
+#endif
+    return tx_addrs[i].sin_addr.s_addr == to->sin_addr.s_addr
+        && tx_addrs[i].sin_port == to->sin_port
+        && len <= tx_seg_size[i]
+        && tx_len[i] == tx_segs[i] * tx_seg_size[i]
+        && tx_segs[i] < RUDP_GSO_MAX_SEGS;
+}
+
+/* queue the datagram for the next flush, or send it right away */
+static int udp_output(const struct ip_iovec *vec, int cnt, int len, u32_t remote_ip, u16_t remote_port)
+{
+    int k;
+
     // TODO, how to deal with block? platform dependency!!
     // if ever blocked, tcp_txnow when recover
 
@@ -396,15 +1546,167 @@ int ip_output_if(char *p, int len, u32_t remote_ip, u16_t remote_port)
     remaddr.sin_family = AF_INET;
     remaddr.sin_addr.s_addr = remote_ip;
     remaddr.sin_port = htons(remote_port);
-    ;
-    printf("udp sendto %s:%u\n", inet_ntoa(remaddr.sin_addr), remote_port);
 
-    int ret = sendto(udp_fd, p, len, 0, (struct sockaddr *)&remaddr, sizeof(remaddr));
-    if (ret > 0)
+    int copy = 0;
+    for (k = 0; k < cnt; k++)
+        if (vec[k].p == NULL)
+            copy += vec[k].len;
+
+    if (len <= RUDP_MAX_DGRAM && !tx_room(cnt, copy))
+        rudp_flush();
+
+    if (len > RUDP_MAX_DGRAM || !tx_room(cnt, copy))
+    {
+        // does not fit the queue, or it is still with the kernel
+        // (io_uring): keep ordering and send it right away, still as one
+        // datagram gathered by the kernel
+        struct iovec iov[cnt];
+        struct msghdr msg;
+        for (k = 0; k < cnt; k++)
+        {
+            iov[k].iov_base = vec[k].base;
+            iov[k].iov_len = vec[k].len;
+        }
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = &remaddr;
+        msg.msg_namelen = sizeof(remaddr);
+        msg.msg_iov = iov;
+        msg.msg_iovlen = cnt;
+
+        rudp_flush();
+        int ret = sendmsg(udp_fd, &msg, 0);
+        rudp_cur->stats.tx_syscalls++;
+        if (ret > 0)
+        {
+            rudp_cur->stats.tx_packets++;
+            return ERR_OK;
+        }
+        perror("udp sendmsg failed");
+        return ret;
+    }
+
+    int i;
+    if (!tx_can_append(&remaddr, len))
+    {
+        i = tx_count++;
+        tx_addrs[i] = remaddr;
+        tx_len[i] = 0;
+        tx_segs[i] = 0;
+        tx_seg_size[i] = (u16_t)len;
+        memset(&tx_msgs[i], 0, sizeof(tx_msgs[i]));
+        tx_msgs[i].msg_hdr.msg_name = &tx_addrs[i];
+        tx_msgs[i].msg_hdr.msg_namelen = sizeof(tx_addrs[i]);
+        tx_msgs[i].msg_hdr.msg_iov = &tx_iovs[tx_iov_used];
+    }
+    else
+        i = tx_count - 1;
+
+    // queue it: the pieces in pbufs by reference, the others (the header,
+    // which tcp_output_segment() rewrites in place) copied, as the caller
+    // may reuse them as soon as we return. Pieces that continue the
+    // previous one in memory extend its iovec.
+    struct msghdr *hdr = &tx_msgs[i].msg_hdr;
+    for (k = 0; k < cnt; k++)
+    {
+        char *base = (char *)vec[k].base;
+        if (vec[k].p == NULL)
+        {
+            base = tx_buf + tx_buf_used;
+            memcpy(base, vec[k].base, vec[k].len);
+            tx_buf_used += vec[k].len;
+        }
+        else
+        {
+            pbuf_ref(vec[k].p);
+            tx_refs[tx_ref_count++] = vec[k].p;
+        }
+
+        struct iovec *last = hdr->msg_iovlen > 0 ? &tx_iovs[tx_iov_used - 1] : NULL;
+        if (last != NULL && (char *)last->iov_base + last->iov_len == base)
+            last->iov_len += vec[k].len;
+        else
+        {
+            tx_iovs[tx_iov_used].iov_base = base;
+            tx_iovs[tx_iov_used].iov_len = vec[k].len;
+            tx_iov_used++;
+            hdr->msg_iovlen++;
+        }
+    }
+    tx_len[i] += len;
+
+    if (++tx_segs[i] == 2)
+    {
+        hdr->msg_control = tx_cmsgs[i];
+        hdr->msg_controllen = sizeof(tx_cmsgs[i]);
+        struct cmsghdr *cm = CMSG_FIRSTHDR(hdr);
+        cm->cmsg_level = SOL_UDP;
+        cm->cmsg_type = UDP_SEGMENT;
+        cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        *(uint16_t *)CMSG_DATA(cm) = tx_seg_size[i];
+    }
+
+    return ERR_OK;
+}
+
+/* hold a copy of the datagram back for delay_ms */
+static int delay_queue(const struct ip_iovec *vec, int cnt, int len, u32_t remote_ip, u16_t remote_port)
+{
+    struct delayed_dgram *d = (struct delayed_dgram *)malloc(sizeof(*d) + len);
+    if (d == NULL)
+        return ERR_OK; // lost, retransmission recovers it
+
+    char *dst = d->data;
+    int k;
+    for (k = 0; k < cnt; k++)
+    {
+        memcpy(dst, vec[k].base, vec[k].len);
+        dst += vec[k].len;
+    }
+    d->next = NULL;
+    d->due = now_ms() + delay_ms;
+    d->remote_ip = remote_ip;
+    d->remote_port = remote_port;
+    d->len = len;
+    if (delay_tail != NULL)
+        delay_tail->next = d;
+    else
+        delay_head = d;
+    delay_tail = d;
+    return ERR_OK;
+}
+
+/* send the delayed datagrams that are due */
+static void delay_release(unsigned long long now)
+{
+    while (delay_head != NULL && delay_head->due <= now)
+    {
+        struct delayed_dgram *d = delay_head;
+        struct ip_iovec vec;
+
+        delay_head = d->next;
+        if (delay_head == NULL)
+            delay_tail = NULL;
+        vec.base = d->data;
+        vec.len = d->len;
+        vec.p = NULL;
+        udp_output(&vec, 1, d->len, d->remote_ip, d->remote_port);
+        free(d);
+    }
+}
+
+int ip_output_if(const struct ip_iovec *vec, int cnt, u32_t remote_ip, u16_t remote_port)
+{
+    int len = 0;
+    int k;
+    for (k = 0; k < cnt; k++)
+        len += vec[k].len;
+
+    if (loss_per_mille > 0 && (int)(rand_r(&loss_seed) % 1000) < loss_per_mille)
         return ERR_OK;
-    perror("udp sendto failed");
+    if (delay_ms > 0)
+        return delay_queue(vec, cnt, len, remote_ip, remote_port);
 
-    return ret;
+    return udp_output(vec, cnt, len, remote_ip, remote_port);
 }
 
 /*
@@ -459,6 +1761,7 @@ rudp_poll(void *arg, struct tcp_pcb *tpcb)
     if (fd->is_closing)
     {
         // try again
+        sendq_push(fd);
         rudp_close(fd);
     }
 
@@ -478,12 +1781,18 @@ rudp_sent(void *arg, struct tcp_pcb *tpcb, u16_t len)
     if (fd == NULL)
         return ERR_OK;
 
+    // the ACK made room, refill the send buffer from the queue
+    if (fd->sendq_head != NULL)
+        sendq_push(fd);
+
     if (fd->is_closing)
     {
         // try again
         rudp_close(fd);
+        return ERR_OK;
     }
 
+    sendq_notify(fd);
     return ERR_OK;
 }
 
@@ -499,6 +1808,15 @@ rudp_sent(void *arg, struct tcp_pcb *tpcb, u16_t len)
 void
 rudp_close(rudp_fd_ptr fd)
 {
+    // the FIN goes behind the queued data: close from rudp_sent() once the
+    // queue is in the send buffer
+    if (fd->sendq_head != NULL)
+    {
+        fd->is_closing = 1;
+        tcp_poll(fd->pcb, rudp_poll, 0);
+        return;
+    }
+
     err_t err = tcp_close(fd->pcb);
     if (err == ERR_OK)
     {
@@ -509,8 +1827,10 @@ rudp_close(rudp_fd_ptr fd)
     }
 
     // possible fail
-    // try again by using poll or sent cb
+    // try again by using poll or sent cb; only closing connections are
+    // polled, so idle ones stay off the timer wheel
     fd->is_closing = 1;
+    tcp_poll(fd->pcb, rudp_poll, 0);
     printf("tcp_close failed, err=%d\n", err);
 }
 
@@ -523,6 +1843,13 @@ void rudp_free(rudp_fd_ptr fd)
     tcp_recv(fd->pcb, NULL);
     tcp_err(fd->pcb, NULL);
     tcp_poll(fd->pcb, NULL, 0);
+    sendq_free(fd);
 
+    // held data still points at fd, the last rudp_release() frees it
+    if (fd->rx_held > 0)
+    {
+        fd->is_freed = 1;
+        return;
+    }
     mem_free(fd);
 }
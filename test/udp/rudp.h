@@ -1,61 +1,315 @@
-/*
- * rudp.h
- *
- *  Created on: 2015年9月14日
- *      Author: johnfu
- */
-
-#ifndef RUDP_H_
-#define RUDP_H_
-
-#include <stddef.h>
-
-#include "lwip/tcp.h"
-
-#ifdef __cplusplus
-extern "C" {
-#endif
-
-typedef struct tcp_pcb* rudp_pcb;
-struct rudp_state;
-typedef struct rudp_state rudp_fd;
-typedef struct rudp_state* rudp_fd_ptr;
-
-typedef err_t (*rudp_accept_fn)(rudp_fd_ptr fd, err_t err);
-typedef void (*rudp_recv_fn)(rudp_fd_ptr fd, const void* buf, size_t len, err_t err);
-typedef err_t (*rudp_connected_fn)(rudp_fd_ptr fd, err_t err);
-
-struct rudp_state
-{
-    // for tcp_close may fail, rudp must retry, not app
-    u8_t is_closing;
-    //  u8_t retries;
-    rudp_pcb pcb;
-
-    rudp_recv_fn recv_cb;
-    rudp_accept_fn accept_cb;
-    rudp_connected_fn connected_cb;
-};
-
-
-int rudp_init();
-
-int rudp_update();
-
-rudp_fd_ptr rudp_socket();
-
-int rudp_bind(rudp_fd_ptr pcb, const char* ipaddr, u16_t port);
-
-int rudp_listen(rudp_fd_ptr pcb, rudp_accept_fn accept_cb, rudp_recv_fn recv_cb);
-
-int rudp_connect(rudp_fd_ptr pcb, const char* ipaddr, u16_t port, rudp_connected_fn connected_cb, rudp_recv_fn recv_cb);
-
-int rudp_send(rudp_fd_ptr pcb, const void *buf, size_t len);
-
-void rudp_close(rudp_fd_ptr fd);
-
-#ifdef __cplusplus
-}
-#endif
-
-#endif /* RUDP_H_ */
+/*
+ * rudp.h
+ *
+ *  Created on: 2015年9月14日
+ *      Author: johnfu
+ */
+
+#ifndef RUDP_H_
+#define RUDP_H_
+
+#include <stddef.h>
+
+#include "lwip/tcp.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct tcp_pcb* rudp_pcb;
+struct rudp_state;
+typedef struct rudp_state rudp_fd;
+typedef struct rudp_state* rudp_fd_ptr;
+
+typedef err_t (*rudp_accept_fn)(rudp_fd_ptr fd, err_t err);
+typedef void (*rudp_recv_fn)(rudp_fd_ptr fd, const void* buf, size_t len, err_t err);
+typedef err_t (*rudp_connected_fn)(rudp_fd_ptr fd, err_t err);
+
+/* read-only view of one piece of received data */
+struct rudp_iovec
+{
+    const void* base;
+    size_t len;
+};
+
+/* received data held by the application, see rudp_release() */
+struct rudp_rx;
+typedef struct rudp_rx* rudp_rx_ptr;
+
+/* data rudp_send() queued for the send buffer */
+struct rudp_tx_chunk;
+
+/*
+ * Completion of rudp_send_ref(): the stack references buf no more, it may
+ * be changed or freed.
+ */
+typedef void (*rudp_send_done_fn)(const void* buf, void* arg);
+
+/*
+ * Backpressure from the send queue, see rudp_set_sendq_cb(): full is 1 when
+ * the queue reached its high watermark, 0 when it drained to half of it.
+ */
+typedef void (*rudp_sendq_fn)(rudp_fd_ptr fd, int full);
+
+/*
+ * Zero-copy variant of rudp_recv_fn: iov points into the stack's receive
+ * buffers and stays valid until rx is passed to rudp_release(). The window
+ * is not reopened before that, so holding data throttles the peer. On close
+ * or error iov and rx are NULL.
+ */
+typedef void (*rudp_recv_iov_fn)(rudp_fd_ptr fd, const struct rudp_iovec* iov, int iovcnt, rudp_rx_ptr rx, err_t err);
+
+/* io_uring transport instead of epoll, recvmmsg and sendmmsg */
+#ifndef RUDP_IO_URING
+#define RUDP_IO_URING 0
+#endif
+
+/* hand runs of equal-sized datagrams to one peer to the kernel as one
+   buffer with UDP_SEGMENT, if the kernel supports it */
+#ifndef RUDP_UDP_GSO
+#define RUDP_UDP_GSO 1
+#endif
+
+/* datagrams per UDP_SEGMENT buffer */
+#ifndef RUDP_GSO_MAX_SEGS
+#define RUDP_GSO_MAX_SEGS 64
+#endif
+
+/* let the kernel coalesce datagrams from one peer into one buffer
+   (UDP_GRO), split again into segments on receive; sockets transport only */
+#ifndef RUDP_UDP_GRO
+#define RUDP_UDP_GRO 1
+#endif
+
+/* UDP_GRO buffers fetched per recvmmsg() call, 64 KB each */
+#ifndef RUDP_GRO_BATCH
+#define RUDP_GRO_BATCH 8
+#endif
+
+/* datagrams fetched per recvmmsg() call */
+#ifndef RUDP_RECV_BATCH
+#define RUDP_RECV_BATCH 32
+#endif
+
+/* datagrams queued before the egress queue is flushed */
+#ifndef RUDP_SEND_BATCH
+#define RUDP_SEND_BATCH 64
+#endif
+
+/* SO_RCVBUF of the socket, so that a large window arriving in a burst is
+   not dropped; the kernel caps it at net.core.rmem_max */
+#ifndef RUDP_SOCK_RCVBUF
+#define RUDP_SOCK_RCVBUF (4 * 1024 * 1024)
+#endif
+
+/* the send queue's high watermark follows twice the window in flight,
+   but is never below this */
+#ifndef RUDP_SENDQ_HIWAT_MIN
+#define RUDP_SENDQ_HIWAT_MIN (64 * 1024)
+#endif
+
+/* transport counters of the current instance */
+struct rudp_stats
+{
+    unsigned long long rx_syscalls;
+    unsigned long long rx_packets;
+    unsigned long long tx_syscalls;
+    unsigned long long tx_packets;
+};
+
+struct rudp_state
+{
+    // for tcp_close may fail, rudp must retry, not app
+    u8_t is_closing;
+    //  u8_t retries;
+    rudp_pcb pcb;
+
+    rudp_recv_fn recv_cb;
+    rudp_recv_iov_fn recv_iov_cb;
+    rudp_accept_fn accept_cb;
+    rudp_connected_fn connected_cb;
+
+    // rudp_rx handles not yet released; the fd outlives rudp_free() until 0
+    u16_t rx_held;
+    u8_t is_freed;
+    // rudp_set_turbo(), passed on to accepted fds
+    u8_t turbo;
+    // rudp_set_fec(), passed on to accepted fds
+    u8_t fec_k;
+    u8_t fec_r;
+
+    // rudp_send() data waiting for room in the send buffer, oldest first
+    struct rudp_tx_chunk* sendq_head;
+    struct rudp_tx_chunk* sendq_tail;
+    size_t sendq_len;
+    rudp_sendq_fn sendq_cb;
+    u8_t sendq_full;
+};
+
+
+/*
+ * Create an instance - a stack, its socket and event loop - and make it the
+ * calling thread's current one. All other functions work on the current
+ * instance, including the callbacks they run.
+ */
+int rudp_init();
+
+/*
+ * The calling thread's current instance, and switching to another one. A
+ * thread may host several instances, and an instance may move to another
+ * thread, as long as no two threads use one instance at a time.
+ */
+struct rudp_instance;
+struct rudp_instance* rudp_get_instance();
+void rudp_set_instance(struct rudp_instance* inst);
+
+/*
+ * Wait until a datagram arrives or a timer tick is due, then process what is
+ * ready. Without connections it waits for datagrams only.
+ */
+int rudp_update();
+
+const struct rudp_stats* rudp_get_stats();
+
+/*
+ * Driving the stack from an existing event loop instead of rudp_update():
+ * wait for rudp_get_fd() to become readable, at most rudp_next_timeout()
+ * milliseconds (-1: no timer pending, wait for data only), then call
+ * rudp_process_ready() and/or rudp_process_timers(). Both flush the egress
+ * queue before returning. The socket is non-blocking.
+ */
+int rudp_get_fd();
+
+int rudp_next_timeout();
+
+/* Process datagrams queued on the socket, returns how many. */
+int rudp_process_ready();
+
+/* Run the timer ticks and retransmissions that are due, returns how many
+   ticks. */
+int rudp_process_timers();
+
+/*
+ * Outgoing datagrams are queued and sent in one sendmmsg() when
+ * rudp_update() is about to block, after timer processing, or when the queue
+ * is full. Call rudp_flush() to push them out right away, e.g. after
+ * rudp_send() from outside rudp_update(). Returns the number sent.
+ */
+int rudp_flush();
+
+/*
+ * Run this thread's stack as shard `index` of `count` instances sharing one
+ * port. Call after rudp_init() and before rudp_bind(); the shards must bind
+ * in index order, since the kernel numbers reuseport sockets by bind order.
+ * Datagrams are then steered by connection id to the owning shard.
+ */
+int rudp_set_shard(int index, int count);
+
+rudp_fd_ptr rudp_socket();
+
+int rudp_bind(rudp_fd_ptr pcb, const char* ipaddr, u16_t port);
+
+int rudp_listen(rudp_fd_ptr pcb, rudp_accept_fn accept_cb, rudp_recv_fn recv_cb);
+
+int rudp_connect(rudp_fd_ptr pcb, const char* ipaddr, u16_t port, rudp_connected_fn connected_cb, rudp_recv_fn recv_cb);
+
+/*
+ * Send len bytes of buf, of any length: as much as the send buffer has room
+ * for goes to it in one tcp_write(). The rest is copied to a queue of fd
+ * that feeds the send buffer as the peer acks data, so all of buf is taken
+ * unless memory runs out (ERR_MEM). The queue is not bounded: watch
+ * rudp_set_sendq_cb() or rudp_sendq_len() to keep it short. On close the
+ * queue is sent before the FIN.
+ */
+int rudp_send(rudp_fd_ptr pcb, const void *buf, size_t len);
+
+/*
+ * Zero-copy variant of rudp_send(): buf is not copied but referenced, by
+ * the send queue, by the segments (tcp_write_ref()) and by the datagrams
+ * queued for the kernel, until the peer acked all of it and the last
+ * datagram went out. Then done_cb(buf, arg) is called, also if the
+ * connection goes away first; buf must not change before that. One buffer may be
+ * passed to many fds, each calls back on its own. done_cb is called once if
+ * this returns ERR_OK, never otherwise; it runs from within the stack, e.g.
+ * in the middle of processing an ACK or in rudp_close(), and within
+ * rudp_send_ref() only for len 0. So it must not send on or close any fd:
+ * refill from rudp_set_sendq_cb() instead.
+ */
+int rudp_send_ref(rudp_fd_ptr fd, const void* buf, size_t len, rudp_send_done_fn done_cb, void* arg);
+
+/*
+ * Call cb when the send queue of fd reaches its high watermark, twice the
+ * window in flight and at least RUDP_SENDQ_HIWAT_MIN, and again when it
+ * drained to half of that. Set on a listening fd, accepted fds inherit it.
+ */
+void rudp_set_sendq_cb(rudp_fd_ptr fd, rudp_sendq_fn cb);
+
+/* Bytes in the send queue of fd, not yet in the send buffer. */
+size_t rudp_sendq_len(rudp_fd_ptr fd);
+
+/*
+ * Deliver data to cb instead of the recv_cb given to rudp_listen() or
+ * rudp_connect(). Set on a listening fd, accepted fds inherit it.
+ */
+void rudp_set_recv_iov(rudp_fd_ptr fd, rudp_recv_iov_fn cb);
+
+/*
+ * Congestion control for fd: "newreno" (the default), "cubic" or "bbr".
+ * Set on a listening fd, accepted fds inherit it. Returns -1 if name is not
+ * built in.
+ */
+int rudp_set_cc(rudp_fd_ptr fd, const char* name);
+
+/*
+ * Send buffer and receive window of fd in bytes (tcp_set_bufsize()), 0
+ * keeps a size. Windows above 64 KB take effect if the peer supports window
+ * scaling, up to 0xFFFF << TCP_RCV_SCALE. Call before rudp_connect() or
+ * rudp_listen(), accepted fds inherit it; on a connection it grows or
+ * shrinks the free space. Returns -1 for a size out of range. A receive
+ * window set here is no longer autotuned (LWIP_TCP_RCV_AUTOTUNE).
+ */
+int rudp_set_bufsize(rudp_fd_ptr fd, size_t snd_size, size_t rcv_size);
+
+#if LWIP_TCP_TURBO
+/*
+ * Low-latency mode for fd (tcp_set_turbo()): no RTO backoff, a short RTO,
+ * fast retransmit on fewer dupacks, no delayed ACKs and no Nagle. Call
+ * before rudp_connect() or rudp_listen(); accepted fds inherit it.
+ */
+void rudp_set_turbo(rudp_fd_ptr fd, int on);
+#endif
+
+#if LWIP_TCP_FEC
+/*
+ * Forward error correction for fd (tcp_set_fec()): r XOR parity datagrams
+ * after every k data segments, so a loss is repaired without a round trip.
+ * k = 0 turns it off. Both ends must set it; call before rudp_connect() or
+ * rudp_listen(), accepted fds inherit it. Returns -1 for k or r out of
+ * range.
+ */
+int rudp_set_fec(rudp_fd_ptr fd, int k, int r);
+#endif
+
+/*
+ * Drop per_mille of the datagrams sent, by all instances, to emulate a
+ * lossy path. 0 (the default) turns it off.
+ */
+void rudp_set_loss(int per_mille);
+
+/*
+ * Hold every datagram sent, by all instances, back for ms milliseconds to
+ * emulate a long path: two instances talking see an RTT of 2 * ms. 0 (the
+ * default) turns it off.
+ */
+void rudp_set_delay(int ms);
+
+/* Give back data passed to a rudp_recv_iov_fn and reopen the window. */
+void rudp_release(rudp_rx_ptr rx);
+
+void rudp_close(rudp_fd_ptr fd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RUDP_H_ */
@@ -0,0 +1,411 @@
+/*
+ * rudp_uring.c
+ *
+ *  io_uring transport for rudp.c, see rudp_uring.h. Talks to the kernel
+ *  through the raw system calls, no liburing needed.
+ */
+
+#define _GNU_SOURCE
+#include "rudp.h"
+
+#if RUDP_IO_URING
+
+#include "rudp_uring.h"
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lwip/pbuf.h"
+
+#define URING_TAG_RECV 1
+#define URING_TAG_SEND 2
+#define URING_BGID 0
+
+struct uring
+{
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sqe_tail;      /* local tail, published on enter */
+    unsigned to_submit;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+struct uring_rx
+{
+    struct pbuf *p;
+    struct sockaddr_in from;
+};
+
+struct rudp_uring
+{
+    struct uring ring;
+    int sock_fd;
+    int tx_inflight;
+
+    /* provided buffers: bufs_pbuf[bid] is posted, NULL once consumed */
+    struct io_uring_buf_ring *buf_ring;
+    struct pbuf *bufs_pbuf[RUDP_URING_BUFS];
+    unsigned short buf_tail;
+
+    /* the multishot receive; its template only fixes the name length */
+    struct msghdr recv_msg;
+    int recv_armed;
+
+    /* received datagrams not handed out yet, at most one per buffer */
+    struct uring_rx rx_ready[RUDP_URING_BUFS];
+    int rx_head;
+    int rx_count;
+};
+
+static struct io_uring_sqe* sqe_get(struct rudp_uring *u)
+{
+    unsigned head = __atomic_load_n(u->ring.sq_head, __ATOMIC_ACQUIRE);
+    if (u->ring.sqe_tail - head >= u->ring.sq_entries)
+        return NULL;
+
+    unsigned idx = u->ring.sqe_tail & u->ring.sq_mask;
+    struct io_uring_sqe *sqe = &u->ring.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    u->ring.sq_array[idx] = idx;
+    u->ring.sqe_tail++;
+    u->ring.to_submit++;
+    return sqe;
+}
+
+static void recv_arm(struct rudp_uring *u)
+{
+    struct io_uring_sqe *sqe = sqe_get(u);
+    if (sqe == NULL)
+        return;
+
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = u->sock_fd;
+    sqe->addr = (uint64_t)(uintptr_t)&u->recv_msg;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = URING_TAG_RECV;
+    u->recv_armed = 1;
+}
+
+static void recv_complete(struct rudp_uring *u, struct io_uring_cqe *cqe)
+{
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        u->recv_armed = 0;
+
+    if (!(cqe->flags & IORING_CQE_F_BUFFER))
+    {
+        /* -ENOBUFS: ran out of buffers, rudp_uring_rx_refill() re-arms */
+        if (cqe->res < 0 && cqe->res != -ENOBUFS)
+            printf("uring recvmsg failed, err=%d\n", cqe->res);
+        return;
+    }
+
+    unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    struct pbuf *p = u->bufs_pbuf[bid];
+    u->bufs_pbuf[bid] = NULL;
+    if (p == NULL)
+        return;
+
+    /* the buffer starts with the recvmsg header and the source address */
+    struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)p->payload;
+    u16_t offset = sizeof(*out) + u->recv_msg.msg_namelen + u->recv_msg.msg_controllen;
+    if (cqe->res < 0 || (out->flags & MSG_TRUNC) || out->payloadlen > (u32_t)(p->len - offset))
+    {
+        printf("datagram truncated, drop\n");
+        pbuf_free(p);
+        return;
+    }
+
+    struct uring_rx *rx = &u->rx_ready[(u->rx_head + u->rx_count) % RUDP_URING_BUFS];
+    memset(&rx->from, 0, sizeof(rx->from));
+    memcpy(&rx->from, out + 1, out->namelen < sizeof(rx->from) ? out->namelen : sizeof(rx->from));
+    pbuf_header(p, -(s16_t)offset);
+    pbuf_realloc(p, (u16_t)out->payloadlen);
+    rx->p = p;
+    u->rx_count++;
+}
+
+static void cq_reap(struct rudp_uring *u)
+{
+    unsigned head = *u->ring.cq_head;
+    unsigned tail = __atomic_load_n(u->ring.cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++)
+    {
+        struct io_uring_cqe *cqe = &u->ring.cqes[head & u->ring.cq_mask];
+        if (cqe->user_data == URING_TAG_SEND)
+        {
+            u->tx_inflight--;
+            // the datagram is lost, retransmission recovers it
+            if (cqe->res < 0)
+                printf("uring sendmsg failed, err=%d\n", cqe->res);
+        }
+        else
+            recv_complete(u, cqe);
+    }
+    __atomic_store_n(u->ring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+struct rudp_uring* rudp_uring_init(int sock)
+{
+    struct io_uring_params params;
+    struct rudp_uring *u = (struct rudp_uring *)calloc(1, sizeof(struct rudp_uring));
+    if (u == NULL)
+        return NULL;
+    memset(&params, 0, sizeof(params));
+
+    u->ring.fd = (int)syscall(__NR_io_uring_setup, RUDP_URING_ENTRIES, &params);
+    if (u->ring.fd < 0)
+    {
+        perror("io_uring_setup failed\n");
+        goto fail;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (cq_size > sq_size)
+            sq_size = cq_size;
+        cq_size = sq_size;
+    }
+
+    char *sq = (char *)mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            u->ring.fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+    {
+        perror("io_uring mmap failed\n");
+        goto fail;
+    }
+    char *cq = sq;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        cq = (char *)mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          u->ring.fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED)
+        {
+            perror("io_uring mmap failed\n");
+            goto fail;
+        }
+    }
+    u->ring.sqes = (struct io_uring_sqe *)mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                                            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                            u->ring.fd, IORING_OFF_SQES);
+    if (u->ring.sqes == MAP_FAILED)
+    {
+        perror("io_uring mmap failed\n");
+        goto fail;
+    }
+
+    u->ring.sq_head = (unsigned *)(sq + params.sq_off.head);
+    u->ring.sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    u->ring.sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    u->ring.sq_entries = *(unsigned *)(sq + params.sq_off.ring_entries);
+    u->ring.sq_array = (unsigned *)(sq + params.sq_off.array);
+    u->ring.sqe_tail = *u->ring.sq_tail;
+    u->ring.to_submit = 0;
+    u->ring.cq_head = (unsigned *)(cq + params.cq_off.head);
+    u->ring.cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    u->ring.cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    u->ring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    u->buf_ring = (struct io_uring_buf_ring *)mmap(NULL, RUDP_URING_BUFS * sizeof(struct io_uring_buf),
+                                                PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (u->buf_ring == MAP_FAILED)
+    {
+        perror("buffer ring mmap failed\n");
+        goto fail;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)u->buf_ring;
+    reg.ring_entries = RUDP_URING_BUFS;
+    reg.bgid = URING_BGID;
+    if (syscall(__NR_io_uring_register, u->ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+    {
+        perror("io_uring buffer ring registration failed\n");
+        goto fail;
+    }
+    u->buf_tail = 0;
+
+    u->sock_fd = sock;
+    memset(&u->recv_msg, 0, sizeof(u->recv_msg));
+    u->recv_msg.msg_namelen = sizeof(struct sockaddr_in);
+    u->recv_armed = 0;
+    u->tx_inflight = 0;
+    u->rx_head = u->rx_count = 0;
+
+    rudp_uring_rx_refill(u);
+    return u;
+
+fail:
+    /* the mappings go with the process, which gives up on the transport */
+    if (u->ring.fd >= 0)
+        close(u->ring.fd);
+    free(u);
+    return NULL;
+}
+
+int rudp_uring_fd(struct rudp_uring *u)
+{
+    return u->ring.fd;
+}
+
+int rudp_uring_send(struct rudp_uring *u, struct msghdr *msg)
+{
+    struct io_uring_sqe *sqe = sqe_get(u);
+    if (sqe == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = u->sock_fd;
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    sqe->user_data = URING_TAG_SEND;
+    u->tx_inflight++;
+    return 0;
+}
+
+int rudp_uring_enter(struct rudp_uring *u, int timeout_ms)
+{
+    unsigned flags = 0;
+    unsigned min_complete = 0;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    void *argp = NULL;
+    size_t argsz = 0;
+
+    /* only block when nothing is waiting to be collected */
+    if (timeout_ms != 0 && u->rx_count == 0
+        && *u->ring.cq_head == __atomic_load_n(u->ring.cq_tail, __ATOMIC_ACQUIRE))
+    {
+        flags |= IORING_ENTER_GETEVENTS;
+        min_complete = 1;
+        if (timeout_ms > 0)
+        {
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+            memset(&arg, 0, sizeof(arg));
+            arg.sigmask_sz = _NSIG / 8;
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+            flags |= IORING_ENTER_EXT_ARG;
+            argp = &arg;
+            argsz = sizeof(arg);
+        }
+    }
+
+    if (u->ring.to_submit == 0 && min_complete == 0)
+    {
+        cq_reap(u);
+        return 0;
+    }
+
+    __atomic_store_n(u->ring.sq_tail, u->ring.sqe_tail, __ATOMIC_RELEASE);
+    int ret = (int)syscall(__NR_io_uring_enter, u->ring.fd, u->ring.to_submit, min_complete, flags, argp, argsz);
+    if (ret < 0)
+    {
+        if (errno != ETIME && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        {
+            perror("io_uring_enter failed\n");
+            return -1;
+        }
+    }
+    else
+        u->ring.to_submit -= ret;
+
+    cq_reap(u);
+    return 1;
+}
+
+int rudp_uring_submit(struct rudp_uring *u)
+{
+    if (u->ring.to_submit == 0)
+        return 0;
+
+    __atomic_store_n(u->ring.sq_tail, u->ring.sqe_tail, __ATOMIC_RELEASE);
+    int ret = (int)syscall(__NR_io_uring_enter, u->ring.fd, u->ring.to_submit, 0, 0, NULL, 0);
+    if (ret < 0)
+    {
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        {
+            perror("io_uring_enter failed\n");
+            return -1;
+        }
+    }
+    else
+        u->ring.to_submit -= ret;
+
+    return 1;
+}
+
+int rudp_uring_tx_inflight(struct rudp_uring *u)
+{
+    return u->tx_inflight;
+}
+
+struct pbuf* rudp_uring_rx_next(struct rudp_uring *u, struct sockaddr_in *from)
+{
+    if (u->rx_count == 0)
+        return NULL;
+
+    struct uring_rx *rx = &u->rx_ready[u->rx_head];
+    u->rx_head = (u->rx_head + 1) % RUDP_URING_BUFS;
+    u->rx_count--;
+    *from = rx->from;
+    return rx->p;
+}
+
+void rudp_uring_rx_refill(struct rudp_uring *u)
+{
+    int posted = 0;
+    int avail = 0;
+    int bid;
+    for (bid = 0; bid < RUDP_URING_BUFS; bid++)
+    {
+        if (u->bufs_pbuf[bid] != NULL)
+        {
+            avail++;
+            continue;
+        }
+
+        /* one pool pbuf, it never chains at PBUF_POOL_BUFSIZE */
+        struct pbuf *p = pbuf_alloc(PBUF_RAW, PBUF_POOL_BUFSIZE, PBUF_POOL);
+        if (p == NULL)
+            break;
+        u->bufs_pbuf[bid] = p;
+
+        struct io_uring_buf *buf = &u->buf_ring->bufs[u->buf_tail & (RUDP_URING_BUFS - 1)];
+        buf->addr = (uint64_t)(uintptr_t)p->payload;
+        buf->len = p->len;
+        buf->bid = (u16_t)bid;
+        u->buf_tail++;
+        posted++;
+        avail++;
+    }
+    if (posted > 0)
+        __atomic_store_n(&u->buf_ring->tail, u->buf_tail, __ATOMIC_RELEASE);
+
+    if (!u->recv_armed && avail > 0)
+        recv_arm(u);
+}
+
+#endif /* RUDP_IO_URING */
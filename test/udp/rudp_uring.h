@@ -0,0 +1,64 @@
+/*
+ * rudp_uring.h
+ *
+ *  io_uring transport for rudp.c, enabled with RUDP_IO_URING.
+ *
+ *  Datagrams are received by one multishot recvmsg into a ring of provided
+ *  buffers, each of them the payload of a pool pbuf, so the kernel writes
+ *  straight into the pbufs tcp_input() consumes. Sends are sendmsg
+ *  submissions that go out with the next io_uring_enter(). Not thread-safe,
+ *  one ring per stack instance, passed to every call.
+ */
+
+#ifndef RUDP_URING_H_
+#define RUDP_URING_H_
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "lwip/pbuf.h"
+
+/* provided receive buffers, a power of two */
+#ifndef RUDP_URING_BUFS
+#define RUDP_URING_BUFS 64
+#endif
+
+/* submission queue entries */
+#ifndef RUDP_URING_ENTRIES
+#define RUDP_URING_ENTRIES 256
+#endif
+
+struct rudp_uring;
+
+/* Set up a ring for sock, NULL on failure. */
+struct rudp_uring* rudp_uring_init(int sock);
+
+/* the ring descriptor, readable while completions are pending */
+int rudp_uring_fd(struct rudp_uring *u);
+
+/* Queue a sendmsg; msg and its buffers must stay valid until
+   rudp_uring_tx_inflight() drops to 0. Returns -1 if the queue is full. */
+int rudp_uring_send(struct rudp_uring *u, struct msghdr *msg);
+
+/*
+ * Submit what is queued and wait for a completion: timeout_ms < 0 waits
+ * forever, 0 does not wait. Completions are then collected, received
+ * datagrams are kept for rudp_uring_rx_next(). Returns 1 if a system call
+ * was made, -1 on error.
+ */
+int rudp_uring_enter(struct rudp_uring *u, int timeout_ms);
+
+/* Submit what is queued without collecting completions, so they keep the
+   ring readable. Returns 1 if a system call was made, -1 on error. */
+int rudp_uring_submit(struct rudp_uring *u);
+
+/* sendmsg submissions not completed yet */
+int rudp_uring_tx_inflight(struct rudp_uring *u);
+
+/* Next received datagram, NULL when none is left. The caller owns it. */
+struct pbuf* rudp_uring_rx_next(struct rudp_uring *u, struct sockaddr_in *from);
+
+/* Hand consumed buffers back to the kernel, re-arm the receive if needed. */
+void rudp_uring_rx_refill(struct rudp_uring *u);
+
+#endif /* RUDP_URING_H_ */
@@ -0,0 +1,151 @@
+/*
+ * stack_bench.cpp
+ *
+ *  Cost of the per-connection work in the stack itself, for 10 .. 100k
+ *  connections, without sockets:
+ *
+ *  - demux: tcp_pcb_hash_lookup() for a stream of incoming connection ids.
+ *    The probes per lookup stay flat, but a lookup ends in reading the pcb,
+ *    and at 100k connections the pcbs (tens of MB) are far out of the cache
+ *    and the TLB. "pcb fetch" reads the same pcbs one after another without
+ *    a lookup: the difference to it is the cost of the table.
+ *  - timer: tcp_slowtmr() with all connections idle, which should not grow
+ *    with their number (the timer wheel).
+ *
+ *  The pcbs do not come from the memp pool, so their number is not bounded
+ *  by MEMP_NUM_TCP_PCB.
+ *
+ *  usage: test_stack_bench [max_connections]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "lwip/init.h"
+#include "lwip/tcp_impl.h"
+#include "bench_util.h"
+
+static const int counts[] = {10, 100, 1000, 10000, 100000};
+
+static FILE* report;
+
+/* datagrams the stack sent, none while the connections are idle */
+static int sent;
+
+static int discard_output(const struct ip_iovec *vec, int cnt, u32_t addr, u16_t port)
+{
+    sent++;
+    return ERR_OK;
+}
+
+static double elapsed_ns(const struct timespec* t0, const struct timespec* t1)
+{
+    return (t1->tv_sec - t0->tv_sec) * 1e9 + (t1->tv_nsec - t0->tv_nsec);
+}
+
+/* n established pcbs with distinct connection ids, on the active list */
+static struct tcp_pcb* pcbs_new(int n)
+{
+    struct tcp_pcb* pcbs = (struct tcp_pcb*)calloc(n, sizeof(struct tcp_pcb));
+    if (pcbs == NULL)
+        exit(1);
+    for (int i = 0; i < n; i++)
+    {
+        pcbs[i].state = ESTABLISHED;
+        pcbs[i].tmr = tcp_ticks;
+        pcbs[i].keep_idle = TCP_KEEPIDLE_DEFAULT;
+#if LWIP_TCP_KEEPALIVE
+        pcbs[i].keep_intvl = TCP_KEEPINTVL_DEFAULT;
+        pcbs[i].keep_cnt = TCP_KEEPCNT_DEFAULT;
+#endif
+        pcbs[i].conn_id.connid1 = 0xc000 + (i & 0x3fff);
+        pcbs[i].conn_id.connid2 = 9529 + i;
+        TCP_REG_ACTIVE(&pcbs[i]);
+    }
+    return pcbs;
+}
+
+static void pcbs_free(struct tcp_pcb* pcbs, int n)
+{
+    /* unlink from the head of the list so each removal is O(1) */
+    for (int i = n - 1; i >= 0; i--)
+        TCP_RMV_ACTIVE(&pcbs[i]);
+    free(pcbs);
+}
+
+static void demux_bench(int n)
+{
+    const int lookups = 1000000;
+    struct tcp_pcb* pcbs = pcbs_new(n);
+    struct connect_id_t* keys = (struct connect_id_t*)malloc(lookups * sizeof(struct connect_id_t));
+    struct timespec t0, t1;
+    volatile u32_t sink = 0;
+    int i;
+
+    if (keys == NULL)
+        exit(1);
+    /* the keys as they come off the wire, not read from the pcbs */
+    for (i = 0; i < lookups; i++)
+        keys[i] = pcbs[((u32_t)i * 2654435761UL) % (u32_t)n].conn_id;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < lookups; i++)
+    {
+        struct tcp_pcb* found = tcp_pcb_hash_lookup(keys[i].connid1, keys[i].connid2);
+        if (found == NULL || found->conn_id.connid2 != keys[i].connid2)
+        {
+            fprintf(stderr, "demux: lookup %d failed\n", i);
+            exit(1);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double lookup_ns = elapsed_ns(&t0, &t1) / lookups;
+
+    /* each read waits for the last one, as in a stream of lookups: connid1
+       is below 1 << 16, so the shift is 0 but not known to the compiler */
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < lookups; i++)
+        sink = pcbs[keys[i].connid2 - 9529 + (sink >> 20)].conn_id.connid1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double fetch_ns = elapsed_ns(&t0, &t1) / lookups;
+
+    fprintf(report, "demux: %6d connections: %.1f ns/lookup, pcb fetch %.1f ns\n",
+            n, lookup_ns, fetch_ns);
+    pcbs_free(pcbs, n);
+    free(keys);
+}
+
+static void timer_bench(int n)
+{
+    const int ticks = 1000;
+    struct tcp_pcb* pcbs = pcbs_new(n);
+    struct timespec t0, t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < ticks; i++)
+        tcp_slowtmr();
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (sent != 0)
+    {
+        fprintf(stderr, "timer: idle connections sent %d datagrams\n", sent);
+        exit(1);
+    }
+    fprintf(report, "timer: %6d idle connections: %.1f ns/tick\n", n, elapsed_ns(&t0, &t1) / ticks);
+    pcbs_free(pcbs, n);
+}
+
+int main(int argc, const char* argv[])
+{
+    int max = argc > 1 ? atoi(argv[1]) : 100000;
+
+    report = bench_report_open();
+    if (report == NULL || lwip_init(discard_output) != ERR_OK)
+        return 1;
+    for (unsigned int k = 0; k < sizeof(counts) / sizeof(counts[0]) && counts[k] <= max; k++)
+        demux_bench(counts[k]);
+    for (unsigned int k = 0; k < sizeof(counts) / sizeof(counts[0]) && counts[k] <= max; k++)
+        timer_bench(counts[k]);
+    fclose(report);
+    return 0;
+}
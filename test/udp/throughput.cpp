@@ -0,0 +1,216 @@
+/*
+ * throughput.cpp
+ *
+ *  Bulk transfer throughput over a long path, with the default buffers
+ *  (TCP_SND_BUF, TCP_WND) fixed, with both autotuned
+ *  (LWIP_TCP_SND_AUTOTUNE, LWIP_TCP_RCV_AUTOTUNE), and with large buffers
+ *  on both ends (rudp_set_bufsize()). Windows beyond 64 KB need window
+ *  scaling (LWIP_WND_SCALE).
+ *
+ *  One server thread takes whatever arrives, one client thread keeps its
+ *  send queue at the high watermark (rudp_set_sendq_cb()), sending one
+ *  static buffer by reference (rudp_send_ref()). Every datagram is held
+ *  back for half the RTT (rudp_set_delay()), so one connection moves at
+ *  most a window per RTT: TCP_WND = 10 * 536 bytes is about 50 KB/s at
+ *  100 ms.
+ *
+ *  usage: test_throughput [seconds] [port] [buffer_kb]
+ *
+ *  5 seconds per run after a 2 second slow start, 2048 KB buffers by
+ *  default; runs go at 50, 100 and 200 ms RTT and run i uses port + i.
+ *  The send buffer of the client and the receive window of the server
+ *  they ended with are reported too.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "bench_util.h"
+
+#if !LWIP_PER_THREAD_STACK
+#error "test_throughput needs LWIP_PER_THREAD_STACK enabled in lwipopts.h"
+#endif
+
+/* bytes per rudp_send() */
+static const size_t CHUNK = 4 * TCP_MSS;
+
+enum mode
+{
+    DEFAULT_BUFFERS,
+    AUTOTUNED,
+    LARGE_BUFFERS,
+    NMODES
+};
+
+struct run
+{
+    u16_t port;
+    int rtt;
+    enum mode mode;
+    size_t bufsize;
+    volatile unsigned long snd_buf;
+    volatile unsigned long rcv_wnd;
+    volatile int run_flag;
+    volatile unsigned long long received;
+};
+
+static LWIP_STACK_LOCAL struct run* server_run;
+
+static void server_recv(rudp_fd_ptr fd, const struct rudp_iovec* iov, int iovcnt, rudp_rx_ptr rx, err_t err)
+{
+    if (rx == NULL)
+    {
+        rudp_close(fd);
+        return;
+    }
+    for (int i = 0; i < iovcnt; i++)
+        server_run->received += iov[i].len;
+    server_run->rcv_wnd = fd->pcb->rcv_wnd_size;
+    rudp_release(rx);
+}
+
+static void* server_main(void* arg)
+{
+    struct run* r = server_run = (struct run*)arg;
+
+    if (rudp_init() != 0)
+        exit(1);
+
+    rudp_fd_ptr fd = rudp_socket();
+    if (fd == NULL
+        || (r->mode == DEFAULT_BUFFERS && rudp_set_bufsize(fd, TCP_SND_BUF, TCP_WND) != 0)
+        || (r->mode == LARGE_BUFFERS && rudp_set_bufsize(fd, r->bufsize, r->bufsize) != 0)
+        || rudp_bind(fd, "127.0.0.1", r->port) != 0
+        || rudp_listen(fd, bench_accept, NULL) != 0)
+    {
+        fprintf(stderr, "server setup failed\n");
+        exit(1);
+    }
+    rudp_set_recv_iov(fd, server_recv);
+    bench_serve(&r->run_flag);
+    return NULL;
+}
+
+static LWIP_STACK_LOCAL int client_connected;
+static LWIP_STACK_LOCAL int client_sendq_full;
+
+static err_t client_connect(rudp_fd_ptr fd, err_t err)
+{
+    if (err != ERR_OK)
+        return err;
+    client_connected = 1;
+    return ERR_OK;
+}
+
+static void client_recv(rudp_fd_ptr fd, const void* buf, size_t len, err_t err)
+{
+}
+
+static void client_sendq(rudp_fd_ptr fd, int full)
+{
+    client_sendq_full = full;
+}
+
+static void client_send_done(const void* buf, void* arg)
+{
+}
+
+/* top up the send queue to its high watermark; zeros never changes, so
+   it is sent by reference */
+static void client_refill(void* arg)
+{
+    static const char zeros[CHUNK] = {0};
+    rudp_fd_ptr fd = (rudp_fd_ptr)arg;
+
+    while (client_connected && !client_sendq_full)
+        rudp_send_ref(fd, zeros, CHUNK, client_send_done, NULL);
+}
+
+static void* client_main(void* arg)
+{
+    struct run* r = (struct run*)arg;
+
+    if (rudp_init() != 0)
+        exit(1);
+
+    rudp_fd_ptr fd = rudp_socket();
+    if (fd == NULL
+        || (r->mode == DEFAULT_BUFFERS && rudp_set_bufsize(fd, TCP_SND_BUF, TCP_WND) != 0)
+        || (r->mode == LARGE_BUFFERS && rudp_set_bufsize(fd, r->bufsize, r->bufsize) != 0)
+        || rudp_connect(fd, "127.0.0.1", r->port, client_connect, client_recv) != 0)
+    {
+        fprintf(stderr, "client setup failed\n");
+        exit(1);
+    }
+    rudp_set_sendq_cb(fd, client_sendq);
+
+    bench_client_loop(&r->run_flag, client_refill, fd);
+    r->snd_buf = fd->pcb->snd_buf_size;
+    return NULL;
+}
+
+static void run(FILE* report, struct run* r, int seconds)
+{
+    pthread_t server, client;
+
+    rudp_set_delay(r->rtt / 2);
+    r->run_flag = 1;
+    server = bench_server_start(server_main, r);
+    pthread_create(&client, NULL, client_main, r);
+
+    sleep(2);
+    unsigned long long start_bytes = r->received;
+    double start = bench_now_sec();
+    sleep(seconds);
+    unsigned long long end_bytes = r->received;
+    double elapsed = bench_now_sec() - start;
+
+    r->run_flag = 0;
+    pthread_join(client, NULL);
+    pthread_join(server, NULL);
+    rudp_set_delay(0);
+
+    double kbps = (end_bytes - start_bytes) / elapsed / 1024;
+    char what[64];
+    if (r->mode == LARGE_BUFFERS)
+        snprintf(what, sizeof(what), "%zu KB buffers", r->bufsize / 1024);
+    else if (r->mode == AUTOTUNED)
+        snprintf(what, sizeof(what), "autotuned");
+    else
+        snprintf(what, sizeof(what), "default buffers");
+    fprintf(report, "rtt %3d ms, %-16s %10.1f KB/s, send buffer %lu KB, window %lu KB\n",
+            r->rtt, what, kbps, r->snd_buf / 1024, r->rcv_wnd / 1024);
+}
+
+int main(int argc, const char* argv[])
+{
+    static const int rtts[] = { 50, 100, 200 };
+    const int nrtts = sizeof(rtts) / sizeof(rtts[0]);
+
+    int seconds = argc > 1 ? atoi(argv[1]) : 5;
+    u16_t port = argc > 2 ? (u16_t)atoi(argv[2]) : 10201;
+    size_t bufsize = (size_t)(argc > 3 ? atoi(argv[3]) : 2048) * 1024;
+    if (seconds <= 0)
+        seconds = 1;
+
+    FILE* report = bench_report_open();
+    if (report == NULL)
+        return 1;
+
+    struct run runs[NMODES * nrtts];
+    memset(runs, 0, sizeof(runs));
+    for (int i = 0; i < NMODES * nrtts; i++)
+    {
+        runs[i].port = (u16_t)(port + i);
+        runs[i].rtt = rtts[i / NMODES];
+        runs[i].mode = (enum mode)(i % NMODES);
+        runs[i].bufsize = bufsize;
+        run(report, &runs[i], seconds);
+        fflush(report);
+    }
+    fclose(report);
+    return 0;
+}
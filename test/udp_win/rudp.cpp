@@ -7,6 +7,7 @@
 #include <WinSock2.h>
 #include <WS2tcpip.h>
 #include <unordered_map>
+#include <vector>
 
 #pragma comment(lib,"ws2_32.lib")
 
@@ -31,7 +32,7 @@ MAP_OF_TCP_PCB map_of_tcp_pcb;
 //ǰ
 void setup_pcb(rudp_state* rudp, tcp_pcb* pcb);
 
-int ip_output_udp(char *data, int len, u32_t addr, u16_t remote_port)
+int ip_output_udp(const struct ip_iovec *vec, int cnt, u32_t addr, u16_t remote_port)
 {
 	struct sockaddr_in remaddr;
 	static socklen_t addrlen = sizeof(remaddr);
@@ -39,8 +40,17 @@ int ip_output_udp(char *data, int len, u32_t addr, u16_t remote_port)
 	remaddr.sin_family = AF_INET;
 	remaddr.sin_addr.S_un.S_addr = addr;
 
-	int ret = sendto(udp_fd, data, len, 0, (SOCKADDR*)&remaddr, addrlen);
-	if (ret <= 0)
+	// one datagram for the whole segment
+	std::vector<WSABUF> bufs(cnt);
+	for (int i = 0; i < cnt; i++)
+	{
+		bufs[i].buf = (char*)vec[i].base;
+		bufs[i].len = (ULONG)vec[i].len;
+	}
+
+	DWORD sent = 0;
+	int ret = WSASendTo(udp_fd, &bufs[0], (DWORD)cnt, &sent, 0, (SOCKADDR*)&remaddr, addrlen, NULL, NULL);
+	if (ret != 0 || sent == 0)
 	{
 		return -3;
 	}
@@ -82,8 +92,9 @@ void tcp_timer()
 int rudp_update()
 {
 	int udp_process_count = 0;
-	const int BUFSIZE = 64 * 1024;
-	char buf[BUFSIZE];
+	// largest datagram we accept: header, options and one MSS of data
+	static const int MAX_DGRAM = TCP_HLEN + 40 + TCP_MSS;
+	static const int MAX_BUFS = (MAX_DGRAM + PBUF_POOL_BUFSIZE - 1) / PBUF_POOL_BUFSIZE;
 
 	DWORD last_tick_count = 0;
 	static const DWORD TIME_INTERVAL = 100;
@@ -94,32 +105,42 @@ int rudp_update()
 
 	do
 	{
-		int recvlen = recvfrom(udp_fd, buf, BUFSIZE, 0, (struct sockaddr *)&remaddr, &addrlen);
-		if (recvlen < 0)
-		{
-			// timeout
-			if (WSAGetLastError() == WSAETIMEDOUT)
-				tcp_timer();
-			else
-				perror("recvfrom failed\n");
-			return -1;
-		}
-
-		struct pbuf *mybuf = pbuf_alloc(PBUF_TRANSPORT, recvlen, PBUF_POOL);
+		// receive straight into pool pbufs, no bounce buffer
+		struct pbuf *mybuf = pbuf_alloc(PBUF_RAW, MAX_DGRAM, PBUF_POOL);
 		if (mybuf == NULL)
 		{
 			perror("pbuff alloc failed\n");
 			return -2;
 		}
 
-		int copy_len = 0;
-		struct pbuf *tmp_buf = mybuf;
-		while (tmp_buf != NULL)
+		WSABUF bufs[MAX_BUFS];
+		DWORD buf_count = 0;
+		for (struct pbuf *q = mybuf; q != NULL && buf_count < MAX_BUFS; q = q->next)
+		{
+			bufs[buf_count].buf = (char*)q->payload;
+			bufs[buf_count].len = q->len;
+			buf_count++;
+		}
+
+		DWORD recvlen = 0;
+		DWORD flags = 0;
+		int fromlen = addrlen;
+		int ret = WSARecvFrom(udp_fd, bufs, buf_count, &recvlen, &flags, (struct sockaddr *)&remaddr, &fromlen, NULL, NULL);
+		if (ret != 0)
 		{
-			memcpy(tmp_buf->payload, buf + copy_len, mybuf->len);
-			copy_len += tmp_buf->len;
-			tmp_buf = tmp_buf->next;
+			int err = WSAGetLastError();
+			pbuf_free(mybuf);
+			// bigger than any segment we send, drop it
+			if (err == WSAEMSGSIZE)
+				continue;
+			// timeout
+			if (err == WSAETIMEDOUT)
+				tcp_timer();
+			else
+				perror("recvfrom failed\n");
+			return -1;
 		}
+		pbuf_realloc(mybuf, (u16_t)recvlen);
 
 		struct ip_addr_t ipaddr;
 		ipaddr.addr = remaddr.sin_addr.s_addr;
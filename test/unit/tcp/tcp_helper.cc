@@ -11,12 +11,12 @@
 #error "This tests needs TCP- and MEMP-statistics enabled"
 #endif
 
-void ip_output_if_real(char *p, int len, u32_t addr, u16_t port);
+void ip_output_if_real(const struct ip_iovec *vec, int cnt, u32_t addr, u16_t port);
 extern "C"
 {
-int test_ip_output(char *p, int len, u32_t addr, u16_t port)
+int test_ip_output(const struct ip_iovec *vec, int cnt, u32_t addr, u16_t port)
 {
-    ip_output_if_real(p, len, addr, port);
+    ip_output_if_real(vec, cnt, addr, port);
     return ERR_OK;
 }
 }
@@ -158,7 +158,7 @@ tcp_set_state(struct tcp_pcb* pcb, enum tcp_state state, ip_addr_t* local_ip,
   /* @todo: remove from previous list */
   pcb->state = state;
   if (state == ESTABLISHED) {
-    TCP_REG(&tcp_active_pcbs, pcb);
+    TCP_REG_ACTIVE(pcb);
     //pcb->local_ip.addr = local_ip->addr;
     pcb->local_port = local_port;
     pcb->remote_ip.addr = remote_ip->addr;
@@ -168,7 +168,7 @@ tcp_set_state(struct tcp_pcb* pcb, enum tcp_state state, ip_addr_t* local_ip,
     //pcb->local_ip.addr = local_ip->addr;
     pcb->local_port = local_port;
   } else if(state == TIME_WAIT) {
-    TCP_REG(&tcp_tw_pcbs, pcb);
+    TCP_REG_TW(pcb);
     //pcb->local_ip.addr = local_ip->addr;
     pcb->local_port = local_port;
     pcb->remote_ip.addr = remote_ip->addr;
@@ -262,20 +262,31 @@ void ip_output_if_init()
     memset(&txcounters, 0, sizeof(struct test_tcp_txcounters));
 }
 
-void ip_output_if_real(char *p, int len, u32_t addr, u16_t port)
+void ip_output_if_real(const struct ip_iovec *vec, int cnt, u32_t addr, u16_t port)
 {
+  int len = 0;
+  for (int i = 0; i < cnt; i++) {
+      len += vec[i].len;
+  }
   txcounters.num_tx_calls++;
   txcounters.num_tx_bytes += len;
+  if (txcounters.hold_tx_pbufs) {
+      for (int i = 0; i < cnt; i++) {
+          if (vec[i].p != NULL) {
+              ASSERT_LT(txcounters.num_held_pbufs, sizeof(txcounters.held_pbufs) / sizeof(txcounters.held_pbufs[0]));
+              pbuf_ref(vec[i].p);
+              txcounters.held_pbufs[txcounters.num_held_pbufs++] = vec[i].p;
+          }
+      }
+  }
   if (txcounters.copy_tx_packets) {
       struct pbuf *p_copy = pbuf_alloc(PBUF_TRANSPORT, len, PBUF_RAM);
       ASSERT_TRUE(p_copy != NULL);
-      struct pbuf *p_iter = p_copy;
       int offset = 0;
-      while (p_iter != NULL)
+      for (int i = 0; i < cnt; i++)
       {
-          MEMCPY(p_iter->payload, p+offset, p_iter->len);
-          offset += p_iter->len;
-          p_iter = p_iter->next;
+          MEMCPY((char *)p_copy->payload + offset, vec[i].base, vec[i].len);
+          offset += vec[i].len;
       }
 
       if (txcounters.tx_packets == NULL) {
@@ -24,6 +24,10 @@ struct test_tcp_txcounters {
   u32_t num_tx_bytes;
   u8_t  copy_tx_packets;
   struct pbuf *tx_packets;
+  /* keep a reference on the pbufs of the pieces sent, as a queue does */
+  u8_t  hold_tx_pbufs;
+  u8_t  num_held_pbufs;
+  struct pbuf *held_pbufs[16];
 };
 
 /* Helper functions */
@@ -47,7 +51,7 @@ struct tcp_pcb* test_tcp_new_counters_pcb(struct test_tcp_counters* counters);
 
 extern "C"
 {
-int test_ip_output(char *p, int len, u32_t addr, u16_t port);
+int test_ip_output(const struct ip_iovec *vec, int cnt, u32_t addr, u16_t port);
 }
 
 /*void test_tcp_input(struct pbuf *p, struct netif *inp);
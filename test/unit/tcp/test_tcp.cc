@@ -55,9 +55,11 @@ class LWIPTest : public testing::Test {
       tcp_ticks = 0;
 
       test_tcp_timer = 0;
+      tcp_set_clock(NULL);
       tcp_remove_all();
   }
   void TearDown() {
+      tcp_set_clock(NULL);
       tcp_remove_all();
   }
   // Some expensive resource shared by all tests.
@@ -690,6 +692,1394 @@ TEST_F(LWIPTest, test_tcp_tx_full_window_lost_from_unacked)
   test_tcp_tx_full_window_lost(0);
 }
 
+/** Several ESTABLISHED pcbs: segments reach the pcb with the matching conn_id,
+ * and the conn_id index follows the pcb through TIME-WAIT and removal. */
+TEST_F(LWIPTest, test_tcp_demux_conn_id)
+{
+  struct test_tcp_counters counters[3];
+  struct tcp_pcb* pcbs[3];
+  struct pbuf* p;
+  char data[] = {1, 2, 3, 4};
+  ip_addr_t remote_ip, local_ip;
+  u16_t remote_port = 0x100, local_port = 0x101;
+  int i;
+
+  memset(counters, 0, sizeof(counters));
+  for (i = 0; i < 3; i++) {
+    pcbs[i] = test_tcp_new_counters_pcb(&counters[i]);
+    ASSERT_TRUE(pcbs[i] != NULL);
+    /* same connid1 for all, only the server assigned connid2 differs */
+    pcbs[i]->conn_id.connid1 = 4000;
+    pcbs[i]->conn_id.connid2 = 10000 + i;
+    tcp_set_state(pcbs[i], ESTABLISHED, &local_ip, &remote_ip, local_port, remote_port);
+  }
+  ASSERT_TRUE(tcp_pcb_hash_lookup(4000, 10001) == pcbs[1]);
+  ASSERT_TRUE(tcp_pcb_hash_lookup(4000, 10003) == NULL);
+
+  /* deliver to the middle one only */
+  tcp_create_rx_segment(pcbs[1], data, sizeof(data), 0, 0, 0, &p);
+  ASSERT_TRUE(p != NULL);
+  tcp_input(remote_ip, remote_port, p);
+  ASSERT_EQ(counters[0].recv_calls, 0);
+  ASSERT_EQ(counters[1].recv_calls, 1);
+  ASSERT_EQ(counters[1].recved_bytes, sizeof(data));
+  ASSERT_EQ(counters[2].recv_calls, 0);
+
+  /* moving to TIME-WAIT keeps the pcb findable, aborting drops it */
+  TCP_RMV_ACTIVE(pcbs[2]);
+  pcbs[2]->state = TIME_WAIT;
+  TCP_REG_TW(pcbs[2]);
+  ASSERT_TRUE(tcp_pcb_hash_lookup(4000, 10002) == pcbs[2]);
+  tcp_abort(pcbs[2]);
+  ASSERT_TRUE(tcp_pcb_hash_lookup(4000, 10002) == NULL);
+  tcp_abort(pcbs[0]);
+  ASSERT_TRUE(tcp_pcb_hash_lookup(4000, 10000) == NULL);
+  ASSERT_TRUE(tcp_pcb_hash_lookup(4000, 10001) == pcbs[1]);
+  tcp_abort(pcbs[1]);
+  ASSERT_TRUE(lwip_stats.memp[MEMP_TCP_PCB].used == 0);
+}
+
+/** Server ids carry the shard index and are unique among existing pcbs. */
+TEST_F(LWIPTest, test_tcp_server_id_shard)
+{
+  struct tcp_pcb* pcb;
+  u32_t id1, id2;
+
+  tcp_set_shard(3, 4);
+  id1 = tcp_new_server_id();
+  ASSERT_EQ(id1 % 4, 3);
+
+  /* an id in use is skipped */
+  pcb = tcp_new();
+  ASSERT_TRUE(pcb != NULL);
+  pcb->conn_id.connid1 = 1;
+  pcb->conn_id.connid2 = id1 + 4;
+  pcb->state = ESTABLISHED;
+  TCP_REG_ACTIVE(pcb);
+  id2 = tcp_new_server_id();
+  ASSERT_EQ(id2 % 4, 3);
+  ASSERT_NE(id2, id1);
+  ASSERT_NE(id2, id1 + 4);
+  tcp_abort(pcb);
+
+  tcp_set_shard(0, 1);
+}
+
+/** Two stack instances in one thread keep their own pcbs, pools and stats. */
+TEST_F(LWIPTest, test_tcp_stack_instances)
+{
+  struct lwip_stack* first = lwip_stack_get();
+  struct lwip_stack* second;
+  struct tcp_pcb* pcb;
+
+  second = lwip_stack_new(test_ip_output);
+  ASSERT_TRUE(second != NULL);
+  ASSERT_TRUE(lwip_stack_get() == first);
+
+  lwip_stack_set(second);
+  pcb = tcp_new();
+  ASSERT_TRUE(pcb != NULL);
+  pcb->state = ESTABLISHED;
+  TCP_REG_ACTIVE(pcb);
+  ASSERT_EQ(lwip_stats.memp[MEMP_TCP_PCB].used, 1);
+
+  lwip_stack_set(first);
+  ASSERT_TRUE(tcp_active_pcbs == NULL);
+  ASSERT_EQ(lwip_stats.memp[MEMP_TCP_PCB].used, 0);
+
+  lwip_stack_set(second);
+  ASSERT_TRUE(tcp_active_pcbs == pcb);
+  tcp_abort(pcb);
+  ASSERT_EQ(lwip_stats.memp[MEMP_TCP_PCB].used, 0);
+
+  lwip_stack_set(first);
+  lwip_stack_free(second);
+}
+
+/** A segment made of several pbufs (header plus unchained data) leaves as one datagram. */
+TEST_F(LWIPTest, test_tcp_output_chained_segment)
+{
+  struct test_tcp_counters counters;
+  struct tcp_pcb* pcb;
+  ip_addr_t remote_ip, local_ip;
+  u16_t remote_port = 0x100, local_port = 0x101;
+  err_t err;
+  u16_t i;
+
+  for (i = 0; i < sizeof(tx_data); i++) {
+    tx_data[i] = (u8_t)i;
+  }
+  memset(&txcounters, 0, sizeof(txcounters));
+  memset(&counters, 0, sizeof(counters));
+
+  pcb = test_tcp_new_counters_pcb(&counters);
+  ASSERT_TRUE(pcb != NULL);
+  tcp_set_state(pcb, ESTABLISHED, &local_ip, &remote_ip, local_port, remote_port);
+  pcb->mss = TCP_MSS;
+  pcb->cwnd = 2*TCP_MSS;
+
+  /* referenced (non-copied) data is chained behind the header pbuf */
+  err = tcp_write(pcb, &tx_data[0], 10, 0);
+  ASSERT_TRUE(err == ERR_OK);
+  err = tcp_write(pcb, &tx_data[10], 10, 0);
+  ASSERT_TRUE(err == ERR_OK);
+  ASSERT_TRUE(pcb->unsent != NULL && pcb->unsent->next == NULL);
+  ASSERT_TRUE(pbuf_clen(pcb->unsent->p) == 3);
+
+  txcounters.copy_tx_packets = 1;
+  err = tcp_output(pcb);
+  ASSERT_TRUE(err == ERR_OK);
+  ASSERT_TRUE(txcounters.num_tx_calls == 1);
+  ASSERT_TRUE(txcounters.num_tx_bytes == 20 + sizeof(struct tcp_hdr));
+  ASSERT_TRUE(txcounters.tx_packets != NULL);
+  ASSERT_TRUE(txcounters.tx_packets->tot_len == 20 + sizeof(struct tcp_hdr));
+  ASSERT_TRUE(memcmp((u8_t *)txcounters.tx_packets->payload + sizeof(struct tcp_hdr), tx_data, 20) == 0);
+  pbuf_free(txcounters.tx_packets);
+  memset(&txcounters, 0, sizeof(txcounters));
+
+  tcp_abort(pcb);
+  ASSERT_TRUE(lwip_stats.memp[MEMP_TCP_PCB].used == 0);
+}
+
+/** An idle connection only comes up on the timer wheel when its keepalive is due. */
+TEST_F(LWIPTest, test_tcp_timer_wheel_keepalive)
+{
+  struct test_tcp_counters counters;
+  struct tcp_pcb* pcb;
+  ip_addr_t remote_ip, local_ip;
+  u16_t remote_port = 0x100, local_port = 0x101;
+  int i;
+
+  memset(&txcounters, 0, sizeof(txcounters));
+  memset(&counters, 0, sizeof(counters));
+
+  pcb = test_tcp_new_counters_pcb(&counters);
+  ASSERT_TRUE(pcb != NULL);
+  pcb->keep_idle = 4 * TCP_SLOW_INTERVAL;
+#if LWIP_TCP_KEEPALIVE
+  pcb->keep_intvl = 2 * TCP_SLOW_INTERVAL;
+  pcb->keep_cnt = 2;
+#endif /* LWIP_TCP_KEEPALIVE */
+  tcp_set_state(pcb, ESTABLISHED, &local_ip, &remote_ip, local_port, remote_port);
+
+  /* first probe once more than keep_idle has passed */
+  for (i = 0; i < 4; i++) {
+    tcp_slowtmr();
+    ASSERT_EQ(txcounters.num_tx_calls, 0);
+  }
+  tcp_slowtmr();
+  ASSERT_EQ(txcounters.num_tx_calls, 1);
+  ASSERT_EQ(pcb->keep_cnt_sent, 1);
+
+#if LWIP_TCP_KEEPALIVE
+  /* next probe keep_intvl later, then the connection is dropped */
+  tcp_slowtmr();
+  ASSERT_EQ(txcounters.num_tx_calls, 1);
+  tcp_slowtmr();
+  ASSERT_EQ(txcounters.num_tx_calls, 2);
+  tcp_slowtmr();
+  tcp_slowtmr();
+  ASSERT_EQ(txcounters.num_tx_calls, 3);
+  ASSERT_EQ(counters.err_calls, 1);
+  ASSERT_EQ(counters.last_err, ERR_ABRT);
+  ASSERT_TRUE(tcp_active_pcbs == NULL);
+#else /* LWIP_TCP_KEEPALIVE */
+  tcp_abort(pcb);
+#endif /* LWIP_TCP_KEEPALIVE */
+  ASSERT_TRUE(lwip_stats.memp[MEMP_TCP_PCB].used == 0);
+}
+
+static u32_t test_clock_us;
+
+static u32_t
+test_clock(void)
+{
+  return test_clock_us;
+}
+
+/** With a clock set, the RTO follows the measured RTT down to TCP_RTO_MIN
+ * and fires to the microsecond from tcp_rto_tmr(), across a clock wrap. */
+TEST_F(LWIPTest, test_tcp_rto_clock)
+{
+  struct test_tcp_counters counters;
+  struct tcp_pcb* pcb;
+  struct pbuf* p;
+  char data1[] = {1, 2, 3, 4};
+  char data2[] = {5, 6, 7, 8};
+  ip_addr_t remote_ip, local_ip;
+  u16_t remote_port = 0x100, local_port = 0x101;
+  u32_t rto;
+  err_t err;
+
+  memset(&txcounters, 0, sizeof(txcounters));
+  memset(&counters, 0, sizeof(counters));
+  test_clock_us = 0xfffff000;
+  tcp_set_clock(test_clock);
+
+  pcb = test_tcp_new_counters_pcb(&counters);
+  ASSERT_TRUE(pcb != NULL);
+  tcp_set_state(pcb, ESTABLISHED, &local_ip, &remote_ip, local_port, remote_port);
+  pcb->mss = TCP_MSS;
+  pcb->cwnd = pcb->snd_wnd;
+
+  /* data1 is acked after 20 ms: RTO = 20 + 4 * 10 ms, at least TCP_RTO_MIN */
+  err = tcp_write(pcb, data1, sizeof(data1), TCP_WRITE_FLAG_COPY);
+  ASSERT_EQ(err, ERR_OK);
+  ASSERT_EQ(tcp_output(pcb), ERR_OK);
+  ASSERT_EQ(txcounters.num_tx_calls, 1);
+  ASSERT_EQ(tcp_rto_next(), 3000 * 1000);
+  test_clock_us += 20 * 1000;
+  tcp_create_rx_segment(pcb, NULL, 0, 0, 4, TCP_ACK, &p);
+  ASSERT_TRUE(p != NULL);
+  tcp_input(remote_ip, remote_port, p);
+  ASSERT_TRUE(pcb->unacked == NULL);
+  ASSERT_EQ(tcp_rto_next(), -1);
+  rto = LWIP_MAX(60, TCP_RTO_MIN);
+  ASSERT_EQ(pcb->rto, rto);
+
+  /* data2 is lost */
+  memset(&txcounters, 0, sizeof(txcounters));
+  err = tcp_write(pcb, data2, sizeof(data2), TCP_WRITE_FLAG_COPY);
+  ASSERT_EQ(err, ERR_OK);
+  ASSERT_EQ(tcp_output(pcb), ERR_OK);
+  ASSERT_EQ(txcounters.num_tx_calls, 1);
+  ASSERT_EQ(tcp_rto_next(), (s32_t)(rto * 1000));
+
+  test_clock_us += rto * 1000 - 1;
+  tcp_rto_tmr();
+  ASSERT_EQ(txcounters.num_tx_calls, 1);
+  ASSERT_EQ(tcp_rto_next(), 1);
+  test_clock_us += 1;
+  tcp_rto_tmr();
+  ASSERT_EQ(txcounters.num_tx_calls, 2);
+  ASSERT_EQ(pcb->nrtx, 1);
+  /* backed off */
+  ASSERT_EQ(pcb->rto, rto << 1);
+  ASSERT_EQ(tcp_rto_next(), (s32_t)(pcb->rto * 1000));
+
+  ASSERT_EQ(lwip_stats.memp[MEMP_TCP_PCB].used, 1);
+  tcp_abort(pcb);
+  ASSERT_EQ(tcp_rto_next(), -1);
+  ASSERT_TRUE(lwip_stats.memp[MEMP_TCP_PCB].used == 0);
+}
+
+#if LWIP_TCP_TURBO
+/** Turbo mode: the RTO is a few SRTTs and does not back off, data is acked
+ * at once, Nagle is off and the second dupack triggers fast retransmit. */
+TEST_F(LWIPTest, test_tcp_turbo)
+{
+  struct test_tcp_counters counters;
+  struct tcp_pcb* pcb;
+  struct pbuf* p;
+  char data1[] = {1, 2, 3, 4};
+  char data2[] = {5, 6, 7, 8};
+  char data3[] = {9, 10, 11, 12};
+  ip_addr_t remote_ip, local_ip;
+  u16_t remote_port = 0x100, local_port = 0x101;
+  u32_t rto;
+  err_t err;
+  int i;
+
+  memset(&txcounters, 0, sizeof(txcounters));
+  memset(&counters, 0, sizeof(counters));
+  test_clock_us = 0;
+  tcp_set_clock(test_clock);
+
+  pcb = test_tcp_new_counters_pcb(&counters);
+  ASSERT_TRUE(pcb != NULL);
+  tcp_set_state(pcb, ESTABLISHED, &local_ip, &remote_ip, local_port, remote_port);
+  pcb->mss = TCP_MSS;
+  pcb->cwnd = pcb->snd_wnd;
+  ASSERT_EQ(pcb->dupthresh, 3);
+  tcp_set_turbo(pcb, 1);
+  ASSERT_TRUE(tcp_turbo_enabled(pcb));
+  ASSERT_TRUE(tcp_nagle_disabled(pcb));
+  ASSERT_EQ(pcb->dupthresh, TCP_TURBO_DUPTHRESH);
+
+  /* data1 is acked after 40 ms: RTO = 40 + 4 * 20 ms, capped at 2 SRTTs */
+  err = tcp_write(pcb, data1, sizeof(data1), TCP_WRITE_FLAG_COPY);
+  ASSERT_EQ(err, ERR_OK);
+  ASSERT_EQ(tcp_output(pcb), ERR_OK);
+  test_clock_us += 40 * 1000;
+  tcp_create_rx_segment(pcb, NULL, 0, 0, 4, TCP_ACK, &p);
+  tcp_input(remote_ip, remote_port, p);
+  ASSERT_TRUE(pcb->unacked == NULL);
+  rto = LWIP_MAX(LWIP_MIN(120, 40 * TCP_TURBO_RTO_SRTT), TCP_TURBO_RTO_MIN);
+  ASSERT_EQ(pcb->rto, rto);
+
+  /* incoming data is acked right away */
+  memset(&txcounters, 0, sizeof(txcounters));
+  tcp_create_rx_segment(pcb, data1, sizeof(data1), 0, 0, TCP_ACK, &p);
+  tcp_input(remote_ip, remote_port, p);
+  ASSERT_EQ(counters.recv_calls, 1);
+  ASSERT_EQ(txcounters.num_tx_calls, 1);
+  ASSERT_FALSE(pcb->flags & TF_ACK_DELAY);
+
+  /* data2 is lost, and so is every retransmission: the RTO stays put */
+  memset(&txcounters, 0, sizeof(txcounters));
+  err = tcp_write(pcb, data2, sizeof(data2), TCP_WRITE_FLAG_COPY);
+  ASSERT_EQ(err, ERR_OK);
+  ASSERT_EQ(tcp_output(pcb), ERR_OK);
+  for (i = 1; i <= 3; i++) {
+    test_clock_us += rto * 1000;
+    tcp_rto_tmr();
+    ASSERT_EQ(txcounters.num_tx_calls, 1 + i);
+    ASSERT_EQ(pcb->nrtx, i);
+    ASSERT_EQ(pcb->rto, rto);
+  }
+  tcp_create_rx_segment(pcb, NULL, 0, sizeof(data1), 4, TCP_ACK, &p);
+  tcp_input(remote_ip, remote_port, p);
+  ASSERT_TRUE(pcb->unacked == NULL);
+
+  /* three small segments go out back to back, without Nagle; the first is
+     lost and the second dupack retransmits it */
+  memset(&txcounters, 0, sizeof(txcounters));
+  pcb->cwnd = pcb->snd_wnd;
+  for (i = 0; i < 3; i++) {
+    err = tcp_write(pcb, data3, sizeof(data3), TCP_WRITE_FLAG_COPY);
+    ASSERT_EQ(err, ERR_OK);
+    ASSERT_EQ(tcp_output(pcb), ERR_OK);
+  }
+  ASSERT_EQ(txcounters.num_tx_calls, 3);
+  memset(&txcounters, 0, sizeof(txcounters));
+  tcp_create_rx_segment(pcb, NULL, 0, sizeof(data1), 0, TCP_ACK, &p);
+  tcp_input(remote_ip, remote_port, p);
+  ASSERT_EQ(txcounters.num_tx_calls, 0);
+  tcp_create_rx_segment(pcb, NULL, 0, sizeof(data1), 0, TCP_ACK, &p);
+  tcp_input(remote_ip, remote_port, p);
+  ASSERT_EQ(txcounters.num_tx_calls, 1);
+  ASSERT_TRUE(pcb->flags & TF_INFR);
+
+  tcp_set_turbo(pcb, 0);
+  ASSERT_FALSE(tcp_nagle_disabled(pcb));
+  ASSERT_EQ(pcb->dupthresh, 3);
+
+  tcp_abort(pcb);
+  ASSERT_TRUE(lwip_stats.memp[MEMP_TCP_PCB].used == 0);
+}
+#endif /* LWIP_TCP_TURBO */
+
+#if LWIP_TCP_SACK
+/** Create an ACK carrying SACK blocks, edges given as offsets from lastack */
+static void
+test_tcp_create_rx_sack(struct tcp_pcb* pcb, u32_t ackno_offset,
+                        const u32_t* edges, u8_t nblocks, struct pbuf** p)
+{
+  u8_t opts[LWIP_TCP_OPT_LEN_SACK_OUT(LWIP_TCP_SACK_MAX_BLOCKS)];
+  u8_t len = LWIP_TCP_OPT_LEN_SACK_OUT(nblocks);
+  u8_t i;
+
+  opts[0] = opts[1] = LWIP_TCP_OPT_NOP;
+  opts[2] = LWIP_TCP_OPT_SACK;
+  opts[3] = (u8_t)(len - 2);
+  for (i = 0; i < 2 * nblocks; i++) {
+    u32_t edge = htonl(pcb->lastack + edges[i]);
+    memcpy(&opts[4 + 4 * i], &edge, 4);
+  }
+  /* the options go out as payload, then the header is stretched over them */
+  tcp_create_rx_segment(pcb, opts, len, 0, ackno_offset, TCP_ACK, p);
+  ASSERT_TRUE(*p != NULL);
+  TCPH_HDRLEN_SET((struct tcp_hdr*)(*p)->payload, (sizeof(struct tcp_hdr) + len) / 4);
+}
+
+/** Out-of-sequence data is acked right away with SACK blocks, the most
+ * recently received one first. */
+TEST_F(LWIPTest, test_tcp_sack_receiver)
+{
+  struct test_tcp_counters counters;
+  struct tcp_pcb* pcb;
+  struct pbuf* p;
+  struct tcp_hdr ackhdr;
+  char data[] = {1, 2, 3, 4, 5, 6, 7, 8};
+  ip_addr_t remote_ip, local_ip;
+  u16_t remote_port = 0x100, local_port = 0x101;
+  u32_t edges[5], rcv_nxt;
+
+  memset(&txcounters, 0, sizeof(txcounters));
+  memset(&counters, 0, sizeof(counters));
+
+  pcb = test_tcp_new_counters_pcb(&counters);
+  ASSERT_TRUE(pcb != NULL);
+  tcp_set_state(pcb, ESTABLISHED, &local_ip, &remote_ip, local_port, remote_port);
+  pcb->flags |= TF_SACK;
+  rcv_nxt = pcb->rcv_nxt;
+
+  /* [8, 12) then [16, 20) arrive, [0, 8) and [12, 16) are missing */
+  tcp_create_rx_segment(pcb, data, 4, 8, 0, TCP_ACK, &p);
+  tcp_input(remote_ip, remote_port, p);
+  ASSERT_EQ(txcounters.num_tx_calls, 1);
+  txcounters.copy_tx_packets = 1;
+  tcp_create_rx_segment(pcb, data, 4, 16, 0, TCP_ACK, &p);
+  tcp_input(remote_ip, remote_port, p);
+  txcounters.copy_tx_packets = 0;
+  ASSERT_EQ(txcounters.num_tx_calls, 2);
+  ASSERT_TRUE(txcounters.tx_packets != NULL);
+  ASSERT_EQ(txcounters.tx_packets->tot_len, sizeof(struct tcp_hdr) + LWIP_TCP_OPT_LEN_SACK_OUT(2));
+  pbuf_copy_partial(txcounters.tx_packets, &ackhdr, sizeof(ackhdr), 0);
+  ASSERT_EQ(ntohl(ackhdr.ackno), rcv_nxt);
+  ASSERT_EQ(TCPH_HDRLEN(&ackhdr) * 4, txcounters.tx_packets->tot_len);
+  pbuf_copy_partial(txcounters.tx_packets, edges, sizeof(edges), sizeof(struct tcp_hdr));
+  ASSERT_EQ(ntohl(edges[0]), 0x01010512U);
+  ASSERT_EQ(ntohl(edges[1]), rcv_nxt + 16);
+  ASSERT_EQ(ntohl(edges[2]), rcv_nxt + 20);
+  ASSERT_EQ(ntohl(edges[3]), rcv_nxt + 8);
+  ASSERT_EQ(ntohl(edges[4]), rcv_nxt + 12);
+  pbuf_free(txcounters.tx_packets);
+  txcounters.tx_packets = NULL;
+
+  /* filling the holes delivers everything */
+  tcp_create_rx_segment(pcb, data, 8, 0, 0, TCP_ACK, &p);
+  tcp_input(remote_ip, remote_port, p);
+  tcp_create_rx_segment(pcb, data, 4, 0, 0, TCP_ACK, &p);
+  tcp_input(remote_ip, remote_port, p);
+  ASSERT_EQ(pcb->rcv_nxt, rcv_nxt + 20);
+  ASSERT_EQ(counters.recved_bytes, 20);
+  ASSERT_TRUE(pcb->ooseq == NULL);
+
+  tcp_abort(pcb);
+  ASSERT_TRUE(lwip_stats.memp[MEMP_TCP_PCB].used == 0);
+}
+
+/** SACK blocks showing three segments above a hole retransmit the hole on
+ * the first dupack; a partial ACK keeps recovery going, SACKed segments are
+ * not sent again. */
+TEST_F(LWIPTest, test_tcp_sack_recovery)
+{
+  struct test_tcp_counters counters;
+  struct tcp_pcb* pcb;
+  struct pbuf* p;
+  struct tcp_hdr hdr;
+  ip_addr_t remote_ip, local_ip;
+  u16_t remote_port = 0x100, local_port = 0x101;
+  u32_t iss, edges[2];
+  err_t err;
+  u16_t i;
+
+  for (i = 0; i < sizeof(tx_data); i++) {
+    tx_data[i] = (u8_t)i;
+  }
+  memset(&txcounters, 0, sizeof(txcounters));
+  memset(&counters, 0, sizeof(counters));
+
+  pcb = test_tcp_new_counters_pcb(&counters);
+  ASSERT_TRUE(pcb != NULL);
+  tcp_set_state(pcb, ESTABLISHED, &local_ip, &remote_ip, local_port, remote_port);
+  pcb->flags |= TF_SACK;
+  pcb->mss = TCP_MSS;
+  pcb->cwnd = 6 * TCP_MSS;
+  iss = pcb->lastack;
+
+  /* 6 segments out, the first one is lost */
+  for (i = 0; i < 6; i++) {
+    err = tcp_write(pcb, &tx_data[i * TCP_MSS], TCP_MSS, TCP_WRITE_FLAG_COPY);
+    ASSERT_EQ(err, ERR_OK);
+  }
+  ASSERT_EQ(tcp_output(pcb), ERR_OK);
+  ASSERT_EQ(txcounters.num_tx_calls, 6);
+  memset(&txcounters, 0, sizeof(txcounters));
+
+  /* one dupack SACKing segments 1..3 */
+  edges[0] = TCP_MSS;
+  edges[1] = 4 * TCP_MSS;
+  txcounters.copy_tx_packets = 1;
+  test_tcp_create_rx_sack(pcb, 0, edges, 1, &p);
+  tcp_input(remote_ip, remote_port, p);
+  txcounters.copy_tx_packets = 0;
+  ASSERT_EQ(pcb->sacked, 3);
+  ASSERT_TRUE(pcb->flags & TF_INFR);
+  ASSERT_EQ(txcounters.num_tx_calls, 1);
+  pbuf_copy_partial(txcounters.tx_packets, &hdr, sizeof(hdr), 0);
+  ASSERT_EQ(ntohl(hdr.seqno), iss);
+  pbuf_free(txcounters.tx_packets);
+  memset(&txcounters, 0, sizeof(txcounters));
+
+  /* partial ACK up to segment 4: still in recovery, segment 4 goes out */
+  txcounters.copy_tx_packets = 1;
+  tcp_create_rx_segment(pcb, NULL, 0, 0, 4 * TCP_MSS, TCP_ACK, &p);
+  tcp_input(remote_ip, remote_port, p);
+  txcounters.copy_tx_packets = 0;
+  ASSERT_EQ(pcb->sacked, 0);
+  ASSERT_TRUE(pcb->flags & TF_INFR);
+  ASSERT_EQ(txcounters.num_tx_calls, 1);
+  pbuf_copy_partial(txcounters.tx_packets, &hdr, sizeof(hdr), 0);
+  ASSERT_EQ(ntohl(hdr.seqno), iss + 4 * TCP_MSS);
+  pbuf_free(txcounters.tx_packets);
+  memset(&txcounters, 0, sizeof(txcounters));
+
+  /* everything acked ends recovery, cwnd deflated to ssthresh */
+  tcp_create_rx_segment(pcb, NULL, 0, 0, 2 * TCP_MSS, TCP_ACK, &p);
+  tcp_input(remote_ip, remote_port, p);
+  ASSERT_TRUE(pcb->unacked == NULL);
+  ASSERT_FALSE(pcb->flags & TF_INFR);
+  ASSERT_GE(pcb->cwnd, pcb->ssthresh);
+  ASSERT_LT(pcb->cwnd, pcb->ssthresh + TCP_MSS);
+
+  tcp_abort(pcb);
+  ASSERT_TRUE(lwip_stats.memp[MEMP_TCP_PCB].used == 0);
+}
+
+/** After an RTO only the holes are sent again: an ACK up to a SACKed
+ * segment with a hole before it on unsent keeps the marks, an ACK stopping
+ * right at a SACKed segment is reneging. */
+TEST_F(LWIPTest, test_tcp_sack_rto)
+{
+  struct test_tcp_counters counters;
+  struct tcp_pcb* pcb;
+  struct pbuf* p;
+  struct tcp_hdr hdr;
+  ip_addr_t remote_ip, local_ip;
+  u16_t remote_port = 0x100, local_port = 0x101;
+  u32_t iss, edges[4];
+  err_t err;
+  u16_t i;
+
+  for (i = 0; i < sizeof(tx_data); i++) {
+    tx_data[i] = (u8_t)i;
+  }
+  memset(&txcounters, 0, sizeof(txcounters));
+  memset(&counters, 0, sizeof(counters));
+
+  pcb = test_tcp_new_counters_pcb(&counters);
+  ASSERT_TRUE(pcb != NULL);
+  tcp_set_state(pcb, ESTABLISHED, &local_ip, &remote_ip, local_port, remote_port);
+  pcb->flags |= TF_SACK;
+  pcb->mss = TCP_MSS;
+  pcb->cwnd = 5 * TCP_MSS;
+  iss = pcb->lastack;
+
+  /* 5 segments out, segments 1 and 3 arrive */
+  for (i = 0; i < 5; i++) {
+    err = tcp_write(pcb, &tx_data[i * TCP_MSS], TCP_MSS, TCP_WRITE_FLAG_COPY);
+    ASSERT_EQ(err, ERR_OK);
+  }
+  ASSERT_EQ(tcp_output(pcb), ERR_OK);
+  ASSERT_EQ(txcounters.num_tx_calls, 5);
+  memset(&txcounters, 0, sizeof(txcounters));
+  edges[0] = TCP_MSS;
+  edges[1] = 2 * TCP_MSS;
+  edges[2] = 3 * TCP_MSS;
+  edges[3] = 4 * TCP_MSS;
+  test_tcp_create_rx_sack(pcb, 0, edges, 2, &p);
+  tcp_input(remote_ip, remote_port, p);
+  ASSERT_EQ(pcb->sacked, 2);
+
+  /* what the retransmission timer does: one segment, the first hole */
+  pcb->cc->rto(pcb);
+  txcounters.copy_tx_packets = 1;
+  tcp_rexmit_rto(pcb);
+  txcounters.copy_tx_packets = 0;
+  ASSERT_EQ(txcounters.num_tx_calls, 1);
+  pbuf_copy_partial(txcounters.tx_packets, &hdr, sizeof(hdr), 0);
+  ASSERT_EQ(ntohl(hdr.seqno), iss);
+  pbuf_free(txcounters.tx_packets);
+  memset(&txcounters, 0, sizeof(txcounters));
+  ASSERT_TRUE(pcb->unsent != NULL);
+  ASSERT_EQ(ntohl(pcb->unsent->tcphdr->seqno), iss + 2 * TCP_MSS);
+
+  /* ACK past segments 0 and 1, with segment 3 SACKed at the head of
+     unacked: the marks stay, and the hole, segment 2, goes out */
+  txcounters.copy_tx_packets = 1;
+  test_tcp_create_rx_sack(pcb, 2 * TCP_MSS, &edges[2], 1, &p);
+  tcp_input(remote_ip, remote_port, p);
+  txcounters.copy_tx_packets = 0;
+  ASSERT_EQ(pcb->lastack, iss + 2 * TCP_MSS);
+  ASSERT_EQ(pcb->sacked, 1);
+  ASSERT_GE(txcounters.num_tx_calls, 1);
+  pbuf_copy_partial(txcounters.tx_packets, &hdr, sizeof(hdr), 0);
+  ASSERT_EQ(ntohl(hdr.seqno), iss + 2 * TCP_MSS);
+  pbuf_free(txcounters.tx_packets);
+  memset(&txcounters, 0, sizeof(txcounters));
+  ASSERT_EQ(ntohl(pcb->unacked->tcphdr->seqno), iss + 2 * TCP_MSS);
+  ASSERT_TRUE(pcb->unacked->next->flags & TF_SEG_SACKED);
+
+  /* an ACK for segment 2 that stops at segment 3: the peer dropped it */
+  tcp_create_rx_segment(pcb, NULL, 0, 0, TCP_MSS, TCP_ACK, &p);
+  tcp_input(remote_ip, remote_port, p);
+  ASSERT_EQ(pcb->lastack, iss + 3 * TCP_MSS);
+  ASSERT_EQ(pcb->sacked, 0);
+  ASSERT_FALSE(pcb->unacked->flags & TF_SEG_SACKED);
+
+  tcp_abort(pcb);
+  ASSERT_TRUE(lwip_stats.memp[MEMP_TCP_PCB].used == 0);
+}
+#endif /* LWIP_TCP_SACK */
+
+/** Run rounds of a path with bandwidth bw (bytes/s) and round-trip time rtt
+ * (us) through the congestion control of pcb: each round sends cwnd and gets
+ * it acked segment by segment, later once cwnd queues at the bottleneck. */
+static void
+test_tcp_cc_rounds(struct tcp_pcb* pcb, int rounds, u32_t bw, u32_t rtt)
+{
+  int r, i, n;
+  u32_t elapsed;
+
+  for (r = 0; r < rounds; r++) {
+    n = LWIP_MAX(pcb->cwnd / pcb->mss, 1);
+    pcb->snd_nxt = pcb->lastack + n * pcb->mss;
+    elapsed = LWIP_MAX(rtt, (u32_t)((u64_t)n * pcb->mss * 1000000 / bw));
+    for (i = 0; i < n; i++) {
+      test_clock_us += elapsed / n;
+      pcb->lastack += pcb->mss;
+      pcb->cc->ack(pcb, pcb->mss);
+      if (i == 0 && pcb->cc->rtt != NULL) {
+        pcb->cc->rtt(pcb, elapsed);
+      }
+    }
+  }
+}
+
+/** After a loss at a large window on a long RTT path, CUBIC is back at the
+ * old window after K seconds, long before Reno's one segment per RTT. */
+TEST_F(LWIPTest, test_tcp_cc_cubic)
+{
+  struct test_tcp_counters counters;
+  struct tcp_pcb* pcb;
+  ip_addr_t remote_ip, local_ip;
+  u16_t remote_port = 0x100, local_port = 0x101;
+  const struct tcp_cc_ops* cc[] = {&tcp_cc_newreno, tcp_cc_find("cubic")};
+  tcpwnd_size_t cwnd[2];
+  u32_t w_max = 100 * TCP_MSS;
+  int i;
+
+  ASSERT_TRUE(cc[1] != NULL);
+  ASSERT_TRUE(tcp_cc_find("none") == NULL);
+  memset(&counters, 0, sizeof(counters));
+  test_clock_us = 0;
+  tcp_set_clock(test_clock);
+
+  for (i = 0; i < 2; i++) {
+    pcb = test_tcp_new_counters_pcb(&counters);
+    ASSERT_TRUE(pcb != NULL);
+    tcp_set_state(pcb, ESTABLISHED, &local_ip, &remote_ip, local_port, remote_port);
+    pcb->mss = TCP_MSS;
+    pcb->snd_wnd = 0xffff;
+    pcb->sa = (200 * 1000) << 3;
+    tcp_set_cc(pcb, cc[i]);
+    ASSERT_TRUE(pcb->cc == cc[i]);
+
+    /* fast retransmit at w_max, recovery ends */
+    pcb->cwnd = (tcpwnd_size_t)w_max;
+    pcb->cc->loss(pcb);
+    ASSERT_EQ(pcb->cwnd, pcb->ssthresh + 3 * TCP_MSS);
+    pcb->cwnd = pcb->ssthresh;
+
+    /* 5 seconds at 200 ms */
+    test_tcp_cc_rounds(pcb, 25, 0xffffffff, 200 * 1000);
+    cwnd[i] = pcb->cwnd;
+    tcp_abort(pcb);
+  }
+  /* Reno: half the window, one segment per RTT back */
+  ASSERT_LT(cwnd[0], (50 + 26) * TCP_MSS);
+  /* CUBIC: 70%, W_max again after K = cbrt(30 / 0.4) = 4.2 s */
+  ASSERT_GE(cwnd[1], w_max);
+  ASSERT_LT(cwnd[1], w_max + 10 * TCP_MSS);
+  ASSERT_TRUE(lwip_stats.memp[MEMP_TCP_PCB].used == 0);
+}
+
+/** BBR starts up until the delivery rate stops growing, then keeps about
+ * twice the bandwidth-delay product in flight, whatever the window was. */
+TEST_F(LWIPTest, test_tcp_cc_bbr)
+{
+  struct test_tcp_counters counters;
+  struct tcp_pcb* pcb;
+  ip_addr_t remote_ip, local_ip;
+  u16_t remote_port = 0x100, local_port = 0x101;
+  const struct tcp_cc_ops* bbr = tcp_cc_find("bbr");
+  /* 5 MB/s, 4 ms: 20000 bytes */
+  u32_t bdp = 5000000 / 1000 * 4;
+
+  ASSERT_TRUE(bbr != NULL);
+  memset(&counters, 0, sizeof(counters));
+  test_clock_us = 0;
+  tcp_set_clock(test_clock);
+
+  pcb = test_tcp_new_counters_pcb(&counters);
+  ASSERT_TRUE(pcb != NULL);
+  tcp_set_state(pcb, ESTABLISHED, &local_ip, &remote_ip, local_port, remote_port);
+  pcb->mss = TCP_MSS;
+  pcb->cwnd = 4 * TCP_MSS;
+  tcp_set_cc(pcb, bbr);
+
+  /* startup grows the window exponentially */
+  test_tcp_cc_rounds(pcb, 4, 5000000, 4000);
+  ASSERT_GE(pcb->cwnd, 32 * TCP_MSS);
+
+  test_tcp_cc_rounds(pcb, 50, 5000000, 4000);
+  ASSERT_GT(pcb->cwnd, bdp * 3 / 2);
+  ASSERT_LT(pcb->cwnd, bdp * 3);
+
+  /* a loss leaves the window alone, an RTO starts it over */
+  pcb->cc->loss(pcb);
+  ASSERT_EQ(pcb->ssthresh, pcb->cwnd);
+  pcb->cc->rto(pcb);
+  ASSERT_EQ(pcb->cwnd, TCP_MSS);
+  test_tcp_cc_rounds(pcb, 1, 5000000, 4000);
+  ASSERT_GT(pcb->cwnd, bdp * 3 / 2);
+
+  /* the minimum RTT is measured again after 10 s with 4 segments */
+  test_clock_us += 10 * 1000 * 1000;
+  test_tcp_cc_rounds(pcb, 1, 5000000, 4000);
+  ASSERT_EQ(TCP_CC_CWND(pcb), 4 * TCP_MSS);
+  test_clock_us += 200 * 1000;
+  test_tcp_cc_rounds(pcb, 2, 5000000, 4000);
+  ASSERT_GT(TCP_CC_CWND(pcb), bdp * 3 / 2);
+
+  tcp_abort(pcb);
+  ASSERT_TRUE(lwip_stats.memp[MEMP_TCP_PCB].used == 0);
+}
+
+#if LWIP_TCP_RACK
+/** A lost tail is probed for two SRTTs after it was sent, and the SACK for
+ * the probe has RACK find the segments before it lost. */
+TEST_F(LWIPTest, test_tcp_rack_tlp)
+{
+  struct test_tcp_counters counters;
+  struct tcp_pcb* pcb;
+  struct pbuf* p;
+  struct tcp_hdr hdr;
+  char data1[] = {1, 2, 3, 4};
+  ip_addr_t remote_ip, local_ip;
+  u16_t remote_port = 0x100, local_port = 0x101;
+  u32_t iss, edges[2];
+  err_t err;
+  u16_t i;
+
+  memset(&txcounters, 0, sizeof(txcounters));
+  memset(&counters, 0, sizeof(counters));
+  test_clock_us = 0;
+  tcp_set_clock(test_clock);
+
+  pcb = test_tcp_new_counters_pcb(&counters);
+  ASSERT_TRUE(pcb != NULL);
+  tcp_set_state(pcb, ESTABLISHED, &local_ip, &remote_ip, local_port, remote_port);
+  pcb->flags |= TF_SACK;
+  pcb->mss = TCP_MSS;
+  pcb->cwnd = 6 * TCP_MSS;
+
+  /* an RTT of 10 ms: the RTO is TCP_RTO_MIN, the probe is due after 20 ms */
+  err = tcp_write(pcb, data1, sizeof(data1), TCP_WRITE_FLAG_COPY);
+  ASSERT_EQ(err, ERR_OK);
+  ASSERT_EQ(tcp_output(pcb), ERR_OK);
+  test_clock_us += 10 * 1000;
+  tcp_create_rx_segment(pcb, NULL, 0, 0, sizeof(data1), TCP_ACK, &p);
+  tcp_input(remote_ip, remote_port, p);
+  ASSERT_TRUE(pcb->unacked == NULL);
+  iss = pcb->lastack;
+
+  /* 4 segments out, none acked */
+  memset(&txcounters, 0, sizeof(txcounters));
+  for (i = 0; i < 4; i++) {
+    err = tcp_write(pcb, &tx_data[i * TCP_MSS], TCP_MSS, TCP_WRITE_FLAG_COPY);
+    ASSERT_EQ(err, ERR_OK);
+  }
+  ASSERT_EQ(tcp_output(pcb), ERR_OK);
+  ASSERT_EQ(txcounters.num_tx_calls, 4);
+  ASSERT_EQ(tcp_rto_next(), 2 * (pcb->sa >> 3));
+
+  /* the probe is the last segment, then the RTO runs */
+  memset(&txcounters, 0, sizeof(txcounters));
+  txcounters.copy_tx_packets = 1;
+  test_clock_us += 20 * 1000;
+  tcp_rto_tmr();
+  txcounters.copy_tx_packets = 0;
+  ASSERT_EQ(txcounters.num_tx_calls, 1);
+  pbuf_copy_partial(txcounters.tx_packets, &hdr, sizeof(hdr), 0);
+  ASSERT_EQ(ntohl(hdr.seqno), iss + 3 * TCP_MSS);
+  pbuf_free(txcounters.tx_packets);
+  ASSERT_EQ(pcb->nrtx, 0);
+  ASSERT_EQ(tcp_rto_next(), (s32_t)(pcb->rto * 1000));
+
+  /* it is SACKed an RTT later: the 3 segments sent before it are lost, and
+     retransmitted in fast recovery */
+  memset(&txcounters, 0, sizeof(txcounters));
+  txcounters.copy_tx_packets = 1;
+  test_clock_us += 10 * 1000;
+  edges[0] = 3 * TCP_MSS;
+  edges[1] = 4 * TCP_MSS;
+  test_tcp_create_rx_sack(pcb, 0, edges, 1, &p);
+  tcp_input(remote_ip, remote_port, p);
+  txcounters.copy_tx_packets = 0;
+  ASSERT_TRUE(pcb->flags & TF_INFR);
+  ASSERT_EQ(txcounters.num_tx_calls, 3);
+  pbuf_copy_partial(txcounters.tx_packets, &hdr, sizeof(hdr), 0);
+  ASSERT_EQ(ntohl(hdr.seqno), iss);
+  pbuf_free(txcounters.tx_packets);
+
+  /* all acked: recovery and the probe episode are over */
+  tcp_create_rx_segment(pcb, NULL, 0, 0, 4 * TCP_MSS, TCP_ACK, &p);
+  tcp_input(remote_ip, remote_port, p);
+  ASSERT_TRUE(pcb->unacked == NULL);
+  ASSERT_FALSE(pcb->flags & TF_INFR);
+  ASSERT_EQ(pcb->tlp_out, 0);
+  ASSERT_EQ(tcp_rto_next(), -1);
+
+  tcp_abort(pcb);
+  ASSERT_TRUE(lwip_stats.memp[MEMP_TCP_PCB].used == 0);
+}
+
+TEST_F(LWIPTest, test_tcp_rack_tlp_rto)
+{
+  struct test_tcp_counters counters;
+  struct tcp_pcb* pcb;
+  struct pbuf* p;
+  char data1[] = {1, 2, 3, 4};
+  ip_addr_t remote_ip, local_ip;
+  u16_t remote_port = 0x100, local_port = 0x101;
+  err_t err;
+
+  memset(&txcounters, 0, sizeof(txcounters));
+  memset(&counters, 0, sizeof(counters));
+  test_clock_us = 0;
+  tcp_set_clock(test_clock);
+
+  pcb = test_tcp_new_counters_pcb(&counters);
+  ASSERT_TRUE(pcb != NULL);
+  tcp_set_state(pcb, ESTABLISHED, &local_ip, &remote_ip, local_port, remote_port);
+  pcb->flags |= TF_SACK;
+  pcb->mss = TCP_MSS;
+  pcb->cwnd = 6 * TCP_MSS;
+
+  /* an RTT of 10 ms */
+  err = tcp_write(pcb, data1, sizeof(data1), TCP_WRITE_FLAG_COPY);
+  ASSERT_EQ(err, ERR_OK);
+  ASSERT_EQ(tcp_output(pcb), ERR_OK);
+  test_clock_us += 10 * 1000;
+  tcp_create_rx_segment(pcb, NULL, 0, 0, sizeof(data1), TCP_ACK, &p);
+  tcp_input(remote_ip, remote_port, p);
+  ASSERT_TRUE(pcb->unacked == NULL);
+
+  /* the probe time-out of a single segment, with the delayed ACK, is longer
+     than an RTO of 15 ms: the probe is due when the RTO would be */
+  pcb->rto = 15;
+  err = tcp_write(pcb, tx_data, TCP_MSS, TCP_WRITE_FLAG_COPY);
+  ASSERT_EQ(err, ERR_OK);
+  ASSERT_EQ(tcp_output(pcb), ERR_OK);
+  ASSERT_EQ(pcb->rto_kind, TCP_RTO_KIND_TLP);
+  ASSERT_EQ(tcp_rto_next(), 15 * 1000);
+
+  /* a segment sent while an RTO runs gets its probe before that fires */
+  tcp_rto_arm(pcb, 5 * 1000, TCP_RTO_KIND_RTO);
+  err = tcp_write(pcb, &tx_data[TCP_MSS], TCP_MSS, TCP_WRITE_FLAG_COPY);
+  ASSERT_EQ(err, ERR_OK);
+  ASSERT_EQ(tcp_output(pcb), ERR_OK);
+  ASSERT_EQ(pcb->rto_kind, TCP_RTO_KIND_TLP);
+  ASSERT_EQ(tcp_rto_next(), 5 * 1000);
+
+  /* which sends the last segment again, not a retransmission time-out */
+  memset(&txcounters, 0, sizeof(txcounters));
+  test_clock_us += 5 * 1000;
+  tcp_rto_tmr();
+  ASSERT_EQ(txcounters.num_tx_calls, 1);
+  ASSERT_EQ(pcb->nrtx, 0);
+  ASSERT_EQ(pcb->tlp_out, 1);
+  ASSERT_EQ(pcb->rto_kind, TCP_RTO_KIND_RTO);
+
+  tcp_abort(pcb);
+  ASSERT_TRUE(lwip_stats.memp[MEMP_TCP_PCB].used == 0);
+}
+#endif /* LWIP_TCP_RACK */
+
+#if LWIP_TCP_FEC
+/** Pass datagram number n of the chain sent by one pcb to the pcb with
+ * connid2, i.e. its peer */
+static void
+test_tcp_fec_deliver(struct pbuf* sent, int n, u32_t connid2,
+                     ip_addr_t remote_ip, u16_t remote_port)
+{
+  struct pbuf *q, *p;
+  struct tcp_hdr* hdr;
+
+  for (q = sent; n > 0; n--) {
+    q = q->next;
+  }
+  p = pbuf_alloc(PBUF_RAW, q->len, PBUF_RAM);
+  ASSERT_TRUE(p != NULL);
+  MEMCPY(p->payload, q->payload, q->len);
+  hdr = (struct tcp_hdr*)p->payload;
+  hdr->connid2 = htonl(connid2);
+  tcp_input(remote_ip, remote_port, p);
+}
+
+/** Lost data segments are rebuilt from the parity that follows the group,
+ * one per parity: 4 segments and 1 parity, then 4 and 2 interleaved. */
+TEST_F(LWIPTest, test_tcp_fec)
+{
+  struct test_tcp_counters counters[2];
+  struct tcp_pcb *tx, *rx;
+  struct tcp_hdr hdr;
+  ip_addr_t remote_ip, local_ip;
+  u16_t remote_port = 0x100, local_port = 0x101;
+  err_t err;
+  int i;
+
+  memset(&txcounters, 0, sizeof(txcounters));
+  memset(counters, 0, sizeof(counters));
+  counters[1].expected_data = (char*)tx_data;
+  counters[1].expected_data_len = 8 * TCP_MSS;
+  for (i = 0; i < (int)sizeof(tx_data); i++) {
+    tx_data[i] = (u8_t)(i * 7);
+  }
+  tx = test_tcp_new_counters_pcb(&counters[0]);
+  rx = test_tcp_new_counters_pcb(&counters[1]);
+  ASSERT_TRUE(tx != NULL && rx != NULL);
+  tx->conn_id.connid1 = rx->conn_id.connid1 = 4000;
+  tx->conn_id.connid2 = 1;
+  rx->conn_id.connid2 = 2;
+  tcp_set_state(tx, ESTABLISHED, &local_ip, &remote_ip, local_port, remote_port);
+  tcp_set_state(rx, ESTABLISHED, &local_ip, &remote_ip, local_port, remote_port);
+  tx->mss = TCP_MSS;
+  tx->cwnd = 10 * TCP_MSS;
+  tx->rcv_nxt = rx->snd_nxt;
+  rx->rcv_nxt = rx->rcv_ann_right_edge = tx->snd_nxt;
+  ASSERT_EQ(tcp_set_fec(tx, 4, 5), ERR_VAL);
+  ASSERT_EQ(tcp_set_fec(tx, 4, 1), ERR_OK);
+  ASSERT_EQ(tcp_set_fec(rx, 4, 1), ERR_OK);
+
+  /* the third segment is lost */
+  txcounters.copy_tx_packets = 1;
+  err = tcp_write(tx, tx_data, 4 * TCP_MSS, TCP_WRITE_FLAG_COPY);
+  ASSERT_EQ(err, ERR_OK);
+  ASSERT_EQ(tcp_output(tx), ERR_OK);
+  txcounters.copy_tx_packets = 0;
+  ASSERT_EQ(txcounters.num_tx_calls, 5);
+  pbuf_copy_partial(txcounters.tx_packets, &hdr, sizeof(hdr), 4 * (TCP_HLEN + TCP_MSS));
+  ASSERT_TRUE(TCPH_FEC(&hdr));
+  for (i = 0; i < 5; i++) {
+    if (i != 2) {
+      test_tcp_fec_deliver(txcounters.tx_packets, i, 2, remote_ip, remote_port);
+    }
+  }
+  ASSERT_EQ(counters[1].recved_bytes, 4 * TCP_MSS);
+  pbuf_free(txcounters.tx_packets);
+  txcounters.tx_packets = NULL;
+
+  /* two parities over alternate segments: the first two are lost */
+  ASSERT_EQ(tcp_set_fec(tx, 4, 2), ERR_OK);
+  ASSERT_EQ(tcp_set_fec(rx, 4, 2), ERR_OK);
+  memset(&txcounters, 0, sizeof(txcounters));
+  txcounters.copy_tx_packets = 1;
+  err = tcp_write(tx, &tx_data[4 * TCP_MSS], 4 * TCP_MSS, TCP_WRITE_FLAG_COPY);
+  ASSERT_EQ(err, ERR_OK);
+  ASSERT_EQ(tcp_output(tx), ERR_OK);
+  txcounters.copy_tx_packets = 0;
+  ASSERT_EQ(txcounters.num_tx_calls, 6);
+  for (i = 2; i < 6; i++) {
+    test_tcp_fec_deliver(txcounters.tx_packets, i, 2, remote_ip, remote_port);
+  }
+  ASSERT_EQ(counters[1].recved_bytes, 8 * TCP_MSS);
+  ASSERT_TRUE(rx->ooseq == NULL);
+  pbuf_free(txcounters.tx_packets);
+
+  tcp_abort(tx);
+  tcp_abort(rx);
+  ASSERT_TRUE(lwip_stats.memp[MEMP_TCP_PCB].used == 0);
+}
+#endif /* LWIP_TCP_FEC */
+
+#if LWIP_WND_SCALE
+/** A receive window set with tcp_set_bufsize() beyond 64 KB: the SYN offers
+ * window scaling and announces 64 KB, the SYN/ACK agrees, and from then on
+ * windows are scaled both ways. A larger window is announced right away. */
+TEST_F(LWIPTest, test_tcp_wnd_scale)
+{
+  struct test_tcp_counters counters;
+  struct tcp_pcb* pcb;
+  struct pbuf* p;
+  struct tcp_hdr hdr;
+  /* NOP, window scale 2 */
+  u8_t opts[] = {1, 3, 3, 2};
+  ip_addr_t remote_ip, local_ip;
+  u16_t remote_port = 0x100;
+  err_t err;
+
+  memset(&txcounters, 0, sizeof(txcounters));
+  memset(&counters, 0, sizeof(counters));
+  memset(&remote_ip, 0, sizeof(remote_ip));
+  memset(&local_ip, 0, sizeof(local_ip));
+  pcb = test_tcp_new_counters_pcb(&counters);
+  ASSERT_TRUE(pcb != NULL);
+  ASSERT_EQ(tcp_set_bufsize(pcb, 0, TCP_RCV_WND_LIMIT + 1), ERR_VAL);
+  ASSERT_EQ(tcp_set_bufsize(pcb, 64 * TCP_MSS, 256 * 1024), ERR_OK);
+  ASSERT_EQ(pcb->snd_buf, 64 * TCP_MSS);
+  ASSERT_EQ(pcb->rcv_wnd, 0xFFFF);
+
+  txcounters.copy_tx_packets = 1;
+  ASSERT_EQ(tcp_connect(pcb, &remote_ip, remote_port, NULL), ERR_OK);
+  txcounters.copy_tx_packets = 0;
+  ASSERT_EQ(txcounters.num_tx_calls, 1);
+  pbuf_copy_partial(txcounters.tx_packets, &hdr, sizeof(hdr), 0);
+  ASSERT_TRUE(TCPH_FLAGS(&hdr) & TCP_SYN);
+  ASSERT_EQ(ntohs(hdr.wnd), 0xFFFF);
+  ASSERT_GT(TCPH_HDRLEN(&hdr), 5);
+  pbuf_free(txcounters.tx_packets);
+  ASSERT_EQ(tcp_set_bufsize(pcb, 0, 512 * 1024), ERR_INPROGRESS);
+
+  /* SYN/ACK with a window of 1000, not scaled */
+  memset(&txcounters, 0, sizeof(txcounters));
+  txcounters.copy_tx_packets = 1;
+  tcp_create_rx_segment_wnd(pcb, opts, sizeof(opts), 1000, 1, TCP_SYN | TCP_ACK, 1000, &p);
+  TCPH_HDRLEN_SET((struct tcp_hdr*)p->payload, 6);
+  tcp_input(remote_ip, remote_port, p);
+  txcounters.copy_tx_packets = 0;
+  ASSERT_EQ(pcb->state, ESTABLISHED);
+  ASSERT_TRUE(pcb->flags & TF_WND_SCALE);
+  ASSERT_EQ(pcb->snd_scale, 2);
+  ASSERT_EQ(pcb->snd_wnd, 1000);
+  ASSERT_EQ(pcb->rcv_wnd, 256 * 1024);
+  ASSERT_EQ(txcounters.num_tx_calls, 1);
+  pbuf_copy_partial(txcounters.tx_packets, &hdr, sizeof(hdr), 0);
+  ASSERT_EQ(ntohs(hdr.wnd), (256 * 1024) >> TCP_RCV_SCALE);
+  pbuf_free(txcounters.tx_packets);
+
+  /* then the peer's windows are scaled */
+  tcp_create_rx_segment_wnd(pcb, NULL, 0, 0, 0, TCP_ACK, 1000, &p);
+  tcp_input(remote_ip, remote_port, p);
+  ASSERT_EQ(pcb->snd_wnd, 4000);
+
+  /* doubling the window announces it */
+  memset(&txcounters, 0, sizeof(txcounters));
+  txcounters.copy_tx_packets = 1;
+  ASSERT_EQ(tcp_set_bufsize(pcb, 0, 512 * 1024), ERR_OK);
+  txcounters.copy_tx_packets = 0;
+  ASSERT_EQ(pcb->rcv_wnd, 512 * 1024);
+  ASSERT_EQ(txcounters.num_tx_calls, 1);
+  pbuf_copy_partial(txcounters.tx_packets, &hdr, sizeof(hdr), 0);
+  ASSERT_EQ(ntohs(hdr.wnd), (512 * 1024) >> TCP_RCV_SCALE);
+  pbuf_free(txcounters.tx_packets);
+
+  /* the send buffer cannot shrink below the data not acked */
+  err = tcp_write(pcb, tx_data, 4 * TCP_MSS, TCP_WRITE_FLAG_COPY);
+  ASSERT_EQ(err, ERR_OK);
+  ASSERT_EQ(tcp_set_bufsize(pcb, 3 * TCP_MSS, 0), ERR_VAL);
+  ASSERT_EQ(tcp_set_bufsize(pcb, 8 * TCP_MSS, 0), ERR_OK);
+  ASSERT_EQ(pcb->snd_buf, 4 * TCP_MSS);
+
+  tcp_abort(pcb);
+  ASSERT_TRUE(lwip_stats.memp[MEMP_TCP_PCB].used == 0);
+}
+#endif /* LWIP_WND_SCALE */
+
+#if LWIP_TCP_RCV_AUTOTUNE && LWIP_WND_SCALE
+/** Receive a window of data per 10 ms round, read after each round: the
+ * receive RTT is measured and the window grows with what was read, until
+ * tcp_set_bufsize() fixes it. */
+TEST_F(LWIPTest, test_tcp_rcv_autotune)
+{
+  struct test_tcp_counters counters;
+  struct tcp_pcb* pcb;
+  struct pbuf* p;
+  ip_addr_t remote_ip, local_ip;
+  u16_t remote_port = 0x100, local_port = 0x101;
+  u16_t i, n;
+  int round;
+
+  memset(&counters, 0, sizeof(counters));
+  test_clock_us = 0;
+  tcp_set_clock(test_clock);
+
+  pcb = test_tcp_new_counters_pcb(&counters);
+  ASSERT_TRUE(pcb != NULL);
+  tcp_set_state(pcb, ESTABLISHED, &local_ip, &remote_ip, local_port, remote_port);
+  pcb->flags |= TF_WND_SCALE;
+  pcb->rcv_scale = TCP_RCV_SCALE;
+
+  for (round = 0; round < 8; round++) {
+    test_clock_us += 10 * 1000;
+    n = (u16_t)(pcb->rcv_wnd / TCP_MSS);
+    for (i = 0; i < n; i++) {
+      tcp_create_rx_segment(pcb, tx_data, TCP_MSS, 0, 0, TCP_ACK, &p);
+      tcp_input(remote_ip, remote_port, p);
+    }
+    for (i = 0; i < n; i++) {
+      tcp_recved(pcb, TCP_MSS);
+    }
+    if (round >= 1) {
+      ASSERT_NEAR(pcb->rcv_rtt, 10 * 1000, 1);
+    }
+  }
+  /* a read is counted in the RTT it is made in: reading each round at once
+     grows the window to twice that round every other round */
+  ASSERT_EQ(pcb->rcv_wnd, pcb->rcv_wnd_size);
+  ASSERT_GT(pcb->rcv_wnd_size, 32 * TCP_WND);
+
+  /* set by the application: autotuning stops */
+  ASSERT_EQ(tcp_set_bufsize(pcb, 0, 16 * TCP_WND), ERR_OK);
+  for (round = 0; round < 2; round++) {
+    test_clock_us += 10 * 1000;
+    n = (u16_t)(pcb->rcv_wnd / TCP_MSS);
+    for (i = 0; i < n; i++) {
+      tcp_create_rx_segment(pcb, tx_data, TCP_MSS, 0, 0, TCP_ACK, &p);
+      tcp_input(remote_ip, remote_port, p);
+      tcp_recved(pcb, TCP_MSS);
+    }
+  }
+  ASSERT_EQ(pcb->rcv_wnd_size, 16 * TCP_WND);
+
+  tcp_abort(pcb);
+  ASSERT_TRUE(lwip_stats.memp[MEMP_TCP_PCB].used == 0);
+}
+#endif /* LWIP_TCP_RCV_AUTOTUNE && LWIP_WND_SCALE */
+
+#if LWIP_TCP_SND_AUTOTUNE
+/** The send buffer grows to twice the window in flight as ACKs grow cwnd,
+ * does not shrink when the peer's window does, and stays as it is once set
+ * with tcp_set_bufsize(). */
+TEST_F(LWIPTest, test_tcp_snd_autotune)
+{
+  struct test_tcp_counters counters;
+  struct tcp_pcb* pcb;
+  struct pbuf* p;
+  ip_addr_t remote_ip, local_ip;
+  u16_t remote_port = 0x100, local_port = 0x101;
+  err_t err;
+
+  memset(&txcounters, 0, sizeof(txcounters));
+  memset(&counters, 0, sizeof(counters));
+
+  pcb = test_tcp_new_counters_pcb(&counters);
+  ASSERT_TRUE(pcb != NULL);
+  tcp_set_state(pcb, ESTABLISHED, &local_ip, &remote_ip, local_port, remote_port);
+  pcb->mss = TCP_MSS;
+  pcb->cwnd = 10 * TCP_MSS;
+  pcb->ssthresh = 100 * TCP_MSS;
+  pcb->snd_wnd = 0xFFFF;
+  ASSERT_EQ(pcb->snd_buf_size, TCP_SND_BUF);
+
+  /* slow start: one ACK adds a segment to cwnd, two to the send buffer */
+  err = tcp_write(pcb, tx_data, 8 * TCP_MSS, TCP_WRITE_FLAG_COPY);
+  ASSERT_EQ(err, ERR_OK);
+  ASSERT_EQ(tcp_output(pcb), ERR_OK);
+  tcp_create_rx_segment_wnd(pcb, NULL, 0, 0, 8 * TCP_MSS, TCP_ACK, 0xFFFF, &p);
+  tcp_input(remote_ip, remote_port, p);
+  ASSERT_EQ(pcb->cwnd, 11 * TCP_MSS);
+  ASSERT_EQ(pcb->snd_buf_size, 22 * TCP_MSS);
+  ASSERT_EQ(pcb->snd_buf, 22 * TCP_MSS);
+
+  /* limited by the peer's window: no growth, and no shrinking */
+  err = tcp_write(pcb, tx_data, 4 * TCP_MSS, TCP_WRITE_FLAG_COPY);
+  ASSERT_EQ(err, ERR_OK);
+  ASSERT_EQ(tcp_output(pcb), ERR_OK);
+  tcp_create_rx_segment_wnd(pcb, NULL, 0, 0, 4 * TCP_MSS, TCP_ACK, 4 * TCP_MSS, &p);
+  tcp_input(remote_ip, remote_port, p);
+  ASSERT_EQ(pcb->cwnd, 12 * TCP_MSS);
+  ASSERT_EQ(pcb->snd_buf_size, 22 * TCP_MSS);
+
+  /* set by the application: autotuning stops */
+  ASSERT_EQ(tcp_set_bufsize(pcb, 16 * TCP_MSS, 0), ERR_OK);
+  err = tcp_write(pcb, tx_data, 4 * TCP_MSS, TCP_WRITE_FLAG_COPY);
+  ASSERT_EQ(err, ERR_OK);
+  ASSERT_EQ(tcp_output(pcb), ERR_OK);
+  tcp_create_rx_segment_wnd(pcb, NULL, 0, 0, 4 * TCP_MSS, TCP_ACK, 0xFFFF, &p);
+  tcp_input(remote_ip, remote_port, p);
+  ASSERT_EQ(pcb->cwnd, 13 * TCP_MSS);
+  ASSERT_EQ(pcb->snd_buf_size, 16 * TCP_MSS);
+  ASSERT_EQ(pcb->snd_buf, 16 * TCP_MSS);
+
+  tcp_abort(pcb);
+  ASSERT_TRUE(lwip_stats.memp[MEMP_TCP_PCB].used == 0);
+}
+#endif /* LWIP_TCP_SND_AUTOTUNE */
+
+#if LWIP_WND_SCALE
+/** A write beyond 64 KB is taken by one tcp_write() and cut into MSS sized
+ * segments in one pass. */
+TEST_F(LWIPTest, test_tcp_write_large)
+{
+  static u8_t big[100 * 1024];
+  struct test_tcp_counters counters;
+  struct tcp_pcb* pcb;
+  struct tcp_seg* seg;
+  ip_addr_t remote_ip, local_ip;
+  u16_t remote_port = 0x100, local_port = 0x101;
+  u32_t seqno, len;
+  err_t err;
+
+  memset(&txcounters, 0, sizeof(txcounters));
+  memset(&counters, 0, sizeof(counters));
+
+  pcb = test_tcp_new_counters_pcb(&counters);
+  ASSERT_TRUE(pcb != NULL);
+  tcp_set_state(pcb, ESTABLISHED, &local_ip, &remote_ip, local_port, remote_port);
+  pcb->mss = TCP_MSS;
+  ASSERT_EQ(tcp_set_bufsize(pcb, 256 * 1024, 0), ERR_OK);
+  ASSERT_EQ(tcp_sndbuf(pcb), 256 * 1024);
+
+  seqno = pcb->snd_lbb;
+  err = tcp_write(pcb, big, sizeof(big), TCP_WRITE_FLAG_COPY);
+  ASSERT_EQ(err, ERR_OK);
+  ASSERT_EQ(tcp_sndbuf(pcb), 256 * 1024 - sizeof(big));
+  ASSERT_EQ(pcb->snd_lbb, seqno + sizeof(big));
+  ASSERT_EQ(pcb->snd_queuelen, (sizeof(big) + TCP_MSS - 1) / TCP_MSS);
+  len = 0;
+  for (seg = pcb->unsent; seg != NULL; seg = seg->next) {
+    ASSERT_EQ(ntohl(seg->tcphdr->seqno), seqno + len);
+    ASSERT_LE(seg->len, TCP_MSS);
+    len += seg->len;
+  }
+  ASSERT_EQ(len, sizeof(big));
+
+  /* more than the send buffer has room for is refused whole */
+  err = tcp_write(pcb, big, sizeof(big), TCP_WRITE_FLAG_COPY);
+  ASSERT_EQ(err, ERR_OK);
+  err = tcp_write(pcb, big, sizeof(big), TCP_WRITE_FLAG_COPY);
+  ASSERT_EQ(err, ERR_MEM);
+  ASSERT_EQ(pcb->snd_lbb, seqno + 2 * sizeof(big));
+
+  tcp_abort(pcb);
+  ASSERT_TRUE(lwip_stats.memp[MEMP_TCP_PCB].used == 0);
+  ASSERT_TRUE(lwip_stats.memp[MEMP_TCP_SEG].used == 0);
+}
+#endif /* LWIP_WND_SCALE */
+
+#if LWIP_TCP_WRITE_REF
+static void
+test_tcp_write_done(void* arg)
+{
+  (*(int*)arg)++;
+}
+
+/** tcp_write_ref() segments reference the caller's data, which is given
+ * back once the last byte is acked, or the pcb is gone; not on failure. */
+TEST_F(LWIPTest, test_tcp_write_ref)
+{
+  static u8_t data[4 * TCP_MSS];
+  struct test_tcp_counters counters;
+  struct tcp_pcb* pcb;
+  struct pbuf* p;
+  ip_addr_t remote_ip, local_ip;
+  u16_t remote_port = 0x100, local_port = 0x101;
+  int done = 0;
+  err_t err;
+
+  memset(&txcounters, 0, sizeof(txcounters));
+  memset(&counters, 0, sizeof(counters));
+
+  pcb = test_tcp_new_counters_pcb(&counters);
+  ASSERT_TRUE(pcb != NULL);
+  tcp_set_state(pcb, ESTABLISHED, &local_ip, &remote_ip, local_port, remote_port);
+  pcb->mss = TCP_MSS;
+  pcb->cwnd = 10 * TCP_MSS;
+  pcb->snd_wnd = 0xFFFF;
+
+  err = tcp_write_ref(pcb, data, sizeof(data), 0, test_tcp_write_done, &done);
+  ASSERT_EQ(err, ERR_OK);
+  /* a header pbuf, then the data where it is */
+  ASSERT_TRUE(pcb->unsent->p->next != NULL);
+  ASSERT_EQ(pcb->unsent->p->next->type, PBUF_REF);
+  ASSERT_EQ(pcb->unsent->p->next->payload, (void*)data);
+  ASSERT_EQ(tcp_output(pcb), ERR_OK);
+  ASSERT_EQ(done, 0);
+
+  /* half of it acked: still referenced */
+  tcp_create_rx_segment_wnd(pcb, NULL, 0, 0, 2 * TCP_MSS, TCP_ACK, 0xFFFF, &p);
+  tcp_input(remote_ip, remote_port, p);
+  ASSERT_EQ(done, 0);
+  tcp_create_rx_segment_wnd(pcb, NULL, 0, 0, 2 * TCP_MSS, TCP_ACK, 0xFFFF, &p);
+  tcp_input(remote_ip, remote_port, p);
+  ASSERT_EQ(done, 1);
+
+  /* refused: never called back */
+  err = tcp_write_ref(pcb, data, tcp_sndbuf(pcb) + 1, 0, test_tcp_write_done, &done);
+  ASSERT_EQ(err, ERR_MEM);
+  ASSERT_EQ(done, 1);
+
+  /* the output function sends the data by reference: it is given back once
+     the output function, too, is done with it */
+  txcounters.hold_tx_pbufs = 1;
+  err = tcp_write_ref(pcb, data, sizeof(data), 0, test_tcp_write_done, &done);
+  ASSERT_EQ(err, ERR_OK);
+  ASSERT_EQ(tcp_output(pcb), ERR_OK);
+  txcounters.hold_tx_pbufs = 0;
+  ASSERT_EQ(txcounters.num_held_pbufs, 4);
+  ASSERT_EQ(txcounters.held_pbufs[0]->payload, (void*)data);
+  tcp_create_rx_segment_wnd(pcb, NULL, 0, 0, 4 * TCP_MSS, TCP_ACK, 0xFFFF, &p);
+  tcp_input(remote_ip, remote_port, p);
+  ASSERT_TRUE(pcb->unacked == NULL);
+  ASSERT_EQ(done, 1);
+  while (txcounters.num_held_pbufs > 0) {
+    pbuf_free(txcounters.held_pbufs[--txcounters.num_held_pbufs]);
+  }
+  ASSERT_EQ(done, 2);
+
+  /* the pcb goes away with the data in flight */
+  err = tcp_write_ref(pcb, data, sizeof(data), 0, test_tcp_write_done, &done);
+  ASSERT_EQ(err, ERR_OK);
+  ASSERT_EQ(tcp_output(pcb), ERR_OK);
+  tcp_abort(pcb);
+  ASSERT_EQ(done, 3);
+  ASSERT_TRUE(lwip_stats.memp[MEMP_TCP_PCB].used == 0);
+  ASSERT_TRUE(lwip_stats.memp[MEMP_TCP_SEG].used == 0);
+}
+
+/** A segment of many small writes by reference is a long pbuf chain, more
+ * pieces than a u8_t counts: it still goes out whole, as one datagram. */
+TEST_F(LWIPTest, test_tcp_write_ref_small)
+{
+  static u8_t data[300];
+  struct test_tcp_counters counters;
+  struct tcp_pcb* pcb;
+  struct tcp_hdr hdr;
+  struct pbuf *p, *q;
+  ip_addr_t remote_ip, local_ip;
+  u16_t remote_port = 0x100, local_port = 0x101;
+  u8_t d[sizeof(data)];
+  int done = 0, n;
+  err_t err;
+  u16_t i;
+
+  memset(&txcounters, 0, sizeof(txcounters));
+  memset(&counters, 0, sizeof(counters));
+  for (i = 0; i < sizeof(data); i++) {
+    data[i] = (u8_t)i;
+  }
+
+  pcb = test_tcp_new_counters_pcb(&counters);
+  ASSERT_TRUE(pcb != NULL);
+  tcp_set_state(pcb, ESTABLISHED, &local_ip, &remote_ip, local_port, remote_port);
+  pcb->mss = TCP_MSS;
+  pcb->cwnd = 10 * TCP_MSS;
+  pcb->snd_wnd = 0xFFFF;
+  /* a send buffer that queues a pbuf per byte */
+  ASSERT_EQ(tcp_set_bufsize(pcb, 20 * TCP_SND_BUF, 0), ERR_OK);
+  ASSERT_GT(TCP_SND_QUEUELEN_MAX(pcb), sizeof(data));
+  /* the window update that announces it */
+  ASSERT_EQ(tcp_output(pcb), ERR_OK);
+  memset(&txcounters, 0, sizeof(txcounters));
+
+  for (i = 0; i < sizeof(data); i++) {
+    err = tcp_write_ref(pcb, &data[i], 1, TCP_WRITE_FLAG_MORE, test_tcp_write_done, &done);
+    ASSERT_EQ(err, ERR_OK);
+  }
+  ASSERT_TRUE(pcb->unsent->next == NULL);
+  for (q = pcb->unsent->p, n = 0; q != NULL; q = q->next) {
+    n++;
+  }
+  ASSERT_GT(n, 255);
+  ASSERT_EQ(pcb->unsent->p->tot_len, pcb->unsent->p->len + sizeof(data));
+
+  txcounters.copy_tx_packets = 1;
+  ASSERT_EQ(tcp_output(pcb), ERR_OK);
+  txcounters.copy_tx_packets = 0;
+  ASSERT_EQ(txcounters.num_tx_calls, 1);
+  ASSERT_EQ(txcounters.tx_packets->tot_len, TCPH_HDRLEN(pcb->unacked->tcphdr) * 4 + sizeof(data));
+  pbuf_copy_partial(txcounters.tx_packets, &hdr, sizeof(hdr), 0);
+  pbuf_copy_partial(txcounters.tx_packets, d, sizeof(d), TCPH_HDRLEN(&hdr) * 4);
+  ASSERT_EQ(memcmp(d, data, sizeof(data)), 0);
+  pbuf_free(txcounters.tx_packets);
+
+  /* acked: all the pbufs leave the send queue */
+  tcp_create_rx_segment_wnd(pcb, NULL, 0, 0, sizeof(data), TCP_ACK, 0xFFFF, &p);
+  tcp_input(remote_ip, remote_port, p);
+  ASSERT_TRUE(pcb->unacked == NULL);
+  ASSERT_EQ(pcb->snd_queuelen, 0);
+  ASSERT_EQ(done, (int)sizeof(data));
+
+  tcp_abort(pcb);
+  ASSERT_TRUE(lwip_stats.memp[MEMP_TCP_PCB].used == 0);
+  ASSERT_TRUE(lwip_stats.memp[MEMP_TCP_SEG].used == 0);
+}
+#endif /* LWIP_TCP_WRITE_REF */
+
 int main(int argc, char** argv)
 {
     testing::AddGlobalTestEnvironment(new LWIPEnvironment);